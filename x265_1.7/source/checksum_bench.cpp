@@ -0,0 +1,74 @@
+// compile: c++ -o checksum_bench checksum_bench.cpp -Icommon -std=c++11 -O2
+
+/*
+ * 比较各种帧校验的吞吐: 旧的boost crc_16、CRC32C slicing-by-8、CRC32C SSE4.2。
+ * usage: checksum_bench [seconds_per_case]
+ */
+
+#include "network/checksum.hpp"
+#include <chrono>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+static
+double Measure( ChecksumEngine &engine, const std::vector<char> &buf, double seconds, uint32_t &result )
+{
+    typedef std::chrono::steady_clock Clock;
+
+    std::size_t bytes = 0;
+    Clock::time_point start = Clock::now(), now;
+    do {
+        for( int i = 0; i < 16; ++i ) {
+            result ^= engine.compute( &buf[0], buf.size() );
+            bytes += buf.size();
+        } // for
+        now = Clock::now();
+    } while( std::chrono::duration<double>(now - start).count() < seconds );
+
+    return (double)bytes / std::chrono::duration<double>(now - start).count() / (1024.0 * 1024.0);
+}
+
+int main( int argc, char **argv )
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+
+    // known answer: crc32c("123456789") == 0xE3069283
+    static const char check[] = "123456789";
+    ChecksumEngine sw( ChecksumEngine::CRC32C, false ), hw( ChecksumEngine::CRC32C );
+    if( sw.compute(check, 9) != 0xE3069283u || hw.compute(check, 9) != 0xE3069283u ) {
+        fprintf( stderr, "crc32c self test failed: %08x %08x\n", sw.compute(check, 9), hw.compute(check, 9) );
+        return -1;
+    } // if
+
+    struct Case { ChecksumEngine::Type type; bool hw; } cases[] = {
+        { ChecksumEngine::CRC16, false },
+        { ChecksumEngine::CRC32C, false },
+        { ChecksumEngine::CRC32C, true },
+    };
+    std::size_t sizes[] = { 4 * 1024, 64 * 1024, 512 * 1024 };
+
+    printf( "sse4.2 available: %s\n", ChecksumEngine::hardwareAvailable() ? "yes" : "no" );
+    printf( "%-18s %10s %12s %10s\n", "impl", "bytes", "MB/s", "vs crc16" );
+
+    uint32_t sink = 0;
+    for( std::size_t size : sizes ) {
+        std::vector<char> buf( size );
+        for( std::size_t i = 0; i < size; ++i )
+            buf[i] = (char)rand();
+
+        double base = 0;
+        for( const Case &c : cases ) {
+            ChecksumEngine engine( c.type, c.hw );
+            if( c.hw && engine.impl() != ChecksumEngine::IMPL_CRC32C_SSE42 )
+                continue;
+            double mbps = Measure( engine, buf, seconds, sink );
+            if( c.type == ChecksumEngine::CRC16 )
+                base = mbps;
+            printf( "%-18s %10lu %12.1f %9.1fx\n", ChecksumEngine::implName(engine.impl()),
+                    (unsigned long)size, mbps, base > 0 ? mbps / base : 0.0 );
+        } // for
+    } // for
+
+    return sink == 0x12345678u;     // keep the results alive
+}
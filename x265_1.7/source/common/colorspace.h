@@ -0,0 +1,72 @@
+/*****************************************************************************
+ * Copyright (C) 2015 x265 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at license @ x265.com.
+ *****************************************************************************/
+
+#ifndef X265_COLORSPACE_H
+#define X265_COLORSPACE_H
+
+#include "common.h"
+
+namespace x265 {
+// private namespace
+
+/* Full range BT.601 BGRA to YUV with 16bit fixed point coefficients, the formulas of the original
+ * capture code. The C primitives and the vector primitives must produce the same bytes */
+enum BgraCoeffs
+{
+    BGRA_Y_R = 19595,
+    BGRA_Y_G = 38470,
+    BGRA_Y_B = 7471,
+    BGRA_U_R = -11056,
+    BGRA_U_G = -21712,
+    BGRA_U_B = 32768,
+    BGRA_V_R = 32768,
+    BGRA_V_G = -27440,
+    BGRA_V_B = -5328,
+    BGRA_Y_ROUND = 1 << 15,
+    BGRA_C_OFFSET = 128 << 16,          // chroma truncates, as it always did
+
+    /* pmaddwd takes int16 coefficients, the ones that do not fit are split in two halves which
+     * are applied to the same sample from two different lanes */
+    BGRA_Y_G0 = 32767,
+    BGRA_Y_G1 = BGRA_Y_G - BGRA_Y_G0,
+    BGRA_U_B0 = 16384,
+    BGRA_U_B1 = BGRA_U_B - BGRA_U_B0,
+    BGRA_V_R0 = 16384,
+    BGRA_V_R1 = BGRA_V_R - BGRA_V_R0
+};
+
+inline uint8_t bgraToY(int b, int g, int r)
+{
+    return (uint8_t)((BGRA_Y_R * r + BGRA_Y_G * g + BGRA_Y_B * b + BGRA_Y_ROUND) >> 16);
+}
+
+inline uint8_t bgraToU(int b, int g, int r)
+{
+    return (uint8_t)((BGRA_U_R * r + BGRA_U_G * g + BGRA_U_B * b + BGRA_C_OFFSET) >> 16);
+}
+
+inline uint8_t bgraToV(int b, int g, int r)
+{
+    return (uint8_t)((BGRA_V_R * r + BGRA_V_G * g + BGRA_V_B * b + BGRA_C_OFFSET) >> 16);
+}
+}
+
+#endif // ifndef X265_COLORSPACE_H
@@ -33,8 +33,21 @@ using namespace x265;
 #define DEBLOCK_SMALLEST_BLOCK  8
 #define DEFAULT_INTRA_TC_OFFSET 2
 
+/* one 2Nx2N skip CU over the whole CTU, predicted from L0 reference 0 with a zero vector */
+static inline bool isZeroMotionSkip(const CUData* ctu)
+{
+    return !ctu->m_cuDepth[0] && ctu->isSkipped(0) && ctu->m_interDir[0] == 1 &&
+           !ctu->m_refIdx[0][0] && !ctu->m_mv[0][0].word;
+}
+
 void Deblock::deblockCTU(const CUData* ctu, const CUGeom& cuGeom, int32_t dir)
 {
+    /* every edge between zero motion skips of a slice has boundary strength 0, so the
+     * unchanged areas of a screen need no walk over their partitions */
+    const CUData* neighbour = dir == EDGE_VER ? ctu->m_cuLeft : ctu->m_cuAbove;
+    if (isZeroMotionSkip(ctu) && (!neighbour || (neighbour->m_slice == ctu->m_slice && isZeroMotionSkip(neighbour))))
+        return;
+
     uint8_t blockStrength[MAX_NUM_PARTITIONS];
 
     memset(blockStrength, 0, sizeof(uint8_t) * cuGeom.numPartitions);
@@ -39,6 +39,9 @@ Frame::Frame()
     m_next = NULL;
     m_prev = NULL;
     m_param = NULL;
+    m_lookaheadExitTime = 0;
+    m_ctuDirtyMap = NULL;
+    m_reconfigureRc = false;
     memset(&m_lowres, 0, sizeof(m_lowres));
 }
 
@@ -47,7 +50,12 @@ bool Frame::create(x265_param *param)
     m_fencPic = new PicYuv;
     m_param = param;
 
-    return m_fencPic->create(param->sourceWidth, param->sourceHeight, param->internalCsp) &&
+    uint32_t widthInCU  = (param->sourceWidth  + g_maxCUSize - 1) >> g_maxLog2CUSize;
+    uint32_t heightInCU = (param->sourceHeight + g_maxCUSize - 1) >> g_maxLog2CUSize;
+    m_ctuDirtyMap = X265_MALLOC(uint8_t, widthInCU * heightInCU);
+
+    return m_ctuDirtyMap &&
+           m_fencPic->create(param->sourceWidth, param->sourceHeight, param->internalCsp) &&
            m_lowres.create(m_fencPic, param->bframes, !!param->rc.aqMode);
 }
 
@@ -100,5 +108,8 @@ void Frame::destroy()
         m_reconPic = NULL;
     }
 
+    X265_FREE(m_ctuDirtyMap);
+    m_ctuDirtyMap = NULL;
+
     m_lowres.destroy();
 }
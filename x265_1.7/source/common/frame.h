@@ -54,6 +54,15 @@ public:
     int64_t                m_dts;
     int32_t                m_forceqp;            // Force to use the qp specified in qp file
     void*                  m_userData;           // user provided pointer passed in with this picture
+    int64_t                m_lookaheadExitTime;  // x265_mdate() when the lookahead decided this frame
+    uint8_t*               m_ctuDirtyMap;        // copy of x265_picture.ctuDirtyMap, m_lowres.ctuDirtyMap points here when valid
+
+    /* rate control targets from x265_encoder_reconfig(), applied by RateControl::rateControlStart() */
+    bool                   m_reconfigureRc;
+    int                    m_rcBitrate;
+    double                 m_rcRfConstant;
+    int                    m_rcVbvMaxBitrate;
+    int                    m_rcVbvBufferSize;
 
     Lowres                 m_lowres;
     bool                   m_lowresInit;         // lowres init complete (pre-analysis)
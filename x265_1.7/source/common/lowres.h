@@ -118,6 +118,8 @@ struct Lowres : public ReferencePlanes
     bool   bKeyframe;
     bool   bLastMiniGopBFrame;
 
+    uint8_t* ctuDirtyMap;    // per CTU, 0 if unchanged since the previous picture. NULL if unknown
+
     /* lookahead output data */
     int64_t   costEst[X265_BFRAME_MAX + 2][X265_BFRAME_MAX + 2];
     int64_t   costEstAq[X265_BFRAME_MAX + 2][X265_BFRAME_MAX + 2];
@@ -151,6 +153,14 @@ struct Lowres : public ReferencePlanes
     bool create(PicYuv *origPic, int _bframes, bool bAqEnabled);
     void destroy();
     void init(PicYuv *origPic, int poc);
+
+    /* true if lowres block (cuX, cuY) lies in a CTU ctuDirtyMap reports unchanged */
+    bool staticBlock(int cuX, int cuY) const
+    {
+        int shift = g_maxLog2CUSize - 1 - X265_LOWRES_CU_BITS;
+        int widthInCTU = (((width + X265_LOWRES_CU_SIZE - 1) >> X265_LOWRES_CU_BITS) + (1 << shift) - 1) >> shift;
+        return !ctuDirtyMap[(cuY >> shift) * widthInCTU + (cuX >> shift)];
+    }
 };
 }
 
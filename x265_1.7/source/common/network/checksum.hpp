@@ -0,0 +1,222 @@
+#ifndef _CHECKSUM_HPP_
+#define _CHECKSUM_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <boost/crc.hpp>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <nmmintrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#endif
+
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+#define HAVE_CRC32C_SSE42       1
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE42            __attribute__((target("sse4.2")))
+#else
+#define TARGET_SSE42
+#endif
+
+/*
+ * 帧完整性校验。线上的类型只有 NONE / CRC16 / CRC32C，会话开始时由客户端的"checksum"命令协商；
+ * CRC32C 用 SSE4.2 的 crc32 指令还是 slicing-by-8 查表是本地的选择，两者结果相同。
+ * 用法: reset(); update() 任意多次; value()
+ */
+class ChecksumEngine {
+public:
+    enum Type {                 // on the wire, one byte in the v2 frame header
+        NONE        = 0,
+        CRC16       = 1,        // boost crc_16, the legacy header
+        CRC32C      = 2,        // Castagnoli
+    };
+
+    enum Impl {
+        IMPL_NONE,
+        IMPL_CRC16,
+        IMPL_CRC32C_SLICING8,
+        IMPL_CRC32C_SSE42,
+    };
+
+    explicit ChecksumEngine( Type _Type = CRC16, bool allowHardware = true )
+            : type_(_Type), impl_(IMPL_NONE), crc32(0)
+    {
+        switch( type_ ) {
+        case CRC16:
+            impl_ = IMPL_CRC16;
+            break;
+        case CRC32C:
+            impl_ = (allowHardware && hardwareAvailable()) ? IMPL_CRC32C_SSE42 : IMPL_CRC32C_SLICING8;
+            break;
+        default:
+            type_ = NONE;
+            break;
+        } // switch
+        reset();
+    }
+
+    Type type() const { return type_; }
+    Impl impl() const { return impl_; }
+
+    void reset()
+    {
+        crc16.reset();
+        crc32 = 0xFFFFFFFFu;
+    }
+
+    void update( const void *buf, std::size_t len )
+    {
+        switch( impl_ ) {
+        case IMPL_CRC16:
+            crc16.process_bytes( buf, len );
+            break;
+        case IMPL_CRC32C_SLICING8:
+            crc32 = crc32cSlicing8( crc32, (const uint8_t*)buf, len );
+            break;
+        case IMPL_CRC32C_SSE42:
+            crc32 = crc32cSse42( crc32, (const uint8_t*)buf, len );
+            break;
+        default:
+            break;
+        } // switch
+    }
+
+    uint32_t value() const
+    {
+        switch( type_ ) {
+        case CRC16:     return crc16.checksum();
+        case CRC32C:    return ~crc32;
+        default:        return 0;
+        } // switch
+    }
+
+    uint32_t compute( const void *buf, std::size_t len )
+    {
+        reset();
+        update( buf, len );
+        return value();
+    }
+
+    static const char* name( Type t )
+    {
+        switch( t ) {
+        case CRC16:     return "crc16";
+        case CRC32C:    return "crc32c";
+        default:        return "none";
+        } // switch
+    }
+
+    static const char* implName( Impl i )
+    {
+        switch( i ) {
+        case IMPL_CRC16:            return "crc16";
+        case IMPL_CRC32C_SLICING8:  return "crc32c-slicing8";
+        case IMPL_CRC32C_SSE42:     return "crc32c-sse4.2";
+        default:                    return "none";
+        } // switch
+    }
+
+    static bool parse( const std::string &s, Type &t )
+    {
+        if( s == "none" )           t = NONE;
+        else if( s == "crc16" )     t = CRC16;
+        else if( s == "crc32c" )    t = CRC32C;
+        else return false;
+        return true;
+    }
+
+    static bool hardwareAvailable()
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid( info, 1 );
+        static const bool ret = (info[2] & (1 << 20)) != 0;
+        return ret;
+#elif defined(HAVE_CRC32C_SSE42)
+        static const bool ret = []() {
+            unsigned int eax, ebx, ecx, edx;
+            return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+        }();
+        return ret;
+#else
+        return false;
+#endif
+    }
+
+private:
+    static const uint32_t (*slicing8Table())[256]
+    {
+        static uint32_t table[8][256];
+        static const bool init = []() {
+            for( uint32_t i = 0; i < 256; ++i ) {
+                uint32_t c = i;
+                for( int k = 0; k < 8; ++k )
+                    c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+                table[0][i] = c;
+            } // for
+            for( uint32_t i = 0; i < 256; ++i )
+                for( int t = 1; t < 8; ++t )
+                    table[t][i] = (table[t-1][i] >> 8) ^ table[0][table[t-1][i] & 0xFF];
+            return true;
+        }();
+        (void)init;
+        return table;
+    }
+
+    static uint32_t crc32cSlicing8( uint32_t crc, const uint8_t *p, std::size_t len )
+    {
+        const uint32_t (*t)[256] = slicing8Table();
+
+        for( ; len && ((uintptr_t)p & 7); --len )
+            crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+
+        for( ; len >= 8; len -= 8, p += 8 ) {
+            uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+            uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+            crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+                ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+        } // for
+
+        for( ; len; --len )
+            crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+
+        return crc;
+    }
+
+#if defined(HAVE_CRC32C_SSE42)
+    TARGET_SSE42
+    static uint32_t crc32cSse42( uint32_t crc, const uint8_t *p, std::size_t len )
+    {
+        for( ; len && ((uintptr_t)p & 7); --len )
+            crc = _mm_crc32_u8( crc, *p++ );
+#if defined(_M_X64) || defined(__x86_64__)
+        uint64_t crc64 = crc;
+        for( ; len >= 8; len -= 8, p += 8 )
+            crc64 = _mm_crc32_u64( crc64, *(const uint64_t*)p );
+        crc = (uint32_t)crc64;
+#endif
+        for( ; len >= 4; len -= 4, p += 4 )
+            crc = _mm_crc32_u32( crc, *(const uint32_t*)p );
+        for( ; len; --len )
+            crc = _mm_crc32_u8( crc, *p++ );
+        return crc;
+    }
+#else
+    static uint32_t crc32cSse42( uint32_t crc, const uint8_t *p, std::size_t len )
+    { return crc32cSlicing8( crc, p, len ); }
+#endif
+
+private:
+    Type                    type_;
+    Impl                    impl_;
+    boost::crc_16_type      crc16;
+    uint32_t                crc32;
+};
+
+#endif
@@ -1,12 +1,16 @@
 // compile: c++ -o client client_test.cpp desktop_streaming_request.cpp -I/home/charles/smb_share/ffmpeg -lboost_system -L/home/charles/smb_share/ffmpeg_lib -lavformat -lavcodec -lavutil -lswscale -lswresample -lx265 `sdl-config --cflags --libs` -lz -lm -std=c++11 -pthread -g
 
 #include "desktop_streaming_request.hpp"
+#include "shm_transport.hpp"
 #include <chrono>
 #include <fstream>
 
 using boost::asio::ip::tcp;
 using boost::asio::ip::address;
 
+// frames over the shared memory ring instead of the data connection, for a consumer on the server's host
+static bool g_shm_transport = false;
+
 class ClientMsgConnection : public MsgConnection {
 public:
     ClientMsgConnection(const std::string &svr_addr, uint16_t port,
@@ -134,9 +138,17 @@ protected:
     bool handle_msg( const std::string &msg, TcpConnectionPtr msg_conn )
     {
         std::cout << "Server message: " << msg << std::endl << std::flush;
+        if( msg.find("Shm transport ") == 0 || msg.find("Shared memory transport") == 0 ) {
+            std::unique_lock<std::mutex> lk(offerLock);
+            shmOffer = msg;
+            offerCond.notify_all();
+        } // if
         return true;
     }
 
+    // the data connection stays open, the server pairs it with the msg connection; frames come from the ring
+    TcpConnectionPtr AttachShm();
+
     bool handle_error( const boost::system::error_code& error, TcpConnectionPtr conn )
     {
         DBG_STREAM("client error on connection " << ADDR_STR(conn) << " " << error);
@@ -145,6 +157,9 @@ protected:
 
 protected:
     TcpConnectionPtr        msgConn, dataConn;
+    std::mutex              offerLock;
+    std::condition_variable offerCond;
+    std::string             shmOffer;       // the reply to "transport shm"
 // FOR TEST
 private:
     void Test1();
@@ -167,7 +182,21 @@ bool TcpClient::Start()
 
     DBG_STREAM("Client connected to server!");
     msgConn->sendMsg( "service DesktopStreaming\n" );
-    RequestPtr pRequest(new DesktopStreamingRequest(msgConn, dataConn));
+    TcpConnectionPtr frameConn = dataConn;
+    if( g_shm_transport ) {
+        frameConn = AttachShm();
+        if( !frameConn )
+            return false;
+    } // if
+    std::shared_ptr<DesktopStreamingRequest> pRequest(new DesktopStreamingRequest(msgConn, frameConn));
+#if defined(HAVE_SHM_TRANSPORT)
+    if( g_shm_transport ) {
+        // overrun with no keyframe left in the ring
+        DesktopStreamingRequest *request = pRequest.get();
+        std::static_pointer_cast<ShmDataConnection>(frameConn)->setResyncHandler(
+                    [request]() { request->RequestKeyframe(); } );
+    } // if
+#endif
     pRequest->Start();
 
 
@@ -205,6 +234,8 @@ bool TcpClient::Start()
 
     string msg;
     while( getline(cin, msg) ) {
+        if( pRequest->handle_command(msg) )
+            continue;
         msg.append(1, '\n');
         msgConn->sendMsg(msg);
     } // while
@@ -224,10 +255,50 @@ bool TcpClient::Start()
  */
 
 
+TcpConnectionPtr TcpClient::AttachShm()
+{
+#if defined(HAVE_SHM_TRANSPORT)
+    msgConn->sendMsg( "transport shm\n" );
+    std::string name;
+    uint64_t token = 0;
+    {
+        std::unique_lock<std::mutex> lk(offerLock);
+        offerCond.wait_for( lk, std::chrono::seconds(5), [this]() { return !shmOffer.empty(); } );
+        if( !ShmDataConnection::parseOffer(shmOffer, name, token) ) {
+            std::cerr << "Server offered no shared memory transport." << std::endl;
+            return TcpConnectionPtr();
+        } // if
+    }
+
+    std::shared_ptr<ShmDataConnection> conn = std::make_shared<ShmDataConnection>( msgConn->socket().get_io_service() );
+    if( !conn->attach(name, token) )
+        return TcpConnectionPtr();
+    conn->addErrorHandler( HANDLER_NO, std::bind(&TcpClient::handle_error, this,
+                std::placeholders::_1, std::placeholders::_2) );
+    return conn;
+#else
+    std::cerr << "Shared memory transport is not supported on this platform." << std::endl;
+    return TcpConnectionPtr();
+#endif
+}
+
+
 int main(int argc, char **argv)
 {
-    if (argc != 2)
-        err_ret(-1, "usage: tcpcli <IP:Port>");
+    if (argc < 2 || argc % 2)
+        err_ret(-1, "usage: tcpcli <IP:Port> [-t decoder_threads] [-s off|demand|<every_n_frames>] [-d on|off] [-m tcp|shm]");
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "-t"))
+            g_decoder_threads = atoi(argv[i+1]);
+        else if (!strcmp(argv[i], "-s"))
+            g_snapshot_policy = argv[i+1];
+        else if (!strcmp(argv[i], "-d"))
+            g_headless_display = !strcmp(argv[i+1], "off");
+        else if (!strcmp(argv[i], "-m"))
+            g_shm_transport = !strcmp(argv[i+1], "shm");
+        else
+            err_ret(-1, "usage: tcpcli <IP:Port> [-t decoder_threads] [-s off|demand|<every_n_frames>] [-d on|off] [-m tcp|shm]");
+    }
 
     try {
         const char*           svrIP;
@@ -9,6 +9,11 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <algorithm>
+#include <array>
 #include <memory>
 #include <string>
 #include <cstring>
@@ -16,6 +21,16 @@
 #include <boost/asio.hpp>
 #include <boost/noncopyable.hpp> 
 #include "../LOG.h"
+#include "checksum.hpp"
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#endif
 
 
 #define err_ret( retval, ... ) do { \
@@ -45,6 +60,17 @@ unsigned short crc_checksum(const void *buf, size_t count)
     return (unsigned short)(result.checksum());
 }
 
+// checksum over a range of scatter/gather buffers, same result as over the concatenated data
+template < typename ConstBufferIterator >
+uint32_t checksum_buffers( ChecksumEngine &engine, ConstBufferIterator first, ConstBufferIterator last )
+{
+    engine.reset();
+    for( ; first != last; ++first )
+        engine.update( boost::asio::buffer_cast<const void*>(*first), boost::asio::buffer_size(*first) );
+
+    return engine.value();
+}
+
 static inline
 uint32_t gen_timestamp()
 {
@@ -58,6 +84,31 @@ uint32_t gen_timestamp()
     // return 0;
 }
 
+// microseconds since epoch, same clock as x265_mdate() so encoder timestamps can be compared
+static inline
+int64_t gen_timestamp_us()
+{
+    typedef std::chrono::system_clock Clock;
+
+    auto now = Clock::now().time_since_epoch();
+    return (int64_t)std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+// names the calling thread (15 chars at most on Linux), shows up in top -H and /proc/<pid>/task/*/comm.
+// threads created afterwards by this one (x265 and decoder workers) inherit the name.
+static inline
+void set_thread_name( const char *name )
+{
+#if defined(__linux__)
+    char buf[16];
+    strncpy( buf, name, sizeof(buf) - 1 );
+    buf[sizeof(buf) - 1] = 0;
+    pthread_setname_np( pthread_self(), buf );
+#else
+    (void)name;
+#endif
+}
+
 
 struct BytesArray : std::vector<char> {
     typedef std::vector<char>               BaseType;
@@ -98,140 +149,618 @@ struct BytesArray : std::vector<char> {
 typedef std::shared_ptr<BytesArray>             BytesArrayPtr;
 
 
-class SharedBuffer {
-public:
-    SharedBuffer( std::size_t _QueSize, std::size_t _ArrSize = 0 ) 
-                    : front(0), rear(0), queSize(_QueSize + 1)
-    {
-        queue.resize( queSize );
-        if( _ArrSize ) {
-            for( std::size_t i = 0; i < queSize; ++i )
-                queue[i].reserve( _ArrSize );
-            // readBuf_.reserve( _ArrSize );
-            // writeBuf_.reserve( _ArrSize );
-        } // if 
+/*
+ * 一次async_write发送的数据，由多段不连续的内存组成(gather write)，例如帧头 + x265的NAL payload，
+ * 发送前不再拷贝到一个连续的BytesArray中。
+ * 这些内存不属于GatherBuffer，最后一个引用释放时(handle_sendData完成之后)由releaser归还给owner，
+ * 如x265_nal_unpin()或BufferPool::put()。
+ */
+struct GatherBuffer : boost::noncopyable {
+    typedef std::vector<boost::asio::const_buffer>      BufferSeq;
+    typedef std::function<void()>                       ReleaserType;
+    typedef std::chrono::steady_clock                   Clock;
 
-        // DBG("SharedBuffer constructor queSize = %lu arrSize = %lu @%lx\n", queSize, _ArrSize, (long)this);
+    // used by the send queue policy, data without FLAG_DROPPABLE is never discarded
+    enum {
+        FLAG_DROPPABLE      = 1,
+        FLAG_KEYFRAME       = 2,        // decodable point, e.g. an IRAP access unit
+    };
+
+    GatherBuffer() : flags(0), size_(0) {}
+
+    virtual ~GatherBuffer()
+    { if( releaser ) releaser(); }
+
+    void append( const void *src, std::size_t n )
+    {
+        bufs.push_back( boost::asio::buffer(src, n) );
+        size_ += n;
     }
 
-    // for dbg
-    // ~SharedBuffer()
-    // { DBG("SharedBuffer destructor @%lx\n", (long)this); }
+    const BufferSeq& buffers() const { return bufs; }
+    std::size_t size() const { return size_; }
 
-    // bool full()
-    // {
-        // std::unique_lock<std::mutex> lk(lock);
-        // return _full();
-    // }
+    bool droppable() const { return (flags & FLAG_DROPPABLE) != 0; }
+    bool keyframe() const { return (flags & FLAG_KEYFRAME) != 0; }
 
-    // bool empty()
-    // {
-        // std::unique_lock<std::mutex> lk(lock);
-        // return _empty();
-    // }
+    ReleaserType                releaser;
+    uint32_t                    flags;          // immutable once sent, may be queued on several connections
+
+protected:
+    BufferSeq                   bufs;
+    std::size_t                 size_;
+};
 
-    // NOTE!!! only for single writer
-    BytesArray& writeBuf() { return queue[rear]; }
-    // BytesArray& readBuf()  { return readBuf_; }
+typedef std::shared_ptr<GatherBuffer>           GatherBufferPtr;
 
-    void push( BytesArray &arr )
+
+#define CACHE_LINE_SIZE         64
+
+/*
+ * futex_wait() 在 *addr == expected 时睡眠，直到futex_wake()或被伪唤醒，调用者需要重新检查条件。
+ * Windows上用WaitOnAddress (Win8+, 需链接Synchronization.lib)。
+ */
+static inline
+void futex_wait( std::atomic<uint32_t> *addr, uint32_t expected )
+{
+#if defined(_WIN32)
+    WaitOnAddress( (volatile VOID*)addr, &expected, sizeof(expected), INFINITE );
+#elif defined(__linux__)
+    syscall( SYS_futex, (uint32_t*)addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0 );
+#else
+    if( addr->load() == expected )
+        std::this_thread::yield();
+#endif
+}
+
+static inline
+void futex_wake( std::atomic<uint32_t> *addr )
+{
+#if defined(_WIN32)
+    WakeByAddressAll( (PVOID)addr );
+#elif defined(__linux__)
+    syscall( SYS_futex, (uint32_t*)addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
+#endif
+}
+
+
+/*
+ * capture线程(唯一的writer)和encoder线程(唯一的reader)之间传递YUV帧的lock-free环形队列。
+ * slot预先分配，writer直接写入writeSlot()，reader拿到slot的指针交给x265，不swap也不拷贝。
+ * head/tail是单调递增的计数器，各占一个cache line；等待时先自旋，再futex睡眠，
+ * 对方只有在有人睡眠时才需要futex_wake，平时push/pop不进内核。
+ */
+class SpscFrameRing : boost::noncopyable {
+    static const int            SPIN_COUNT = 4000;
+public:
+    typedef std::chrono::steady_clock       Clock;
+
+    // _QueSize 个可读帧，另加一个slot给reader正在使用的帧
+    SpscFrameRing( std::size_t _QueSize, std::size_t _ArrSize = 0 )
+            : slots(_QueSize + 1), capacity((uint32_t)_QueSize + 1)
+            , readHeld(false), lastHandoffUs(0), handoffCount(0), handoffTotalUs(0), handoffMaxUs(0)
     {
-        // DBG("push @%lx", (long)this);
-        std::unique_lock<std::mutex> lk(lock);
+        head = tail = 0;
+        readerWaiting = writerWaiting = 0;
+        reserve( _ArrSize );
+    }
 
-        while( _full() )
-            condWr.wait(lk);
-            
-        queue[rear].swap( arr );
-        rear = (rear + 1) % queSize;
+    void reserve( std::size_t _ArrSize )
+    {
+        for( auto &slot : slots )
+            slot.buf.reserve( _ArrSize );
+    }
 
-        lk.unlock();
-        condRd.notify_one();
+    // 只有在reader和writer都停止时调用
+    void reset()
+    {
+        head = tail = 0;
+        readHeld = false;
+        readerWaiting = writerWaiting = 0;     // no thread is blocked on the ring while it is reset
+    }
+
+    // NOTE!!! only for single writer, blocks until a slot is free
+    BytesArray& writeSlot()
+    {
+        uint32_t h = head.load( std::memory_order_relaxed );
+        waitFor( tail, writerWaiting, [&]{ return h - tail.load() < capacity; } );
+        return slots[h % capacity].buf;
     }
 
-    void push()
-    { this->push( writeBuf() ); }
+    // NOTE!!! writer only, the slot committed last or NULL if none since reset(). it stays intact
+    // until the writer has committed the current slot, the reader never writes a slot
+    const BytesArray* lastCommitted() const
+    {
+        uint32_t h = head.load( std::memory_order_relaxed );
+        return h ? &slots[(h - 1) % capacity].buf : NULL;
+    }
 
-    void pop( BytesArray &arr )
+    void commitWrite()
     {
-        // DBG("pop @%lx", (long)this);
-        std::unique_lock<std::mutex> lk(lock);
+        uint32_t h = head.load( std::memory_order_relaxed );
+        slots[h % capacity].commitTime = Clock::now();
+        head.store( h + 1 );
+        if( readerWaiting.load() )
+            futex_wake( &head );
+    }
 
-        while( _empty() )
-            condRd.wait(lk);
-            
-        queue[front].swap( arr );
-        front = (front + 1) % queSize;
+    // NOTE!!! only for single reader, the slot stays valid until releaseRead()
+    BytesArray* readSlot()
+    {
+        uint32_t t = tail.load( std::memory_order_relaxed );
+        waitFor( head, readerWaiting, [&]{ return head.load() != t; } );
+        readHeld = true;
+
+        Slot &slot = slots[t % capacity];
+        uint64_t us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                            Clock::now() - slot.commitTime).count();
+        lastHandoffUs = us;
+        handoffTotalUs += us;
+        ++handoffCount;
+        if( us > handoffMaxUs )
+            handoffMaxUs = us;
+
+        return &slot.buf;
+    }
 
-        lk.unlock();
-        condWr.notify_one();
+    void releaseRead()
+    {
+        if( !readHeld )
+            return;
+        readHeld = false;
+        tail.store( tail.load(std::memory_order_relaxed) + 1 );
+        if( writerWaiting.load() )
+            futex_wake( &tail );
     }
 
-    /*
-     * void clear()
-     * {
-     *     std::unique_lock<std::mutex> lk(lock);
-     *     front = rear = 0;
-     * }
-     */
+    // capture commit -> encoder acquire latency, reader side only
+    uint64_t lastHandoffMicros() const { return lastHandoffUs; }
+    uint64_t maxHandoffMicros() const { return handoffMaxUs; }
+    uint64_t avgHandoffMicros() const
+    { return handoffCount ? handoffTotalUs / handoffCount : 0; }
+
+protected:
+    template < typename Pred >
+    void waitFor( std::atomic<uint32_t> &word, std::atomic<uint32_t> &waiting, Pred ready )
+    {
+        for( int i = 0; i < SPIN_COUNT; ++i ) {
+            if( ready() )
+                return;
+            spin_pause();
+        } // for
+
+        // seq_cst pairs the waiting flag with the other side's counter update,
+        // so either we see the update or it sees the flag and wakes us
+        while( true ) {
+            uint32_t observed = word.load();
+            waiting.store( 1 );
+            if( ready() )
+                break;
+            futex_wait( &word, observed );
+        } // while
+        waiting.store( 0, std::memory_order_relaxed );
+    }
 
-    // void pop()
-    // { this->pop( readBuf_ ); }
+    static void spin_pause()
+    {
+#if defined(_MSC_VER)
+        YieldProcessor();
+#elif defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+    }
 
 protected:
-    bool _full()  { return ((rear + 1) % queSize == front); }
-    bool _empty() { return (front == rear); }
+    struct Slot {
+        BytesArray              buf;
+        Clock::time_point       commitTime;
+        char                    pad[CACHE_LINE_SIZE];   // keep neighbouring slots' headers apart
+    };
+
+    std::atomic<uint32_t>       head;           // written by writer
+    char                        pad0[CACHE_LINE_SIZE - sizeof(std::atomic<uint32_t>)];
+    std::atomic<uint32_t>       readerWaiting;
+    char                        pad1[CACHE_LINE_SIZE - sizeof(std::atomic<uint32_t>)];
+    std::atomic<uint32_t>       tail;           // written by reader
+    char                        pad2[CACHE_LINE_SIZE - sizeof(std::atomic<uint32_t>)];
+    std::atomic<uint32_t>       writerWaiting;
+    char                        pad3[CACHE_LINE_SIZE - sizeof(std::atomic<uint32_t>)];
+
+    std::vector<Slot>           slots;
+    const uint32_t              capacity;
+    bool                        readHeld;
+    uint64_t                    lastHandoffUs, handoffCount, handoffTotalUs, handoffMaxUs;
+};
+
+
+/*
+ * Vyukov bounded MPMC queue, lock-free, 每个cell有自己的序号所以没有ABA问题。
+ * 拿到cell的线程独占它，所以T可以是shared_ptr这类非trivial的类型。
+ */
+template < typename T >
+class MpmcBoundedQueue : boost::noncopyable {
+public:
+    // capacity is rounded up to a power of two
+    explicit MpmcBoundedQueue( std::size_t _Capacity )
+    {
+        std::size_t cap = 2;
+        while( cap < _Capacity )
+            cap <<= 1;
+        mask = cap - 1;
+        cells.reset( new Cell[cap] );
+        for( std::size_t i = 0; i < cap; ++i )
+            cells[i].seq.store( i, std::memory_order_relaxed );
+        enqueuePos.store( 0, std::memory_order_relaxed );
+        dequeuePos.store( 0, std::memory_order_relaxed );
+    }
+
+    bool push( T &&elem )
+    {
+        Cell *cell;
+        std::size_t pos = enqueuePos.load( std::memory_order_relaxed );
+        while( true ) {
+            cell = &cells[pos & mask];
+            std::size_t seq = cell->seq.load( std::memory_order_acquire );
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if( dif == 0 ) {
+                if( enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) )
+                    break;
+            } else if( dif < 0 ) {
+                return false;       // full
+            } else {
+                pos = enqueuePos.load( std::memory_order_relaxed );
+            } // if
+        } // while
+
+        cell->data = std::move( elem );
+        cell->seq.store( pos + 1, std::memory_order_release );
+        return true;
+    }
+
+    bool pop( T &elem )
+    {
+        Cell *cell;
+        std::size_t pos = dequeuePos.load( std::memory_order_relaxed );
+        while( true ) {
+            cell = &cells[pos & mask];
+            std::size_t seq = cell->seq.load( std::memory_order_acquire );
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if( dif == 0 ) {
+                if( dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) )
+                    break;
+            } else if( dif < 0 ) {
+                return false;       // empty
+            } else {
+                pos = dequeuePos.load( std::memory_order_relaxed );
+            } // if
+        } // while
+
+        elem = std::move( cell->data );
+        cell->seq.store( pos + mask + 1, std::memory_order_release );
+        return true;
+    }
 
 protected:
-    std::size_t                                                             front, rear;
-    const std::size_t                                                       queSize;
-    std::mutex                                                              lock;
-    std::condition_variable                                                 condRd;
-    std::condition_variable                                                 condWr;
-    std::vector<BytesArray>                                                 queue;
-    // BytesArray                                                              readBuf_, writeBuf_;
+    struct Cell {
+        std::atomic<std::size_t>    seq;
+        T                           data;
+    };
+
+    std::unique_ptr<Cell[]>         cells;
+    std::size_t                     mask;
+    char                            pad0[CACHE_LINE_SIZE];
+    std::atomic<std::size_t>        enqueuePos;
+    char                            pad1[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+    std::atomic<std::size_t>        dequeuePos;
+    char                            pad2[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
 };
 
 
 /*
- * 用来快速生成BytesArray，省去反复分配内存，与SharedBuffer无关
+ * 用来快速生成BytesArray，省去反复分配内存，与SpscFrameRing无关
+ * 按2的幂分size class (4KiB ~ 64MiB)，get(size)拿到的buffer已reserve到所在class的大小，
+ * 大的I帧不会再触发vector重新分配。
+ * 每个线程先用自己的cache (无同步)，cache空/满时再和全局的lock-free队列交换一批。
+ * 稳定运行后 misses 不再增长，即不再有内存分配。
  */
 template <typename ContainerType>
-class BufferMgr {
+class BufferPool : boost::noncopyable {
     typedef std::shared_ptr<ContainerType>          ElemType;
+
+    static const int            MIN_CLASS_SHIFT = 12;
+    static const int            NUM_CLASSES = 15;
+    static const int            THREAD_CACHE_SIZE = 4;
+    static const int            MAX_POOLS_PER_THREAD = 4;
+public:
+    struct Stats {
+        uint64_t        hits;           // served from a thread cache or the global lists
+        uint64_t        misses;         // had to allocate
+        uint64_t        outstanding;    // currently handed out
+        uint64_t        highWater;      // max outstanding so far
+    };
+
 public:
-    BufferMgr( std::size_t _ReserveSize, std::size_t _ListSize )
-            : RESERVE_SIZE(_ReserveSize), LIST_SIZE(_ListSize) {}
+    // _ListSize: max number of free buffers kept in each size class
+    BufferPool( std::size_t _ReserveSize, std::size_t _ListSize )
+            : RESERVE_SIZE(_ReserveSize)
+    {
+        for( int i = 0; i < NUM_CLASSES; ++i )
+            freeLists[i].reset( new MpmcBoundedQueue<ElemType>(_ListSize) );
+        hits = misses = outstanding = highWater = 0;
+    }
 
     ElemType get()
+    { return get( RESERVE_SIZE ); }
+
+    // the returned buffer is empty with capacity() >= size
+    ElemType get( std::size_t size )
     {
         ElemType ret;
+        int cls = sizeClass( size );
+
+        if( cls < NUM_CLASSES ) {
+            ThreadCache *cache = threadCache();
+            if( cache && !cache->count[cls] )
+                refill( *cache, cls );
+            if( cache && cache->count[cls] )
+                ret = std::move( cache->slots[cls][--cache->count[cls]] );
+            else
+                freeLists[cls]->pop( ret );
+        } // if
 
-        std::unique_lock<std::mutex> lk(lock);
-        if( !bufList.empty() ) {
-            ret = std::move(bufList.front());
-            bufList.pop_front();
-            return std::move(ret);
+        if( ret ) {
+            ++hits;
+        } else {
+            ++misses;
+            ret.reset( new ContainerType );
+            ret->reserve( cls < NUM_CLASSES ? classSize(cls) : size );
         } // if
 
-        lk.unlock();
-        ret.reset( new ContainerType );
-        ret->reserve( RESERVE_SIZE );
-        return std::move(ret);
+        uint64_t cur = ++outstanding;
+        uint64_t hw = highWater.load( std::memory_order_relaxed );
+        while( cur > hw && !highWater.compare_exchange_weak(hw, cur, std::memory_order_relaxed) ) ;
+
+        return ret;
     }
 
     void put( ElemType elem )
     {
+        --outstanding;
         elem->clear();
+
+        // the class whose size the buffer can fully serve
+        int cls = -1;
+        for( std::size_t cap = elem->capacity() >> MIN_CLASS_SHIFT; cap; cap >>= 1 )
+            ++cls;
+        if( cls < 0 )
+            return;
+        if( cls >= NUM_CLASSES )
+            cls = NUM_CLASSES - 1;
+
+        ThreadCache *cache = threadCache();
+        if( cache ) {
+            if( cache->count[cls] == THREAD_CACHE_SIZE )
+                spill( *cache, cls );
+            cache->slots[cls][cache->count[cls]++] = std::move( elem );
+            return;
+        } // if
+
+        freeLists[cls]->push( std::move(elem) );     // dropped if the class is full
+    }
+
+    Stats stats() const
+    {
+        Stats st = { hits.load(), misses.load(), outstanding.load(), highWater.load() };
+        return st;
+    }
+
+protected:
+    struct ThreadCache {
+        ThreadCache() : owner(NULL) { memset( count, 0, sizeof(count) ); }
+
+        const void      *owner;
+        int             count[NUM_CLASSES];
+        ElemType        slots[NUM_CLASSES][THREAD_CACHE_SIZE];
+    };
+
+    static int sizeClass( std::size_t size )
+    {
+        int cls = 0;
+        while( cls < NUM_CLASSES && classSize(cls) < size )
+            ++cls;
+        return cls;
+    }
+
+    static std::size_t classSize( int cls )
+    { return (std::size_t)1 << (MIN_CLASS_SHIFT + cls); }
+
+    // NULL if this thread already caches for too many pools, then the global lists are used directly
+    ThreadCache* threadCache()
+    {
+        static thread_local ThreadCache caches[MAX_POOLS_PER_THREAD];
+        for( auto &c : caches ) {
+            if( c.owner == this )
+                return &c;
+            if( !c.owner ) {
+                c.owner = this;
+                return &c;
+            } // if
+        } // for
+        return NULL;
+    }
+
+    // take up to half a cache from the global list
+    void refill( ThreadCache &cache, int cls )
+    {
+        ElemType elem;
+        while( cache.count[cls] < THREAD_CACHE_SIZE / 2 && freeLists[cls]->pop(elem) )
+            cache.slots[cls][cache.count[cls]++] = std::move( elem );
+    }
+
+    // give half of the cache back to the global list
+    void spill( ThreadCache &cache, int cls )
+    {
+        while( cache.count[cls] > THREAD_CACHE_SIZE / 2 ) {
+            ElemType &elem = cache.slots[cls][--cache.count[cls]];
+            if( !freeLists[cls]->push(std::move(elem)) )
+                elem.reset();
+        } // while
+    }
+
+private:
+    std::unique_ptr<MpmcBoundedQueue<ElemType> >    freeLists[NUM_CLASSES];
+    const std::size_t                               RESERVE_SIZE;
+    std::atomic<uint64_t>                           hits, misses, outstanding, highWater;
+};
+
+
+/*
+ * 接收用的字节环，容量为2的幂。单线程使用(连接的strand上)，不加锁。
+ * writable() 给出空闲区(可能绕回成两段)，一次read_some读满尽量多的数据，commit() 确认读入的字节；
+ * peek()/read() 从头部取出数据，跨越环尾时自动拼接。
+ */
+class RecvRing : boost::noncopyable {
+public:
+    typedef std::array<boost::asio::mutable_buffer, 2>     MutableBufferPair;
+
+    explicit RecvRing( std::size_t _Capacity )
+            : mask(RoundUp(_Capacity) - 1), buf(mask + 1), head(0), tail(0) {}
+
+    std::size_t capacity() const { return mask + 1; }
+    std::size_t size() const { return tail - head; }
+    std::size_t space() const { return capacity() - size(); }
+    bool empty() const { return head == tail; }
+
+    // free space as at most two buffers, pass both to read_some for a single readv
+    MutableBufferPair writable()
+    {
+        std::size_t pos = tail & mask;
+        std::size_t first = std::min( space(), capacity() - pos );
+        MutableBufferPair ret = {{ boost::asio::buffer(&buf[pos], first),
+                                   boost::asio::buffer(&buf[0], space() - first) }};
+        return ret;
+    }
+
+    void commit( std::size_t n )
+    {
+        assert( n <= space() );
+        tail += n;
+    }
+
+    // copy n bytes starting offset bytes past the head, without consuming them
+    void peek( void *dst, std::size_t n, std::size_t offset = 0 ) const
+    {
+        assert( offset + n <= size() );
+        std::size_t pos = (head + offset) & mask;
+        std::size_t first = std::min( n, capacity() - pos );
+        memcpy( dst, &buf[pos], first );
+        memcpy( (char*)dst + first, &buf[0], n - first );
+    }
+
+    uint8_t at( std::size_t offset ) const
+    { return (uint8_t)buf[(head + offset) & mask]; }
+
+    void consume( std::size_t n )
+    {
+        assert( n <= size() );
+        head += n;
+        if( head == tail )
+            head = tail = 0;        // restart at the front, the next read is one contiguous buffer
+    }
+
+    void read( void *dst, std::size_t n )
+    {
+        peek( dst, n );
+        consume( n );
+    }
+
+private:
+    static std::size_t RoundUp( std::size_t n )
+    {
+        std::size_t ret = 1;
+        while( ret < n )
+            ret <<= 1;
+        return ret;
+    }
+
+private:
+    std::size_t         mask;
+    std::vector<char>   buf;
+    std::size_t         head, tail;     // free running, only masked on access
+};
+
+
+/*
+ * 三缓冲，一个生产者一个消费者。两边各自独占一个slot，第三个slot在两者之间原子交换。
+ * 生产者写完backSlot()后publish()，马上换到一个空闲slot继续写，从不等待；
+ * 消费者acquire()总是换到最新完成的那个slot，中间没来得及取的被覆盖(计入overwritten)。
+ * waitAcquire()在没有新slot时阻塞，锁只用来等待，不在交换路径上。
+ */
+template < typename T >
+class TripleBuffer : boost::noncopyable {
+    static const unsigned       FRESH = 4;          // the middle slot holds an unread publish
+    static const unsigned       INDEX_MASK = 3;
+public:
+    TripleBuffer() : back(0), front(1), middle(2), overwritten(0) {}
+
+    // every slot, for setup and teardown while neither side is running
+    T& at( int i ) { return slots[i]; }
+
+    // producer side
+    T& backSlot() { return slots[back]; }
+
+    void publish()
+    {
+        unsigned prev = middle.exchange( back | FRESH, std::memory_order_acq_rel );
+        if( prev & FRESH )
+            overwritten.fetch_add( 1, std::memory_order_relaxed );
+        back = prev & INDEX_MASK;
+
+        { std::lock_guard<std::mutex> lk(lock); }
+        cond.notify_one();
+    }
+
+    // consumer side, true if a newer slot was swapped in as frontSlot()
+    bool acquire()
+    {
+        if( !(middle.load(std::memory_order_acquire) & FRESH) )
+            return false;
+        front = middle.exchange( front, std::memory_order_acq_rel ) & INDEX_MASK;
+        return true;
+    }
+
+    template < typename Rep, typename Period >
+    bool waitAcquire( const std::chrono::duration<Rep, Period> &timeout )
+    {
+        if( acquire() )
+            return true;
         std::unique_lock<std::mutex> lk(lock);
-        if( bufList.size() < LIST_SIZE )
-            bufList.push_back( std::move(elem) ); 
+        cond.wait_for( lk, timeout, [this]()
+                { return (middle.load(std::memory_order_acquire) & FRESH) != 0; } );
+        lk.unlock();
+        return acquire();
     }
 
+    T& frontSlot() { return slots[front]; }
+
+    // let a waiting consumer re-check its stop condition
+    void wake()
+    {
+        { std::lock_guard<std::mutex> lk(lock); }
+        cond.notify_all();
+    }
+
+    uint64_t overwrittenCount() const
+    { return overwritten.load(std::memory_order_relaxed); }
+
 private:
-    std::deque<ElemType>         bufList;
+    T                           slots[3];
+    unsigned                    back;               // producer only
+    unsigned                    front;              // consumer only
+    std::atomic<unsigned>       middle;
+    std::atomic<uint64_t>       overwritten;
     std::mutex                  lock;
-    const std::size_t           RESERVE_SIZE, LIST_SIZE;
+    std::condition_variable     cond;
 };
 
 
@@ -282,4 +811,134 @@ protected:
 
 typedef std::shared_ptr<std::string>        StringPtr;
 
+
+/*
+ * 延迟直方图，单位微秒。按2的幂分段，每段再分8个子桶，percentile的误差小于12.5%。
+ * 任意线程都可以并发record，读出的是近似值。
+ */
+class LatencyHistogram : boost::noncopyable {
+    static const int            SUB_BITS = 3;
+    static const int            SUB_COUNT = 1 << SUB_BITS;
+    static const int            NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+public:
+    LatencyHistogram()
+    { reset(); }
+
+    void record( int64_t us )
+    {
+        uint64_t v = us > 0 ? (uint64_t)us : 0;
+        buckets[bucketOf(v)].fetch_add( 1, std::memory_order_relaxed );
+        total.fetch_add( 1, std::memory_order_relaxed );
+        uint64_t cur = maxValue.load( std::memory_order_relaxed );
+        while( v > cur && !maxValue.compare_exchange_weak(cur, v, std::memory_order_relaxed) ) {}
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t max() const { return maxValue.load(std::memory_order_relaxed); }
+
+    // upper bound of the bucket holding the p-th quantile, p in [0, 1]
+    uint64_t percentile( double p ) const
+    {
+        uint64_t n = count();
+        if( !n ) return 0;
+        uint64_t rank = (uint64_t)(p * (double)n);
+        if( rank >= n ) rank = n - 1;
+        uint64_t seen = 0;
+        for( int i = 0; i < NUM_BUCKETS; ++i ) {
+            seen += buckets[i].load( std::memory_order_relaxed );
+            if( seen > rank )
+                return std::min( bucketUpper(i), max() );
+        } // for
+        return max();
+    }
+
+    void reset()
+    {
+        for( int i = 0; i < NUM_BUCKETS; ++i )
+            buckets[i].store( 0, std::memory_order_relaxed );
+        total.store( 0, std::memory_order_relaxed );
+        maxValue.store( 0, std::memory_order_relaxed );
+    }
+
+private:
+    static int bucketOf( uint64_t v )
+    {
+        if( v < SUB_COUNT )
+            return (int)v;
+        int msb = 63;
+        while( !(v >> msb) ) --msb;
+        int shift = msb - SUB_BITS;
+        return ((msb - SUB_BITS + 1) << SUB_BITS) + (int)((v >> shift) & (SUB_COUNT - 1));
+    }
+
+    static uint64_t bucketUpper( int idx )
+    {
+        if( idx < SUB_COUNT )
+            return (uint64_t)idx;
+        int shift = (idx >> SUB_BITS) - 1;
+        uint64_t lower = (uint64_t)(SUB_COUNT + (idx & (SUB_COUNT - 1))) << shift;
+        return lower + ((uint64_t)1 << shift) - 1;
+    }
+
+private:
+    std::atomic<uint64_t>       buckets[NUM_BUCKETS];
+    std::atomic<uint64_t>       total;
+    std::atomic<uint64_t>       maxValue;
+};
+
+/*
+ * 一组命名的流水线阶段，每个阶段一个LatencyHistogram，report()生成可以通过msg通道发送的文本。
+ */
+class LatencyTracer : boost::noncopyable {
+public:
+    LatencyTracer( const char * const *_Names, std::size_t n )
+            : names(_Names, _Names + n), hists(n) {}
+
+    void record( std::size_t stage, int64_t us )
+    { hists[stage].record( us ); }
+
+    void reset()
+    {
+        for( auto &h : hists )
+            h.reset();
+    }
+
+    // one line per stage: "<title> <stage>: n=... p50=...us p99=...us max=...us"
+    std::string report( const std::string &title ) const
+    {
+        std::string ret;
+        char line[256];
+        for( std::size_t i = 0; i < hists.size(); ++i ) {
+            const LatencyHistogram &h = hists[i];
+            sprintf( line, "%s %-10s n=%llu p50=%lluus p99=%lluus max=%lluus\n",
+                    title.c_str(), names[i].c_str(), (unsigned long long)h.count(),
+                    (unsigned long long)h.percentile(0.5), (unsigned long long)h.percentile(0.99),
+                    (unsigned long long)h.max() );
+            ret.append( line );
+        } // for
+        return ret;
+    }
+
+    // {"<stage>":{"n":..,"p50":..,"p90":..,"p99":..,"max":..},...}, values in us
+    std::string json() const
+    {
+        std::string ret( "{" );
+        char item[256];
+        for( std::size_t i = 0; i < hists.size(); ++i ) {
+            const LatencyHistogram &h = hists[i];
+            sprintf( item, "%s\"%s\":{\"n\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}",
+                    i ? "," : "", names[i].c_str(), (unsigned long long)h.count(),
+                    (unsigned long long)h.percentile(0.5), (unsigned long long)h.percentile(0.9),
+                    (unsigned long long)h.percentile(0.99), (unsigned long long)h.max() );
+            ret.append( item );
+        } // for
+        ret.append( "}" );
+        return ret;
+    }
+
+private:
+    std::vector<std::string>        names;
+    std::vector<LatencyHistogram>   hists;
+};
+
 #endif
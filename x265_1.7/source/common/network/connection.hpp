@@ -3,16 +3,51 @@
 
 #include "common_utils.hpp"
 
-#define ADDR_STR(conn)          (conn)->socket().remote_endpoint().address().to_string()
+#define ADDR_STR(conn)          remote_address_string((conn)->socket())
 #define SHUTDOWN_W              (boost::asio::ip::tcp::socket::shutdown_send)
 #define SHUTDOWN_R              (boost::asio::ip::tcp::socket::shutdown_receive)
 #define SHUTDOWN_RW             (boost::asio::ip::tcp::socket::shutdown_both)
 
+// a connection that never had a peer (e.g. the shared memory transport) logs instead of throwing
+static inline
+std::string remote_address_string( const boost::asio::ip::tcp::socket &sock )
+{
+    boost::system::error_code ec;
+    boost::asio::ip::tcp::endpoint ep = sock.remote_endpoint( ec );
+    return ec ? std::string("(no peer)") : ep.address().to_string();
+}
+
 /*
  * error list:
  * 对方进程退出，正在读的连接 connection read error: asio.misc:2
  */
 
+/*
+ * DataConnection发送队列的预算，队列中最老的一帧等待超过maxDelayMs，或排队字节数超过maxBytes时，
+ * 丢弃队列中的帧直到下一个可解码点(关键帧)，并通知上层请求IDR。0表示不限制。
+ */
+struct SendQueuePolicy {
+    SendQueuePolicy( uint32_t _MaxDelayMs = 0, std::size_t _MaxBytes = 0 )
+            : maxDelayMs(_MaxDelayMs), maxBytes(_MaxBytes) {}
+
+    bool unlimited() const { return !maxDelayMs && !maxBytes; }
+
+    uint32_t            maxDelayMs;
+    std::size_t         maxBytes;
+};
+
+struct SendQueueStats {
+    SendQueueStats() : droppedFrames(0), droppedBytes(0), writtenBytes(0), queueDelayMs(0), writeDelayMs(0)
+                     , queuedFrames(0), queuedBytes(0), keyframeRequested(false) {}
+
+    uint64_t            droppedFrames, droppedBytes;    // totals
+    uint64_t            writtenBytes;       // total handed to the socket, compared with the client's acks
+    uint32_t            queueDelayMs;       // age of the oldest data still waiting to be written
+    uint32_t            writeDelayMs;       // enqueue -> write completion of the last written data
+    std::size_t         queuedFrames, queuedBytes;
+    bool                keyframeRequested;  // the drop left no decodable point, a new keyframe is needed
+};
+
 class TcpConnection : public std::enable_shared_from_this<TcpConnection>
                     , protected boost::noncopyable
 {
@@ -29,6 +64,9 @@ public:
     typedef std::function<bool(const std::string&, pointer)>                    MsgHandlerType;
     typedef std::function<void(BytesArrayPtr, size_t)>                          DataHandlerType;
     typedef std::function<void(boost::asio::streambuf*, size_t)>                DataStreamHandlerType;
+    typedef std::function<void(const SendQueueStats&)>                          CongestionHandlerType;
+    typedef std::function<void(size_t)>                                         ReadHandlerType;
+    typedef RecvRing::MutableBufferPair                                         MutableBufferPair;
 public:
     explicit TcpConnection(boost::asio::io_service& io_service, ConnType _Type)
                 : socket_(io_service), strand_(io_service), type_(_Type) {}
@@ -49,14 +87,22 @@ public:
     }
 
     virtual void sendData( BytesArrayPtr data ) { DBG_STREAM("TcpConnection::sendData()"); }
+    virtual void sendData( GatherBufferPtr data ) { DBG_STREAM("TcpConnection::sendData() gather"); }
     virtual void recvData( BytesArrayPtr data, const DataHandlerType &on_data_handler )
     { DBG_STREAM("TcpConnection::recvData()"); }
     virtual void recvData( const DataStreamHandlerType &on_data_handler, size_t len = 1 )
     { DBG_STREAM("TcpConnection::recvData() stream"); }
+    // whatever is available, up to the size of bufs; recvExactly fills buf completely
+    virtual void recvSome( const MutableBufferPair &bufs, const ReadHandlerType &on_read_handler )
+    { DBG_STREAM("TcpConnection::recvSome()"); }
+    virtual void recvExactly( const boost::asio::mutable_buffer &buf, const ReadHandlerType &on_read_handler )
+    { DBG_STREAM("TcpConnection::recvExactly()"); }
     virtual void sendMsg( const std::string &msg ) {}
     virtual void sendMsg( StringPtr msg ) { DBG_STREAM("TcpConnection::sendMsg()"); }
     virtual void recvMsg() { DBG_STREAM("TcpConnection::recvMsg()"); }
     virtual void connect( const endpoint_type &server ) { DBG_STREAM("TcpConnection::connect()"); }
+    virtual void setSendQueuePolicy( const SendQueuePolicy &policy ) {}
+    virtual SendQueueStats sendQueueStats() { return SendQueueStats(); }
 
     ConnType type() const { return type_; }
     // void connect( const std::string &server, uint16_t port )
@@ -71,34 +117,65 @@ public:
     virtual void handle_sendMsg(const boost::system::error_code& error,
                 size_t bytes_transferred) {}
     virtual void handle_recvMsg(const boost::system::error_code& error) {}
-    virtual void handle_sendData(BytesArrayPtr data, const boost::system::error_code& error,
+    virtual void handle_sendData(GatherBufferPtr data, const boost::system::error_code& error,
                 size_t bytes_transferred) {}
     virtual void handle_recvData(BytesArrayPtr data, const DataHandlerType &on_data_handler, 
                 const boost::system::error_code& error, size_t bytes_transferred) {}
     virtual void handle_recvDataStream(const DataStreamHandlerType &on_data_handler, 
                 const boost::system::error_code& error, size_t bytes_transferred) {}
+    virtual void handle_recvSome(const ReadHandlerType &on_read_handler,
+                const boost::system::error_code& error, size_t bytes_transferred) {}
     virtual void handle_connect(const boost::system::error_code& error) {}
     virtual bool isConnected() const { return true; }
 
+    /*
+     * io_service可能在多个线程中运行，handler可能在别的连接的strand中增删(如Service的构造和析构)，
+     * 所以handler表要加锁，调用时先拷贝一份，handler里可以安全地增删handler。
+     */
     void addErrorHandler( int no, const ErrorHandlerType &err_handler )
-    { errHandlers[no] = err_handler; }
+    {
+        std::unique_lock<std::mutex> lk(handlerLock);
+        errHandlers[no] = err_handler;
+    }
 
     void addMsgHandler( int no, const MsgHandlerType &msg_handler )
-    { msgHandlers[no] = msg_handler; }
+    {
+        std::unique_lock<std::mutex> lk(handlerLock);
+        msgHandlers[no] = msg_handler;
+    }
 
     void removeErrorHandler( int no )
-    { errHandlers.erase(no); }
+    {
+        std::unique_lock<std::mutex> lk(handlerLock);
+        errHandlers.erase(no);
+    }
 
     void removeMsgHandler( int no )
-    { msgHandlers.erase(no); }
+    {
+        std::unique_lock<std::mutex> lk(handlerLock);
+        msgHandlers.erase(no);
+    }
+
+    /*
+     * 发送队列丢帧或者需要关键帧时由notifyCongestion调用，不能阻塞。handler在congestionLock里调用，
+     * 这里也要拿这个锁，所以返回之后旧的handler不会还在执行，也不会再被调用，可以绑定Service的this。
+     */
+    void setCongestionHandler( const CongestionHandlerType &handler )
+    {
+        std::unique_lock<std::mutex> lk(congestionLock);
+        congestionHandler = handler;
+    }
 
     // error categories can check boost/asio/error.hpp
     virtual void OnError(const boost::system::error_code& error) 
     { 
-        DBG_STREAM( "Connection to " << socket().remote_endpoint() 
-                    << " error: " << error );
+        DBG_STREAM( "Connection to " << ADDR_STR(this) << " error: " << error );
+
+        std::unique_lock<std::mutex> lk(handlerLock);
+        std::map<int, ErrorHandlerType> handlers( errHandlers );
+        lk.unlock();
 
-        for( auto& v : errHandlers ) {
+        for( auto& v : handlers ) {
             if( (v.second)(error, shared_from_this()) )
                 break;
         } // for
@@ -109,12 +186,27 @@ public:
         // DBG_STREAM("Connection to " << socket().remote_endpoint() 
                 // << " received msg: " << msg );
         
-        for( auto& v : msgHandlers ) {
+        std::unique_lock<std::mutex> lk(handlerLock);
+        std::map<int, MsgHandlerType> handlers( msgHandlers );
+        lk.unlock();
+
+        for( auto& v : handlers ) {
             if( (v.second)(msg, shared_from_this()) )
                 break;
         } // for 
     }
 
+protected:
+    // false if there is no handler
+    bool notifyCongestion( const SendQueueStats &stats )
+    {
+        std::unique_lock<std::mutex> lk(congestionLock);
+        if( !congestionHandler )
+            return false;
+        congestionHandler( stats );
+        return true;
+    }
+
 protected:
     boost::asio::ip::tcp::socket        socket_;
     /// Strand to ensure the connection's handlers are not called concurrently.
@@ -122,6 +214,9 @@ protected:
     boost::asio::streambuf              recvBuf;
     std::map<int, ErrorHandlerType>     errHandlers;
     std::map<int, MsgHandlerType>       msgHandlers;
+    std::mutex                          handlerLock;
+    CongestionHandlerType               congestionHandler;
+    std::mutex                          congestionLock;     // held while congestionHandler runs
     ConnType                            type_;
 };
 
@@ -138,9 +233,19 @@ class DataConnection : public TcpConnection
 {
 public:
     DataConnection(boost::asio::io_service& io_service)
-            : TcpConnection(io_service, ConnType::DATA) {}
+            : TcpConnection(io_service, ConnType::DATA)
+            , queuedBytes(0), dropUntilKeyframe(false) {}
 
+    // the BytesArray is sent in place, it is kept alive until the write completes
     void sendData( BytesArrayPtr data )
+    {
+        GatherBufferPtr buf = std::make_shared<GatherBuffer>();
+        buf->append( data->ptr(), data->size() );
+        buf->releaser = [data]() {};
+        this->sendData( buf );
+    }
+
+    void sendData( GatherBufferPtr data )
     {
         // final aim is to call async_write
         /*
@@ -154,6 +259,18 @@ public:
                 );
     }
 
+    void setSendQueuePolicy( const SendQueuePolicy &policy )
+    {
+        strand_.post( std::bind(&DataConnection::setSendQueuePolicyImpl,
+                    std::dynamic_pointer_cast<DataConnection>(shared_from_this()), policy) );
+    }
+
+    SendQueueStats sendQueueStats()
+    {
+        std::unique_lock<std::mutex> lk(statsLock);
+        return stats;
+    }
+
     /*
      * //!! read does not need strand 调用者要保证read handle_read串行化
      */
@@ -166,8 +283,8 @@ public:
         // at_least_one(1) normally fill up the data buf
         boost::asio::async_read( socket_, boost::asio::buffer(*data),
                 boost::asio::transfer_exactly(len),
-                std::bind(&TcpConnection::handle_recvData,  shared_from_this(), 
-                        data, on_data_handler, std::placeholders::_1, std::placeholders::_2) );
+                strand_.wrap(std::bind(&TcpConnection::handle_recvData,  shared_from_this(),
+                        data, on_data_handler, std::placeholders::_1, std::placeholders::_2)) );
         // boost::asio::async_read( socket_, boost::asio::buffer(*data),
                 // boost::asio::transfer_at_least(1),
                 // std::bind(&TcpConnection::handle_recvData,  shared_from_this(), 
@@ -180,35 +297,162 @@ public:
 
         boost::asio::async_read( socket_, recvBuf,
                 boost::asio::transfer_at_least(len),
-                std::bind(&TcpConnection::handle_recvDataStream, shared_from_this(), 
-                        on_data_handler, std::placeholders::_1, std::placeholders::_2) );
+                strand_.wrap(std::bind(&TcpConnection::handle_recvDataStream, shared_from_this(),
+                        on_data_handler, std::placeholders::_1, std::placeholders::_2)) );
+    }
+
+    void recvSome( const MutableBufferPair &bufs, const ReadHandlerType &on_read_handler )
+    {
+        socket_.async_read_some( bufs,
+                strand_.wrap(std::bind(&TcpConnection::handle_recvSome, shared_from_this(),
+                        on_read_handler, std::placeholders::_1, std::placeholders::_2)) );
+    }
+
+    void recvExactly( const boost::asio::mutable_buffer &buf, const ReadHandlerType &on_read_handler )
+    {
+        boost::asio::async_read( socket_, boost::asio::mutable_buffers_1(buf),
+                boost::asio::transfer_exactly(boost::asio::buffer_size(buf)),
+                strand_.wrap(std::bind(&TcpConnection::handle_recvSome, shared_from_this(),
+                        on_read_handler, std::placeholders::_1, std::placeholders::_2)) );
     }
 
 protected:
-    void sendDataImpl( BytesArrayPtr data )
+    void sendDataImpl( GatherBufferPtr data )
     {
-        outgoingQueue.push_back( data );
+        GatherBuffer::Clock::time_point now = GatherBuffer::Clock::now();
+
+        // after a drop nothing is decodable until the next keyframe
+        if( dropUntilKeyframe && data->droppable() ) {
+            if( !data->keyframe() ) {
+                SendQueueStats snapshot;
+                {
+                    std::unique_lock<std::mutex> lk(statsLock);
+                    ++stats.droppedFrames;
+                    stats.droppedBytes += data->size();
+                    snapshot = stats;
+                }
+                // the keyframe request may have been lost, repeat it once a second
+                if( now - lastKeyframeRequest > std::chrono::seconds(1) && notifyCongestion(snapshot) )
+                    lastKeyframeRequest = now;
+                return;
+            } // if
+            dropUntilKeyframe = false;
+        } // if
+
+        outgoingQueue.push_back( OutgoingItem(data, now) );
+        queuedBytes += data->size();
         if ( outgoingQueue.size() > 1 ) {
             // leave the job to handle_sendData
+            enforceSendQueuePolicy();
+            updateQueueStats();
             return;
         } // if
 
+        updateQueueStats();
         DoSendData();
     }
 
+    void setSendQueuePolicyImpl( SendQueuePolicy policy )
+    { sendPolicy = policy; }
+
+    /*
+     * outgoingQueue.front()正在发送，不能动。超出预算时丢弃front之后、最新的关键帧之前的所有可丢弃帧；
+     * 队列中没有关键帧时全部丢弃，并在下一个关键帧到来之前丢弃新的帧，由congestionHandler请求IDR。
+     */
+    void enforceSendQueuePolicy()
+    {
+        if( sendPolicy.unlimited() || outgoingQueue.size() < 2 )
+            return;
+
+        uint32_t delayMs = (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                    GatherBuffer::Clock::now() - outgoingQueue[1].enqueueTime).count();
+        std::size_t waitingBytes = queuedBytes - outgoingQueue.front().data->size();
+        if( !(sendPolicy.maxDelayMs && delayMs > sendPolicy.maxDelayMs)
+                && !(sendPolicy.maxBytes && waitingBytes > sendPolicy.maxBytes) )
+            return;
+
+        std::size_t lastKey = 0;
+        for( std::size_t i = outgoingQueue.size() - 1; i > 0; --i ) {
+            if( outgoingQueue[i].data->keyframe() ) {
+                lastKey = i;
+                break;
+            } // if
+        } // for
+
+        std::size_t end = lastKey ? lastKey : outgoingQueue.size();
+        uint64_t nDropped = 0, bytesDropped = 0;
+        std::deque<OutgoingItem> kept;
+        for( std::size_t i = 1; i < outgoingQueue.size(); ++i ) {
+            OutgoingItem &item = outgoingQueue[i];
+            if( i < end && item.data->droppable() ) {
+                ++nDropped;
+                bytesDropped += item.data->size();
+            } else {
+                kept.push_back( item );
+            } // if
+        } // for
+        outgoingQueue.resize( 1 );
+        outgoingQueue.insert( outgoingQueue.end(), kept.begin(), kept.end() );
+        queuedBytes -= (std::size_t)bytesDropped;
+
+        // 只有真的丢了帧才进入丢帧模式，这时一定调用congestionHandler请求IDR，
+        // 否则在下一次请求(限速1s)之前新的帧都被丢弃却没有请求关键帧
+        bool requestKeyframe = !lastKey && nDropped;
+        if( requestKeyframe ) {
+            dropUntilKeyframe = true;
+            lastKeyframeRequest = GatherBuffer::Clock::now();
+        } // if
+
+        SendQueueStats snapshot;
+        {
+            std::unique_lock<std::mutex> lk(statsLock);
+            stats.droppedFrames += nDropped;
+            stats.droppedBytes += bytesDropped;
+            stats.queueDelayMs = delayMs;
+            stats.keyframeRequested = requestKeyframe;
+            snapshot = stats;
+        }
+
+        DBG_STREAM("Send queue over budget, delay " << delayMs << "ms " << waitingBytes
+                    << " bytes, dropped " << nDropped << " frames");
+        if( nDropped )
+            notifyCongestion( snapshot );
+    }
+
+    void updateQueueStats()
+    {
+        std::unique_lock<std::mutex> lk(statsLock);
+        stats.queuedFrames = outgoingQueue.size();
+        stats.queuedBytes = queuedBytes;
+        stats.queueDelayMs = outgoingQueue.empty() ? 0 :
+                (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                    GatherBuffer::Clock::now() - outgoingQueue.front().enqueueTime).count();
+    }
+
     void DoSendData()
     {
-        BytesArrayPtr data = outgoingQueue.front();
+        GatherBufferPtr data = outgoingQueue.front().data;
 
-        boost::asio::async_write(socket_, boost::asio::buffer(*data),
+        // header and payloads go out in one gathered write, no copy into a contiguous buffer
+        boost::asio::async_write(socket_, data->buffers(),
                     strand_.wrap(std::bind(&TcpConnection::handle_sendData, shared_from_this(), data,
                         std::placeholders::_1, std::placeholders::_2)));
     }
 
-    void handle_sendData(BytesArrayPtr pData, const boost::system::error_code& error,
+    // pData is released (and its memory returned to the owner) when the last reference goes away
+    void handle_sendData(GatherBufferPtr pData, const boost::system::error_code& error,
                 size_t bytes_transferred)
     {
+        GatherBuffer::Clock::time_point enqueueTime = outgoingQueue.front().enqueueTime;
         outgoingQueue.pop_front();
+        queuedBytes -= pData->size();
+        {
+            std::unique_lock<std::mutex> lk(statsLock);
+            stats.writeDelayMs = (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                        GatherBuffer::Clock::now() - enqueueTime).count();
+            stats.writtenBytes += bytes_transferred;
+        }
+        updateQueueStats();
 
         if( error ) {
             OnError( error );
@@ -245,8 +489,36 @@ protected:
         on_data_handler( &recvBuf, bytes_transferred );
     }
 
+    void handle_recvSome(const ReadHandlerType &on_read_handler,
+            const boost::system::error_code& error, size_t bytes_transferred)
+    {
+        if( error ) {
+            OnError( error );
+            return;
+        } // if
+
+        on_read_handler( bytes_transferred );
+    }
+
 protected:
-    std::deque<BytesArrayPtr>        outgoingQueue;
+    // the same GatherBuffer may be queued on several connections (broadcast), so the
+    // per-connection enqueue time lives in the queue entry
+    struct OutgoingItem {
+        OutgoingItem() {}
+        OutgoingItem( const GatherBufferPtr &_Data, GatherBuffer::Clock::time_point _Time )
+                : data(_Data), enqueueTime(_Time) {}
+
+        GatherBufferPtr                     data;
+        GatherBuffer::Clock::time_point     enqueueTime;
+    };
+
+    std::deque<OutgoingItem>         outgoingQueue;
+    std::size_t                      queuedBytes;       // including the write in flight
+    SendQueuePolicy                  sendPolicy;
+    bool                             dropUntilKeyframe;
+    GatherBuffer::Clock::time_point  lastKeyframeRequest;
+    SendQueueStats                   stats;
+    std::mutex                       statsLock;         // stats are read by other threads
 };
 
 
@@ -272,8 +544,8 @@ public:
     void recvMsg()
     {
         boost::asio::async_read_until(socket_, recvBuf, "\n",
-                std::bind(&TcpConnection::handle_recvMsg, shared_from_this(),
-                    std::placeholders::_1));
+                strand_.wrap(std::bind(&TcpConnection::handle_recvMsg, shared_from_this(),
+                    std::placeholders::_1)));
     }
 
     bool recvMsgSync( std::string &msg )
@@ -358,6 +630,79 @@ protected:
 };
 
 
+/*
+ * 在多个线程中运行同一个io_service。每个连接的handler都经过自己的strand_，所以同一连接
+ * 仍然是串行的，不同连接的发送可以并行。
+ */
+class IoServicePool : boost::noncopyable {
+public:
+    explicit IoServicePool( boost::asio::io_service &_IoService, const char *_ThreadName = "io" )
+            : io_service(_IoService), threadName(_ThreadName) {}
+
+    ~IoServicePool()
+    { join(); }
+
+    static std::size_t defaultThreads()
+    {
+        std::size_t n = std::thread::hardware_concurrency();
+        return n ? n : 1;
+    }
+
+    // start nThreads threads running io_service, returns immediately
+    void start( std::size_t nThreads )
+    {
+        for( std::size_t i = 0; i < nThreads; ++i )
+            threads.emplace_back( std::bind(&IoServicePool::DoRun, this) );
+    }
+
+    // run io_service on nThreads threads including the caller's, returns when io_service stops
+    void run( std::size_t nThreads )
+    {
+        start( nThreads > 1 ? nThreads - 1 : 0 );
+        try {
+            io_service.run();
+        } catch ( ... ) {
+            io_service.stop();
+            join();
+            throw;
+        }
+        join();
+    }
+
+    void stop()
+    { io_service.stop(); }
+
+    void join()
+    {
+        for( auto &t : threads ) {
+            if( t.joinable() )
+                t.join();
+        } // for
+        threads.clear();
+    }
+
+    std::size_t size() const { return threads.size(); }
+
+private:
+    void DoRun()
+    {
+        set_thread_name( threadName );
+        try {
+            io_service.run();
+        } catch ( const std::exception &ex ) {
+            std::cerr << "io thread " << std::this_thread::get_id()
+                      << " exception caught: " << ex.what() << std::endl;
+            io_service.stop();
+        }
+    }
+
+private:
+    boost::asio::io_service             &io_service;
+    const char                          *threadName;
+    std::vector<std::thread>            threads;
+};
+
+
 
 #endif
 
@@ -1,10 +1,9 @@
 #include "desktop_streaming_request.hpp"
 #include <fstream>
+#include <map>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
-#include <libavformat/avformat.h>
-#include <libavformat/avio.h>
 #include <libavutil/file.h>
 #include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
@@ -12,260 +11,800 @@ extern "C" {
 #include <SDL_thread.h>
 } // extern "C"
 
-BufferMgr<BytesArray>    DesktopStreamingRequest::gRecvBufMgr(INIT_FRAME_SIZE, 10);
+#ifndef AV_INPUT_BUFFER_PADDING_SIZE
+#define AV_INPUT_BUFFER_PADDING_SIZE    FF_INPUT_BUFFER_PADDING_SIZE
+#endif
+static_assert( DECODER_PADDING_SIZE >= AV_INPUT_BUFFER_PADDING_SIZE, "receive buffers are too short for the decoder" );
+
+BufferPool<BytesArray>   DesktopStreamingRequest::gRecvBufMgr(INIT_FRAME_SIZE, 16);
+
+static const char * const CLIENT_LATENCY_STAGES[CLS_COUNT] = {
+    "network", "queue", "decode", "present", "endtoend"
+};
+LatencyTracer            gClientLatency(CLIENT_LATENCY_STAGES, CLS_COUNT);
+int                      g_decoder_threads = 0;
+const char*              g_snapshot_policy = "off";
+bool                     g_headless_display = false;
+
+/*
+ * 交给解码器的帧以seqNO作为packet的pts登记，解码出的图像用pkt_pts找回自己的记录。
+ * 解码出错或者没有输出图像的packet留下的记录，在后面的图像输出时一起删掉(没有B帧，输出顺序等于发送顺序)，
+ * 不会错配到后面的帧上；seq 0 的参数集不产生图像，不登记。
+ */
+struct PendingTrace {
+    int64_t         captureTime;
+    int64_t         demuxTime;
+    bool            present;        // false: the playout scheduler is catching up, decode only
+};
+static std::map<int64_t, PendingTrace> pendingTraces;   // by packet pts, player thread only
 
 
 static
 DesktopStreamingRequest *pInstance = NULL;
 static
-BufferMgr<BytesArray>   *pBufMgr = NULL;
+BufferPool<BytesArray>  *pBufMgr = NULL;
 
-static
-int WriteJPEG( const AVCodecContext *pCodecCtx, AVFrame *pFrame, const char *filename );
 
-static 
-int read_packet(void *opaque, uint8_t *buf, int buf_size)
-{
-    int             nread;
-    RecvdFrame      frame;
+/*
+ * 截图在后台线程里编码、写文件，MJPEG编码器只创建一次(尺寸或格式变化时重建)。
+ * 解码线程只对解码出的帧做av_frame_ref放进有界队列，队列满时丢弃这张截图，不阻塞解码。
+ * 策略: off 不截图；demand 只在控制台输入"snapshot"时截下一帧；n 每n帧截一张(也响应"snapshot")。
+ */
+class SnapshotWorker : boost::noncopyable {
+public:
+    enum Mode { OFF, ON_DEMAND, EVERY_N };
+
+    struct Stats {
+        uint64_t        written;
+        uint64_t        dropped;        // queue full
+        uint64_t        failed;
+    };
+
+    explicit SnapshotWorker( std::size_t _MaxQueued = 4 )
+            : maxQueued(_MaxQueued), mode(OFF), interval(0), requested(false), quit(false)
+            , pEncCtx(NULL), encWidth(0), encHeight(0), encFormat(AV_PIX_FMT_NONE)
+    { memset( &stats, 0, sizeof(stats) ); }
+
+    ~SnapshotWorker()
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        quit = true;
+        lk.unlock();
+        cond.notify_one();
+        if( worker.joinable() )
+            worker.join();
+        for( auto &job : jobs )
+            av_frame_free( &job.frame );
+        CloseEncoder();
+    }
 
-    frame = pInstance->FrameQueue().pop();
-    nread = frame.pData->size();
-    assert( nread <= buf_size );            //!!
-    memcpy( buf, frame.pData->ptr(), nread );
-    DBG_STREAM("Player required a frame: " << frame << " when " << gen_timestamp());
-    pBufMgr->put( frame.pData );
+    static bool ParsePolicy( const std::string &s, Mode &mode, uint32_t &interval )
+    {
+        interval = 0;
+        if( s == "off" ) {
+            mode = OFF;
+        } else if( s == "demand" ) {
+            mode = ON_DEMAND;
+        } else {
+            char *end = NULL;
+            unsigned long n = strtoul( s.c_str(), &end, 10 );
+            if( !n || *end )
+                return false;
+            mode = EVERY_N;
+            interval = (uint32_t)n;
+        } // if
+        return true;
+    }
 
-    // DEBUG
-    // static std::ofstream ofs( "client.h265", std::ios::out | std::ios::binary );
-    // ofs.write( frame.pData->ptr(), nread );
-    // ofs.flush();
+    void setPolicy( Mode _Mode, uint32_t _Interval )
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        mode = _Mode;
+        interval = _Interval;
+    }
 
-    return nread;
-}
+    void requestOne()
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        requested = true;
+    }
 
-int DesktopStreamingRequest::PlayerRoutine()
-{
-    AVFormatContext*                    fmt_ctx = NULL;
-    AVIOContext*                        avio_ctx = NULL;
-    AVCodecContext*                     pCodecCtx = NULL;
-    unsigned char*                      readBuf = NULL;
-    int                     i, ret = 0, videoStreamIndex;
-    AVCodec         *pCodec = NULL;
-    AVFrame         *pFrame = NULL; 
-    AVPacket        packet;
-    int             frameFinished;
+    // decode thread, frameNo numbers the files
+    void offer( const AVFrame *frame, uint32_t frameNo )
+    {
+        std::unique_lock<std::mutex> lk(lock);
+
+        bool take = (mode == EVERY_N && frameNo % interval == 0) || (mode != OFF && requested);
+        if( !take )
+            return;
+        requested = false;
+        if( jobs.size() >= maxQueued ) {
+            ++stats.dropped;
+            return;
+        } // if
 
-    AVDictionary    *optionsDict = NULL;
-    struct SwsContext *sws_ctx = NULL;
+        // the reference keeps the decoder's picture alive, no pixel copy for refcounted frames
+        Job job;
+        job.frame = av_frame_alloc();
+        if( !job.frame || av_frame_ref(job.frame, frame) < 0 ) {
+            av_frame_free( &job.frame );
+            ++stats.failed;
+            return;
+        } // if
+        job.frameNo = frameNo;
+        jobs.push_back( job );
 
-    SDL_Overlay     *bmp = NULL;
-    SDL_Surface     *screen = NULL;
-    SDL_Rect        rect;
-    SDL_Event       event;
+        if( !worker.joinable() )
+            worker = std::thread( std::bind(&SnapshotWorker::Run, this) );
+        lk.unlock();
+        cond.notify_one();
+    }
 
-    // JPG_Converter   jpg_converter;
-    uint32_t        decodeSeqNO = 0;
-    char            jpgFileName[64];
+    std::string report()
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        char buf[160];
+        sprintf( buf, "Snapshot policy=%s written=%llu dropped=%llu failed=%llu\n",
+                    mode == OFF ? "off" : mode == ON_DEMAND ? "demand" : std::to_string(interval).c_str(),
+                    (unsigned long long)stats.written, (unsigned long long)stats.dropped,
+                    (unsigned long long)stats.failed );
+        return buf;
+    }
 
-    pInstance = this;
-    pBufMgr = &gRecvBufMgr;
+private:
+    struct Job {
+        AVFrame        *frame;
+        uint32_t        frameNo;
+    };
+
+    void Run()
+    {
+        set_thread_name( "snapshot" );
+        for( ;; ) {
+            std::unique_lock<std::mutex> lk(lock);
+            while( jobs.empty() && !quit )
+                cond.wait( lk );
+            if( quit )
+                return;
+            Job job = jobs.front();
+            jobs.pop_front();
+            lk.unlock();
+
+            char filename[64];
+            sprintf( filename, "%u.jpg", job.frameNo );
+            int ret = WriteJPEG( job.frame, filename );
+            av_frame_free( &job.frame );
+
+            lk.lock();
+            if( ret < 0 )
+                ++stats.failed;
+            else
+                ++stats.written;
+        } // for
+    }
 
-    /* register codecs and formats and other lavf/lavc components*/
-    av_register_all();
+    static AVPixelFormat JpegFormat( int fmt )
+    {
+        switch( fmt ) {
+        case AV_PIX_FMT_YUV420P:    return AV_PIX_FMT_YUVJ420P;
+        case AV_PIX_FMT_YUV422P:    return AV_PIX_FMT_YUVJ422P;
+        case AV_PIX_FMT_YUV444P:    return AV_PIX_FMT_YUVJ444P;
+        default:                    return AV_PIX_FMT_NONE;
+        } // switch
+    }
 
-    if (!(fmt_ctx = avformat_alloc_context())) {
-        ret = AVERROR(ENOMEM);
-        DBG("avformat_alloc_context fail!");
-        goto end;
+    void CloseEncoder()
+    {
+        if( pEncCtx ) {
+            avcodec_close( pEncCtx );
+            av_free( pEncCtx );
+            pEncCtx = NULL;
+        } // if
     }
 
-    readBuf = (unsigned char*)av_malloc(PLAYER_BUFSIZE);
-    if (!readBuf) {
-        ret = AVERROR(ENOMEM);
-        DBG("alloc buffer fail!");
-        goto end;
+    // worker thread only
+    bool OpenEncoder( int width, int height, AVPixelFormat format )
+    {
+        if( pEncCtx && width == encWidth && height == encHeight && format == encFormat )
+            return true;
+        CloseEncoder();
+
+        AVCodec *pCodec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+        if( !pCodec ) {
+            fprintf(stderr, "Cannot find MJPEG codec!\n");
+            return false;
+        } // if
+
+        pEncCtx = avcodec_alloc_context3(pCodec);
+        if( !pEncCtx ) {
+            fprintf(stderr, "Allocate CodecCtx error!\n");
+            return false;
+        } // if
+
+        pEncCtx->width          = width;
+        pEncCtx->height         = height;
+        pEncCtx->pix_fmt        = format;
+        pEncCtx->time_base.num  = 1;
+        pEncCtx->time_base.den  = 25;
+        pEncCtx->flags          = CODEC_FLAG_QSCALE;
+
+        AVDictionary *optionsDict = NULL;
+        if( avcodec_open2(pEncCtx, pCodec, &optionsDict) < 0 ) {
+            fprintf(stderr, "open codec context error!\n");
+            av_free( pEncCtx );
+            pEncCtx = NULL;
+            return false;
+        } // if
+        pEncCtx->global_quality = pEncCtx->qmin * FF_QP2LAMBDA;
+
+        encWidth = width;
+        encHeight = height;
+        encFormat = format;
+        return true;
     }
 
-    //!! readBuf 必须动态分配，在open_input内部释放
-    avio_ctx = avio_alloc_context(readBuf, PLAYER_BUFSIZE,
-                                  0, NULL, &read_packet, NULL, NULL);
-    if (!avio_ctx) {
-        ret = AVERROR(ENOMEM);
-        DBG("avio_alloc_context fail!");
-        goto end;
+    int WriteJPEG( AVFrame *pFrame, const char *filename )
+    {
+        AVPixelFormat format = JpegFormat( pFrame->format );
+        if( format == AV_PIX_FMT_NONE || !OpenEncoder(pFrame->width, pFrame->height, format) )
+            return -1;
+
+        DBG_STREAM("Writing jpg file: " << filename);
+
+        AVPacket pkt;
+        int got_output = 0;
+        pFrame->pts     = 1;
+        pFrame->quality = pEncCtx->global_quality;
+        av_init_packet(&pkt);
+        pkt.data = NULL;    // packet data will be allocated by the encoder
+        pkt.size = 0;
+        if( avcodec_encode_video2(pEncCtx, &pkt, pFrame, &got_output) < 0 ) {
+            fprintf(stderr, "Error encoding frame\n");
+            return -1;
+        } // if
+        if( !got_output )
+            return -1;
+
+        int ret = 0;
+        FILE *fp = fopen( filename, "wb" );
+        if( fp ) {
+            fwrite( pkt.data, 1, pkt.size, fp );
+            fclose( fp );
+        } else {
+            std::cerr << "Cannot open file " << filename << " for writing!" << std::endl;
+            ret = -1;
+        } // if
+        av_packet_unref(&pkt);
+        return ret;
     }
-    fmt_ctx->pb = avio_ctx;
 
-    ret = avformat_open_input(&fmt_ctx, NULL, NULL, NULL);
-    if (ret < 0) {
-        DBG("Could not open input!");
-        goto end;
+private:
+    std::size_t                 maxQueued;
+    std::deque<Job>             jobs;
+    std::mutex                  lock;
+    std::condition_variable     cond;
+    std::thread                 worker;         // started with the first snapshot
+    Mode                        mode;
+    uint32_t                    interval;
+    bool                        requested;
+    bool                        quit;
+    Stats                       stats;
+
+    AVCodecContext             *pEncCtx;
+    int                         encWidth, encHeight;
+    AVPixelFormat               encFormat;
+};
+
+static SnapshotWorker           gSnapshots;
+
+
+/*
+ * 显示流水线: 解码线程 -> 颜色转换线程 -> 显示线程，相邻两级之间用三缓冲交接，
+ * 任何一级都不等下一级: 转换或显示慢了，中间的帧被更新的覆盖，显示的总是最新完成的一帧。
+ * 解码线程只对帧做av_frame_ref(解码器输出引用计数的帧)；转换线程用sws_scale转成YUV420P，
+ * 输出到自己的缓冲里；SDL的调用(初始化、overlay、事件)都在显示线程里。
+ * headless时不初始化SDL，显示线程取到转换好的帧就算显示，用于loopback benchmark。
+ */
+class DisplayPipeline : boost::noncopyable {
+public:
+    // present thread: decoded, capture (0 unless traced) and present time of a shown picture
+    typedef std::function<void(int64_t, int64_t, int64_t)>    PresentedHandlerType;
+
+    struct Stats {
+        uint64_t        submitted;
+        uint64_t        converted;
+        uint64_t        presented;
+        uint64_t        convertSkipped;     // overwritten before conversion
+        uint64_t        presentSkipped;     // converted but overwritten before display
+    };
+
+    DisplayPipeline() : headless(false), quit(false), quitRequested(false), submitted(0), converted(0), presented(0)
+    {
+        for( int i = 0; i < 3; ++i ) {
+            decodedBuf.at(i).frame = av_frame_alloc();
+            memset( &convertedBuf.at(i), 0, sizeof(ConvertedSlot) );
+        } // for
     }
 
-    //!! 这里需要预读取
-    //fmt_ctx->flags |= AVFMT_FLAG_NOBUFFER;
-    ret = avformat_find_stream_info(fmt_ctx, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "Could not find stream information\n");
-        goto end;
+    ~DisplayPipeline()
+    {
+        stop();
+        for( int i = 0; i < 3; ++i ) {
+            av_frame_free( &decodedBuf.at(i).frame );
+            if( convertedBuf.at(i).data[0] )
+                av_freep( &convertedBuf.at(i).data[0] );
+        } // for
+    }
+
+    void start( const PresentedHandlerType &handler, bool _Headless = false )
+    {
+        onPresented = handler;
+        headless = _Headless;
+        converter = std::thread( std::bind(&DisplayPipeline::ConvertRoutine, this) );
+        presenter = std::thread( std::bind(&DisplayPipeline::PresentRoutine, this) );
+    }
+
+    void stop()
+    {
+        quit = true;
+        decodedBuf.wake();
+        convertedBuf.wake();
+        if( converter.joinable() )
+            converter.join();
+        if( presenter.joinable() )
+            presenter.join();
+    }
+
+    // decode thread, never blocks
+    bool submit( const AVFrame *frame, int64_t decodedTime, int64_t captureTime )
+    {
+        DecodedSlot &slot = decodedBuf.backSlot();
+        av_frame_unref( slot.frame );
+        if( av_frame_ref(slot.frame, frame) < 0 )
+            return false;
+        slot.decodedTime = decodedTime;
+        slot.captureTime = captureTime;
+        decodedBuf.publish();
+        ++submitted;
+        return true;
+    }
+
+    // the window was closed
+    bool closed() const { return quitRequested; }
+
+    Stats stats() const
+    {
+        Stats ret;
+        ret.submitted = submitted;
+        ret.converted = converted;
+        ret.presented = presented;
+        ret.convertSkipped = decodedBuf.overwrittenCount();
+        ret.presentSkipped = convertedBuf.overwrittenCount();
+        return ret;
+    }
+
+    std::string report() const
+    {
+        Stats st = stats();
+        char buf[200];
+        sprintf( buf, "Display submitted=%llu converted=%llu presented=%llu skipped convert=%llu present=%llu\n",
+                    (unsigned long long)st.submitted, (unsigned long long)st.converted,
+                    (unsigned long long)st.presented, (unsigned long long)st.convertSkipped,
+                    (unsigned long long)st.presentSkipped );
+        return buf;
     }
-    DBG("avformat_find_stream_info Done!"); 
-    /* sleep(10); */
 
-    av_dump_format(fmt_ctx, 0, "input_video", 0);
+private:
+    struct DecodedSlot {
+        AVFrame        *frame;
+        int64_t         decodedTime;
+        int64_t         captureTime;
+    };
+
+    struct ConvertedSlot {
+        uint8_t        *data[4];            // YUV420P, one av_image_alloc block
+        int             linesize[4];
+        int             width, height;
+        int64_t         decodedTime;
+        int64_t         captureTime;
+    };
+
+    void ConvertRoutine()
+    {
+        struct SwsContext *sws_ctx = NULL;
+
+        set_thread_name( "convert" );
+
+        while( !quit ) {
+            if( !decodedBuf.waitAcquire(std::chrono::milliseconds(100)) )
+                continue;
+            const DecodedSlot &src = decodedBuf.frontSlot();
+            const AVFrame *frame = src.frame;
+            ConvertedSlot &dst = convertedBuf.backSlot();
+
+            if( dst.width != frame->width || dst.height != frame->height ) {
+                if( dst.data[0] )
+                    av_freep( &dst.data[0] );
+                if( av_image_alloc(dst.data, dst.linesize, frame->width, frame->height,
+                            AV_PIX_FMT_YUV420P, 32) < 0 ) {
+                    DBG("av_image_alloc error!");
+                    dst.width = dst.height = 0;
+                    continue;
+                } // if
+                dst.width = frame->width;
+                dst.height = frame->height;
+            } // if
+
+            sws_ctx = sws_getCachedContext( sws_ctx, frame->width, frame->height, (AVPixelFormat)frame->format,
+                            frame->width, frame->height, AV_PIX_FMT_YUV420P, SWS_BICUBIC, // original 420p
+                            NULL, NULL, NULL );    //!! SWS_BILINEAR
+            if( !sws_ctx ) {
+                DBG("sws_getContext error!");
+                continue;
+            } // if
+
+            // 将yuv444转为yuv420以便用SDL显示
+            sws_scale( sws_ctx, (uint8_t const * const *)frame->data,
+                    frame->linesize, 0, frame->height, dst.data, dst.linesize );
+            dst.decodedTime = src.decodedTime;
+            dst.captureTime = src.captureTime;
+            convertedBuf.publish();
+            ++converted;
+        } // while
+
+        if( sws_ctx )
+            sws_freeContext( sws_ctx );
+    }
 
-    videoStreamIndex = -1;
-    for(i = 0; i < fmt_ctx->nb_streams; i++) {
-        if(fmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
-            videoStreamIndex = i;
-            break;
+    void PresentRoutine()
+    {
+        SDL_Overlay     *bmp = NULL;
+        SDL_Surface     *screen = NULL;
+        SDL_Rect        rect;
+        SDL_Event       event;
+
+        set_thread_name( "present" );
+
+        if( headless ) {
+            while( !quit ) {
+                if( !convertedBuf.waitAcquire(std::chrono::milliseconds(10)) )
+                    continue;
+                const ConvertedSlot &src = convertedBuf.frontSlot();
+                ++presented;
+                if( onPresented )
+                    onPresented( src.decodedTime, src.captureTime, gen_timestamp_us() );
+            } // while
+            return;
         } // if
-    } // for 
 
-    if(videoStreamIndex == -1) {
-        DBG("Cannot find a valid video stream!");
-        goto end;
+        if( SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) ) {
+            DBG( "Could not initialize SDL - %s", SDL_GetError());
+            quitRequested = true;
+            return;
+        } // if
+
+        while( !quit ) {
+            while( SDL_PollEvent(&event) ) {
+                if( event.type == SDL_QUIT )
+                    quitRequested = true;
+            } // while
+
+            // wake up now and then to keep the window responsive
+            if( !convertedBuf.waitAcquire(std::chrono::milliseconds(10)) )
+                continue;
+            const ConvertedSlot &src = convertedBuf.frontSlot();
+
+            // the picture size is only known once the decoder has seen the SPS
+            if( !bmp || bmp->w != src.width || bmp->h != src.height ) {
+                if( bmp )
+                    SDL_FreeYUVOverlay( bmp );
+                screen = SDL_SetVideoMode(src.width, src.height, 0, 0);   //!! original 24
+                if( !screen ) {
+                    DBG("SDL: could not set video mode - exiting");
+                    quitRequested = true;
+                    break;
+                } // if
+                // Allocate a place to put our YUV image on that screen
+                bmp = SDL_CreateYUVOverlay(src.width, src.height, SDL_YV12_OVERLAY, screen);
+            } // if
+
+            // YV12 keeps V before U
+            SDL_LockYUVOverlay(bmp);
+            CopyPlane( bmp->pixels[0], bmp->pitches[0], src.data[0], src.linesize[0], src.width, src.height );
+            CopyPlane( bmp->pixels[2], bmp->pitches[2], src.data[1], src.linesize[1], (src.width + 1) / 2, (src.height + 1) / 2 );
+            CopyPlane( bmp->pixels[1], bmp->pitches[1], src.data[2], src.linesize[2], (src.width + 1) / 2, (src.height + 1) / 2 );
+            SDL_UnlockYUVOverlay(bmp);
+
+            rect.x = 0;
+            rect.y = 0;
+            rect.w = src.width;
+            rect.h = src.height;
+            SDL_DisplayYUVOverlay(bmp, &rect);
+            ++presented;
+
+            if( onPresented )
+                onPresented( src.decodedTime, src.captureTime, gen_timestamp_us() );
+        } // while
+
+        if( bmp )
+            SDL_FreeYUVOverlay( bmp );
+        SDL_Quit();
+    }
+
+    static void CopyPlane( uint8_t *dst, int dstStride, const uint8_t *src, int srcStride, int width, int height )
+    {
+        for( int y = 0; y < height; ++y )
+            memcpy( dst + y * dstStride, src + y * srcStride, width );
+    }
+
+private:
+    TripleBuffer<DecodedSlot>       decodedBuf;
+    TripleBuffer<ConvertedSlot>     convertedBuf;
+    std::thread                     converter, presenter;
+    PresentedHandlerType            onPresented;
+    bool                            headless;
+    std::atomic<bool>               quit;
+    std::atomic<bool>               quitRequested;
+    std::atomic<uint64_t>           submitted, converted, presented;
+};
+
+static DisplayPipeline          *pDisplay = NULL;
+
+
+std::string DesktopStreamingRequest::DisplayReport() const
+{
+    return pDisplay ? pDisplay->report() : std::string();
+}
+
+
+DesktopStreamingRequest::Summary DesktopStreamingRequest::Summarize()
+{
+    Summary ret;
+    memset( &ret, 0, sizeof(ret) );
+    ret.frames = recvStats.frames;
+    ret.bytes = recvStats.bytes;
+    ret.playout = frameQueue.getStats();
+    DisplayPipeline *display = pDisplay;
+    if( display ) {
+        DisplayPipeline::Stats st = display->stats();
+        ret.displayed = st.presented;
+        ret.displaySkipped = st.convertSkipped + st.presentSkipped;
+    } // if
+    return ret;
+}
+
+
+bool DesktopStreamingRequest::handle_command( const std::string &cmd )
+{
+    std::stringstream sstr( cmd );
+    std::string word, arg;
+    sstr >> word;
+    if( word != "snapshot" )
+        return false;
+
+    if( sstr >> arg ) {
+        SnapshotWorker::Mode mode;
+        uint32_t interval;
+        if( !SnapshotWorker::ParsePolicy(arg, mode, interval) ) {
+            std::cout << "usage: snapshot [off|demand|<every_n_frames>]" << std::endl;
+            return true;
+        } // if
+        gSnapshots.setPolicy( mode, interval );
+    } else {
+        gSnapshots.requestOne();
+    } // if
+
+    std::cout << gSnapshots.report() << std::flush;
+    return true;
+}
+
+/*
+ * 收到的帧直接作为AVPacket交给解码器，不经过demuxer和AVIO的拷贝。
+ * packet的数据就是接收buffer池里的BytesArray，用AVBufferRef引用计数，解码器释放最后一个引用时
+ * 在回调里还给buffer池，所以帧的大小不受限制。
+ */
+static
+void ReleaseRecvBuffer( void *opaque, uint8_t *data )
+{
+    BytesArrayPtr *holder = (BytesArrayPtr*)opaque;
+    pBufMgr->put( *holder );
+    delete holder;
+}
+
+static
+bool NextPacket( AVPacket *pkt, uint32_t *pSeqNO = NULL )
+{
+    RecvdFrame      frame = pInstance->FrameQueue().pop();
+    BytesArrayPtr   pData = frame.pData;
+
+    if( frame.seqNO_ ) {
+        PendingTrace trace;
+        trace.captureTime = frame.captureTime_;
+        trace.demuxTime = gen_timestamp_us();
+        trace.present = frame.present_;
+        gClientLatency.record( CLS_QUEUE, trace.demuxTime - frame.recvTime_ );
+        pendingTraces[frame.seqNO_] = trace;
+    } // if
+
+    // the decoder's bitstream reader may read past the end, it needs zeroed padding;
+    // InitFrame got a buffer with room for it
+    int size = (int)pData->size();
+    pData->resize( size + AV_INPUT_BUFFER_PADDING_SIZE );
+
+    BytesArrayPtr *holder = new BytesArrayPtr( pData );
+    av_init_packet( pkt );
+    pkt->buf = av_buffer_create( (uint8_t*)pData->ptr(), (int)pData->size(), ReleaseRecvBuffer, holder, 0 );
+    if( !pkt->buf ) {
+        delete holder;
+        pBufMgr->put( pData );
+        return false;
+    } // if
+    pkt->data = pkt->buf->data;
+    pkt->size = size;
+    if( frame.seqNO_ )
+        pkt->pts = frame.seqNO_;
+
+    DBG_STREAM("Player required a frame: " << frame << " when " << gen_timestamp());
+    if( pSeqNO )
+        *pSeqNO = frame.seqNO_;
+    return true;
+}
+
+int DesktopStreamingRequest::PlayerRoutine()
+{
+    AVCodecContext*                     pCodecCtx = NULL;
+    int                     ret = 0;
+    AVCodec         *pCodec = NULL;
+    AVFrame         *pFrame = NULL; 
+    AVPacket        packet;
+    bool            havePacket = false;
+    uint32_t        firstSeqNO = 0;
+    int             frameFinished;
+
+    AVDictionary    *optionsDict = NULL;
+    DisplayPipeline display;
+
+    uint32_t        decodeSeqNO = 0;
+
+    set_thread_name( "decode" );
+
+    pInstance = this;
+    pBufMgr = &gRecvBufMgr;
+
+    {
+        SnapshotWorker::Mode mode;
+        uint32_t interval;
+        if( SnapshotWorker::ParsePolicy(g_snapshot_policy, mode, interval) )
+            gSnapshots.setPolicy( mode, interval );
+        else
+            std::cerr << "bad snapshot policy " << g_snapshot_policy << ", snapshots are off" << std::endl;
     }
- 
-    pCodecCtx = fmt_ctx->streams[videoStreamIndex]->codec;
+
+    /* register codecs, the stream is raw HEVC, no demuxer is involved */
+    avcodec_register_all();
 
     // Find the decoder for the video stream
-    pCodec = avcodec_find_decoder(pCodecCtx->codec_id);
+    pCodec = avcodec_find_decoder(AV_CODEC_ID_HEVC);
     if(pCodec == NULL) {
         DBG("Unsupported codec!");
+        ret = -1;
         goto end;
     } // if 
     DBG("Decoder name = %s, long_name = %s", pCodec->name, pCodec->long_name);
 
-    // Open codec
-    if(avcodec_open2(pCodecCtx, pCodec, &optionsDict) < 0) {
-        DBG("open codec error!");
-        goto end;
-    }
-
-    // jpg_converter.init( pCodecCtx );
-
-    // Allocate video frame
-    pFrame = av_frame_alloc();
-    if( !pFrame ) {
-        DBG("alloc frame fail!");
+    pCodecCtx = avcodec_alloc_context3(pCodec);
+    if( !pCodecCtx ) {
+        ret = AVERROR(ENOMEM);
+        DBG("avcodec_alloc_context3 fail!");
         goto end;
     }
 
-    // useless for sync
     /*
-     * for( i = 1; i <= 500; ++i ) {
-     *     av_read_frame(fmt_ctx, &packet);
-     *     printf("skip %d frame\n", i);
-     * }
+     * fast start: 第一帧(seq 0)是RAWOutput::writeHeaders发出的VPS/SPS/PPS，直接作为extradata
+     * 配置解码器，不需要探测码流。只用slice线程，帧线程会让每个线程多缓存一帧。
      */
-
-    if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER)) {
-        DBG( "Could not initialize SDL - %s", SDL_GetError());
+    if( !NextPacket(&packet, &firstSeqNO) )
         goto end;
-    }
+    havePacket = true;
+    startup.headerTime = gen_timestamp_us();
+    if( firstSeqNO == 0 ) {
+        pCodecCtx->extradata = (uint8_t*)av_mallocz( packet.size + AV_INPUT_BUFFER_PADDING_SIZE );
+        if( pCodecCtx->extradata ) {
+            memcpy( pCodecCtx->extradata, packet.data, packet.size );
+            pCodecCtx->extradata_size = packet.size;
+            av_packet_unref( &packet );
+            havePacket = false;
+        } // if
+    } // if
+    pCodecCtx->flags |= CODEC_FLAG_LOW_DELAY;
+    pCodecCtx->flags2 |= CODEC_FLAG2_FAST;
+    pCodecCtx->thread_count = g_decoder_threads;       // 0: one per core
+    pCodecCtx->thread_type = FF_THREAD_SLICE;
+    // the display pipeline keeps references to the pictures
+    pCodecCtx->refcounted_frames = 1;
 
-    screen = SDL_SetVideoMode(pCodecCtx->width, pCodecCtx->height, 0, 0);   //!! original 24
-    if(!screen) {
-        DBG("SDL: could not set video mode - exiting");
+    // Open codec
+    if(avcodec_open2(pCodecCtx, pCodec, &optionsDict) < 0) {
+        DBG("open codec error!");
+        ret = -1;
         goto end;
     }
 
-    // Allocate a place to put our YUV image on that screen
-    bmp = SDL_CreateYUVOverlay(pCodecCtx->width, pCodecCtx->height,
-                    SDL_YV12_OVERLAY, screen);
-
-    sws_ctx = sws_getContext( pCodecCtx->width, pCodecCtx->height, pCodecCtx->pix_fmt,
-                    pCodecCtx->width, pCodecCtx->height, AV_PIX_FMT_YUV420P, SWS_BICUBIC, // original 420p
-                    NULL, NULL, NULL );    //!! SWS_BILINEAR
-    if( !sws_ctx ) {
-        DBG("sws_getContext error!");
+    // Allocate video frame
+    pFrame = av_frame_alloc();
+    if( !pFrame ) {
+        DBG("alloc frame fail!");
         goto end;
     }
 
-    while(av_read_frame(fmt_ctx, &packet) >= 0) {
-        // Is this a packet from the video stream?
-        if(packet.stream_index==videoStreamIndex) {
-            DBG_STREAM( "going to decode packet size = " << packet.size
-                   << " cksum = " << crc_checksum(packet.data, packet.size)
-                   << " at time: " << gen_timestamp() );
-            // Decode video frame 解码结果存放在pFrame中，frameFinished表示成功与否
-            avcodec_decode_video2(pCodecCtx, pFrame, &frameFinished, &packet);
-            if( frameFinished ) {
-                /* frame->pts = av_frame_get_best_effort_timestamp(frame); */ //!!
-                // DBG_STREAM( "Decoded frame format = " << pFrame->format << " pict_type = " 
-                       // << pFrame->pict_type << " coded_picture_number = " << pFrame->coded_picture_number
-                       // << " display_picture_number = " << pFrame->display_picture_number
-                       // << " pkt_pos = " << pFrame->pkt_pos
-                       // << " pkt_size = " << pFrame->pkt_size
-                       // << " pts = " << pFrame->pts
-                       // << " pkt_pts = " << pFrame->pkt_pts );
-
-                sprintf( jpgFileName, "%u.jpg", ++decodeSeqNO );
-                WriteJPEG( pCodecCtx, pFrame, jpgFileName );
-                // jpg_converter.convert( pFrame, jpgFileName );
-
-                SDL_LockYUVOverlay(bmp);
-
-                // 将yuv444转为yuv420以便用SDL显示，转换后的图像存储在pict中，其指针指向内存为bmp
-                AVFrame pict;
-                pict.data[0] = bmp->pixels[0];
-                pict.data[1] = bmp->pixels[2];
-                pict.data[2] = bmp->pixels[1];
-
-                pict.linesize[0] = bmp->pitches[0];
-                pict.linesize[1] = bmp->pitches[2];
-                pict.linesize[2] = bmp->pitches[1];
-
-                // Convert the image into YUV format that SDL uses
-                sws_scale( sws_ctx, (uint8_t const * const *)pFrame->data, 
-                        pFrame->linesize, 0, pCodecCtx->height, pict.data, pict.linesize );
-
-                SDL_UnlockYUVOverlay(bmp);
-
-                rect.x = 0;
-                rect.y = 0;
-                rect.w = pCodecCtx->width;
-                rect.h = pCodecCtx->height;
-                SDL_DisplayYUVOverlay(bmp, &rect);
-                DBG_STREAM( "Finish show packet size = " << packet.size
-                        << " cksum = " << crc_checksum(packet.data, packet.size)
-                        << " at time: " << gen_timestamp() );
-            } else {
-                DBG_STREAM("frameFinished is not true!");
-            } // if frameFinished
+    display.start( [this]( int64_t decodedTime, int64_t captureTime, int64_t presentTime )
+    {
+        if( !startup.firstPresentTime ) {
+            startup.firstPresentTime = presentTime;
+            std::cout << StartupReport() << std::flush;
+        } // if
+        gClientLatency.record( CLS_PRESENT, presentTime - decodedTime );
+        if( captureTime )
+            gClientLatency.record( CLS_END_TO_END, presentTime - captureTime );
+    }, g_headless_display );
+    pDisplay = &display;
+
+    while( havePacket || NextPacket(&packet) ) {
+        havePacket = false;
+        DBG_STREAM( "going to decode packet size = " << packet.size
+               << " at time: " << gen_timestamp() );
+        // Decode video frame 解码结果存放在pFrame中，frameFinished表示成功与否
+        if( avcodec_decode_video2(pCodecCtx, pFrame, &frameFinished, &packet) < 0 ) {
+            DBG_STREAM( "decode error on packet size = " << packet.size );
+            RequestKeyframe();
+        } // if
+        if( frameFinished ) {
+            PendingTrace trace = { 0, 0, true };
+            int64_t decodedTime = gen_timestamp_us();
+            if( !startup.firstDecodeTime )
+                startup.firstDecodeTime = decodedTime;
+            auto it = pendingTraces.lower_bound( pFrame->pkt_pts );
+            if( it != pendingTraces.end() && it->first == pFrame->pkt_pts ) {
+                trace = it->second;
+                gClientLatency.record( CLS_DECODE, decodedTime - trace.demuxTime );
+                ++it;
+            } // if
+            // packets before this picture that produced none
+            pendingTraces.erase( pendingTraces.begin(), it );
+            if( !trace.present ) {
+                // catching up: the picture is still needed as a reference, just not shown
+                DBG_STREAM( "Skip presenting packet size = " << packet.size );
+                goto next_packet;
+            } // if
+
+            gSnapshots.offer( pFrame, ++decodeSeqNO );
+            display.submit( pFrame, decodedTime, trace.captureTime );
+            DBG_STREAM( "Handed to display packet size = " << packet.size
+                    << " at time: " << gen_timestamp() );
         } else {
-            DBG_STREAM("NOT A VIDEO PACKET!");
-        } // if videoStreamIndex
+            DBG_STREAM("frameFinished is not true!");
+        } // if frameFinished
 
+next_packet:
         // av_free_packet(&packet);
         av_packet_unref(&packet);
-        SDL_PollEvent(&event);
-        switch(event.type) {
-            case SDL_QUIT:
-                SDL_Quit();
-                /* exit(0); */
-                goto end;
-                break;
-            default:
-                break;
-        } // switch
-
+        av_frame_unref(pFrame);
+        if( display.closed() )
+            goto end;
     } // while
 
 end:
+    display.stop();
+    pDisplay = NULL;
+    if( havePacket )
+        av_packet_unref(&packet);
     if( pFrame )
-        av_free(pFrame);
+        av_frame_free(&pFrame);
     // Close the codec
-    if( pCodecCtx )
+    if( pCodecCtx ) {
         avcodec_close(pCodecCtx);
-    // Close the video file
-    if( fmt_ctx )
-        avformat_close_input(&fmt_ctx);
-    /* note: the internal buffer could have changed, and be != avio_ctx_buffer */
-    if (avio_ctx)
-        av_freep(&avio_ctx);
+        av_free(pCodecCtx);
+    }
 
     if (ret < 0) {
         // fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
@@ -277,94 +816,6 @@ end:
 }
 
 
-static
-int WriteJPEG( const AVCodecContext *pCodecCtx, AVFrame *pFrame, const char *filename )
-{
-    AVCodecContext         *pOCodecCtx;
-    AVCodec                *pOCodec;
-    // uint8_t                *Buffer;
-    // int                     BufSiz;
-    // int                     BufSizActual;
-    int                     got_output;
-    int                     ret = 0;
-    AVPixelFormat           ImgFmt = AV_PIX_FMT_YUVJ444P; //!!??!!
-    FILE                   *JPEGFile;
-    char                    JPEGFName[256];
-    AVDictionary           *optionsDict = NULL;
-    AVPacket                pkt;
-
-    // BufSiz = avpicture_get_size( ImgFmt, pCodecCtx->width, pCodecCtx->height );
-    // BufSiz = av_image_get_buffer_size( ImgFmt, pCodecCtx->width, pCodecCtx->height, 1 );
-
-    // Buffer = (uint8_t *) malloc ( BufSiz );
-    // if ( Buffer == NULL )
-        // return ( 0 );
-    // memset ( Buffer, 0, BufSiz );
-
-    DBG_STREAM("Writing jpg file: " << filename);
-
-    pOCodec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
-    if (!pOCodec) {
-        fprintf(stderr, "Cannot find MJPEG codec!\n");
-        return -1;
-    }
-
-    pOCodecCtx = avcodec_alloc_context3(pOCodec);
-    if ( !pOCodecCtx ) {
-        fprintf(stderr, "Allocate CodecCtx error!\n");
-        return -1;
-    }
-
-    pOCodecCtx->bit_rate      = pCodecCtx->bit_rate;
-    pOCodecCtx->width         = pCodecCtx->width;
-    pOCodecCtx->height        = pCodecCtx->height;
-    pOCodecCtx->pix_fmt       = ImgFmt;
-    pOCodecCtx->time_base.num = pCodecCtx->time_base.num;
-    pOCodecCtx->time_base.den = pCodecCtx->time_base.den;
-    pOCodecCtx->framerate = pCodecCtx->framerate;
-
-    if ( avcodec_open2(pOCodecCtx, pOCodec, &optionsDict) < 0 ) {
-        fprintf(stderr, "open codec context error!\n");
-        return -1;
-    }
-
-    // pOCodecCtx->mb_lmin        = pOCodecCtx->lmin = pOCodecCtx->qmin * FF_QP2LAMBDA;
-    // pOCodecCtx->mb_lmax        = pOCodecCtx->lmax = pOCodecCtx->qmax * FF_QP2LAMBDA;
-    pOCodecCtx->flags          = CODEC_FLAG_QSCALE;
-    pOCodecCtx->global_quality = pOCodecCtx->qmin * FF_QP2LAMBDA;
-
-    pFrame->pts     = 1;
-    pFrame->quality = pOCodecCtx->global_quality;
-    // int avcodec_encode_video2(AVCodecContext *avctx, AVPacket *avpkt, const AVFrame *frame, int *got_packet_ptr);
-    av_init_packet(&pkt);
-    pkt.data = NULL;    // packet data will be allocated by the encoder
-    pkt.size = 0;
-    ret = avcodec_encode_video2(pOCodecCtx, &pkt, pFrame, &got_output);
-    if (ret < 0) {
-        fprintf(stderr, "Error encoding frame\n");
-        return -1;
-    }
-    // BufSizActual = avcodec_encode_video( pOCodecCtx, Buffer, BufSiz, pFrame );
-    if (got_output) {
-        JPEGFile = fopen ( filename, "wb" );
-        if( !JPEGFile ) {
-            std::cerr << "Cannot open file " << filename << " for writing!" << std::endl;
-            return -1;
-        }
-        fwrite(pkt.data, 1, pkt.size, JPEGFile);
-        av_packet_unref(&pkt);
-        fclose ( JPEGFile );
-    }
-
-    // fwrite ( Buffer, 1, BufSizActual, JPEGFile );
-
-    avcodec_close ( pOCodecCtx );
-    av_free( pOCodecCtx );
-    // free ( Buffer );
-
-    return 0;
-}
-
 // FOR TEST
 /*
  * void DesktopStreamingRequest::PlayerRoutine()
@@ -385,90 +836,3 @@ int WriteJPEG( const AVCodecContext *pCodecCtx, AVFrame *pFrame, const char *fil
  *     return;
  * }
  */
-
-/*
- * struct JPG_Converter {
- *     JPG_Converter() : pOCodecCtx(NULL), pOCodec(NULL) {}
- * 
- *     ~JPG_Converter()
- *     {
- *         if( pOCodecCtx ) {
- *             avcodec_close ( pOCodecCtx );
- *             av_free( pOCodecCtx );
- *         } // if
- *     }
- * 
- *     int init( AVCodecContext *pCodecCtx )
- *     {
- *         AVDictionary           *optionsDict = NULL;
- * 
- *         pOCodec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
- *         if (!pOCodec) {
- *             fprintf(stderr, "Cannot find MJPEG codec!\n");
- *             return -1;
- *         }
- * 
- *         pOCodecCtx = avcodec_alloc_context3(pOCodec);
- *         if ( !pOCodecCtx ) {
- *             fprintf(stderr, "Allocate CodecCtx error!\n");
- *             return -1;
- *         }
- * 
- *         pOCodecCtx->bit_rate      = pCodecCtx->bit_rate;
- *         pOCodecCtx->width         = pCodecCtx->width;
- *         pOCodecCtx->height        = pCodecCtx->height;
- *         pOCodecCtx->pix_fmt       = AV_PIX_FMT_YUVJ420P;
- *         pOCodecCtx->time_base.num = pCodecCtx->time_base.num;
- *         pOCodecCtx->time_base.den = pCodecCtx->time_base.den;
- *         pOCodecCtx->framerate = pCodecCtx->framerate;
- * 
- *         if ( avcodec_open2(pOCodecCtx, pOCodec, &optionsDict) < 0 ) {
- *             fprintf(stderr, "open codec context error!\n");
- *             return -1;
- *         } // if
- * 
- *         pOCodecCtx->flags          = CODEC_FLAG_QSCALE;
- *         pOCodecCtx->global_quality = pOCodecCtx->qmin * FF_QP2LAMBDA;
- * 
- *         return 0;
- *     }
- * 
- *     int convert( AVFrame *pFrame, const char *filename )
- *     {
- *         int             ret = 0;
- *         FILE            *fp;
- * 
- *         pFrame->pts     = 1;
- *         pFrame->quality = pOCodecCtx->global_quality;
- *         // int avcodec_encode_video2(AVCodecContext *avctx, AVPacket *avpkt, const AVFrame *frame, int *got_packet_ptr);
- *         av_init_packet(&pkt);
- *         pkt.data = NULL;    // packet data will be allocated by the encoder
- *         pkt.size = 0;
- *         ret = avcodec_encode_video2(pOCodecCtx, &pkt, pFrame, &got_output);
- *         if (ret < 0) {
- *             fprintf(stderr, "Error encoding frame\n");
- *             return -1;
- *         }
- * 
- *         if( (fp = fopen(filename, "wb")) == NULL ) {
- *             fprintf(stderr, "cannot open file %s for writing!\n", filename);
- *             return -1;
- *         }
- *         // BufSizActual = avcodec_encode_video( pOCodecCtx, Buffer, BufSiz, pFrame );
- *         if (got_output) {
- *             fwrite(pkt.data, 1, pkt.size, fp);
- *             av_packet_unref(&pkt);
- *         } // if
- * 
- *         fclose ( fp );
- *         return 0;
- *     }
- * 
- *     AVCodecContext         *pOCodecCtx;
- *     AVCodec                *pOCodec;
- *     AVPacket                pkt;
- *     int                     got_output;
- * };
- */
-
-
@@ -7,6 +7,30 @@
 #define INIT_FRAME_SIZE             (256*1024)
 // header: 0xFE + seqNO + timestamp + crc + frameSize
 #define ENCODED_FRAME_HEADER_LEN        15
+// traced header: 0xFC + seqNO + timestamp + crc + frameSize + captureTime(8, us) + serverDelay(4, us capture->send)
+#define TRACE_HEADER_EXT_LEN            12
+// v2 header: 0xFB + version(1) + flags(1) + checksumType(1) + seqNO + timestamp + checksum(4) + frameSize
+//      [+ captureTime(8) + serverDelay(4)]
+#define FRAME_HEADER_V2_LEN             20
+#define HEADER_FLAG_TRACE               2
+#define TRACE_FIELDS_LEN                12
+#define MAX_FRAME_HEADER_LEN            (FRAME_HEADER_V2_LEN + TRACE_FIELDS_LEN)
+// zeroed tail the decoder may read past a packet, at least AV_INPUT_BUFFER_PADDING_SIZE
+#define DECODER_PADDING_SIZE            64
+
+enum ClientLatencyStage {
+    CLS_NETWORK,        // server send -> received, needs synchronized clocks
+    CLS_QUEUE,          // received -> handed to the demuxer
+    CLS_DECODE,         // handed to the demuxer -> decoded
+    CLS_PRESENT,        // decoded -> displayed
+    CLS_END_TO_END,     // server capture -> displayed, needs synchronized clocks
+    CLS_COUNT
+};
+
+extern LatencyTracer            gClientLatency;
+extern int                      g_decoder_threads;      // 0: let the decoder pick
+extern const char*              g_snapshot_policy;      // off, demand or every n frames
+extern bool                     g_headless_display;     // decode and convert, but open no window
 
 
 struct RecvdFrame {
@@ -20,13 +44,210 @@ struct RecvdFrame {
 
     BytesArrayPtr           pData;
     uint32_t                seqNO_;
-    uint16_t                cksum_;
+    uint32_t                cksum_;
+    ChecksumEngine::Type    cksumType_;
     uint32_t                timestamp_; // encoded time
+    // latency tracing, 0 unless the server sent the traced header
+    int64_t                 captureTime_;   // server gen_timestamp_us()
+    uint32_t                serverDelay_;   // capture -> header generated on the server, us
+    int64_t                 recvTime_;      // local gen_timestamp_us()
+    bool                    present_;       // false when the playout scheduler is catching up
 };
 
 typedef std::shared_ptr<RecvdFrame>     RecvdFramePtr;
 
 
+/*
+ * 客户端的播放调度，替代原来无界的SharedQueue<RecvdFrame>。
+ * 网络线程push，播放线程的read_packet阻塞在pop上。
+ * 抖动按RFC 3550的方法从帧头的服务端时间戳估计: 传输时间 = 本地接收时间 - 服务端时间，
+ * 相邻两帧传输时间之差的平滑均值就是抖动。时钟不需要同步，只用到差值和最小传输时间。
+ * 每帧的播放时间 = 服务端时间 + 最小传输时间 + 目标缓冲，目标缓冲随抖动自适应。
+ * 积压超过目标缓冲 + CATCHUP_MARGIN 时进入追帧模式: 不再等待，帧照常解码但不显示，
+ * 积压回到目标以内后恢复正常播放。
+ */
+class PlayoutScheduler : boost::noncopyable {
+public:
+    static const int64_t        DEFAULT_MIN_DELAY_US = 0;
+    static const int64_t        DEFAULT_MAX_DELAY_US = 150 * 1000;
+    static const int64_t        CATCHUP_MARGIN_US = 100 * 1000;
+    static const int            JITTER_FACTOR = 3;
+    static const int            BASE_WINDOW = 256;      // frames, lets the min transit drift up
+
+    struct Stats {
+        uint64_t        presented;
+        uint64_t        skipped;        // decoded but not presented in catch-up mode
+        uint64_t        late;           // arrived after its playout time
+        uint64_t        catchUps;       // number of times catch-up mode was entered
+        int64_t         jitterUs;
+        int64_t         targetUs;
+        int64_t         backlogUs;
+    };
+
+public:
+    PlayoutScheduler( int64_t _MinDelayUs = DEFAULT_MIN_DELAY_US, int64_t _MaxDelayUs = DEFAULT_MAX_DELAY_US )
+            : minDelayUs(_MinDelayUs), maxDelayUs(_MaxDelayUs)
+            , haveClock(false), lastTs(0), serverClockUs(0), haveTransit(false), lastTransitUs(0)
+            , baseTransitUs(0), windowMinUs(0), windowCount(0), jitterUs(0)
+            , catchUp(false), curPresent(true)
+    { memset( &stats, 0, sizeof(stats) ); }
+
+    void push( const RecvdFrame &frame )
+    {
+        std::unique_lock<std::mutex> lk(lock);
+
+        Entry entry;
+        entry.frame = frame;
+        entry.serverUs = ServerClock( frame.timestamp_ );
+        if( frame.seqNO_ )
+            UpdateJitter( entry.serverUs, frame.recvTime_ );
+        entries.push_back( entry );
+
+        lk.unlock();
+        condRd.notify_one();
+    }
+
+    RecvdFrame pop()
+    {
+        std::unique_lock<std::mutex> lk(lock);
+
+        while( entries.empty() )
+            condRd.wait( lk );
+
+        // the parameter sets pass immediately
+        if( entries.front().frame.seqNO_ ) {
+            for( ;; ) {
+                const Entry &head = entries.front();
+                int64_t target = TargetDelayUs();
+                int64_t backlog = entries.back().serverUs - head.serverUs;
+
+                if( !catchUp && backlog > target + CATCHUP_MARGIN_US ) {
+                    catchUp = true;
+                    ++stats.catchUps;
+                    DBG_STREAM( "playout catch-up, backlog " << backlog << "us target " << target << "us" );
+                } else if( catchUp && backlog <= target ) {
+                    catchUp = false;
+                } // if
+
+                if( catchUp )
+                    break;
+
+                int64_t deadline = head.serverUs + baseTransitUs + target;
+                int64_t now = gen_timestamp_us();
+                if( now >= deadline ) {
+                    if( head.frame.recvTime_ > deadline )
+                        ++stats.late;
+                    break;
+                } // if
+
+                // new frames may push the backlog over the margin, re-check when they arrive
+                condRd.wait_until( lk, std::chrono::system_clock::time_point(
+                                    std::chrono::microseconds(deadline)) );
+            } // for
+
+            curPresent = !catchUp;
+            if( curPresent )
+                ++stats.presented;
+            else
+                ++stats.skipped;
+        } // if
+
+        RecvdFrame retval = entries.front().frame;
+        retval.present_ = curPresent;
+        entries.pop_front();
+        return retval;
+    }
+
+    Stats getStats()
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        Stats ret = stats;
+        ret.jitterUs = (int64_t)jitterUs;
+        ret.targetUs = TargetDelayUs();
+        ret.backlogUs = entries.empty() ? 0 : entries.back().serverUs - entries.front().serverUs;
+        return ret;
+    }
+
+    std::string report()
+    {
+        Stats st = getStats();
+        char buf[256];
+        sprintf( buf, "Playout presented=%llu skipped=%llu late=%llu catchups=%llu jitter=%lldus "
+                    "target=%lldus backlog=%lldus\n",
+                    (unsigned long long)st.presented, (unsigned long long)st.skipped,
+                    (unsigned long long)st.late, (unsigned long long)st.catchUps,
+                    (long long)st.jitterUs, (long long)st.targetUs, (long long)st.backlogUs );
+        return buf;
+    }
+
+private:
+    struct Entry {
+        RecvdFrame      frame;
+        int64_t         serverUs;       // header timestamp unwrapped to us
+    };
+
+    // the header timestamp is the low 32 bits of the server's ms clock
+    int64_t ServerClock( uint32_t ts )
+    {
+        if( !haveClock ) {
+            haveClock = true;
+            serverClockUs = (int64_t)ts * 1000;
+        } else {
+            serverClockUs += (int64_t)(int32_t)(ts - lastTs) * 1000;
+        } // if
+        lastTs = ts;
+        return serverClockUs;
+    }
+
+    void UpdateJitter( int64_t serverUs, int64_t recvUs )
+    {
+        int64_t transit = recvUs - serverUs;
+
+        if( !haveTransit ) {
+            haveTransit = true;
+            baseTransitUs = windowMinUs = lastTransitUs = transit;
+        } else {
+            int64_t d = transit - lastTransitUs;
+            jitterUs += ((double)(d < 0 ? -d : d) - jitterUs) / 16.0;
+            lastTransitUs = transit;
+        } // if
+
+        baseTransitUs = std::min( baseTransitUs, transit );
+        windowMinUs = std::min( windowMinUs, transit );
+        if( ++windowCount >= BASE_WINDOW ) {
+            baseTransitUs = windowMinUs;
+            windowMinUs = transit;
+            windowCount = 0;
+        } // if
+    }
+
+    int64_t TargetDelayUs() const
+    {
+        int64_t target = (int64_t)(JITTER_FACTOR * jitterUs);
+        return std::max( minDelayUs, std::min(maxDelayUs, target) );
+    }
+
+private:
+    std::deque<Entry>           entries;
+    std::mutex                  lock;
+    std::condition_variable     condRd;
+
+    int64_t                     minDelayUs, maxDelayUs;
+    bool                        haveClock;
+    uint32_t                    lastTs;
+    int64_t                     serverClockUs;
+    bool                        haveTransit;
+    int64_t                     lastTransitUs;
+    int64_t                     baseTransitUs;      // smallest transit seen, the network floor
+    int64_t                     windowMinUs;
+    int                         windowCount;
+    double                      jitterUs;
+    bool                        catchUp;
+    bool                        curPresent;         // decision for the frame being popped
+    Stats                       stats;
+};
+
+
 // FOR DEBUG
 namespace std {
     inline
@@ -41,21 +262,47 @@ namespace std {
 
 class DesktopStreamingRequest : public Request {
     static const int            HANDLER_NO = 1;
-    static const int            PLAYER_BUFSIZE = (512*1024);
+    static const std::size_t    RECV_RING_SIZE = (256*1024);
+    // a body remainder at least this large is read straight into the frame buffer
+    static const std::size_t    DIRECT_READ_MIN = (64*1024);
+    // an IDR needs a round trip and an encode before it arrives, don't ask again before that
+    static const int64_t        KEYFRAME_REQUEST_INTERVAL_US = 500 * 1000;
+    // received byte count reported to the server's rate controller
+    static const int64_t        ACK_INTERVAL_US = 100 * 1000;
+public:
+    // counters of one session, see Summarize()
+    struct Summary {
+        uint64_t                    frames;             // frames received
+        uint64_t                    bytes;
+        PlayoutScheduler::Stats     playout;
+        uint64_t                    displayed;
+        uint64_t                    displaySkipped;     // overwritten inside the display pipeline
+    };
+
 public:
     DesktopStreamingRequest( const TcpConnectionPtr &msg_conn, const TcpConnectionPtr &data_conn )
                 : Request(msg_conn, data_conn, HANDLER_NO)
+                , encoderArgs("- --preset ultrafast --bframes 0 --rc-lookahead 0 --ref 1 --no-b-pyramid "
+                              "--input-res 1920x1080 --input-csp i444 --fps 60 -o -")
+                , ring(RECV_RING_SIZE), bodyFilled(0), lastAck(0), lastKeyframeRequest(0), keyframeRequests(0)
     {
-        pHeaderBuf.reset( new BytesArray );
-        pHeaderBuf->resize( ENCODED_FRAME_HEADER_LEN );
+        memset( &recvStats, 0, sizeof(recvStats) );
+        memset( &startup, 0, sizeof(startup) );
     }
 
-    // TODO can specify args
+    // x265 command line without the leading "x265", takes effect on Start()
+    void SetEncoderArgs( const std::string &args )
+    { encoderArgs = args; }
+
     void Start()
     {
-        StringPtr pMsg = std::make_shared<std::string>("x265 - --preset ultrafast --bframes 0 --rc-lookahead 0 --ref 1 --no-b-pyramid --input-res 1920x1080 --input-csp i444 --fps 60 -o -\n");
+        // preferred checksums first, the server switches to the v2 header when it knows one of them
+        StringPtr pChecksum = std::make_shared<std::string>("checksum crc32c crc16 none\n");
+        StringPtr pMsg = std::make_shared<std::string>("x265 " + encoderArgs + "\n");
+        startup.startTime = gen_timestamp_us();
         StartPlayer();
-        RequestFrameHeader();
+        RequestData();
+        msgConn->sendMsg(pChecksum);
         msgConn->sendMsg(pMsg);
     }
 
@@ -68,16 +315,113 @@ public:
 
     int PlayerRoutine();
 
-    void OnFrameHeader( BytesArrayPtr data, size_t len )
+    /*
+     * 数据连接上每次read_some读入尽可能多的数据到接收环，然后切出环里所有完整的帧，
+     * 一次读取、一次handler调度可以交付多帧。帧头或帧体跨越两次读取时，已读的部分留在环里
+     * (帧体直接拷进帧的buffer)，等下一次读取。环里读完后剩余的帧体如果很大(I帧)，
+     * 直接读进帧的buffer，不经过环。
+     */
+    void RequestData()
     {
-        assert( len == ENCODED_FRAME_HEADER_LEN );
-        assert( data == pHeaderBuf );
+        dataConn->recvSome( ring.writable(), std::bind(&DesktopStreamingRequest::OnData, this,
+                    std::placeholders::_1) );
+    }
 
-        char *p = data->ptr();
-        if( *p++ != (char)0xfe ) {
-            std::cerr << "wrong frame header format!" << std::endl;
-            return;
+    void OnData( size_t len )
+    {
+        ring.commit( len );
+        ++recvStats.reads;
+        recvStats.bytes += len;
+        SendAck();
+        ParseFrames();
+    }
+
+    void OnBodyDirect( size_t len )
+    {
+        ++recvStats.reads;
+        ++recvStats.directReads;
+        recvStats.bytes += len;
+        SendAck();
+        bodyFilled += len;
+        assert( bodyFilled == nextFrame.size() );
+        OnFrameBody();
+        ParseFrames();
+    }
+
+    void ParseFrames()
+    {
+        for( ;; ) {
+            if( !nextFrame.pData ) {            // expecting a header
+                std::size_t hdrLen = HeaderLen();
+                if( !hdrLen || ring.size() < hdrLen )
+                    break;
+                char header[MAX_FRAME_HEADER_LEN];
+                ring.read( header, hdrLen );
+                if( !ParseHeader(header) ) {
+                    // frames are only delimited by their lengths, a payload byte can look like any marker;
+                    // there is nothing to resync on, end the stream instead of going silent
+                    char msgBuf[128];
+                    sprintf( msgBuf, "wrong frame header format 0x%02x at byte %llu, closing the data connection",
+                                (unsigned char)header[0], (unsigned long long)(recvStats.bytes - ring.size() - hdrLen) );
+                    std::cerr << msgBuf << std::endl;
+                    dataConn->shutdown( SHUTDOWN_RW );
+                    return;
+                } // if
+                bodyFilled = 0;
+            } // if
+
+            std::size_t remain = nextFrame.size() - bodyFilled;
+            std::size_t n = std::min( remain, ring.size() );
+            ring.read( nextFrame.ptr() + bodyFilled, n );
+            bodyFilled += n;
+            remain -= n;
+            if( !remain ) {
+                OnFrameBody();
+                continue;
+            } // if
+
+            // the ring is drained and the body goes on
+            if( remain >= DIRECT_READ_MIN ) {
+                dataConn->recvExactly( boost::asio::buffer(nextFrame.ptr() + bodyFilled, remain),
+                        std::bind(&DesktopStreamingRequest::OnBodyDirect, this, std::placeholders::_1) );
+                return;
+            } // if
+            break;
+        } // for
+
+        RequestData();
+    }
+
+    // length of the header at the head of the ring, 0 until enough of it arrived to tell
+    std::size_t HeaderLen() const
+    {
+        if( ring.empty() )
+            return 0;
+
+        switch( ring.at(0) ) {
+        case 0xfe:
+            return ENCODED_FRAME_HEADER_LEN;
+        case 0xfc:
+            return ENCODED_FRAME_HEADER_LEN + TRACE_HEADER_EXT_LEN;
+        case 0xfb:
+            if( ring.size() < 3 )
+                return 0;
+            return FRAME_HEADER_V2_LEN + ((ring.at(2) & HEADER_FLAG_TRACE) ? TRACE_FIELDS_LEN : 0);
+        default:
+            return 1;                           // ParseHeader rejects it
+        } // switch
+    }
+
+    bool ParseHeader( const char *p )
+    {
+        char marker = *p;
+        if( marker == (char)0xfb ) {
+            ParseHeaderV2( p );
+            return true;
         } // if
+        if( marker != (char)0xfe && marker != (char)0xfc )
+            return false;
+        ++p;
 
         using boost::asio::detail::socket_ops::network_to_host_short;
         using boost::asio::detail::socket_ops::network_to_host_long;
@@ -93,45 +437,154 @@ public:
         nextFrame.timestamp_ = network_to_host_long( nextFrame.timestamp_ );
 
         // read crc
-        memcpy( &(nextFrame.cksum_), p, 2 );
+        uint16_t crc;
+        memcpy( &crc, p, 2 );
         p += 2;
-        nextFrame.cksum_ = network_to_host_short( nextFrame.cksum_ );
+        nextFrame.cksum_ = network_to_host_short( crc );
+        nextFrame.cksumType_ = ChecksumEngine::CRC16;
 
         // read framesize 
         uint32_t framesize;
         memcpy( &framesize, p, 4 );
-        framesize = network_to_host_long( framesize );
-        nextFrame.pData = gRecvBufMgr.get();
+        p += 4;
+        InitFrame( network_to_host_long(framesize) );
+
+        // 0xFC: the latency trace follows
+        if( marker == (char)0xfc )
+            ParseTraceFields( p );
+        return true;
+    }
+
+    void InitFrame( uint32_t framesize )
+    {
+        // the pool class has to fit the padding NextPacket appends, or that would reallocate
+        nextFrame.pData = gRecvBufMgr.get( framesize + DECODER_PADDING_SIZE );
         nextFrame.pData->resize( framesize );
 
-        RequestFrameBody();
+        nextFrame.captureTime_ = 0;
+        nextFrame.serverDelay_ = 0;
+    }
+
+    void ParseHeaderV2( const char *p )
+    {
+        using boost::asio::detail::socket_ops::network_to_host_long;
+
+        p += 2;                     // marker, version
+        uint8_t flags = (uint8_t)*p++;
+        nextFrame.cksumType_ = (ChecksumEngine::Type)(uint8_t)*p++;
+
+        uint32_t val;
+        memcpy( &val, p, 4 );
+        p += 4;
+        nextFrame.seqNO_ = network_to_host_long( val );
+        memcpy( &val, p, 4 );
+        p += 4;
+        nextFrame.timestamp_ = network_to_host_long( val );
+        memcpy( &val, p, 4 );
+        p += 4;
+        nextFrame.cksum_ = network_to_host_long( val );
+        memcpy( &val, p, 4 );
+        p += 4;
+        InitFrame( network_to_host_long(val) );
+
+        if( flags & HEADER_FLAG_TRACE )
+            ParseTraceFields( p );
     }
 
-    void OnFrameBody( BytesArrayPtr data, size_t len )
+    const char* ParseTraceFields( const char *p )
     {
-        assert( len == data->size() );
-        assert( data == nextFrame.pData );
+        using boost::asio::detail::socket_ops::network_to_host_long;
 
-        RequestFrameHeader();
+        uint32_t high, low;
+        memcpy( &high, p, 4 );
+        memcpy( &low, p + 4, 4 );
+        p += 8;
+        nextFrame.captureTime_ = (int64_t)(((uint64_t)network_to_host_long(high) << 32)
+                                    | network_to_host_long(low));
+        memcpy( &(nextFrame.serverDelay_), p, 4 );
+        p += 4;
+        nextFrame.serverDelay_ = network_to_host_long( nextFrame.serverDelay_ );
+        return p;
+    }
 
-        // for debug
-        uint16_t crc = crc_checksum( data->ptr(), data->size() );
-        if( crc != nextFrame.cksum_ ) {
-            DBG_STREAM( "checksum inconsistent on frame: " << nextFrame << " local crc is " << crc );
-            // exit(-1);
-        } // if 
+    // the body is complete, hand the frame to the player
+    void OnFrameBody()
+    {
+        BytesArrayPtr data = nextFrame.pData;
+
+        nextFrame.recvTime_ = gen_timestamp_us();
+        if( nextFrame.captureTime_ )
+            gClientLatency.record( CLS_NETWORK,
+                    nextFrame.recvTime_ - nextFrame.captureTime_ - nextFrame.serverDelay_ );
+
+        if( nextFrame.cksumType_ != ChecksumEngine::NONE ) {
+            if( checksumEngine.type() != nextFrame.cksumType_ )
+                checksumEngine = ChecksumEngine( nextFrame.cksumType_ );
+            uint32_t crc = checksumEngine.compute( data->ptr(), data->size() );
+            if( crc != nextFrame.cksum_ ) {
+                DBG_STREAM( "checksum inconsistent on frame: " << nextFrame << " local "
+                            << ChecksumEngine::name(nextFrame.cksumType_) << " is " << crc );
+                RequestKeyframe();
+            } // if
+        } // if
 
         frameQueue.push( nextFrame );
         DBG_STREAM( "Received " << nextFrame << " recv_time: " << gen_timestamp() );
+
+        // misses should stop growing once every size class has warmed up
+        if( nextFrame.seqNO_ % 600 == 0 ) {
+            BufferPool<BytesArray>::Stats st = gRecvBufMgr.stats();
+            DBG_STREAM( "recv buffer pool hits: " << st.hits << " misses: " << st.misses
+                        << " outstanding: " << st.outstanding << " high-water: " << st.highWater );
+        } // if
+
+        ++recvStats.frames;
+        nextFrame.pData.reset();
+    }
+
+    /*
+     * 定期告诉服务端一共收到了多少字节，服务端用它和已经写进socket的字节数之差估计
+     * 网络里排队的数据，再据此调整编码码率(见RateController)。数据连接的strand上调用。
+     */
+    void SendAck()
+    {
+        int64_t now = gen_timestamp_us();
+        if( now - lastAck < ACK_INTERVAL_US )
+            return;
+        lastAck = now;
+        char buf[40];
+        sprintf( buf, "ack %llu\n", (unsigned long long)recvStats.bytes );
+        msgConn->sendMsg( std::make_shared<std::string>(buf) );
     }
 
     // for player read_packet use
-    SharedQueue<RecvdFrame>& FrameQueue() { return frameQueue; }
+    PlayoutScheduler& FrameQueue() { return frameQueue; }
+
+    /*
+     * 码流损坏(校验错、解码出错)之后向服务端发"idr"，下一帧编码成IDR，解码从那里恢复，
+     * 不用重新发x265命令重启编码器。网络线程和播放线程都会调用，间隔内的请求合并。
+     */
+    void RequestKeyframe()
+    {
+        int64_t now = gen_timestamp_us(), last = lastKeyframeRequest;
+        if( now - last < KEYFRAME_REQUEST_INTERVAL_US
+                    || !lastKeyframeRequest.compare_exchange_strong(last, now) )
+            return;
+        ++keyframeRequests;
+        DBG_STREAM( "requesting a keyframe" );
+        msgConn->sendMsg( std::make_shared<std::string>("idr\n") );
+    }
 
 public:
     bool handle_msg( const std::string &msg, TcpConnectionPtr msg_conn )
     {
         DBG_STREAM("DesktopStreamingRequest received msg: " << msg);
+
+        // the server answered "latency", show the client side stages next to it
+        if( msg.find("Latency server") == 0 && msg.find(" capture ") != std::string::npos )
+            std::cout << gClientLatency.report( "Latency client" ) << frameQueue.report()
+                        << RecvReport() << StartupReport() << DisplayReport() << std::flush;
+
         return false;
     }
 
@@ -141,25 +594,64 @@ public:
         return false;
     }
 
+    // "snapshot" takes one, "snapshot off|demand|<n>" sets the policy
+    bool handle_command( const std::string &cmd );
+
+    // read racily from another thread, good enough for reports
+    Summary Summarize();
+
 protected:
-    void RequestFrameHeader()
+    // time to first frame, relative to the request
+    std::string StartupReport() const
     {
-        dataConn->recvData( pHeaderBuf, std::bind(&DesktopStreamingRequest::OnFrameHeader, this, 
-                    std::placeholders::_1, std::placeholders::_2) );
+        char buf[160];
+        sprintf( buf, "Startup header=%lldus decoded=%lldus presented=%lldus\n",
+                    (long long)(startup.headerTime ? startup.headerTime - startup.startTime : -1),
+                    (long long)(startup.firstDecodeTime ? startup.firstDecodeTime - startup.startTime : -1),
+                    (long long)(startup.firstPresentTime ? startup.firstPresentTime - startup.startTime : -1) );
+        return buf;
     }
 
-    void RequestFrameBody()
+    std::string DisplayReport() const;
+
+    std::string RecvReport() const
     {
-        dataConn->recvData( nextFrame.pData, std::bind(&DesktopStreamingRequest::OnFrameBody, this,
-                    std::placeholders::_1, std::placeholders::_2) );
+        char buf[160];
+        sprintf( buf, "Recv reads=%llu direct=%llu frames=%llu bytes=%llu frames/read=%.2f idr requests=%llu\n",
+                    (unsigned long long)recvStats.reads, (unsigned long long)recvStats.directReads,
+                    (unsigned long long)recvStats.frames, (unsigned long long)recvStats.bytes,
+                    recvStats.reads ? (double)recvStats.frames / recvStats.reads : 0.0,
+                    (unsigned long long)keyframeRequests );
+        return buf;
     }
 
 protected:
-    BytesArrayPtr                   pHeaderBuf;
-    RecvdFrame                      nextFrame;
-    SharedQueue<RecvdFrame>         frameQueue;
+    struct RecvStats {
+        uint64_t        reads;
+        uint64_t        directReads;    // body remainders read past the ring
+        uint64_t        frames;
+        uint64_t        bytes;
+    };
+
+    std::string                     encoderArgs;
+    RecvRing                        ring;
+    RecvdFrame                      nextFrame;      // pData is NULL while expecting a header
+    std::size_t                     bodyFilled;
+    RecvStats                       recvStats;      // data connection strand only, read racily for reports
+    int64_t                         lastAck;        // gen_timestamp_us(), data connection strand only
+    // local gen_timestamp_us(), 0 until reached; each field has one writer and is written once
+    struct StartupTimes {
+        int64_t         startTime;          // x265 request sent, by Start() before the player thread starts
+        int64_t         headerTime;         // parameter sets handed to the decoder, by the player thread
+        int64_t         firstDecodeTime;    // by the player thread
+        int64_t         firstPresentTime;   // by the display thread, which prints StartupReport()
+    }                               startup;
+    ChecksumEngine                  checksumEngine;
+    std::atomic<int64_t>            lastKeyframeRequest;    // gen_timestamp_us()
+    std::atomic<uint64_t>           keyframeRequests;
+    PlayoutScheduler                frameQueue;
     std::unique_ptr<std::thread>    playerThread;
-    static BufferMgr<BytesArray>    gRecvBufMgr;
+    static BufferPool<BytesArray>   gRecvBufMgr;
 };
 
 
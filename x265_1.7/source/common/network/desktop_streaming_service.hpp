@@ -2,22 +2,223 @@
 #define _DESKTOP_STREAMING_SERVICE_HPP_
 
 #include "service.hpp"
+#include "rate_controller.hpp"
+#include "shm_transport.hpp"
+#include "recorder.hpp"
+#include <set>
 
 #define INIT_FRAME_SIZE             (256*1024)
 // header: 0xFE + seqNO + timestamp + crc + frameSize
 #define ENCODED_FRAME_HEADER_LEN        15
+// traced header: 0xFC + seqNO + timestamp + crc + frameSize + captureTime(8, us) + serverDelay(4, us capture->send)
+#define TRACE_HEADER_EXT_LEN            12
+// v2 header, used once the client negotiated a checksum:
+// 0xFB + version(1) + flags(1) + checksumType(1) + seqNO + timestamp + checksum(4) + frameSize
+//      [+ captureTime(8) + serverDelay(4)]
+#define FRAME_HEADER_V2_LEN             20
+#define FRAME_HEADER_VERSION            2
+#define HEADER_FLAG_TRACE               2
+#define TRACE_FIELDS_LEN                12
+#define MAX_FRAME_HEADER_LEN            (FRAME_HEADER_V2_LEN + TRACE_FIELDS_LEN)
 
 struct YuvFrameInfo {
     YuvFrameInfo() {}
-    YuvFrameInfo( uint32_t _SeqNO )
-            : seqNO( _SeqNO ), timestamp(gen_timestamp()) {}
+    YuvFrameInfo( uint32_t _SeqNO, int64_t _CaptureTime = 0, int64_t _ConvertTime = 0 )
+            : seqNO( _SeqNO ), timestamp(gen_timestamp())
+            , captureTime(_CaptureTime), convertTime(_ConvertTime), readyTime(gen_timestamp_us())
+            , dirtyMapOffset(0), dirtyTiles(0), tileCols(0), tileRows(0) {}
+
+    // per-CTU change map against the previous frame (input/tile_differ.hpp), NULL if not computed
+    const uint8_t* dirtyMap() const
+    { return dirtyMapOffset ? (const uint8_t*)this + dirtyMapOffset : NULL; }
 
     uint32_t        seqNO;
     uint32_t        timestamp;
+    // latency tracing, gen_timestamp_us()
+    int64_t         captureTime;        // capture started
+    int64_t         convertTime;        // RGB->YUV started
+    int64_t         readyTime;          // committed to the ring
+    // dirty tiles, the map is tileCols * tileRows bytes after the picture in the same slot
+    uint32_t        dirtyMapOffset;     // from the start of this header, 0 if there is no map
+    uint32_t        dirtyTiles;
+    uint16_t        tileCols, tileRows;
+};
+
+/*
+ * 一帧在server端流水线各阶段的时间戳，YUVInput::readPicture分配，通过x265_picture.userData
+ * 跟着这一帧穿过encoder，RAWOutput::writeFrame记录到gServerLatency之后释放。
+ * 中途退出时还留在encoder里的帧不会输出，encoder关闭后由YUVInput析构时统一释放(DesktopStreamingService::FreeFrameTraces)。
+ */
+struct FrameTrace {
+    FrameTrace( const YuvFrameInfo &info )
+            : seqNO(info.seqNO), captureTime(info.captureTime), convertTime(info.convertTime)
+            , readyTime(info.readyTime), readTime(gen_timestamp_us()) {}
+
+    uint32_t        seqNO;
+    int64_t         captureTime, convertTime, readyTime, readTime;
+};
+
+enum ServerLatencyStage {
+    SLS_CAPTURE,        // capture start -> convert start
+    SLS_CONVERT,        // convert start -> committed to the ring
+    SLS_QUEUE,          // ring -> read by the encoder thread
+    SLS_LOOKAHEAD,      // read -> left the lookahead
+    SLS_DISPATCH,       // lookahead -> frame encoder started
+    SLS_ENCODE,         // frame encoder start -> end
+    SLS_OUTPUT,         // encoder end -> RAWOutput::writeFrame
+    SLS_SEND,           // writeFrame -> written to every connection
+    SLS_TOTAL,          // capture start -> written
+    SLS_COUNT
 };
 
+extern LatencyTracer            gServerLatency;
+
 #define         YUV_HEADER_LEN sizeof(YuvFrameInfo)
 
+// input/capture_source.hpp
+class CaptureSource;
+struct CaptureFormat;
+typedef std::shared_ptr<CaptureSource>      CaptureSourcePtr;
+// input/tile_differ.hpp
+class TileDiffer;
+
+/*
+ * 一个会话里所有帧的帧头格式，version 1 是 0xFE/0xFC 的旧格式(CRC-16)，
+ * 客户端用"checksum"命令协商之后为 version 2。
+ */
+struct FrameHeaderFormat {
+    FrameHeaderFormat( uint8_t _Version = 1, ChecksumEngine::Type _Checksum = ChecksumEngine::CRC16,
+                        bool _Traced = false )
+            : version(_Version), checksum(_Checksum), traced(_Traced) {}
+
+    uint8_t                 version;
+    ChecksumEngine::Type    checksum;
+    bool                    traced;     // carries the capture time to the client
+};
+
+/*
+ * 编码后的一帧: 帧头 + x265输出的NAL payload，payload不拷贝，
+ * 由RAWOutput pin住encoder的NAL buffer，发送完成后通过releaser归还给encoder。
+ */
+struct EncodedFrame : GatherBuffer {
+    explicit EncodedFrame( const FrameHeaderFormat &_Format = FrameHeaderFormat() )
+            : format(_Format), seqNO(0), captureTime(0)
+    { append( header, headerLen() ); }
+
+    uint32_t headerLen() const
+    {
+        if( format.version >= 2 )
+            return FRAME_HEADER_V2_LEN + (format.traced ? TRACE_FIELDS_LEN : 0);
+        return ENCODED_FRAME_HEADER_LEN + (format.traced ? TRACE_HEADER_EXT_LEN : 0);
+    }
+
+    uint32_t payloadSize() const
+    { return (uint32_t)(size() - headerLen()); }
+
+    char                header[MAX_FRAME_HEADER_LEN];
+    FrameHeaderFormat   format;
+    uint32_t            seqNO;          // set with the header
+    int64_t             captureTime;
+};
+
+typedef std::shared_ptr<EncodedFrame>       EncodedFramePtr;
+
+/*
+ * 一次编码，多路发送。每个观看者的数据连接都是一个subscriber，同一个EncodedFrame
+ * 直接放到所有subscriber的发送队列里，不拷贝，每个连接各自按自己的SendQueuePolicy丢帧。
+ * seq 0 的参数集帧(VPS/SPS/PPS)被缓存下来，中途加入的观看者先收到它，然后丢弃
+ * 可丢弃帧直到下一个关键帧，同时请求编码器插入一个IDR。
+ */
+class FrameBroadcaster {
+public:
+    typedef std::function<void()>           KeyframeRequesterType;
+
+    FrameBroadcaster() {}
+
+    void subscribe( const TcpConnectionPtr &conn )
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        Subscriber &sub = subscribers[conn.get()];
+        sub.conn = conn;
+        sub.needKeyframe = true;
+        if( paramSets ) {
+            conn->sendData( paramSets );
+            if( keyframeRequester )
+                keyframeRequester();
+        } // if
+    }
+
+    void unsubscribe( const TcpConnectionPtr &conn )
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        subscribers.erase( conn.get() );
+    }
+
+    // called by the encoder thread, frame header already generated
+    void publish( uint32_t frame_no, const EncodedFramePtr &frame )
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        if( frame_no == 0 ) {
+            // new encoder session, every subscriber restarts from these parameter sets
+            paramSets = frame;
+            for( auto &v : subscribers )
+                v.second.needKeyframe = true;
+        } // if
+        for( auto &v : subscribers ) {
+            Subscriber &sub = v.second;
+            if( sub.needKeyframe && frame->droppable() ) {
+                if( !frame->keyframe() )
+                    continue;
+                sub.needKeyframe = false;
+            } // if
+            sub.conn->sendData( frame );
+        } // for
+    }
+
+    // the encoder side, typically DesktopStreamingService::RequestKeyframe
+    void setKeyframeRequester( const KeyframeRequesterType &func )
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        keyframeRequester = func;
+    }
+
+    // the encoding client is gone, cached parameter sets are stale
+    void endSession()
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        keyframeRequester = KeyframeRequesterType();
+        paramSets.reset();
+    }
+
+    void requestKeyframe()
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        if( keyframeRequester )
+            keyframeRequester();
+    }
+
+    std::size_t size()
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        return subscribers.size();
+    }
+
+private:
+    struct Subscriber {
+        TcpConnectionPtr    conn;
+        bool                needKeyframe;
+    };
+
+    std::map<TcpConnection*, Subscriber>    subscribers;
+    EncodedFramePtr                         paramSets;
+    KeyframeRequesterType                   keyframeRequester;
+    std::mutex                              lock;
+};
+
+extern FrameBroadcaster         gBroadcaster;
+// serve more than one client, later clients join the running stream as viewers
+extern bool                     g_broadcast_mode;
+
 extern std::unique_ptr<boost::asio::deadline_timer>    fps_timer_counter;
 extern bool g_fps_count_flag;
 extern uint32_t g_fps_count;
@@ -26,28 +227,58 @@ extern void FPS_CountHandler(const boost::system::error_code &ec);
 /*
  * 有3个线程在工作
  * 1. 从Service继承来的pWorkThread, 用于处理输入命令
- * 2. pCaptureThread StartCapture启动，由x265_main执行input模块StartReader时启动
+ * 2. pCaptureThread StartCapture启动，由x265_main执行input模块StartReader时启动，或者"start"命令、采集n帧命令启动，yuvBuf唯一的writer
  * 3. pEncodeThread StartStreaming启动，执行x265_main
  */
 class DesktopStreamingService : public Service {
     static const int            HANDLER_NO = 1;
     static const size_t         YUV_BUFSIZE = 2;
+    static const uint32_t       DEFAULT_SEND_DELAY_MS = 200;      // send queue latency budget
 public:
-    static ServicePtr CreateInstance( ClientInfo *client )
+    static ServicePtr CreateInstance( ClientInfo *client );
+
+    // the capture source spec of sessions that do not choose one with "capture <spec>",
+    // e.g. "synthetic:text" (see CreateCaptureSource); empty is the platform default
+    static void SetDefaultCaptureSource( const std::string &spec )
     {
-        // pInstance.reset( new DesktopStreamingService(client) );
-        // return pInstance;
-        ServicePtr ret(new DesktopStreamingService(client));
-        pInstance = dynamic_cast<DesktopStreamingService*>(ret.get());
-        return ret;
+        std::unique_lock<std::mutex> lk(sourceLock());
+        defaultCaptureSpec() = spec;
     }
 
+    // a source object the caller keeps, e.g. the loopback benchmark reading its counters;
+    // used by every session instead of the specs until reset
+    static void SetCaptureSource( const CaptureSourcePtr &source )
+    {
+        std::unique_lock<std::mutex> lk(sourceLock());
+        fixedSource() = source;
+    }
+
+    // for the encoder and capture threads, which the session joins before it goes away
     static DesktopStreamingService* instance()
     { return pInstance; }
 
+    // for threads the session does not own, e.g. a viewer's strand; NULL once it is destroyed
+    static std::shared_ptr<DesktopStreamingService> sharedInstance()
+    {
+        std::unique_lock<std::mutex> lk(instanceLock());
+        return sessionRef().lock();
+    }
+
     ~DesktopStreamingService()
     {
+        gBroadcaster.endSession();
+        gBroadcaster.unsubscribe( pClient->dataTransport() );
+        StopRecording();
+        if( pClient->shmConn ) {
+            pClient->shmConn->shutdown( SHUTDOWN_RW );
+            pClient->shmConn.reset();
+        } // if
+        // waits out an OnCongestion running on the strand, none starts after it
+        pClient->dataConn->setCongestionHandler( TcpConnection::CongestionHandlerType() );
         EndStreaming();
+        std::unique_lock<std::mutex> lk(instanceLock());
+        if( pInstance == this )
+            pInstance = NULL;
         DBG_STREAM("DesktopStreamingService destructor");
     }
 
@@ -56,38 +287,71 @@ public:
         if( pEncodeThread )
             EndStreaming();
         yuvSeqNO = 0;
+        yuvBuf.reset();     // drop frames the last encoder did not consume
+        {
+            std::unique_lock<std::mutex> lk(captureLock);
+            captureClosed = false;
+        }
         pEncodeThread.reset( new std::thread(std::bind(&DesktopStreamingService::DoStartEncoder, this, cmd)) );
     }
 
-    void StartCapture() // start continuous capture, called by yuv.cpp startReader, launched by x265
+    /*
+     * yuvBuf只有一个writer: pCaptureThread。连续采集(yuv.cpp startReader，"start")和采集n帧都在这个线程里，
+     * 已经在采集时不再启动第二个；没有encoder或者正在结束时也不启动。maxFrames为0表示一直采集到StopCapture。
+     * encoder线程也会调用这里，所以不等待，返回false表示没有启动。
+     */
+    bool StartCapture( uint32_t maxFrames = 0 )
     {
-        if( captureRunning )
-            StopCapture();
+        std::unique_lock<std::mutex> lk(captureLock);
+        if( captureRunning || captureStopping || captureClosed )
+            return false;
+        if( pCaptureThread ) {
+            // ended by itself, n frames captured or the source failed
+            pCaptureThread->join();
+            pCaptureThread.reset();
+        } // if
 
         Start_FPS_Count();
 
         captureRunning = true;
-        pCaptureThread.reset( new std::thread(std::bind(&DesktopStreamingService::DoStartCapture, this)) );
+        pCaptureThread.reset( new std::thread(std::bind(&DesktopStreamingService::DoStartCapture, this, maxFrames)) );
+        return true;
     }
 
     void StopCapture() // implement pause
     {
+        std::unique_lock<std::mutex> lk(captureLock);
         captureRunning = false;
-        if( pCaptureThread && pCaptureThread->joinable() )
+        while( captureStopping )
+            captureCond.wait( lk );     // joined by another thread
+        if( pCaptureThread ) {
+            // joined without the lock: the capture thread may wait for a free slot while the encoder,
+            // the reader, calls StartCapture(). The thread stays in pCaptureThread so no second writer starts
+            captureStopping = true;
+            lk.unlock();
             pCaptureThread->join();
-        pCaptureThread.reset();
+            lk.lock();
+            pCaptureThread.reset();
+            captureStopping = false;
+            captureCond.notify_all();
+        } // if
 
         Stop_FPS_Count();
     }
 
     void EndStreaming() // end all, capture and encoder
     {
+        {
+            std::unique_lock<std::mutex> lk(captureLock);
+            captureClosed = true;       // the encoder may still call StartCapture() while it drains
+        }
         StopCapture();
         yuvSeqNO = 0;
 
         if( pEncodeThread ) {
-            BytesArray emptyBuf;
-            yuvBuf.push( emptyBuf );        // make readPicture return false;
+            // the capture thread is joined and cannot restart, this thread is the only writer now
+            yuvBuf.writeSlot().clear();     // make readPicture return false;
+            yuvBuf.commitWrite();
 
             if( pEncodeThread->joinable() )
                 pEncodeThread->join();
@@ -105,20 +369,32 @@ public:
         Service::terminate();
     }
 
-    void SendEncodedFrame( uint32_t frame_no, const BytesArrayPtr &frame )
+    void SendEncodedFrame( uint32_t frame_no, const EncodedFramePtr &frame )
     {
         ++g_fps_count;
-        uint32_t frameLen = frame->size() - ENCODED_FRAME_HEADER_LEN;
-        genFrameHeader( frame_no, frame->ptr(), frameLen );
-        pClient->sendData( frame );
+        genFrameHeader( frame_no, *frame );
+        gBroadcaster.publish( frame_no, frame );
     }
 
-    void genFrameHeader( uint32_t frame_no, char *p, uint32_t frameLen )
+    void genFrameHeader( uint32_t frame_no, EncodedFrame &frame )
     {
         using boost::asio::detail::socket_ops::host_to_network_short;
         using boost::asio::detail::socket_ops::host_to_network_long;
 
-        *p++ = (char)0xFE;
+        const FrameHeaderFormat &fmt = frame.format;
+        frame.seqNO = frame_no;
+        bool v2 = fmt.version >= 2;
+        char *p = frame.header;
+        uint32_t frameLen = frame.payloadSize();
+
+        if( v2 ) {
+            *p++ = (char)0xFB;
+            *p++ = (char)FRAME_HEADER_VERSION;
+            *p++ = (char)(fmt.traced ? HEADER_FLAG_TRACE : 0);
+            *p++ = (char)fmt.checksum;
+        } else {
+            *p++ = fmt.traced ? (char)0xFC : (char)0xFE;
+        } // if
 
         uint32_t nSeqNO = host_to_network_long( frame_no );
         memcpy( p, &nSeqNO, 4 );
@@ -130,27 +406,287 @@ public:
         p += 4;
 
         char *pCRC = p;             // caculate later
-        p += 2;
+        p += v2 ? 4 : 2;
 
         uint32_t nFrameLen = host_to_network_long( frameLen );
         memcpy( p, &nFrameLen, 4 );
         p += 4;
 
-        // p now points at frame data
-        uint16_t crc = crc_checksum( p, frameLen );
-        uint16_t nCRC = host_to_network_short( crc );
-        memcpy( pCRC, &nCRC, 2 );
+        if( fmt.traced ) {
+            uint64_t captureTime = (uint64_t)frame.captureTime;
+            uint32_t nHigh = host_to_network_long( (uint32_t)(captureTime >> 32) );
+            uint32_t nLow = host_to_network_long( (uint32_t)captureTime );
+            memcpy( p, &nHigh, 4 );
+            memcpy( p + 4, &nLow, 4 );
+            p += 8;
+
+            int64_t delay = gen_timestamp_us() - frame.captureTime;
+            uint32_t nDelay = host_to_network_long( delay > 0 ? (uint32_t)delay : 0 );
+            memcpy( p, &nDelay, 4 );
+            p += 4;
+        } // if
+
+        // checksum over the NAL payloads, which follow the header in the buffer sequence
+        const GatherBuffer::BufferSeq &bufs = frame.buffers();
+        ChecksumEngine engine( fmt.checksum );
+        uint32_t crc = checksum_buffers( engine, bufs.begin() + 1, bufs.end() );
+        if( v2 ) {
+            uint32_t nCRC = host_to_network_long( crc );
+            memcpy( pCRC, &nCRC, 4 );
+        } else {
+            uint16_t nCRC = host_to_network_short( (uint16_t)crc );
+            memcpy( pCRC, &nCRC, 2 );
+        } // if
     }
 
-    SharedBuffer& YuvBuffer()
+    SpscFrameRing& YuvBuffer()
     { return yuvBuf; }
 
+    // the next picture read by the encoder becomes an IDR, may be called from any thread.
+    // x265 restarts its keyint count there, so this also works with --keyint -1 (one IDR, then P only)
+    void RequestKeyframe()
+    { keyframeRequested = true; }
+
+    // called by YUVInput::readPicture
+    bool TakeKeyframeRequest()
+    { return keyframeRequested.exchange(false); }
+
+    // x265_picture.userData of the pictures inside the encoder, the encoder thread only
+    FrameTrace* NewFrameTrace( const YuvFrameInfo &info )
+    {
+        FrameTrace *trace = new FrameTrace( info );
+        frameTraces.insert( trace );
+        return trace;
+    }
+
+    void DeleteFrameTrace( FrameTrace *trace )
+    {
+        frameTraces.erase( trace );
+        delete trace;
+    }
+
+    // after encoder_close, the pictures an abort left in the encoder never reach writeFrame
+    void FreeFrameTraces()
+    {
+        for( FrameTrace *trace : frameTraces )
+            delete trace;
+        frameTraces.clear();
+    }
+
+    // called by x265_main once the encoder is open, 0 when VBV is off and the rate cannot follow the network
+    void SetEncoderBitrate( uint32_t kbps )
+    {
+        encoderKbps = kbps;
+        pendingKbps = kbps ? rateController.restart( kbps ) : 0;
+    }
+
+    // called by x265_main between frames, a new VBV max rate chosen by the rate controller
+    bool TakeBitrateChange( uint32_t &kbps )
+    {
+        kbps = pendingKbps.exchange( 0 );
+        return kbps != 0 && encoderKbps != 0;
+    }
+
+    RateController::Stats RateControlStatistics()
+    { return rateController.stats(); }
+
+    // the owner's data connection
+    SendQueueStats SendQueueStatistics()
+    { return pClient->dataTransport()->sendQueueStats(); }
+
+    // header layout of the frames encoded from now on
+    FrameHeaderFormat HeaderFormat() const
+    {
+        int checksum = checksumType;
+        if( checksum < 0 )
+            return FrameHeaderFormat( 1, ChecksumEngine::CRC16, traceHeaders );
+        return FrameHeaderFormat( FRAME_HEADER_VERSION, (ChecksumEngine::Type)checksum, traceHeaders );
+    }
+
+    // called by YUVInput before capture starts, preallocates the ring slots
     void SetFrameSize(uint32_t _FrameSize)
-    { framesize = _FrameSize; }
+    {
+        framesize = _FrameSize;
+        yuvBuf.reserve( framesize + YUV_HEADER_LEN );
+    }
+
+    // the encoder's CTU size, set before YUVInput opens the capture source; the dirty tiles match it
+    void SetTileSize( uint32_t _TileSize )
+    { tileSize = _TileSize; }
+
+    // the reply to "checksum", the client switches its header parser on it
+    static void ReportHeaderFormat( ClientInfo *client, const FrameHeaderFormat &fmt )
+    {
+        char msgBuf[128];
+        ChecksumEngine engine( fmt.checksum );
+        sprintf( msgBuf, "Header v%u checksum %s (%s).\n", (unsigned)fmt.version,
+                    ChecksumEngine::name(fmt.checksum), ChecksumEngine::implName(engine.impl()) );
+        client->sendMsg( msgBuf );
+    }
+
+    // "sendbudget <ms> [bytes]", 0 means unlimited; the budget is per data connection
+    static void SetSendBudget( ClientInfo *client, const std::string &msg )
+    {
+        unsigned int ms = 0;
+        unsigned long bytes = 0;
+        if( sscanf(msg.c_str(), "sendbudget %u %lu", &ms, &bytes) < 1 ) {
+            client->sendMsg( "usage: sendbudget <ms> [bytes]\n" );
+            return;
+        } // if
+        client->dataConn->setSendQueuePolicy( SendQueuePolicy(ms, bytes) );
+        client->sendMsg( "Send queue budget updated.\n" );
+    }
+
+    // the reply to "queuestats", also sent when the send queue drops frames
+    static void ReportSendQueue( ClientInfo *client, const SendQueueStats &stats )
+    {
+        char msgBuf[256];
+        sprintf( msgBuf, "Send queue: dropped %llu frames (%llu bytes), queue delay %u ms, "
+                    "write delay %u ms, %lu frames %lu bytes queued.\n",
+                    (unsigned long long)stats.droppedFrames, (unsigned long long)stats.droppedBytes,
+                    stats.queueDelayMs, stats.writeDelayMs,
+                    (unsigned long)stats.queuedFrames, (unsigned long)stats.queuedBytes );
+        client->sendMsg( msgBuf );
+    }
+
+    /*
+     * "transport shm|tcp": 同机的消费者(录像、转发)改从共享内存环取帧，回复"Shm transport <name> <token>"，
+     * 客户端用ShmDataConnection接入；"transport tcp"回到数据连接。subscribed表示这个客户端已经在收流，
+     * 切换时换掉FrameBroadcaster里的订阅，新的订阅先收到参数集并请求一个IDR。
+     */
+    static void SelectTransport( ClientInfo *client, const std::string &msg, bool subscribed )
+    {
+        if( msg == "transport shm" ) {
+#if defined(HAVE_SHM_TRANSPORT)
+            std::shared_ptr<ShmConnection> conn = std::dynamic_pointer_cast<ShmConnection>( client->shmConn );
+            if( !conn ) {
+                conn = std::make_shared<ShmConnection>( client->msgConn->socket().get_io_service() );
+                if( !conn->open() ) {
+                    client->sendMsg( "Shared memory transport unavailable.\n" );
+                    return;
+                } // if
+                // a reader that attaches with no keyframe in the ring needs one
+                conn->setCongestionHandler( []( const SendQueueStats &stats ) {
+                    if( stats.keyframeRequested )
+                        gBroadcaster.requestKeyframe();
+                } );
+                if( subscribed )
+                    gBroadcaster.unsubscribe( client->dataTransport() );
+                client->shmConn = conn;
+                if( subscribed )
+                    gBroadcaster.subscribe( conn );
+            } // if
+            char msgBuf[160];
+            sprintf( msgBuf, "Shm transport %s %016llx\n", conn->name().c_str(), (unsigned long long)conn->token() );
+            client->sendMsg( msgBuf );
+#else
+            client->sendMsg( "Shared memory transport unavailable.\n" );
+#endif
+        } else if( msg == "transport tcp" ) {
+            if( client->shmConn ) {
+                if( subscribed ) {
+                    gBroadcaster.unsubscribe( client->shmConn );
+                    gBroadcaster.subscribe( client->dataConn );
+                } // if
+                client->shmConn->shutdown( SHUTDOWN_RW );
+                client->shmConn.reset();
+            } // if
+            client->sendMsg( "Transport tcp.\n" );
+        } else {
+            client->sendMsg( "usage: transport tcp|shm\n" );
+        } // if
+    }
+
+    /*
+     * "record <path>": 把正在编码的流同时录成Annex-B文件path和索引path.idx，录像作为一个subscriber
+     * 从下一个关键帧开始；"record off"结束；"record"报告进度。
+     */
+    void Record( const std::string &msg )
+    {
+        std::string path = msg.size() > 7 ? msg.substr(7) : std::string();
+        if( msg == "record" ) {
+            ReportRecording();
+        } else if( msg == "record off" ) {
+            ReportRecording();
+            StopRecording();
+        } else if( msg.compare(0, 7, "record ") != 0 || path.empty() ) {
+            pClient->sendMsg( "usage: record <path>|off\n" );
+        } else {
+            StopRecording();
+            std::shared_ptr<RecordingTap> tap = std::make_shared<RecordingTap>(
+                        pClient->msgConn->socket().get_io_service(),
+                        []( const GatherBuffer &buf, RecordingTap::FrameInfo &info ) {
+                            const EncodedFrame *frame = dynamic_cast<const EncodedFrame*>( &buf );
+                            if( !frame )
+                                return;
+                            info.headerLen = frame->headerLen();
+                            info.seqNO = frame->seqNO;
+                            if( frame->captureTime )
+                                info.timeUs = frame->captureTime;
+                        } );
+            if( !tap->open(path) ) {
+                pClient->sendMsg( "Cannot create " + path + ".\n" );
+                return;
+            } // if
+            tap->setCongestionHandler( []( const SendQueueStats &stats ) {
+                if( stats.keyframeRequested )
+                    gBroadcaster.requestKeyframe();
+            } );
+            recorder = tap;
+            gBroadcaster.subscribe( recorder );
+            pClient->sendMsg( "Recording to " + path + ".\n" );
+        } // if
+    }
+
+    void StopRecording()
+    {
+        if( recorder ) {
+            gBroadcaster.unsubscribe( recorder );
+            recorder->shutdown( SHUTDOWN_RW );
+            recorder.reset();
+        } // if
+    }
+
+    void ReportRecording()
+    {
+        if( !recorder ) {
+            pClient->sendMsg( "Not recording.\n" );
+            return;
+        } // if
+        RecordingStats st = recorder->recordingStats();
+        char msgBuf[256];
+        sprintf( msgBuf, ": %llu frames, %llu bytes, %llu keyframes, %llu dropped%s.\n",
+                    (unsigned long long)st.frames, (unsigned long long)st.bytes,
+                    (unsigned long long)st.keyframes, (unsigned long long)st.droppedFrames,
+                    st.failed ? ", write failed" : "" );
+        pClient->sendMsg( "Recording " + recorder->path() + msgBuf );
+    }
+
+    // one msg per stage, the client prints its own stages when it sees the first line
+    static void ReportLatency( ClientInfo *client )
+    {
+        std::string report = gServerLatency.report( "Latency server" );
+        std::string::size_type pos = 0, next;
+        while( (next = report.find('\n', pos)) != std::string::npos ) {
+            client->sendMsg( report.substr(pos, next - pos + 1) );
+            pos = next + 1;
+        } // while
+    }
 
 public:
     bool handle_msg( const std::string &msg, TcpConnectionPtr msg_conn )
     {
+        // ack <bytes>, sent by the client every ACK_INTERVAL_US, not worth a log line or a reply
+        if( msg.compare(0, 4, "ack ") == 0 ) {
+            unsigned long long bytes = 0;
+            if( sscanf(msg.c_str(), "ack %llu", &bytes) == 1 ) {
+                uint32_t kbps = rateController.onAck( bytes, SendQueueStatistics(), gen_timestamp_us() );
+                if( kbps )
+                    pendingKbps = kbps;
+            } // if
+            return true;
+        } // if
+
         DBG_STREAM("DesktopStreamingService received msg from " << ADDR_STR(msg_conn) << ": " << msg);
 
         // x265 encoding cmd, including all args
@@ -167,24 +703,91 @@ public:
             pClient->sendMsg( "Streaming terminated.\n" );
             return true;
         } else if( msg == "start" ) {
-            if( !captureRunning ) {
-                StartCapture();
+            if( captureRunning )
+                pClient->sendMsg( "Capture already running.\n" );
+            else if( StartCapture() )
                 pClient->sendMsg( "Capture going on.\n" );
+            else
+                pClient->sendMsg( "No encoder running, start x265 first.\n" );
+            return true;
+        } else if( msg.find("sendbudget") == 0 ) { // sendbudget <ms> [bytes], 0 means unlimited
+            SetSendBudget( pClient, msg );
+            return true;
+        } else if( msg == "queuestats" ) {
+            ReportSendQueue( pClient, pClient->dataTransport()->sendQueueStats() );
+            pClient->sendMsg( rateController.report() );
+            return true;
+        } else if( msg.find("transport") == 0 ) {
+            SelectTransport( pClient, msg, true );
+            return true;
+        } else if( msg.find("ratecontrol") == 0 ) { // ratecontrol <min_kbps> <max_kbps> [delay_ms] | off
+            unsigned int minKbps = 0, maxKbps = 0, delayMs = 0;
+            if( msg == "ratecontrol off" ) {
+                rateController.disable();
+                pClient->sendMsg( "Rate control off.\n" );
+            } else if( sscanf(msg.c_str(), "ratecontrol %u %u %u", &minKbps, &maxKbps, &delayMs) < 2 ) {
+                pClient->sendMsg( "usage: ratecontrol <min_kbps> <max_kbps> [delay_ms] | off\n" );
             } else {
-                pClient->sendMsg( "Capture already running.\n" );
+                rateController.configure( minKbps, maxKbps, encoderKbps, delayMs );
+                pClient->sendMsg( rateController.report() );
+                if( !encoderKbps )
+                    pClient->sendMsg( "Rate control takes effect with an encoder started with --vbv-maxrate "
+                                "and --vbv-bufsize.\n" );
             } // if
             return true;
-        } else if( isdigit(msg[0]) ) { // capture n frames
-            if( captureRunning ) {
-                pClient->sendMsg( "Capture running! you have to pause first.\n" );
-                return true;
+        } else if( msg.find("record") == 0 ) {
+            Record( msg );
+            return true;
+        } else if( msg == "idr" ) { // the client lost sync, restart decoding without restarting x265
+            RequestKeyframe();
+            pClient->sendMsg( "Keyframe requested.\n" );
+            return true;
+        } else if( msg.find("checksum") == 0 ) { // checksum <preferred> [<fallback> ...]
+            std::stringstream sstr( msg );
+            std::string word;
+            ChecksumEngine::Type type;
+            sstr >> word;
+            while( sstr >> word ) {
+                if( ChecksumEngine::parse(word, type) ) {
+                    checksumType = (int)type;
+                    ReportHeaderFormat( pClient, HeaderFormat() );
+                    return true;
+                } // if
+            } // while
+            pClient->sendMsg( "usage: checksum none|crc16|crc32c ...\n" );
+            return true;
+        } else if( msg.find("latency") == 0 ) { // latency [on|off|reset]
+            if( msg == "latency on" ) {
+                traceHeaders = true;
+                pClient->sendMsg( "Latency trace headers on.\n" );
+            } else if( msg == "latency off" ) {
+                traceHeaders = false;
+                pClient->sendMsg( "Latency trace headers off.\n" );
+            } else if( msg == "latency reset" ) {
+                gServerLatency.reset();
+                pClient->sendMsg( "Latency histograms reset.\n" );
+            } else {
+                ReportLatency( pClient );
             } // if
+            return true;
+        } else if( msg.find("capture") == 0 ) { // capture [<spec>], the source of the next x265 start
             std::unique_lock<std::mutex> lk(lock);
-            pNextJob.reset( new JobItem(std::bind(&DesktopStreamingService::Capture_n_frames,
-                            dynamic_cast<DesktopStreamingService*>(this),
-                            std::placeholders::_1, std::placeholders::_2), msg) );
+            if( msg.size() > 8 )
+                captureSpec = msg.substr( 8 );
+            std::string reply = "Capture source " + (captureSpec.empty() ? std::string("default") : captureSpec)
+                        + (captureDescription.empty() ? std::string() : ", running " + captureDescription) + ".\n";
             lk.unlock();
-            cond.notify_one();
+            pClient->sendMsg( reply );
+            return true;
+        } else if( isdigit(msg[0]) ) { // capture n frames, on the capture thread like continuous capture
+            unsigned int n = 0;
+            if( sscanf(msg.c_str(), "%u", &n) != 1 || !n ) {
+                pClient->sendMsg( "usage: <n>, capture n frames\n" );
+            } else if( captureRunning ) {
+                pClient->sendMsg( "Capture running! you have to pause first.\n" );
+            } else if( !StartCapture(n) ) {
+                pClient->sendMsg( "No encoder running, start x265 first.\n" );
+            } // if
             return true;
         }
 
@@ -199,11 +802,53 @@ public:
         return false;
     }
 
+protected:
+    // runs on the data connection's strand when the send queue dropped frames
+    void OnCongestion( const SendQueueStats &stats )
+    {
+        if( stats.keyframeRequested )
+            RequestKeyframe();
+        ReportSendQueue( pClient, stats );
+    }
+
 protected:
     void DoStartEncoder( const std::string &cmd ); // call x265_main
-    void DoStartCapture();
-    void Capture_n_frames( const std::string &cmd, const ErrType &error ); // run on workthread of Service
-    char* CaptureOneFrame(std::size_t &len);        // inplement at yuv.cpp
+    void DoStartCapture( uint32_t maxFrames );     // the capture thread, 0 until StopCapture()
+    // inplement at yuv.cpp, writes len bytes into dst, *pConvertTime is when RGB->YUV started
+    bool CaptureOneFrame(char *dst, std::size_t len, int64_t *pConvertTime = NULL);
+    // inplement at yuv.cpp, fills the dirty tile fields of a captured slot before it is committed
+    void MarkDirtyTiles( BytesArray &buffer );
+
+    static std::mutex& sourceLock()
+    {
+        static std::mutex           lock;
+        return lock;
+    }
+
+    static std::mutex& instanceLock()
+    {
+        static std::mutex           lock;
+        return lock;
+    }
+
+    // the same session as pInstance, under instanceLock
+    static std::weak_ptr<DesktopStreamingService>& sessionRef()
+    {
+        static std::weak_ptr<DesktopStreamingService>   session;
+        return session;
+    }
+
+    static std::string& defaultCaptureSpec()
+    {
+        static std::string          spec;
+        return spec;
+    }
+
+    static CaptureSourcePtr& fixedSource()
+    {
+        static CaptureSourcePtr     source;
+        return source;
+    }
 
     void Start_FPS_Count()
     {
@@ -227,8 +872,15 @@ protected:
     explicit DesktopStreamingService( ClientInfo *client )
             : Service("DesktopStreaming", client, HANDLER_NO)
             , yuvBuf(YUV_BUFSIZE, YUV_HEADER_LEN)
-            , framesize(0), captureRunning(false)
+            , framesize(0), tileSize(64), captureRunning(false), captureStopping(false), captureClosed(true)
+            , keyframeRequested(false)
+            , traceHeaders(false), checksumType(-1), encoderKbps(0), pendingKbps(0)
     {
+        pClient->dataConn->setSendQueuePolicy( SendQueuePolicy(DEFAULT_SEND_DELAY_MS) );
+        pClient->dataConn->setCongestionHandler( std::bind(&DesktopStreamingService::OnCongestion,
+                    this, std::placeholders::_1) );
+        gBroadcaster.setKeyframeRequester( std::bind(&DesktopStreamingService::RequestKeyframe, this) );
+        gBroadcaster.subscribe( pClient->dataTransport() );
     }
 
     // DesktopStreamingService( const DesktopStreamingService& ) {}
@@ -238,9 +890,26 @@ protected:
 
 private:
     uint32_t                            framesize;
+    uint32_t                            tileSize;
     uint32_t                            yuvSeqNO;
-    bool                                captureRunning;
-    SharedBuffer                        yuvBuf;
+    std::atomic<bool>                   captureRunning;     // cleared to stop the capture thread
+    bool                                captureStopping;    // pCaptureThread is being joined, under captureLock
+    bool                                captureClosed;      // no encoder to capture for, under captureLock
+    std::mutex                          captureLock;
+    std::condition_variable             captureCond;
+    std::atomic<bool>                   keyframeRequested;
+    std::set<FrameTrace*>               frameTraces;        // allocated, not yet written, the encoder thread only
+    std::atomic<bool>                   traceHeaders;
+    std::atomic<int>                    checksumType;       // ChecksumEngine::Type, -1 until negotiated
+    RateController                      rateController;
+    std::atomic<uint32_t>               encoderKbps;        // VBV max rate the encoder was opened with
+    std::atomic<uint32_t>               pendingKbps;        // not yet applied by the encoder thread, 0 if none
+    std::shared_ptr<RecordingTap>       recorder;
+    std::string                         captureSpec;        // "capture <spec>", empty for the default
+    std::string                         captureDescription; // of the running source, under lock
+    CaptureSourcePtr                    pCaptureSource;     // the encoder and capture threads only
+    std::shared_ptr<TileDiffer>         pTileDiffer;        // same, NULL if the format has no dirty tiles
+    SpscFrameRing                       yuvBuf;
     std::unique_ptr<std::thread>        pCaptureThread;
     std::unique_ptr<std::thread>        pEncodeThread;
 
@@ -249,14 +918,146 @@ private:
     // boost::asio::io_service             *fps_io_service;
     // std::unique_ptr<boost::asio::deadline_timer>    fps_timer_counter;
 
-// FOR TEST
+public:
+    // called by YUVInput once the session's format is known, creates the source CaptureOneFrame reads;
+    // implemented at yuv.cpp. false if the source cannot produce this format
+    bool OpenCaptureSource( const CaptureFormat &format );
+};
+
+
+/*
+ * broadcast模式下第一个客户端之后的客户端，只订阅已经在跑的流，不能控制采集和编码。
+ */
+class DesktopStreamingViewer : public Service {
+    static const int            HANDLER_NO = 1;
+    static const uint32_t       DEFAULT_SEND_DELAY_MS = 200;
+public:
+    explicit DesktopStreamingViewer( ClientInfo *client )
+            : Service("DesktopStreaming", client, HANDLER_NO), subscribed(false)
+    {
+        pClient->dataConn->setSendQueuePolicy( SendQueuePolicy(DEFAULT_SEND_DELAY_MS) );
+        pClient->dataConn->setCongestionHandler( std::bind(&DesktopStreamingViewer::OnCongestion,
+                    this, std::placeholders::_1) );
+    }
+
+    ~DesktopStreamingViewer()
+    {
+        Leave();
+        // waits out an OnCongestion running on the strand, none starts after it
+        pClient->dataConn->setCongestionHandler( TcpConnection::CongestionHandlerType() );
+        DBG_STREAM("DesktopStreamingViewer destructor");
+    }
+
+    void terminate() // override
+    {
+        DBG_STREAM("DesktopStreamingViewer::terminate()");
+
+        Leave();
+        Service::terminate();
+    }
+
+public:
+    bool handle_msg( const std::string &msg, TcpConnectionPtr msg_conn )
+    {
+        // the bitrate follows the broadcasting client's connection only
+        if( msg.compare(0, 4, "ack ") == 0 )
+            return true;
+
+        DBG_STREAM("DesktopStreamingViewer received msg from " << ADDR_STR(msg_conn) << ": " << msg);
+
+        // encoding args belong to the first client, a viewer just joins
+        if( msg.find("x265") == 0 ) {
+            if( !subscribed ) {
+                gBroadcaster.subscribe( pClient->dataTransport() );
+                subscribed = true;
+            } // if
+            pClient->sendMsg( "Joined broadcast.\n" );
+            return true;
+        } else if( msg == "quit" ) {
+            terminate();
+            pClient->sendMsg( "Streaming terminated.\n" );
+            return true;
+        } else if( msg == "pause" || msg == "start" || isdigit(msg[0]) ) {
+            pClient->sendMsg( "Capture is controlled by the broadcasting client.\n" );
+            return true;
+        } else if( msg.find("sendbudget") == 0 ) {
+            DesktopStreamingService::SetSendBudget( pClient, msg );
+            return true;
+        } else if( msg == "queuestats" ) {
+            DesktopStreamingService::ReportSendQueue( pClient, pClient->dataTransport()->sendQueueStats() );
+            return true;
+        } else if( msg.find("transport") == 0 ) {
+            DesktopStreamingService::SelectTransport( pClient, msg, subscribed );
+            return true;
+        } else if( msg == "idr" ) {
+            gBroadcaster.requestKeyframe();
+            pClient->sendMsg( "Keyframe requested.\n" );
+            return true;
+        } else if( msg == "latency" ) {
+            DesktopStreamingService::ReportLatency( pClient );
+            return true;
+        } else if( msg.find("checksum") == 0 ) {
+            // the header format belongs to the broadcasting session, tell the viewer what it gets
+            std::shared_ptr<DesktopStreamingService> owner = DesktopStreamingService::sharedInstance();
+            DesktopStreamingService::ReportHeaderFormat( pClient,
+                        owner ? owner->HeaderFormat() : FrameHeaderFormat() );
+            return true;
+        }
+
+        return false;
+    }
+
+    bool handle_error( const boost::system::error_code& error, TcpConnectionPtr conn )
+    {
+        DBG_STREAM("DesktopStreamingViewer::handle_error on connection " << ADDR_STR(conn) << " " << error);
+        return false;
+    }
+
+protected:
+    void Leave()
+    {
+        if( subscribed ) {
+            gBroadcaster.unsubscribe( pClient->dataTransport() );
+            subscribed = false;
+        } // if
+        if( pClient->shmConn ) {
+            pClient->shmConn->shutdown( SHUTDOWN_RW );
+            pClient->shmConn.reset();
+        } // if
+    }
+
+    void OnCongestion( const SendQueueStats &stats )
+    {
+        if( stats.keyframeRequested )
+            gBroadcaster.requestKeyframe();
+        DesktopStreamingService::ReportSendQueue( pClient, stats );
+    }
+
+    int handler_NO() const { return HANDLER_NO; }
+
 private:
-    char* ReadFrameFromFile( std::size_t &len );
+    bool                subscribed;
 };
 
 
+inline
+ServicePtr DesktopStreamingService::CreateInstance( ClientInfo *client )
+{
+    // pInstance.reset( new DesktopStreamingService(client) );
+    // return pInstance;
+    std::unique_lock<std::mutex> lk(instanceLock());
+    if( g_broadcast_mode && pInstance )
+        return std::make_shared<DesktopStreamingViewer>( client );
+
+    std::shared_ptr<DesktopStreamingService> ret(new DesktopStreamingService(client));
+    pInstance = ret.get();
+    sessionRef() = ret;
+    return ret;
+}
+
+
 // declare
-extern BufferMgr<BytesArray>            gServerBufMgr;
+extern BufferPool<BytesArray>           gServerBufMgr;
 
 #endif
 
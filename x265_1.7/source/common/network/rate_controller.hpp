@@ -0,0 +1,165 @@
+#ifndef _RATE_CONTROLLER_HPP_
+#define _RATE_CONTROLLER_HPP_
+
+#include "connection.hpp"
+
+/*
+ * 根据拥塞调整编码码率。输入是客户端定期发回的ack(累计收到的字节数)和数据连接发送队列的状态:
+ *     交付速率 = 两次ack之间客户端收到的字节 / 时间
+ *     在途字节 = 已写入socket的字节 - 客户端已收到的字节 (socket缓冲和网络里排着的)
+ *     排队延迟 = (在途字节 + 发送队列里的字节) / 交付速率，至少是发送队列的等待时间
+ * 排队延迟超过目标或者发送队列丢了帧，码率降到交付速率的85%(排空积压)，之后保持一段时间再判断；
+ * 延迟低于目标的一半并且编码器确实用满了当前码率，每次增加5%(至少MIN_STEP_KBPS)探测更多带宽。
+ * 画面静止时码率用不满，交付速率只反映内容而不是带宽，这时不增也不减。
+ * 输出的目标码率由编码线程在两帧之间通过x265_encoder_reconfig设置给VBV。
+ */
+class RateController : boost::noncopyable {
+public:
+    static const uint32_t       DEFAULT_TARGET_DELAY_MS = 60;
+    static const int64_t        MIN_SAMPLE_US = 50 * 1000;
+    static const int64_t        HOLD_US = 500 * 1000;           // after a change, let it take effect
+    static const uint32_t       MIN_STEP_KBPS = 100;
+
+    struct Stats {
+        uint32_t        targetKbps;
+        uint32_t        deliveryKbps;
+        uint32_t        delayMs;
+        uint64_t        decreases;
+        uint64_t        increases;
+    };
+
+public:
+    RateController() : enabled(false), minKbps(0), maxKbps(0), targetDelayMs(DEFAULT_TARGET_DELAY_MS)
+                     , target(0), haveSample(false), lastAcked(0), lastSampleUs(0), lastDropped(0)
+                     , lastChangeUs(0), deliveryBps(0), delayMs(0), decreases(0), increases(0) {}
+
+    // starts from startKbps, the rate the encoder was opened with
+    void configure( uint32_t _MinKbps, uint32_t _MaxKbps, uint32_t startKbps,
+                    uint32_t _TargetDelayMs = DEFAULT_TARGET_DELAY_MS )
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        minKbps = std::max( 1u, std::min(_MinKbps, _MaxKbps) );
+        maxKbps = std::max( minKbps, _MaxKbps );
+        targetDelayMs = _TargetDelayMs ? _TargetDelayMs : DEFAULT_TARGET_DELAY_MS;
+        target = std::max( minKbps, std::min(maxKbps, startKbps ? startKbps : maxKbps) );
+        haveSample = false;
+        enabled = true;
+    }
+
+    // a new encoder opened at kbps; returns the rate to switch it to when that is out of range, 0 otherwise
+    uint32_t restart( uint32_t kbps )
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        haveSample = false;
+        lastChangeUs = 0;
+        target = kbps;
+        if( !enabled )
+            return 0;
+        target = std::max( minKbps, std::min(maxKbps, kbps) );
+        return target != kbps ? target : 0;
+    }
+
+    void disable()
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        enabled = false;
+    }
+
+    bool isEnabled()
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        return enabled;
+    }
+
+    // one client ack; returns the new target in kbps when it changed, 0 otherwise
+    uint32_t onAck( uint64_t ackedBytes, const SendQueueStats &stats, int64_t nowUs )
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        if( !enabled )
+            return 0;
+
+        if( !haveSample || ackedBytes < lastAcked ) {
+            haveSample = true;
+            lastAcked = ackedBytes;
+            lastSampleUs = nowUs;
+            lastDropped = stats.droppedFrames;
+            return 0;
+        } // if
+        int64_t dt = nowUs - lastSampleUs;
+        if( dt < MIN_SAMPLE_US )
+            return 0;
+
+        double rate = (double)(ackedBytes - lastAcked) * 8e6 / (double)dt;
+        deliveryBps = deliveryBps > 0 ? deliveryBps + (rate - deliveryBps) / 4 : rate;
+        uint64_t inflight = stats.writtenBytes > ackedBytes ? stats.writtenBytes - ackedBytes : 0;
+        double backlog = (double)(inflight + stats.queuedBytes) * 8e3;
+        delayMs = deliveryBps > 0 ? (uint32_t)std::min( backlog / deliveryBps, 1e6 ) : stats.queueDelayMs;
+        delayMs = std::max( delayMs, stats.queueDelayMs );
+        bool dropped = stats.droppedFrames > lastDropped;
+
+        lastAcked = ackedBytes;
+        lastSampleUs = nowUs;
+        lastDropped = stats.droppedFrames;
+
+        if( nowUs - lastChangeUs < HOLD_US )
+            return 0;
+
+        uint32_t delivery = (uint32_t)(deliveryBps / 1000);
+        uint32_t next = target;
+        if( dropped || delayMs > targetDelayMs ) {
+            // drain: send less than the path delivered
+            next = (uint32_t)(std::min(target, delivery) * 0.85);
+            ++decreases;
+        } else if( delayMs < targetDelayMs / 2 && delivery >= target * 7 / 10 ) {
+            next = target + std::max( target / 20, MIN_STEP_KBPS );
+            ++increases;
+        } // if
+        next = std::max( minKbps, std::min(maxKbps, next) );
+        if( next == target )
+            return 0;
+
+        DBG_STREAM( "rate controller: delay " << delayMs << "ms delivery " << delivery << "kbps inflight "
+                    << inflight << " target " << target << " -> " << next << "kbps" );
+        target = next;
+        lastChangeUs = nowUs;
+        return target;
+    }
+
+    Stats stats()
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        Stats ret;
+        ret.targetKbps = target;
+        ret.deliveryKbps = (uint32_t)(deliveryBps / 1000);
+        ret.delayMs = delayMs;
+        ret.decreases = decreases;
+        ret.increases = increases;
+        return ret;
+    }
+
+    std::string report()
+    {
+        Stats st = stats();
+        char buf[200];
+        sprintf( buf, "Rate control %s target=%ukbps delivery=%ukbps delay=%ums decreases=%llu increases=%llu\n",
+                    isEnabled() ? "on" : "off", st.targetKbps, st.deliveryKbps, st.delayMs,
+                    (unsigned long long)st.decreases, (unsigned long long)st.increases );
+        return buf;
+    }
+
+private:
+    std::mutex                  lock;
+    bool                        enabled;
+    uint32_t                    minKbps, maxKbps, targetDelayMs;
+    uint32_t                    target;
+    bool                        haveSample;
+    uint64_t                    lastAcked;
+    int64_t                     lastSampleUs;
+    uint64_t                    lastDropped;
+    int64_t                     lastChangeUs;
+    double                      deliveryBps;        // smoothed
+    uint32_t                    delayMs;
+    uint64_t                    decreases, increases;
+};
+
+#endif
@@ -0,0 +1,428 @@
+#ifndef _RECORDER_HPP_
+#define _RECORDER_HPP_
+
+#include "connection.hpp"
+#include <cstdio>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+ * 录像索引文件(<录像文件>.idx)，方便按时间定位而不用扫描Annex-B起始码。本机字节序:
+ *     header: magic "X265RIDX"(8) + version(4) + entrySize(4) + startTime(8, us, gen_timestamp_us)
+ *     entry:  offset(8, 录像文件中的字节偏移) + time(8, us, 相对startTime) + seqNO(4) + flags(4)
+ * 每个关键帧和参数集(VPS/SPS/PPS)一条。定位时从目标时间之前最近的关键帧开始，先送给解码器
+ * 在它之前最近的参数集。
+ */
+struct RecordingIndexEntry {
+    enum {
+        FLAG_KEYFRAME       = 1,
+        FLAG_PARAM_SETS     = 2,        // a new encoder session starts here
+    };
+
+    uint64_t        offset;
+    int64_t         timeUs;
+    uint32_t        seqNO;
+    uint32_t        flags;
+};
+
+struct RecordingIndexHeader {
+    static const uint32_t       VERSION = 1;
+
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        entrySize;
+    int64_t         startTimeUs;
+};
+
+struct RecordingStats {
+    RecordingStats() : frames(0), bytes(0), keyframes(0), droppedFrames(0), failed(false) {}
+
+    uint64_t        frames, bytes, keyframes;
+    uint64_t        droppedFrames;      // the writer fell more than MAX_QUEUED_BYTES behind
+    bool            failed;             // a write failed, the recording stopped there
+};
+
+/*
+ * 录像，和观看者的数据连接一样订阅FrameBroadcaster，拿到的是同一个引用计数的EncodedFrame，
+ * sendData只是入队，写线程每次取走队列里的所有帧，去掉帧头后把NAL payload拷贝到WRITE_BLOCK大小的
+ * 缓冲，攒满一块才write一次，编码线程从不等磁盘。不满一块的数据最多在内存里停留FLUSH_INTERVAL_MS，
+ * 进程异常退出时最多丢这么久的数据。
+ * 录像文件用O_DIRECT(Windows上FILE_FLAG_NO_BUFFERING)打开，不经过page cache，不会把编码机的内存
+ * 挤成脏页；每次写的偏移和长度都是DIRECT_ALIGN的整数倍。不满一块时末尾补零写出，没写满的最后一个扇区
+ * 留在缓冲里，下次连同后面的数据写到同一位置，关闭时截掉补的零(Annex-B允许trailing zero，异常退出时
+ * 留下的零也不影响解码)。文件系统不支持O_DIRECT(如tmpfs)时照常经过page cache，写法不变。
+ * 磁盘跟不上(队列超过MAX_QUEUED_BYTES)时像发送队列一样丢帧到下一个关键帧并请求IDR，录像仍然可以解码。
+ * frameInfo由上层提供，告诉录像帧头长度、帧序号和采集时间，录像本身不依赖帧头格式。
+ */
+#if defined(_WIN32)
+typedef HANDLE                  RecordingFile;
+#define NO_RECORDING_FILE       INVALID_HANDLE_VALUE
+#else
+typedef int                     RecordingFile;
+#define NO_RECORDING_FILE       (-1)
+#endif
+
+class RecordingTap : public TcpConnection {
+public:
+    static const std::size_t    WRITE_BLOCK = 1024 * 1024;
+    static const std::size_t    DIRECT_ALIGN = 4096;        // a multiple of the logical sector size
+    static const std::size_t    MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+    static const uint32_t       FLUSH_INTERVAL_MS = 200;
+
+    struct FrameInfo {
+        FrameInfo() : headerLen(0), seqNO(0), timeUs(0) {}
+
+        std::size_t     headerLen;      // leading bytes that are not part of the bitstream
+        uint32_t        seqNO;
+        int64_t         timeUs;         // gen_timestamp_us(), preset to the time sendData was called
+    };
+    typedef std::function<void(const GatherBuffer&, FrameInfo&)>    FrameInfoType;
+
+    RecordingTap( boost::asio::io_service &io_service, const FrameInfoType &_FrameInfo = FrameInfoType() )
+            : TcpConnection(io_service, ConnType::DATA), frameInfo(_FrameInfo), file(NO_RECORDING_FILE), indexFile(NULL)
+            , startTimeUs(0), block(NULL), blockLen(0), syncedLen(0), blockTimeUs(0), blockOffset(0)
+            , queuedBytes(0), waitKeyframe(false), stopping(false) {}
+
+    ~RecordingTap()
+    { Stop(); }
+
+    // creates path and path.idx and starts the writer thread, false if either file cannot be created
+    bool open( const std::string &path )
+    {
+        path_ = path;
+        OpenFile( path );
+        indexFile = fopen( (path + ".idx").c_str(), "wb" );
+        if( file == NO_RECORDING_FILE || !indexFile ) {
+            DBG_STREAM( "RecordingTap cannot create " << path << ": " << strerror(errno) );
+            CloseFiles();
+            return false;
+        } // if
+
+        startTimeUs = gen_timestamp_us();
+        RecordingIndexHeader header;
+        memcpy( header.magic, "X265RIDX", 8 );
+        header.version = RecordingIndexHeader::VERSION;
+        header.entrySize = sizeof(RecordingIndexEntry);
+        header.startTimeUs = startTimeUs;
+        fwrite( &header, sizeof(header), 1, indexFile );
+        fflush( indexFile );
+
+        blockMem.reset( new char[WRITE_BLOCK + DIRECT_ALIGN] );
+        block = (char*)(((uintptr_t)blockMem.get() + DIRECT_ALIGN - 1) & ~(uintptr_t)(DIRECT_ALIGN - 1));
+        pWriteThread.reset( new std::thread(std::bind(&RecordingTap::WriteRoutine, this)) );
+        return true;
+    }
+
+    const std::string& path() const { return path_; }
+
+    void sendData( BytesArrayPtr pBuf )
+    {
+        GatherBufferPtr buf = std::make_shared<GatherBuffer>();
+        buf->append( pBuf->ptr(), pBuf->size() );
+        buf->releaser = [pBuf]() {};
+        sendData( buf );
+    }
+
+    // called by FrameBroadcaster::publish on the encoder thread, holding the broadcaster lock
+    void sendData( GatherBufferPtr buf )
+    {
+        Pending item;
+        item.info.timeUs = gen_timestamp_us();
+        if( frameInfo )
+            frameInfo( *buf, item.info );
+        item.buf = buf;
+
+        std::unique_lock<std::mutex> lk(lock);
+        if( stopping || stats.failed )
+            return;
+        if( buf->droppable() ) {
+            if( queuedBytes + buf->size() > MAX_QUEUED_BYTES ) {
+                if( !waitKeyframe ) {
+                    SendQueueStats qs = StatsLocked();
+                    qs.keyframeRequested = true;
+                    // the handler asks the broadcaster for an IDR, not while publish holds its lock
+                    strand_.post( std::bind(&RecordingTap::notifyCongestion, shared_from_this(), qs) );
+                } // if
+                waitKeyframe = true;
+            } else if( waitKeyframe && buf->keyframe() ) {
+                waitKeyframe = false;
+            } // if
+            if( waitKeyframe ) {
+                ++stats.droppedFrames;
+                return;
+            } // if
+        } // if
+        queuedBytes += buf->size();
+        queue.push_back( item );
+        lk.unlock();
+        cond.notify_one();
+    }
+
+    SendQueueStats sendQueueStats()
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        return StatsLocked();
+    }
+
+    RecordingStats recordingStats()
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        return stats;
+    }
+
+    // writes what is queued and closes the files
+    void shutdown( boost::asio::ip::tcp::socket::shutdown_type )
+    { Stop(); }
+
+protected:
+    struct Pending {
+        GatherBufferPtr     buf;
+        FrameInfo           info;
+    };
+
+    SendQueueStats StatsLocked() const
+    {
+        SendQueueStats qs;
+        qs.droppedFrames = stats.droppedFrames;
+        qs.writtenBytes = stats.bytes;
+        qs.queuedFrames = queue.size();
+        qs.queuedBytes = queuedBytes;
+        return qs;
+    }
+
+    void Stop()
+    {
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            stopping = true;
+        }
+        cond.notify_one();
+        if( pWriteThread && pWriteThread->joinable() )
+            pWriteThread->join();
+        pWriteThread.reset();
+        CloseFiles();
+    }
+
+    void CloseFiles()
+    {
+        CloseFile();
+        if( indexFile )
+            fclose( indexFile );
+        indexFile = NULL;
+    }
+
+    // uncached if the file system allows it, the writes are aligned either way
+    void OpenFile( const std::string &path )
+    {
+#if defined(_WIN32)
+        file = CreateFileA( path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, NULL );
+#else
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#if defined(O_DIRECT)
+        file = ::open( path.c_str(), flags | O_DIRECT, 0644 );
+        if( file != NO_RECORDING_FILE || errno != EINVAL )
+            return;
+#endif
+        file = ::open( path.c_str(), flags, 0644 );
+#endif
+    }
+
+    // len and offset are multiples of DIRECT_ALIGN
+    bool WriteAt( const char *p, std::size_t len, uint64_t offset )
+    {
+#if defined(_WIN32)
+        OVERLAPPED ov;
+        memset( &ov, 0, sizeof(ov) );
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD written = 0;
+        return WriteFile( file, p, (DWORD)len, &written, &ov ) && written == len;
+#else
+        ssize_t n;
+        do {
+            n = ::pwrite( file, p, len, (off_t)offset );
+        } while( n < 0 && errno == EINTR );
+        return n == (ssize_t)len;
+#endif
+    }
+
+    // cuts the zeros the last write padded the file with
+    void CloseFile()
+    {
+        if( file == NO_RECORDING_FILE )
+            return;
+        uint64_t size = blockOffset + syncedLen;
+#if defined(_WIN32)
+        LARGE_INTEGER pos;
+        pos.QuadPart = (LONGLONG)size;
+        if( !SetFilePointerEx(file, pos, NULL, FILE_BEGIN) || !SetEndOfFile(file) )
+            DBG_STREAM( "RecordingTap cannot truncate " << path_ );
+        CloseHandle( file );
+#else
+        if( ftruncate(file, (off_t)size) != 0 )
+            DBG_STREAM( "RecordingTap cannot truncate " << path_ << ": " << strerror(errno) );
+        ::close( file );
+#endif
+        file = NO_RECORDING_FILE;
+    }
+
+    void WriteRoutine()
+    {
+        std::deque<Pending> batch;
+        std::unique_lock<std::mutex> lk(lock);
+        while( true ) {
+            cond.wait_for( lk, std::chrono::milliseconds(FLUSH_INTERVAL_MS),
+                            [this]{ return stopping || !queue.empty(); } );
+            if( queue.empty() ) {
+                if( stopping )
+                    break;
+                lk.unlock();
+                Flush();            // idle, put the partial block on disk
+                lk.lock();
+                continue;
+            } // if
+
+            batch.swap( queue );
+            queuedBytes = 0;
+            lk.unlock();
+
+            uint64_t frames = 0, bytes = 0, keyframes = 0;
+            bool ok = true;
+            for( Pending &item : batch ) {
+                std::size_t n = Append( item, keyframes );
+                ok = ok && n != (std::size_t)-1;
+                if( !ok )
+                    break;
+                ++frames;
+                bytes += n;
+            } // for
+            batch.clear();          // the encoder gets its NAL buffers back
+            // a low bitrate takes long to fill a block
+            if( ok && blockLen > syncedLen && gen_timestamp_us() - blockTimeUs >= FLUSH_INTERVAL_MS * 1000 )
+                Flush();
+
+            lk.lock();
+            stats.frames += frames;
+            stats.bytes += bytes;
+            stats.keyframes += keyframes;
+            if( !ok ) {
+                stats.failed = true;
+                queue.clear();
+                queuedBytes = 0;
+                break;
+            } // if
+        } // while
+        lk.unlock();
+        Flush();
+    }
+
+    // copies the bitstream part of one frame into the block, returns its size or -1 if a write failed
+    std::size_t Append( const Pending &item, uint64_t &keyframes )
+    {
+        uint64_t offset = blockOffset + blockLen;
+        if( blockLen == syncedLen )
+            blockTimeUs = gen_timestamp_us();
+        if( !item.buf->droppable() || item.buf->keyframe() ) {
+            RecordingIndexEntry entry;
+            entry.offset = offset;
+            entry.timeUs = item.info.timeUs - startTimeUs;
+            entry.seqNO = item.info.seqNO;
+            entry.flags = item.buf->keyframe() ? RecordingIndexEntry::FLAG_KEYFRAME
+                                                : RecordingIndexEntry::FLAG_PARAM_SETS;
+            pendingIndex.push_back( entry );
+            if( item.buf->keyframe() )
+                ++keyframes;
+        } // if
+
+        std::size_t skip = item.info.headerLen, total = 0;
+        for( const boost::asio::const_buffer &b : item.buf->buffers() ) {
+            const char *p = boost::asio::buffer_cast<const char*>( b );
+            std::size_t n = boost::asio::buffer_size( b );
+            std::size_t s = std::min( skip, n );
+            p += s;
+            n -= s;
+            skip -= s;
+            total += n;
+            while( n ) {
+                std::size_t room = WRITE_BLOCK - blockLen;
+                std::size_t len = std::min( room, n );
+                memcpy( block + blockLen, p, len );
+                blockLen += len;
+                p += len;
+                n -= len;
+                if( blockLen == WRITE_BLOCK && !WriteBlock() )
+                    return (std::size_t)-1;
+            } // while
+        } // for
+        return total;
+    }
+
+    // writes the block at blockOffset, padded with zeros to DIRECT_ALIGN; the partial sector at the end
+    // stays at the front of the block and is written again together with what follows it
+    bool WriteBlock()
+    {
+        std::size_t padded = (blockLen + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+        memset( block + blockLen, 0, padded - blockLen );
+        if( padded && !WriteAt(block, padded, blockOffset) ) {
+            DBG_STREAM( "RecordingTap write to " << path_ << " failed: " << strerror(errno) );
+            return false;
+        } // if
+        uint64_t fileBytes = blockOffset + blockLen;
+        std::size_t whole = blockLen & ~(DIRECT_ALIGN - 1);
+        memmove( block, block + whole, blockLen - whole );
+        blockOffset += whole;
+        blockLen -= whole;
+        syncedLen = blockLen;
+
+        // entries are written once the data they point to is on disk
+        std::size_t n = 0;
+        while( n < pendingIndex.size() && pendingIndex[n].offset < fileBytes )
+            ++n;
+        if( n ) {
+            fwrite( &pendingIndex[0], sizeof(RecordingIndexEntry), n, indexFile );
+            fflush( indexFile );
+            pendingIndex.erase( pendingIndex.begin(), pendingIndex.begin() + n );
+        } // if
+        return true;
+    }
+
+    void Flush()
+    {
+        if( file != NO_RECORDING_FILE && blockLen > syncedLen && !WriteBlock() ) {
+            std::unique_lock<std::mutex> lk(lock);
+            stats.failed = true;
+        } // if
+    }
+
+protected:
+    FrameInfoType                       frameInfo;
+    std::string                         path_;
+    RecordingFile                       file;
+    FILE                                *indexFile;
+    int64_t                             startTimeUs;
+    // writer thread only
+    std::unique_ptr<char[]>             blockMem;
+    char                                *block;             // DIRECT_ALIGN aligned in blockMem, WRITE_BLOCK long
+    std::size_t                         blockLen;
+    std::size_t                         syncedLen;          // leading bytes of block already on disk
+    int64_t                             blockTimeUs;        // when the oldest byte not on disk arrived
+    uint64_t                            blockOffset;        // file offset of block, DIRECT_ALIGN aligned
+    std::vector<RecordingIndexEntry>    pendingIndex;
+    std::unique_ptr<std::thread>        pWriteThread;
+    // shared with sendData
+    std::mutex                          lock;
+    std::condition_variable             cond;
+    std::deque<Pending>                 queue;
+    std::size_t                         queuedBytes;
+    bool                                waitKeyframe;
+    bool                                stopping;
+    RecordingStats                      stats;
+};
+
+#endif
@@ -33,6 +33,8 @@ public:
     // async notify
     virtual bool handle_msg( const std::string &msg, TcpConnectionPtr msg_conn ) = 0;
     virtual bool handle_error( const boost::system::error_code& error, TcpConnectionPtr conn ) = 0;
+    // a line typed on the client console, true if the request handled it locally
+    virtual bool handle_command( const std::string &cmd ) { return false; }
 
     void sendMsg( const std::string &msg )
     { sendMsg(std::make_shared<std::string>(msg)); }
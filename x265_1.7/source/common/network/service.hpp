@@ -27,12 +27,20 @@ struct ClientInfo {
     void sendMsg( const StringPtr &pMsg )
     { msgConn->sendMsg(pMsg); }
 
+    // where data goes out: the data connection, or the shared memory ring a same-host consumer selected
+    TcpConnectionPtr dataTransport() const
+    { return shmConn ? shmConn : dataConn; }
+
     void sendData( const BytesArrayPtr &pBuf )
-    { dataConn->sendData( pBuf ); }
+    { dataTransport()->sendData( pBuf ); }
+
+    void sendData( const GatherBufferPtr &pBuf )
+    { dataTransport()->sendData( pBuf ); }
 
     bool                            msgConnReady;
     bool                            dataConnReady;
     TcpConnectionPtr                msgConn, dataConn;
+    TcpConnectionPtr                shmConn;        // "transport shm", NULL for TCP
     std::map<std::string, ServicePtr>   services;
 };
 
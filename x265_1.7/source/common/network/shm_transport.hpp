@@ -0,0 +1,783 @@
+#ifndef _SHM_TRANSPORT_HPP_
+#define _SHM_TRANSPORT_HPP_
+
+#include "connection.hpp"
+
+#if defined(__linux__)
+#define HAVE_SHM_TRANSPORT      1
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <random>
+#endif
+
+#if defined(HAVE_SHM_TRANSPORT)
+
+/*
+ * 同一台机器上的消费者(录像、转发进程)通过共享内存取编码后的帧，不经过loopback TCP的两次内核拷贝。
+ * memfd里是一个记录环: ShmRingHeader + capacity字节的记录区，每条记录是 ShmRecord + 一次sendData的全部字节
+ * (帧头 + payload，和TCP数据连接上的字节完全一样)，8字节对齐，环尾放不下时写一个PAD记录跳到环头。
+ * 位置都是单调增长的流偏移，writePos之前是完整的记录，tailPos之前的已经被覆盖。
+ * 写端从不等读端: 读得太慢的读端被覆盖之后从最近的关键帧(keyframePos)重新开始，或者跳过
+ * 可丢弃帧直到下一个关键帧。不可丢弃的数据(参数集)另外在sticky区保留一份，新的读端先收到它。
+ * 每个读端一个eventfd，写完一条记录通知所有读端。
+ * 读端通过抽象命名空间的unix socket接入: 发送token，收到槽号和memfd、eventfd两个fd(SCM_RIGHTS)，
+ * 之后这个socket只用来表示存活，任何一端关闭就是断开。
+ */
+struct ShmRingHeader {
+    static const uint32_t   MAGIC = 0x58323635;         // "X265"
+    static const uint32_t   VERSION = 1;
+    static const uint32_t   STICKY_CAPACITY = 64 * 1024;
+    static const uint64_t   NO_KEYFRAME = ~0ull;
+
+    uint32_t                magic, version;
+    uint64_t                capacity;           // record area, right after the page-aligned header
+    std::atomic<uint64_t>   writePos;
+    std::atomic<uint64_t>   tailPos;
+    std::atomic<uint64_t>   keyframePos;        // NO_KEYFRAME until the first one after the parameter sets
+    std::atomic<uint32_t>   stickySeq;          // seqlock, odd while the sticky data is rewritten
+    uint32_t                stickyLen;
+    char                    sticky[STICKY_CAPACITY];
+
+    static std::size_t headerSize()
+    { return (sizeof(ShmRingHeader) + 4095) & ~(std::size_t)4095; }
+};
+
+struct ShmRecord {
+    static const uint32_t   FLAG_PAD = 0x80000000u;     // skip to the start of the ring
+
+    uint32_t                len;                // bytes of data after this header
+    uint32_t                flags;              // GatherBuffer flags
+};
+
+static_assert( ATOMIC_LLONG_LOCK_FREE == 2, "the ring positions are shared between processes" );
+
+#define SHM_ALIGN8(n)       (((n) + 7) & ~(uint64_t)7)
+
+/*
+ * 服务端，写端。作为一个数据连接订阅FrameBroadcaster，sendData直接在调用线程(编码线程)拷贝进环，
+ * GatherBuffer马上释放，NAL buffer更早还给encoder。
+ */
+class ShmConnection : public TcpConnection {
+    typedef boost::asio::local::stream_protocol     LocalProtocol;
+    typedef std::shared_ptr<LocalProtocol::socket>  LocalSocketPtr;
+public:
+    static const std::size_t    DEFAULT_CAPACITY = 32 * 1024 * 1024;
+    static const int            MAX_READERS = 8;
+
+    ShmConnection( boost::asio::io_service &io_service, std::size_t _Capacity = DEFAULT_CAPACITY )
+            : TcpConnection(io_service, ConnType::DATA), ioService(io_service), acceptor(io_service)
+            , capacity(SHM_ALIGN8(_Capacity)), memfd(-1), mapping(NULL), hdr(NULL), data(NULL), token_(0)
+    {
+        for( int i = 0; i < MAX_READERS; ++i )
+            readerFds[i] = -1;
+    }
+
+    ~ShmConnection()
+    {
+        for( int i = 0; i < MAX_READERS; ++i )
+            if( readerFds[i] >= 0 )
+                close( readerFds[i] );
+        if( mapping )
+            munmap( mapping, ShmRingHeader::headerSize() + capacity );
+        if( memfd >= 0 )
+            close( memfd );
+    }
+
+    // creates the ring and starts listening for readers, false if the system refused
+    bool open()
+    {
+        static std::atomic<uint32_t> instances(0);
+        std::size_t size = ShmRingHeader::headerSize() + capacity;
+
+        memfd = memfd_create( "x265-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING );
+        if( memfd < 0 || ftruncate(memfd, size) < 0 )
+            return Fail( "memfd" );
+        // readers map it too, its size must not change under them
+        fcntl( memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW );
+        mapping = (char*)mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0 );
+        if( mapping == MAP_FAILED ) {
+            mapping = NULL;
+            return Fail( "mmap" );
+        } // if
+        hdr = new (mapping) ShmRingHeader;
+        hdr->magic = ShmRingHeader::MAGIC;
+        hdr->version = ShmRingHeader::VERSION;
+        hdr->capacity = capacity;
+        hdr->writePos = 0;
+        hdr->tailPos = 0;
+        hdr->keyframePos = ShmRingHeader::NO_KEYFRAME;
+        hdr->stickySeq = 0;
+        hdr->stickyLen = 0;
+        data = mapping + ShmRingHeader::headerSize();
+
+        char buf[64];
+        sprintf( buf, "x265-shm-%d-%u", (int)getpid(), (unsigned)instances++ );
+        name_ = buf;
+        std::random_device rd;
+        token_ = ((uint64_t)rd() << 32) | rd();
+
+        boost::system::error_code ec;
+        LocalProtocol::endpoint ep( std::string(1, '\0') + name_ );
+        acceptor.open( ep.protocol(), ec );
+        if( !ec ) acceptor.bind( ep, ec );
+        if( !ec ) acceptor.listen( MAX_READERS, ec );
+        if( ec ) {
+            errno = ec.value();
+            return Fail( "listen" );
+        } // if
+        Accept();
+        return true;
+    }
+
+    // the abstract socket name and the token a reader presents, sent to the client in the "transport shm" reply
+    const std::string& name() const { return name_; }
+    uint64_t token() const { return token_; }
+
+    void sendData( BytesArrayPtr pBuf )
+    {
+        GatherBufferPtr buf = std::make_shared<GatherBuffer>();
+        buf->append( pBuf->ptr(), pBuf->size() );
+        buf->releaser = [pBuf]() {};
+        sendData( buf );
+    }
+
+    void sendData( GatherBufferPtr buf )
+    {
+        std::unique_lock<std::mutex> lk(writeLock);
+        if( !hdr )
+            return;
+        if( !buf->droppable() )
+            UpdateSticky( *buf );
+        Publish( *buf );
+    }
+
+    SendQueueStats sendQueueStats()
+    {
+        std::unique_lock<std::mutex> lk(writeLock);
+        return stats;
+    }
+
+    // stops accepting and disconnects every reader
+    void shutdown( boost::asio::ip::tcp::socket::shutdown_type type )
+    {
+        strand_.post( std::bind(&ShmConnection::DoClose,
+                    std::static_pointer_cast<ShmConnection>(shared_from_this())) );
+    }
+
+protected:
+    bool Fail( const char *what )
+    {
+        std::cerr << "shared memory transport: " << what << " failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    void Accept()
+    {
+        LocalSocketPtr sock = std::make_shared<LocalProtocol::socket>( ioService );
+        acceptor.async_accept( *sock, strand_.wrap(std::bind(&ShmConnection::handle_accept,
+                    std::static_pointer_cast<ShmConnection>(shared_from_this()), sock, std::placeholders::_1)) );
+    }
+
+    void handle_accept( LocalSocketPtr sock, const boost::system::error_code &error )
+    {
+        if( error )
+            return;         // closed
+        Accept();
+
+        // the peer is on this host and answers at once, a stuck one only holds this strand for a second
+        int fd = sock->native_handle();
+        struct timeval tv = { 1, 0 };
+        setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+        uint64_t tok = 0;
+        if( recv(fd, &tok, sizeof(tok), MSG_WAITALL) != (ssize_t)sizeof(tok) || tok != token_ ) {
+            DBG_STREAM( "shared memory reader rejected" );
+            return;
+        } // if
+
+        int slot = -1, efd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+        {
+            std::unique_lock<std::mutex> lk(writeLock);
+            for( int i = 0; i < MAX_READERS && slot < 0; ++i )
+                if( readerFds[i] < 0 && !readerSockets[i] )
+                    slot = i;
+        }
+        if( slot < 0 || efd < 0 ) {
+            DBG_STREAM( "no slot for another shared memory reader" );
+            if( efd >= 0 )
+                close( efd );
+            return;
+        } // if
+
+        uint32_t nSlot = (uint32_t)slot;
+        struct iovec iov = { &nSlot, sizeof(nSlot) };
+        char ctrl[CMSG_SPACE(2 * sizeof(int))];
+        memset( ctrl, 0, sizeof(ctrl) );
+        struct msghdr mh;
+        memset( &mh, 0, sizeof(mh) );
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = ctrl;
+        mh.msg_controllen = sizeof(ctrl);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR( &mh );
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN( 2 * sizeof(int) );
+        int fds[2] = { memfd, efd };
+        memcpy( CMSG_DATA(cmsg), fds, sizeof(fds) );
+        if( sendmsg(fd, &mh, MSG_NOSIGNAL) != (ssize_t)sizeof(nSlot) ) {
+            close( efd );
+            return;
+        } // if
+
+        bool needKeyframe;
+        SendQueueStats snapshot;
+        {
+            std::unique_lock<std::mutex> lk(writeLock);
+            readerFds[slot] = efd;
+            readerSockets[slot] = sock;
+            uint64_t kp = hdr->keyframePos.load( std::memory_order_relaxed );
+            needKeyframe = kp == ShmRingHeader::NO_KEYFRAME || kp < hdr->tailPos.load(std::memory_order_relaxed);
+            snapshot = stats;
+        }
+        DBG_STREAM( "shared memory reader attached to slot " << slot );
+
+        // nothing in the ring to start from
+        if( needKeyframe ) {
+            snapshot.keyframeRequested = true;
+            notifyCongestion( snapshot );
+        } // if
+
+        // the reader never writes, a completion means it went away
+        sock->async_read_some( boost::asio::buffer(detachBuf[slot], 1),
+                strand_.wrap(std::bind(&ShmConnection::handle_detach,
+                    std::static_pointer_cast<ShmConnection>(shared_from_this()), slot,
+                    std::placeholders::_1, std::placeholders::_2)) );
+    }
+
+    void handle_detach( int slot, const boost::system::error_code &error, std::size_t )
+    {
+        DBG_STREAM( "shared memory reader in slot " << slot << " detached: " << error );
+        LocalSocketPtr sock;
+        {
+            std::unique_lock<std::mutex> lk(writeLock);
+            if( readerFds[slot] >= 0 )
+                close( readerFds[slot] );
+            readerFds[slot] = -1;
+            sock.swap( readerSockets[slot] );
+        }
+    }
+
+    void DoClose()
+    {
+        boost::system::error_code ignored_ec;
+        acceptor.close( ignored_ec );
+        std::unique_lock<std::mutex> lk(writeLock);
+        for( int i = 0; i < MAX_READERS; ++i )
+            if( readerSockets[i] )
+                readerSockets[i]->close( ignored_ec );      // handle_detach releases the slot
+    }
+
+    void UpdateSticky( const GatherBuffer &buf )
+    {
+        if( buf.size() > ShmRingHeader::STICKY_CAPACITY )
+            return;
+        hdr->stickySeq.fetch_add( 1, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+        char *p = hdr->sticky;
+        for( const boost::asio::const_buffer &b : buf.buffers() ) {
+            std::size_t n = boost::asio::buffer_size( b );
+            memcpy( p, boost::asio::buffer_cast<const char*>(b), n );
+            p += n;
+        } // for
+        hdr->stickyLen = (uint32_t)buf.size();
+        hdr->stickySeq.fetch_add( 1, std::memory_order_release );
+        // a new session, keyframes before its parameter sets are no starting point
+        hdr->keyframePos.store( ShmRingHeader::NO_KEYFRAME, std::memory_order_release );
+    }
+
+    // bytes from pos to the next record
+    uint64_t RecordSpan( uint64_t pos ) const
+    {
+        const ShmRecord *rec = (const ShmRecord*)(data + pos % capacity);
+        if( rec->flags & ShmRecord::FLAG_PAD )
+            return capacity - pos % capacity;
+        return sizeof(ShmRecord) + SHM_ALIGN8(rec->len);
+    }
+
+    void Publish( const GatherBuffer &buf )
+    {
+        uint64_t recLen = sizeof(ShmRecord) + SHM_ALIGN8(buf.size());
+        if( recLen > capacity / 4 ) {
+            ++stats.droppedFrames;
+            stats.droppedBytes += buf.size();
+            return;
+        } // if
+
+        uint64_t pos = hdr->writePos.load( std::memory_order_relaxed );
+        uint64_t pad = capacity - pos % capacity < recLen ? capacity - pos % capacity : 0;
+        uint64_t end = pos + pad + recLen;
+
+        // readers check tailPos after copying, the old records are invalid before they are overwritten
+        uint64_t tail = hdr->tailPos.load( std::memory_order_relaxed );
+        while( tail + capacity < end )
+            tail += RecordSpan( tail );
+        hdr->tailPos.store( tail, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+
+        if( pad ) {
+            ShmRecord *rec = (ShmRecord*)(data + pos % capacity);
+            rec->len = 0;
+            rec->flags = ShmRecord::FLAG_PAD;
+            pos += pad;
+        } // if
+        ShmRecord *rec = (ShmRecord*)(data + pos % capacity);
+        rec->len = (uint32_t)buf.size();
+        rec->flags = buf.flags;
+        char *p = (char*)(rec + 1);
+        for( const boost::asio::const_buffer &b : buf.buffers() ) {
+            std::size_t n = boost::asio::buffer_size( b );
+            memcpy( p, boost::asio::buffer_cast<const char*>(b), n );
+            p += n;
+        } // for
+
+        hdr->writePos.store( end, std::memory_order_release );
+        if( buf.keyframe() )
+            hdr->keyframePos.store( pos, std::memory_order_release );
+        stats.writtenBytes += buf.size();
+
+        uint64_t one = 1;
+        for( int i = 0; i < MAX_READERS; ++i )
+            if( readerFds[i] >= 0 && write(readerFds[i], &one, sizeof(one)) < 0 && errno != EAGAIN )
+                DBG_STREAM( "notify shared memory reader " << i << ": " << strerror(errno) );
+    }
+
+protected:
+    boost::asio::io_service     &ioService;
+    LocalProtocol::acceptor     acceptor;
+    std::size_t                 capacity;
+    int                         memfd;
+    char                        *mapping;
+    ShmRingHeader               *hdr;
+    char                        *data;          // record area
+    std::string                 name_;
+    uint64_t                    token_;
+    // protected by writeLock; the sockets are only touched on strand_
+    std::mutex                  writeLock;
+    int                         readerFds[MAX_READERS];         // eventfd, -1 for a free slot
+    LocalSocketPtr              readerSockets[MAX_READERS];
+    char                        detachBuf[MAX_READERS][1];
+    SendQueueStats              stats;
+};
+
+
+/*
+ * 客户端，读端。实现TcpConnection的recvSome/recvExactly，DesktopStreamingRequest不用改就可以从共享内存解析帧。
+ * 读线程等待eventfd，把记录里的字节拷进请求的buffer，然后在strand上调用handler，和socket读完成一样。
+ * 被覆盖之后从最近的关键帧接着读；如果正在交付的一条记录被覆盖了，它剩下的部分用0补齐，
+ * 客户端的校验或者解码会丢掉这一帧，流仍然按帧对齐。
+ */
+class ShmDataConnection : public TcpConnection {
+public:
+    typedef std::function<void()>       ResyncHandlerType;
+
+    explicit ShmDataConnection( boost::asio::io_service &io_service )
+            : TcpConnection(io_service, ConnType::DATA), sockFd(-1), memfd(-1), eventFd(-1), stopFd(-1)
+            , mapping(NULL), mapSize(0), hdr(NULL), data(NULL), capacity(0), slot(-1), closing(false)
+            , pendingExact(false), readPos(0), recStart(0), recPos(0), recRemain(0), recDelivered(false)
+            , zeroFill(0), stagingPos(0), waitKeyframe(false), lastStickySeq(0), overruns_(0) {}
+
+    ~ShmDataConnection()
+    {
+        Stop();
+        if( mapping )
+            munmap( mapping, mapSize );
+        int *fds[] = { &sockFd, &memfd, &eventFd, &stopFd };
+        for( int *fd : fds )
+            if( *fd >= 0 )
+                close( *fd );
+    }
+
+    // "Shm transport <name> <token>", the server's reply to "transport shm"
+    static bool parseOffer( const std::string &msg, std::string &name, uint64_t &token )
+    {
+        char nameBuf[108];
+        unsigned long long tok = 0;
+        if( sscanf(msg.c_str(), "Shm transport %107s %llx", nameBuf, &tok) != 2 )
+            return false;
+        name = nameBuf;
+        token = tok;
+        return true;
+    }
+
+    // connects to the writer and maps the ring, the object must already be owned by a shared_ptr
+    bool attach( const std::string &name, uint64_t token )
+    {
+        struct sockaddr_un addr;
+        memset( &addr, 0, sizeof(addr) );
+        addr.sun_family = AF_UNIX;
+        if( name.size() + 1 > sizeof(addr.sun_path) )
+            return false;
+        memcpy( addr.sun_path + 1, name.data(), name.size() );      // abstract namespace
+        socklen_t addrLen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + name.size());
+
+        sockFd = ::socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+        if( sockFd < 0 || ::connect(sockFd, (struct sockaddr*)&addr, addrLen) < 0
+                    || send(sockFd, &token, sizeof(token), MSG_NOSIGNAL) != (ssize_t)sizeof(token) )
+            return Fail( "connect" );
+
+        uint32_t nSlot = 0;
+        struct iovec iov = { &nSlot, sizeof(nSlot) };
+        char ctrl[CMSG_SPACE(2 * sizeof(int))];
+        struct msghdr mh;
+        memset( &mh, 0, sizeof(mh) );
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = ctrl;
+        mh.msg_controllen = sizeof(ctrl);
+        if( recvmsg(sockFd, &mh, MSG_WAITALL | MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(nSlot) )
+            return Fail( "handshake" );
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR( &mh );
+        if( !cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)) )
+            return Fail( "handshake" );
+        int fds[2];
+        memcpy( fds, CMSG_DATA(cmsg), sizeof(fds) );
+        memfd = fds[0];
+        eventFd = fds[1];
+        slot = (int)nSlot;
+
+        struct stat st;
+        if( fstat(memfd, &st) < 0 || (std::size_t)st.st_size < ShmRingHeader::headerSize() )
+            return Fail( "fstat" );
+        mapSize = (std::size_t)st.st_size;
+        mapping = (char*)mmap( NULL, mapSize, PROT_READ, MAP_SHARED, memfd, 0 );
+        if( mapping == MAP_FAILED ) {
+            mapping = NULL;
+            return Fail( "mmap" );
+        } // if
+        hdr = (const ShmRingHeader*)mapping;
+        if( hdr->magic != ShmRingHeader::MAGIC || hdr->version != ShmRingHeader::VERSION
+                    || ShmRingHeader::headerSize() + hdr->capacity > mapSize ) {
+            errno = EPROTO;
+            return Fail( "ring header" );
+        } // if
+        data = mapping + ShmRingHeader::headerSize();
+        capacity = hdr->capacity;
+
+        stopFd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+        if( stopFd < 0 )
+            return Fail( "eventfd" );
+        LoadSticky();
+        Resync( false );
+        readThread.reset( new std::thread(std::bind(&ShmDataConnection::ReadRoutine, this,
+                    std::weak_ptr<TcpConnection>(shared_from_this()))) );
+        DBG_STREAM( "attached to shared memory ring " << name << " slot " << slot
+                    << " capacity " << capacity );
+        return true;
+    }
+
+    // called on the read thread when frames were lost and no keyframe is left to restart from
+    void setResyncHandler( const ResyncHandlerType &handler )
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        resyncHandler = handler;
+    }
+
+    uint64_t overruns() const { return overruns_; }
+
+    void recvSome( const MutableBufferPair &bufs, const ReadHandlerType &on_read_handler )
+    { Request( bufs, false, on_read_handler ); }
+
+    void recvExactly( const boost::asio::mutable_buffer &buf, const ReadHandlerType &on_read_handler )
+    {
+        MutableBufferPair bufs = {{ buf, boost::asio::mutable_buffer() }};
+        Request( bufs, true, on_read_handler );
+    }
+
+    void handle_recvSome( const ReadHandlerType &on_read_handler,
+            const boost::system::error_code& error, size_t bytes_transferred )
+    {
+        if( error ) {
+            OnError( error );
+            return;
+        } // if
+
+        on_read_handler( bytes_transferred );
+    }
+
+    void shutdown( boost::asio::ip::tcp::socket::shutdown_type type )
+    { Stop(); }
+
+    bool isConnected() const { return hdr != NULL; }
+
+protected:
+    bool Fail( const char *what )
+    {
+        std::cerr << "shared memory transport: " << what << " failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    void Request( const MutableBufferPair &bufs, bool exact, const ReadHandlerType &handler )
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        pendingBufs = bufs;
+        pendingExact = exact;
+        pendingHandler = handler;
+        lk.unlock();
+        cond.notify_one();
+    }
+
+    void Stop()
+    {
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            closing = true;
+        }
+        cond.notify_one();
+        uint64_t one = 1;
+        if( stopFd >= 0 && write(stopFd, &one, sizeof(one)) < 0 )
+            DBG_STREAM( "stop shared memory reader: " << strerror(errno) );
+        if( readThread && readThread->joinable() ) {
+            if( readThread->get_id() == std::this_thread::get_id() )
+                readThread->detach();
+            else
+                readThread->join();
+        } // if
+    }
+
+    void ReadRoutine( std::weak_ptr<TcpConnection> self )
+    {
+        set_thread_name( "shm-read" );
+
+        for( ;; ) {
+            MutableBufferPair bufs;
+            bool exact;
+            ReadHandlerType handler;
+            {
+                std::unique_lock<std::mutex> lk(lock);
+                while( !closing && !pendingHandler )
+                    cond.wait( lk );
+                if( closing )
+                    return;
+                bufs = pendingBufs;
+                exact = pendingExact;
+                handler.swap( pendingHandler );
+            }
+
+            boost::system::error_code ec;
+            std::size_t n = Fill( bufs, exact, ec );
+            if( !ec && (!n || closing) )
+                return;         // stopped
+            TcpConnectionPtr conn = self.lock();
+            if( !conn )
+                return;
+            strand_.post( std::bind(&TcpConnection::handle_recvSome, conn, handler, ec, n) );
+            if( ec )
+                return;
+        } // for
+    }
+
+    // copies stream bytes into bufs, at least one, all of them if exact; 0 when stopped
+    std::size_t Fill( const MutableBufferPair &bufs, bool exact, boost::system::error_code &ec )
+    {
+        std::size_t got = 0, want = 0;
+        for( const boost::asio::mutable_buffer &b : bufs )
+            want += boost::asio::buffer_size( b );
+
+        while( got < want ) {
+            // the destination of the next byte
+            std::size_t skip = got, idx = 0;
+            while( skip >= boost::asio::buffer_size(bufs[idx]) )
+                skip -= boost::asio::buffer_size( bufs[idx++] );
+            char *dst = boost::asio::buffer_cast<char*>( bufs[idx] ) + skip;
+            std::size_t room = boost::asio::buffer_size( bufs[idx] ) - skip;
+
+            if( zeroFill ) {
+                std::size_t n = (std::size_t)std::min<uint64_t>( room, zeroFill );
+                memset( dst, 0, n );
+                zeroFill -= n;
+                got += n;
+            } else if( stagingPos < staging.size() ) {
+                std::size_t n = std::min( room, staging.size() - stagingPos );
+                memcpy( dst, &staging[stagingPos], n );
+                stagingPos += n;
+                got += n;
+            } else if( recRemain ) {
+                std::size_t n = (std::size_t)std::min<uint64_t>( room, recRemain );
+                memcpy( dst, data + recPos % capacity, n );
+                std::atomic_thread_fence( std::memory_order_acquire );
+                if( hdr->tailPos.load(std::memory_order_relaxed) > recStart ) {
+                    // overwritten while we copied; untouched records are dropped whole
+                    if( recDelivered ) {
+                        memset( dst, 0, n );
+                        zeroFill = recRemain - n;
+                        got += n;
+                    } // if
+                    recRemain = 0;
+                    Resync( true );
+                    continue;
+                } // if
+                recPos += n;
+                recRemain -= n;
+                recDelivered = true;
+                got += n;
+            } else if( !NextRecord() ) {
+                if( got && !exact )
+                    break;
+                if( !Wait(ec) )
+                    return got;
+            } // if
+        } // while
+
+        return got;
+    }
+
+    // positions the next record, false if the writer has not produced one yet
+    bool NextRecord()
+    {
+        for( ;; ) {
+            uint64_t w = hdr->writePos.load( std::memory_order_acquire );
+            if( readPos >= w )
+                return false;
+            if( hdr->tailPos.load(std::memory_order_acquire) > readPos ) {
+                Resync( true );
+                continue;
+            } // if
+            ShmRecord rec = *(const ShmRecord*)(data + readPos % capacity);
+            std::atomic_thread_fence( std::memory_order_acquire );
+            if( hdr->tailPos.load(std::memory_order_relaxed) > readPos ) {
+                Resync( true );
+                continue;
+            } // if
+
+            if( rec.flags & ShmRecord::FLAG_PAD ) {
+                readPos += capacity - readPos % capacity;
+                continue;
+            } // if
+            uint64_t span = sizeof(ShmRecord) + SHM_ALIGN8(rec.len);
+            if( waitKeyframe ) {
+                if( rec.flags & GatherBuffer::FLAG_KEYFRAME ) {
+                    waitKeyframe = false;
+                } else if( rec.flags & GatherBuffer::FLAG_DROPPABLE ) {
+                    readPos += span;
+                    continue;
+                } // if
+            } // if
+            if( !(rec.flags & GatherBuffer::FLAG_DROPPABLE) )
+                lastStickySeq = hdr->stickySeq.load( std::memory_order_acquire );
+
+            recStart = readPos;
+            recPos = readPos + sizeof(ShmRecord);
+            recRemain = rec.len;
+            recDelivered = false;
+            readPos += span;
+            if( recRemain )
+                return true;
+        } // for
+    }
+
+    // restart from the latest keyframe still in the ring, or wait for the next one
+    void Resync( bool overrun )
+    {
+        uint64_t tail = hdr->tailPos.load( std::memory_order_acquire );
+        uint64_t w = hdr->writePos.load( std::memory_order_acquire );
+        uint64_t kp = hdr->keyframePos.load( std::memory_order_acquire );
+        bool haveKeyframe = kp != ShmRingHeader::NO_KEYFRAME && kp >= tail && kp < w;
+        readPos = haveKeyframe ? kp : w;
+        waitKeyframe = !haveKeyframe;
+        if( !overrun )
+            return;
+
+        ++overruns_;
+        DBG_STREAM( "shared memory reader overrun, restarting at " << (haveKeyframe ? "the last keyframe" : "the next keyframe") );
+        // the session changed while we were behind
+        if( hdr->stickySeq.load(std::memory_order_acquire) != lastStickySeq )
+            LoadSticky();
+        if( !haveKeyframe ) {
+            ResyncHandlerType handler;
+            {
+                std::unique_lock<std::mutex> lk(lock);
+                handler = resyncHandler;
+            }
+            if( handler )
+                handler();
+        } // if
+    }
+
+    void LoadSticky()
+    {
+        for( ;; ) {
+            uint32_t seq = hdr->stickySeq.load( std::memory_order_acquire );
+            if( seq & 1 ) {
+                std::this_thread::yield();
+                continue;
+            } // if
+            uint32_t len = std::min( hdr->stickyLen, ShmRingHeader::STICKY_CAPACITY );
+            staging.assign( hdr->sticky, hdr->sticky + len );
+            std::atomic_thread_fence( std::memory_order_acquire );
+            if( hdr->stickySeq.load(std::memory_order_relaxed) == seq ) {
+                lastStickySeq = seq;
+                break;
+            } // if
+        } // for
+        stagingPos = 0;
+    }
+
+    // blocks until the writer signals, false when stopped or the writer went away
+    bool Wait( boost::system::error_code &ec )
+    {
+        struct pollfd pfd[3] = { { eventFd, POLLIN, 0 }, { sockFd, POLLIN, 0 }, { stopFd, POLLIN, 0 } };
+        for( ;; ) {
+            int ret = poll( pfd, 3, -1 );
+            if( ret < 0 && errno == EINTR )
+                continue;
+            if( ret < 0 || pfd[2].revents )
+                return false;
+            if( pfd[1].revents ) {
+                ec = boost::asio::error::eof;
+                return false;
+            } // if
+            uint64_t count;
+            if( read(eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN )
+                DBG_STREAM( "shared memory reader eventfd: " << strerror(errno) );
+            return true;
+        } // for
+    }
+
+protected:
+    int                         sockFd, memfd, eventFd, stopFd;
+    char                        *mapping;
+    std::size_t                 mapSize;
+    const ShmRingHeader         *hdr;
+    const char                  *data;
+    uint64_t                    capacity;
+    int                         slot;
+
+    std::mutex                  lock;
+    std::condition_variable     cond;
+    bool                        closing;
+    MutableBufferPair           pendingBufs;
+    bool                        pendingExact;
+    ReadHandlerType             pendingHandler;
+    ResyncHandlerType           resyncHandler;
+    std::unique_ptr<std::thread>    readThread;
+
+    // the read thread's position in the stream
+    uint64_t                    readPos;        // next record
+    uint64_t                    recStart, recPos, recRemain;    // the record being delivered
+    bool                        recDelivered;   // part of it already went to the caller
+    uint64_t                    zeroFill;       // the rest of an overwritten record
+    std::vector<char>           staging;        // sticky data delivered before the records
+    std::size_t                 stagingPos;
+    bool                        waitKeyframe;
+    uint32_t                    lastStickySeq;
+    std::atomic<uint64_t>       overruns_;
+};
+
+#endif // HAVE_SHM_TRANSPORT
+
+#endif
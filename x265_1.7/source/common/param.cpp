@@ -1358,6 +1358,10 @@ void x265_print_reconfigured_params(x265_param* param, x265_param* reconfiguredP
     TOOLCMP(param->bEnableTSkipFast, reconfiguredParam->bEnableTSkipFast, "tskip-fast=%d", reconfiguredParam->bEnableTSkipFast);
     TOOLCMP(param->bEnableSignHiding, reconfiguredParam->bEnableSignHiding, "signhide=%d", reconfiguredParam->bEnableSignHiding);
     TOOLCMP(param->bEnableFastIntra, reconfiguredParam->bEnableFastIntra, "fast-intra=%d", reconfiguredParam->bEnableFastIntra);
+    TOOLCMP(param->rc.bitrate, reconfiguredParam->rc.bitrate, "bitrate=%d", reconfiguredParam->rc.bitrate);
+    TOOLCMP(param->rc.rfConstant, reconfiguredParam->rc.rfConstant, "crf=%.1f", reconfiguredParam->rc.rfConstant);
+    TOOLCMP(param->rc.vbvMaxBitrate, reconfiguredParam->rc.vbvMaxBitrate, "vbv-maxrate=%d", reconfiguredParam->rc.vbvMaxBitrate);
+    TOOLCMP(param->rc.vbvBufferSize, reconfiguredParam->rc.vbvBufferSize, "vbv-bufsize=%d", reconfiguredParam->rc.vbvBufferSize);
     if (param->bEnableLoopFilter && (param->deblockingFilterBetaOffset != reconfiguredParam->deblockingFilterBetaOffset 
         || param->deblockingFilterTCOffset != reconfiguredParam->deblockingFilterTCOffset))
     {
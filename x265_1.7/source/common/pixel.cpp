@@ -26,6 +26,7 @@
 
 #include "common.h"
 #include "primitives.h"
+#include "colorspace.h"
 #include "x265.h"
 
 #include <cstdlib> // abs()
@@ -944,6 +945,69 @@ void planecopy_sp_c(const uint16_t* src, intptr_t srcStride, pixel* dst, intptr_
     }
 }
 
+void bgra_to_i444_c(const uint8_t* src, intptr_t srcStride, uint8_t* dstY, uint8_t* dstU, uint8_t* dstV, intptr_t yStride, intptr_t cStride, int width, int height)
+{
+    for (int r = 0; r < height; r++)
+    {
+        for (int c = 0; c < width; c++)
+        {
+            const uint8_t* px = src + 4 * c;
+            dstY[c] = bgraToY(px[0], px[1], px[2]);
+            dstU[c] = bgraToU(px[0], px[1], px[2]);
+            dstV[c] = bgraToV(px[0], px[1], px[2]);
+        }
+
+        src += srcStride;
+        dstY += yStride;
+        dstU += cStride;
+        dstV += cStride;
+    }
+}
+
+/* the chroma of each 2x2 block is converted from the rounded average of its four BGRA samples */
+void bgra_to_i420_c(const uint8_t* src, intptr_t srcStride, uint8_t* dstY, uint8_t* dstU, uint8_t* dstV, intptr_t yStride, intptr_t cStride, int width, int height)
+{
+    for (int r = 0; r < height; r += 2)
+    {
+        const uint8_t* src1 = src + srcStride;
+        for (int c = 0; c < width; c += 2)
+        {
+            const uint8_t* p0 = src + 4 * c;
+            const uint8_t* p1 = src1 + 4 * c;
+            dstY[c] = bgraToY(p0[0], p0[1], p0[2]);
+            dstY[c + 1] = bgraToY(p0[4], p0[5], p0[6]);
+            dstY[c + yStride] = bgraToY(p1[0], p1[1], p1[2]);
+            dstY[c + yStride + 1] = bgraToY(p1[4], p1[5], p1[6]);
+
+            int b = (p0[0] + p0[4] + p1[0] + p1[4] + 2) >> 2;
+            int g = (p0[1] + p0[5] + p1[1] + p1[5] + 2) >> 2;
+            int rr = (p0[2] + p0[6] + p1[2] + p1[6] + 2) >> 2;
+            dstU[c >> 1] = bgraToU(b, g, rr);
+            dstV[c >> 1] = bgraToV(b, g, rr);
+        }
+
+        src += 2 * srcStride;
+        dstY += 2 * yStride;
+        dstU += cStride;
+        dstV += cStride;
+    }
+}
+
+void diff_tiles_c(const uint8_t* a, const uint8_t* b, intptr_t stride, int width, int height, int tileWidth, uint8_t* dirty)
+{
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0, t = 0; x < width; x += tileWidth, t++)
+        {
+            if (!dirty[t] && memcmp(a + x, b + x, X265_MIN(tileWidth, width - x)))
+                dirty[t] = 1;
+        }
+
+        a += stride;
+        b += stride;
+    }
+}
+
 /* Estimate the total amount of influence on future quality that could be had if we
  * were to improve the reference samples used to inter predict any given CU. */
 void estimateCUPropagateCost(int* dst, const uint16_t* propagateIn, const int32_t* intraCosts, const uint16_t* interCosts,
@@ -1244,6 +1308,9 @@ void setupPixelPrimitives_c(EncoderPrimitives &p)
 
     p.planecopy_cp = planecopy_cp_c;
     p.planecopy_sp = planecopy_sp_c;
+    p.bgra_to_i444 = bgra_to_i444_c;
+    p.bgra_to_i420 = bgra_to_i420_c;
+    p.diff_tiles = diff_tiles_c;
     p.propagateCost = estimateCUPropagateCost;
 }
 }
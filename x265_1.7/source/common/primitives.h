@@ -176,6 +176,12 @@ typedef void (*saoCuOrgB0_t)(pixel* rec, const int8_t* offsetBo, int ctuWidth, i
 typedef void (*sign_t)(int8_t *dst, const pixel *src1, const pixel *src2, const int endX);
 typedef void (*planecopy_cp_t) (const uint8_t* src, intptr_t srcStride, pixel* dst, intptr_t dstStride, int width, int height, int shift);
 typedef void (*planecopy_sp_t) (const uint16_t* src, intptr_t srcStride, pixel* dst, intptr_t dstStride, int width, int height, int shift, uint16_t mask);
+/* 8bit BGRA (captured desktop) to 8bit planar YUV, full range BT.601. srcStride may be negative to
+ * read a bottom-up bitmap. cStride is the stride of the U and V planes */
+typedef void (*bgra_to_yuv_t) (const uint8_t* src, intptr_t srcStride, uint8_t* dstY, uint8_t* dstU, uint8_t* dstV, intptr_t yStride, intptr_t cStride, int width, int height);
+/* a row of tiles tileWidth bytes wide: sets dirty[i] if the bytes of tile i in the two planes differ in any
+ * of the height rows, tiles already marked are not compared. The rows are read in memory order */
+typedef void (*tile_diff_t) (const uint8_t* a, const uint8_t* b, intptr_t stride, int width, int height, int tileWidth, uint8_t* dirty);
 
 typedef void (*cutree_propagate_cost) (int* dst, const uint16_t* propagateIn, const int32_t* intraCosts, const uint16_t* interCosts, const int32_t* invQscales, const double* fpsFactor, int len);
 
@@ -296,6 +302,10 @@ struct EncoderPrimitives
     planecopy_cp_t        planecopy_cp;
     planecopy_sp_t        planecopy_sp;
 
+    bgra_to_yuv_t         bgra_to_i444;
+    bgra_to_yuv_t         bgra_to_i420;     // chroma of each 2x2 block from its averaged BGRA, even width and height
+    tile_diff_t           diff_tiles;       // dirty tile detection of captured frames
+
     weightp_sp_t          weight_sp;
     weightp_pp_t          weight_pp;
 
@@ -0,0 +1,231 @@
+/*****************************************************************************
+ * Copyright (C) 2015 x265 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at license @ x265.com.
+ *****************************************************************************/
+
+#include "common.h"
+#include "primitives.h"
+#include "colorspace.h"
+#include <immintrin.h> // AVX2
+
+using namespace x265;
+
+namespace {
+
+/* same scheme as colorspace-ssse3.cpp on 8 pixels, the shuffles work within 128bit lanes */
+ALIGN_VAR_32(static const int8_t, tab_shuf_bg[32]) =
+{
+    0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1,
+    0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1
+};
+ALIGN_VAR_32(static const int8_t, tab_shuf_rg[32]) =
+{
+    2, -1, 1, -1, 6, -1, 5, -1, 10, -1, 9, -1, 14, -1, 13, -1,
+    2, -1, 1, -1, 6, -1, 5, -1, 10, -1, 9, -1, 14, -1, 13, -1
+};
+ALIGN_VAR_32(static const int8_t, tab_shuf_rb[32]) =
+{
+    2, -1, 0, -1, 6, -1, 4, -1, 10, -1, 8, -1, 14, -1, 12, -1,
+    2, -1, 0, -1, 6, -1, 4, -1, 10, -1, 8, -1, 14, -1, 12, -1
+};
+ALIGN_VAR_32(static const int8_t, tab_shuf_rr[32]) =
+{
+    2, -1, 2, -1, 6, -1, 6, -1, 10, -1, 10, -1, 14, -1, 14, -1,
+    2, -1, 2, -1, 6, -1, 6, -1, 10, -1, 10, -1, 14, -1, 14, -1
+};
+ALIGN_VAR_32(static const int8_t, tab_shuf_pair[32]) =
+{
+    0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15,
+    0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15
+};
+
+/* int16 coefficient lo for the even lanes and hi for the odd lanes */
+inline __m256i coeffPair(int lo, int hi)
+{
+    return _mm256_set1_epi32((int)(((uint32_t)(uint16_t)hi << 16) | (uint16_t)lo));
+}
+
+struct Coeffs
+{
+    __m256i ybg, yrg, ubg, urb, vbg, vrr;
+    __m256i yround, cround;
+    __m256i bg, rg, rb, rr, pair, ones, two;
+    __m256i order, pairOrder;
+
+    Coeffs()
+    {
+        ybg = coeffPair(BGRA_Y_B, BGRA_Y_G0);
+        yrg = coeffPair(BGRA_Y_R, BGRA_Y_G1);
+        ubg = coeffPair(BGRA_U_B0, BGRA_U_G);
+        urb = coeffPair(BGRA_U_R, BGRA_U_B1);
+        vbg = coeffPair(BGRA_V_B, BGRA_V_G);
+        vrr = coeffPair(BGRA_V_R0, BGRA_V_R1);
+        yround = _mm256_set1_epi32(BGRA_Y_ROUND);
+        cround = _mm256_set1_epi32(BGRA_C_OFFSET);
+        bg = _mm256_load_si256((const __m256i*)tab_shuf_bg);
+        rg = _mm256_load_si256((const __m256i*)tab_shuf_rg);
+        rb = _mm256_load_si256((const __m256i*)tab_shuf_rb);
+        rr = _mm256_load_si256((const __m256i*)tab_shuf_rr);
+        pair = _mm256_load_si256((const __m256i*)tab_shuf_pair);
+        ones = _mm256_set1_epi8(1);
+        two = _mm256_set1_epi16(2);
+        // the packs interleave the 128bit lanes, dwords 0 4 1 5 2 6 3 7 put them back in order
+        order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        pairOrder = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    }
+};
+
+/* 8 BGRA pixels to 8 int32 of each component */
+inline void convert8(const Coeffs& k, __m256i px, __m256i& u, __m256i& v)
+{
+    __m256i bg = _mm256_shuffle_epi8(px, k.bg);
+    u = _mm256_add_epi32(_mm256_madd_epi16(bg, k.ubg), _mm256_madd_epi16(_mm256_shuffle_epi8(px, k.rb), k.urb));
+    v = _mm256_add_epi32(_mm256_madd_epi16(bg, k.vbg), _mm256_madd_epi16(_mm256_shuffle_epi8(px, k.rr), k.vrr));
+    u = _mm256_srai_epi32(_mm256_add_epi32(u, k.cround), 16);
+    v = _mm256_srai_epi32(_mm256_add_epi32(v, k.cround), 16);
+}
+
+inline __m256i luma8(const Coeffs& k, __m256i px)
+{
+    __m256i y = _mm256_add_epi32(_mm256_madd_epi16(_mm256_shuffle_epi8(px, k.bg), k.ybg),
+                                 _mm256_madd_epi16(_mm256_shuffle_epi8(px, k.rg), k.yrg));
+    return _mm256_srai_epi32(_mm256_add_epi32(y, k.yround), 16);
+}
+
+/* 32 int32 in four registers to 32 bytes in pixel order */
+inline __m256i pack32(const Coeffs& k, __m256i a, __m256i b, __m256i c, __m256i d)
+{
+    __m256i x = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+    return _mm256_permutevar8x32_epi32(x, k.order);
+}
+
+/* horizontal pair sums of 8 BGRA pixels, int16 B G R A of pixels 0+1, 2+3, ... */
+inline __m256i pairSums(const Coeffs& k, __m256i px)
+{
+    return _mm256_maddubs_epi16(_mm256_shuffle_epi8(px, k.pair), k.ones);
+}
+
+/* the rounded average of the 2x2 blocks of 16 pixels, a0 a1 of the upper row and b0 b1 below them, 8 BGRA pixels */
+inline __m256i average2x2(const Coeffs& k, __m256i a0, __m256i a1, __m256i b0, __m256i b1)
+{
+    __m256i a = _mm256_add_epi16(pairSums(k, a0), pairSums(k, b0));
+    __m256i b = _mm256_add_epi16(pairSums(k, a1), pairSums(k, b1));
+    a = _mm256_srli_epi16(_mm256_add_epi16(a, k.two), 2);
+    b = _mm256_srli_epi16(_mm256_add_epi16(b, k.two), 2);
+    return _mm256_permutevar8x32_epi32(_mm256_packus_epi16(a, b), k.pairOrder);
+}
+
+void bgra_to_i444(const uint8_t* src, intptr_t srcStride, uint8_t* dstY, uint8_t* dstU, uint8_t* dstV, intptr_t yStride, intptr_t cStride, int width, int height)
+{
+    const Coeffs k;
+
+    for (int r = 0; r < height; r++)
+    {
+        int c = 0;
+        for (; c + 32 <= width; c += 32)
+        {
+            const __m256i* s = (const __m256i*)(src + 4 * c);
+            __m256i px[4], u[4], v[4];
+            for (int i = 0; i < 4; i++)
+            {
+                px[i] = _mm256_loadu_si256(s + i);
+                convert8(k, px[i], u[i], v[i]);
+            }
+            _mm256_storeu_si256((__m256i*)(dstY + c), pack32(k, luma8(k, px[0]), luma8(k, px[1]), luma8(k, px[2]), luma8(k, px[3])));
+            _mm256_storeu_si256((__m256i*)(dstU + c), pack32(k, u[0], u[1], u[2], u[3]));
+            _mm256_storeu_si256((__m256i*)(dstV + c), pack32(k, v[0], v[1], v[2], v[3]));
+        }
+
+        for (; c < width; c++)
+        {
+            const uint8_t* p = src + 4 * c;
+            dstY[c] = bgraToY(p[0], p[1], p[2]);
+            dstU[c] = bgraToU(p[0], p[1], p[2]);
+            dstV[c] = bgraToV(p[0], p[1], p[2]);
+        }
+
+        src += srcStride;
+        dstY += yStride;
+        dstU += cStride;
+        dstV += cStride;
+    }
+}
+
+void bgra_to_i420(const uint8_t* src, intptr_t srcStride, uint8_t* dstY, uint8_t* dstU, uint8_t* dstV, intptr_t yStride, intptr_t cStride, int width, int height)
+{
+    const Coeffs k;
+
+    for (int r = 0; r < height; r += 2)
+    {
+        const uint8_t* src1 = src + srcStride;
+        uint8_t* dstY1 = dstY + yStride;
+
+        /* one pass: 32 pixels of both rows are loaded once for their 64 luma and 16 chroma samples */
+        int c = 0;
+        for (; c + 32 <= width; c += 32)
+        {
+            const __m256i* s0 = (const __m256i*)(src + 4 * c);
+            const __m256i* s1 = (const __m256i*)(src1 + 4 * c);
+            __m256i y0[2], y1[2], u[2], v[2];
+            for (int i = 0; i < 2; i++)
+            {
+                __m256i a0 = _mm256_loadu_si256(s0 + 2 * i), a1 = _mm256_loadu_si256(s0 + 2 * i + 1);
+                __m256i b0 = _mm256_loadu_si256(s1 + 2 * i), b1 = _mm256_loadu_si256(s1 + 2 * i + 1);
+                y0[i] = _mm256_packs_epi32(luma8(k, a0), luma8(k, a1));
+                y1[i] = _mm256_packs_epi32(luma8(k, b0), luma8(k, b1));
+                convert8(k, average2x2(k, a0, a1, b0, b1), u[i], v[i]);
+            }
+            _mm256_storeu_si256((__m256i*)(dstY + c), _mm256_permutevar8x32_epi32(_mm256_packus_epi16(y0[0], y0[1]), k.order));
+            _mm256_storeu_si256((__m256i*)(dstY1 + c), _mm256_permutevar8x32_epi32(_mm256_packus_epi16(y1[0], y1[1]), k.order));
+            /* 16 U then 16 V */
+            __m256i uv = pack32(k, u[0], u[1], v[0], v[1]);
+            _mm_storeu_si128((__m128i*)(dstU + (c >> 1)), _mm256_castsi256_si128(uv));
+            _mm_storeu_si128((__m128i*)(dstV + (c >> 1)), _mm256_extracti128_si256(uv, 1));
+        }
+
+        for (; c < width; c += 2)
+        {
+            const uint8_t* p0 = src + 4 * c;
+            const uint8_t* p1 = src1 + 4 * c;
+            dstY[c] = bgraToY(p0[0], p0[1], p0[2]);
+            dstY[c + 1] = bgraToY(p0[4], p0[5], p0[6]);
+            dstY1[c] = bgraToY(p1[0], p1[1], p1[2]);
+            dstY1[c + 1] = bgraToY(p1[4], p1[5], p1[6]);
+            int b = (p0[0] + p0[4] + p1[0] + p1[4] + 2) >> 2;
+            int g = (p0[1] + p0[5] + p1[1] + p1[5] + 2) >> 2;
+            int rr = (p0[2] + p0[6] + p1[2] + p1[6] + 2) >> 2;
+            dstU[c >> 1] = bgraToU(b, g, rr);
+            dstV[c >> 1] = bgraToV(b, g, rr);
+        }
+
+        src += 2 * srcStride;
+        dstY += 2 * yStride;
+        dstU += cStride;
+        dstV += cStride;
+    }
+}
+}
+
+namespace x265 {
+void setupIntrinsicColorspace_avx2(EncoderPrimitives& p)
+{
+    p.bgra_to_i444 = bgra_to_i444;
+    p.bgra_to_i420 = bgra_to_i420;
+}
+}
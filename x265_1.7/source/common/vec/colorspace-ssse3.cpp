@@ -0,0 +1,200 @@
+/*****************************************************************************
+ * Copyright (C) 2015 x265 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at license @ x265.com.
+ *****************************************************************************/
+
+#include "common.h"
+#include "primitives.h"
+#include "colorspace.h"
+#include <xmmintrin.h> // SSE
+#include <pmmintrin.h> // SSE3
+#include <tmmintrin.h> // SSSE3
+
+using namespace x265;
+
+namespace {
+
+/* Each component is two pmaddwd of zero extended samples, one on (B,G) pairs and one on
+ * (R,X) pairs where X is chosen so every coefficient fits in int16, see colorspace.h */
+ALIGN_VAR_16(static const int8_t, tab_shuf_bg[16]) = { 0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1 };
+ALIGN_VAR_16(static const int8_t, tab_shuf_rg[16]) = { 2, -1, 1, -1, 6, -1, 5, -1, 10, -1, 9, -1, 14, -1, 13, -1 };
+ALIGN_VAR_16(static const int8_t, tab_shuf_rb[16]) = { 2, -1, 0, -1, 6, -1, 4, -1, 10, -1, 8, -1, 14, -1, 12, -1 };
+ALIGN_VAR_16(static const int8_t, tab_shuf_rr[16]) = { 2, -1, 2, -1, 6, -1, 6, -1, 10, -1, 10, -1, 14, -1, 14, -1 };
+// horizontal neighbours next to each other for pmaddubsw: B0 B1 G0 G1 R0 R1 A0 A1 ...
+ALIGN_VAR_16(static const int8_t, tab_shuf_pair[16]) = { 0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15 };
+
+struct Coeffs
+{
+    __m128i ybg, yrg, ubg, urb, vbg, vrr;
+    __m128i yround, cround;
+    __m128i bg, rg, rb, rr, pair, ones, two;
+
+    Coeffs()
+    {
+        ybg = _mm_set_epi16(BGRA_Y_G0, BGRA_Y_B, BGRA_Y_G0, BGRA_Y_B, BGRA_Y_G0, BGRA_Y_B, BGRA_Y_G0, BGRA_Y_B);
+        yrg = _mm_set_epi16(BGRA_Y_G1, BGRA_Y_R, BGRA_Y_G1, BGRA_Y_R, BGRA_Y_G1, BGRA_Y_R, BGRA_Y_G1, BGRA_Y_R);
+        ubg = _mm_set_epi16(BGRA_U_G, BGRA_U_B0, BGRA_U_G, BGRA_U_B0, BGRA_U_G, BGRA_U_B0, BGRA_U_G, BGRA_U_B0);
+        urb = _mm_set_epi16(BGRA_U_B1, BGRA_U_R, BGRA_U_B1, BGRA_U_R, BGRA_U_B1, BGRA_U_R, BGRA_U_B1, BGRA_U_R);
+        vbg = _mm_set_epi16(BGRA_V_G, BGRA_V_B, BGRA_V_G, BGRA_V_B, BGRA_V_G, BGRA_V_B, BGRA_V_G, BGRA_V_B);
+        vrr = _mm_set_epi16(BGRA_V_R1, BGRA_V_R0, BGRA_V_R1, BGRA_V_R0, BGRA_V_R1, BGRA_V_R0, BGRA_V_R1, BGRA_V_R0);
+        yround = _mm_set1_epi32(BGRA_Y_ROUND);
+        cround = _mm_set1_epi32(BGRA_C_OFFSET);
+        bg = _mm_load_si128((const __m128i*)tab_shuf_bg);
+        rg = _mm_load_si128((const __m128i*)tab_shuf_rg);
+        rb = _mm_load_si128((const __m128i*)tab_shuf_rb);
+        rr = _mm_load_si128((const __m128i*)tab_shuf_rr);
+        pair = _mm_load_si128((const __m128i*)tab_shuf_pair);
+        ones = _mm_set1_epi8(1);
+        two = _mm_set1_epi16(2);
+    }
+};
+
+/* 4 BGRA pixels to 4 int32 of each chroma component */
+inline void convert4(const Coeffs& k, __m128i px, __m128i& u, __m128i& v)
+{
+    __m128i bg = _mm_shuffle_epi8(px, k.bg);
+    u = _mm_add_epi32(_mm_madd_epi16(bg, k.ubg), _mm_madd_epi16(_mm_shuffle_epi8(px, k.rb), k.urb));
+    v = _mm_add_epi32(_mm_madd_epi16(bg, k.vbg), _mm_madd_epi16(_mm_shuffle_epi8(px, k.rr), k.vrr));
+    u = _mm_srai_epi32(_mm_add_epi32(u, k.cround), 16);
+    v = _mm_srai_epi32(_mm_add_epi32(v, k.cround), 16);
+}
+
+inline __m128i luma4(const Coeffs& k, __m128i px)
+{
+    __m128i y = _mm_add_epi32(_mm_madd_epi16(_mm_shuffle_epi8(px, k.bg), k.ybg),
+                              _mm_madd_epi16(_mm_shuffle_epi8(px, k.rg), k.yrg));
+    return _mm_srai_epi32(_mm_add_epi32(y, k.yround), 16);
+}
+
+/* 16 int32 in four registers to 16 bytes */
+inline __m128i pack16(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+    return _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+}
+
+/* the rounded average of the 2x2 blocks of 8 pixels of two rows, 4 BGRA pixels */
+inline __m128i average2x2(const Coeffs& k, const uint8_t* row0, const uint8_t* row1)
+{
+    __m128i a = _mm_add_epi16(_mm_maddubs_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)row0), k.pair), k.ones),
+                              _mm_maddubs_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)row1), k.pair), k.ones));
+    __m128i b = _mm_add_epi16(_mm_maddubs_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(row0 + 16)), k.pair), k.ones),
+                              _mm_maddubs_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(row1 + 16)), k.pair), k.ones));
+    a = _mm_srli_epi16(_mm_add_epi16(a, k.two), 2);
+    b = _mm_srli_epi16(_mm_add_epi16(b, k.two), 2);
+    return _mm_packus_epi16(a, b);
+}
+
+void lumaRow(const Coeffs& k, const uint8_t* src, uint8_t* dstY, int width)
+{
+    int c = 0;
+    for (; c + 16 <= width; c += 16)
+    {
+        const __m128i* s = (const __m128i*)(src + 4 * c);
+        __m128i y = pack16(luma4(k, _mm_loadu_si128(s)), luma4(k, _mm_loadu_si128(s + 1)),
+                           luma4(k, _mm_loadu_si128(s + 2)), luma4(k, _mm_loadu_si128(s + 3)));
+        _mm_storeu_si128((__m128i*)(dstY + c), y);
+    }
+
+    for (; c < width; c++)
+        dstY[c] = bgraToY(src[4 * c], src[4 * c + 1], src[4 * c + 2]);
+}
+
+void bgra_to_i444(const uint8_t* src, intptr_t srcStride, uint8_t* dstY, uint8_t* dstU, uint8_t* dstV, intptr_t yStride, intptr_t cStride, int width, int height)
+{
+    const Coeffs k;
+
+    for (int r = 0; r < height; r++)
+    {
+        int c = 0;
+        for (; c + 16 <= width; c += 16)
+        {
+            const __m128i* s = (const __m128i*)(src + 4 * c);
+            __m128i px[4], u[4], v[4];
+            for (int i = 0; i < 4; i++)
+            {
+                px[i] = _mm_loadu_si128(s + i);
+                convert4(k, px[i], u[i], v[i]);
+            }
+            _mm_storeu_si128((__m128i*)(dstY + c), pack16(luma4(k, px[0]), luma4(k, px[1]), luma4(k, px[2]), luma4(k, px[3])));
+            _mm_storeu_si128((__m128i*)(dstU + c), pack16(u[0], u[1], u[2], u[3]));
+            _mm_storeu_si128((__m128i*)(dstV + c), pack16(v[0], v[1], v[2], v[3]));
+        }
+
+        for (; c < width; c++)
+        {
+            const uint8_t* p = src + 4 * c;
+            dstY[c] = bgraToY(p[0], p[1], p[2]);
+            dstU[c] = bgraToU(p[0], p[1], p[2]);
+            dstV[c] = bgraToV(p[0], p[1], p[2]);
+        }
+
+        src += srcStride;
+        dstY += yStride;
+        dstU += cStride;
+        dstV += cStride;
+    }
+}
+
+void bgra_to_i420(const uint8_t* src, intptr_t srcStride, uint8_t* dstY, uint8_t* dstU, uint8_t* dstV, intptr_t yStride, intptr_t cStride, int width, int height)
+{
+    const Coeffs k;
+
+    for (int r = 0; r < height; r += 2)
+    {
+        const uint8_t* src1 = src + srcStride;
+        lumaRow(k, src, dstY, width);
+        lumaRow(k, src1, dstY + yStride, width);
+
+        /* 32 pixels of both rows give 16 chroma samples */
+        int c = 0;
+        for (; c + 32 <= width; c += 32)
+        {
+            __m128i u[4], v[4];
+            for (int i = 0; i < 4; i++)
+                convert4(k, average2x2(k, src + 4 * (c + 8 * i), src1 + 4 * (c + 8 * i)), u[i], v[i]);
+            _mm_storeu_si128((__m128i*)(dstU + (c >> 1)), pack16(u[0], u[1], u[2], u[3]));
+            _mm_storeu_si128((__m128i*)(dstV + (c >> 1)), pack16(v[0], v[1], v[2], v[3]));
+        }
+
+        for (; c < width; c += 2)
+        {
+            const uint8_t* p0 = src + 4 * c;
+            const uint8_t* p1 = src1 + 4 * c;
+            int b = (p0[0] + p0[4] + p1[0] + p1[4] + 2) >> 2;
+            int g = (p0[1] + p0[5] + p1[1] + p1[5] + 2) >> 2;
+            int rr = (p0[2] + p0[6] + p1[2] + p1[6] + 2) >> 2;
+            dstU[c >> 1] = bgraToU(b, g, rr);
+            dstV[c >> 1] = bgraToV(b, g, rr);
+        }
+
+        src += 2 * srcStride;
+        dstY += 2 * yStride;
+        dstU += cStride;
+        dstV += cStride;
+    }
+}
+}
+
+namespace x265 {
+void setupIntrinsicColorspace_ssse3(EncoderPrimitives& p)
+{
+    p.bgra_to_i444 = bgra_to_i444;
+    p.bgra_to_i420 = bgra_to_i420;
+}
+}
@@ -0,0 +1,78 @@
+/*****************************************************************************
+ * Copyright (C) 2015 x265 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at license @ x265.com.
+ *****************************************************************************/
+
+#include "common.h"
+#include "primitives.h"
+#include <immintrin.h> // AVX2
+
+using namespace x265;
+
+namespace {
+/* same as tilediff-sse3.cpp with 32 byte loads, a row of a 64 pixel luma tile is two of them */
+inline int differs(const uint8_t* a, const uint8_t* b, int n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    int x = 0;
+    for (; x + 64 <= n; x += 64)
+    {
+        __m256i d0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + x)), _mm256_loadu_si256((const __m256i*)(b + x)));
+        __m256i d1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + x + 32)), _mm256_loadu_si256((const __m256i*)(b + x + 32)));
+        acc = _mm256_or_si256(acc, _mm256_or_si256(d0, d1));
+    }
+
+    if (x + 32 <= n)
+    {
+        acc = _mm256_or_si256(acc, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + x)), _mm256_loadu_si256((const __m256i*)(b + x))));
+        x += 32;
+    }
+
+    if (!_mm256_testz_si256(acc, acc))
+        return 1;
+
+    for (; x < n; x++)
+        if (a[x] != b[x])
+            return 1;
+
+    return 0;
+}
+
+void diff_tiles(const uint8_t* a, const uint8_t* b, intptr_t stride, int width, int height, int tileWidth, uint8_t* dirty)
+{
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0, t = 0; x < width; x += tileWidth, t++)
+        {
+            if (!dirty[t] && differs(a + x, b + x, X265_MIN(tileWidth, width - x)))
+                dirty[t] = 1;
+        }
+
+        a += stride;
+        b += stride;
+    }
+}
+}
+
+namespace x265 {
+void setupIntrinsicTileDiff_avx2(EncoderPrimitives& p)
+{
+    p.diff_tiles = diff_tiles;
+}
+}
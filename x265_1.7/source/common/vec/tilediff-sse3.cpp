@@ -0,0 +1,81 @@
+/*****************************************************************************
+ * Copyright (C) 2015 x265 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at license @ x265.com.
+ *****************************************************************************/
+
+#include "common.h"
+#include "primitives.h"
+#include <xmmintrin.h> // SSE
+#include <pmmintrin.h> // SSE3
+
+using namespace x265;
+
+namespace {
+/* the differences of a tile's bytes in a row are OR-ed together and tested once. Only SSE2
+ * instructions are used, but like dct-sse3.cpp this is the SSE3 tier of the intrinsic primitives:
+ * built with -msse3, guarded by HAVE_SSE3 and set up for X265_CPU_SSE3 */
+inline int differs(const uint8_t* a, const uint8_t* b, int n)
+{
+    __m128i acc = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 32 <= n; x += 32)
+    {
+        __m128i d0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + x)), _mm_loadu_si128((const __m128i*)(b + x)));
+        __m128i d1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + x + 16)), _mm_loadu_si128((const __m128i*)(b + x + 16)));
+        acc = _mm_or_si128(acc, _mm_or_si128(d0, d1));
+    }
+
+    if (x + 16 <= n)
+    {
+        acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + x)), _mm_loadu_si128((const __m128i*)(b + x))));
+        x += 16;
+    }
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+        return 1;
+
+    for (; x < n; x++)
+        if (a[x] != b[x])
+            return 1;
+
+    return 0;
+}
+
+void diff_tiles(const uint8_t* a, const uint8_t* b, intptr_t stride, int width, int height, int tileWidth, uint8_t* dirty)
+{
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0, t = 0; x < width; x += tileWidth, t++)
+        {
+            if (!dirty[t] && differs(a + x, b + x, X265_MIN(tileWidth, width - x)))
+                dirty[t] = 1;
+        }
+
+        a += stride;
+        b += stride;
+    }
+}
+}
+
+namespace x265 {
+void setupIntrinsicTileDiff_sse3(EncoderPrimitives& p)
+{
+    p.diff_tiles = diff_tiles;
+}
+}
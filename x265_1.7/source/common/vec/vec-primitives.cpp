@@ -32,12 +32,13 @@
 #define HAVE_SSE4
 #define HAVE_AVX2
 #elif defined(__GNUC__)
-#if __clang__ || (__GNUC__ >= 4 && __GNUC_MINOR__ >= 3)
+/* GCC 5 and later have every intrinsic header GCC 4.3/4.7 introduced */
+#if __clang__ || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 3)
 #define HAVE_SSE3
 #define HAVE_SSSE3
 #define HAVE_SSE4
 #endif
-#if __clang__ || (__GNUC__ >= 4 && __GNUC_MINOR__ >= 7)
+#if __clang__ || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7)
 #define HAVE_AVX2
 #endif
 #elif defined(_MSC_VER)
@@ -56,6 +57,10 @@ namespace x265 {
 void setupIntrinsicDCT_sse3(EncoderPrimitives&);
 void setupIntrinsicDCT_ssse3(EncoderPrimitives&);
 void setupIntrinsicDCT_sse41(EncoderPrimitives&);
+void setupIntrinsicColorspace_ssse3(EncoderPrimitives&);
+void setupIntrinsicColorspace_avx2(EncoderPrimitives&);
+void setupIntrinsicTileDiff_sse3(EncoderPrimitives&);
+void setupIntrinsicTileDiff_avx2(EncoderPrimitives&);
 
 /* Use primitives for the best available vector architecture */
 void setupInstrinsicPrimitives(EncoderPrimitives &p, int cpuMask)
@@ -64,12 +69,14 @@ void setupInstrinsicPrimitives(EncoderPrimitives &p, int cpuMask)
     if (cpuMask & X265_CPU_SSE3)
     {
         setupIntrinsicDCT_sse3(p);
+        setupIntrinsicTileDiff_sse3(p);
     }
 #endif
 #ifdef HAVE_SSSE3
     if (cpuMask & X265_CPU_SSSE3)
     {
         setupIntrinsicDCT_ssse3(p);
+        setupIntrinsicColorspace_ssse3(p);
     }
 #endif
 #ifdef HAVE_SSE4
@@ -77,6 +84,13 @@ void setupInstrinsicPrimitives(EncoderPrimitives &p, int cpuMask)
     {
         setupIntrinsicDCT_sse41(p);
     }
+#endif
+#ifdef HAVE_AVX2
+    if (cpuMask & X265_CPU_AVX2)
+    {
+        setupIntrinsicColorspace_avx2(p);
+        setupIntrinsicTileDiff_avx2(p);
+    }
 #endif
     (void)p;
     (void)cpuMask;
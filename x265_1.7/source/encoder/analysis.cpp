@@ -200,6 +200,74 @@ Mode& Analysis::compressCTU(CUData& ctu, Frame& frame, const CUGeom& cuGeom, con
     return *m_modeDepth[0].bestMode;
 }
 
+Mode* Analysis::compressStaticCTU(CUData& ctu, Frame& frame, const CUGeom& cuGeom, const Entropy& initialContext)
+{
+    /* CTUs cut by the picture edge have no 2Nx2N CU to skip */
+    if (cuGeom.flags & CUGeom::SPLIT_MANDATORY)
+        return NULL;
+
+    m_slice = ctu.m_slice;
+    m_frame = &frame;
+
+    X265_CHECK(m_slice->m_sliceType != I_SLICE, "static CTU in I slice\n");
+
+    int qp = setLambdaFromQP(ctu, m_slice->m_pps->bUseDQP ? calculateQpforCuSize(ctu, cuGeom) : m_slice->m_sliceQp);
+    ctu.setQPSubParts((int8_t)qp, 0, 0);
+
+    ModeDepth& md = m_modeDepth[0];
+    Mode& skip = md.pred[PRED_SKIP];
+    skip.initCosts();
+    skip.cu.initSubCU(ctu, cuGeom, qp);
+    skip.cu.setPartSizeSubParts(SIZE_2Nx2N);
+    skip.cu.setPredModeSubParts(MODE_INTER);
+    skip.cu.m_mergeFlag[0] = true;
+
+    /* the skip must predict from L0 reference 0 with a zero vector, if no merge
+     * candidate offers that the CTU goes through the normal analysis */
+    MVField candMvField[MRG_MAX_NUM_CANDS][2];
+    uint8_t candDir[MRG_MAX_NUM_CANDS];
+    uint32_t numMergeCand = skip.cu.getInterMergeCandidates(0, 0, candMvField, candDir);
+    uint32_t cand = 0;
+    while (cand < numMergeCand && (candDir[cand] != 1 || candMvField[cand][0].refIdx || candMvField[cand][0].mv.word))
+        cand++;
+    if (cand == numMergeCand)
+        return NULL;
+
+    ProfileCUScope(ctu, totalCTUTime, totalCTUs);
+
+    skip.cu.m_mvpIdx[0][0] = (uint8_t)cand; // merge candidate ID is stored in L0 MVP idx
+    skip.cu.setPUInterDir(candDir[cand], 0, 0);
+    skip.cu.setPUMv(0, candMvField[cand][0].mv, 0, 0);
+    skip.cu.setPUMv(1, candMvField[cand][1].mv, 0, 0);
+    skip.cu.setPURefIdx(0, (int8_t)candMvField[cand][0].refIdx, 0, 0);
+    skip.cu.setPURefIdx(1, (int8_t)candMvField[cand][1].refIdx, 0, 0);
+    skip.cu.setPredModeSubParts(MODE_SKIP);
+    skip.cu.clearCbf();
+    skip.cu.setTUDepthSubParts(0, 0, 0);
+    checkDQP(skip, cuGeom);
+
+    /* nothing is decided here, so only the bits are counted; the distortion is left at zero */
+    m_entropyCoder.load(initialContext);
+    m_entropyCoder.resetBits();
+    if (!(cuGeom.flags & CUGeom::LEAF))
+        m_entropyCoder.codeSplitFlag(skip.cu, 0, 0);
+    if (m_slice->m_pps->bTransquantBypassEnabled)
+        m_entropyCoder.codeCUTransquantBypassFlag(skip.cu.m_tqBypass[0]);
+    m_entropyCoder.codeSkipFlag(skip.cu, 0);
+    m_entropyCoder.codeMergeIndex(skip.cu, 0);
+    skip.mvBits = skip.totalBits = m_entropyCoder.getNumberOfWrittenBits();
+    updateModeCost(skip);
+
+    md.bestMode = &skip;
+    X265_CHECK(skip.ok(), "static skip mode is not ok");
+    skip.cu.copyToPic(0);
+
+    /* a zero vector into an unweighted reference and no residual, the recon is the
+     * reference's own recon of this CTU, which FrameEncoder::copyStaticRecon already
+     * copied for the whole row */
+    return &skip;
+}
+
 void Analysis::tryLossless(const CUGeom& cuGeom)
 {
     ModeDepth& md = m_modeDepth[cuGeom.depth];
@@ -100,6 +100,10 @@ public:
 
     Mode& compressCTU(CUData& ctu, Frame& frame, const CUGeom& cuGeom, const Entropy& initialContext);
 
+    /* code a CTU that did not change since L0 reference 0 as a zero motion skip, without
+     * analysis. Returns NULL if the CTU cannot be coded that way, compressCTU() must be used */
+    Mode* compressStaticCTU(CUData& ctu, Frame& frame, const CUGeom& cuGeom, const Entropy& initialContext);
+
 protected:
 
     /* Analysis data for load/save modes, keeps getting incremented as CTU analysis proceeds and data is consumed or read */
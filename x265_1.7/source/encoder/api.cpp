@@ -218,6 +218,24 @@ void x265_cleanup(void)
         BitCost::destroy();
         CUData::s_partSet[0] = NULL; /* allow CUData to adjust to new CTU size */
     }
+    NALList::destroyBufferPool();
+}
+
+extern "C"
+void* x265_nal_pin(const x265_nal *nal)
+{
+    if (!nal)
+        return NULL;
+
+    /* the first payload of an access unit starts at its NALList buffer */
+    NALList::pinBuffer(nal->payload);
+    return nal->payload;
+}
+
+extern "C"
+void x265_nal_unpin(void *handle)
+{
+    NALList::releaseBuffer((uint8_t*)handle);
 }
 
 extern "C"
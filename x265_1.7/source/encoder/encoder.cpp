@@ -59,6 +59,7 @@ Encoder::Encoder()
 {
     m_aborted = false;
     m_reconfigured = false;
+    m_reconfigureRc = false;
     m_encodedFrameNum = 0;
     m_pocLast = -1;
     m_curEncoder = 0;
@@ -506,6 +507,14 @@ int Encoder::encode(const x265_picture* pic_in, x265_picture* pic_out)
         inFrame->m_forceqp   = pic_in->forceqp;
         inFrame->m_param     = m_reconfigured ? m_latestParam : m_param;
 
+        /* the caller may reuse its change map with the next picture */
+        inFrame->m_lowres.ctuDirtyMap = NULL;
+        if (pic_in->ctuDirtyMap)
+        {
+            memcpy(inFrame->m_ctuDirtyMap, pic_in->ctuDirtyMap, m_sps.numCuInWidth * m_sps.numCuInHeight);
+            inFrame->m_lowres.ctuDirtyMap = inFrame->m_ctuDirtyMap;
+        }
+
         if (m_pocLast == 0)
             m_firstPts = inFrame->m_pts;
         if (m_bframeDelay && m_pocLast == m_bframeDelay)
@@ -586,6 +595,10 @@ int Encoder::encode(const x265_picture* pic_in, x265_picture* pic_out)
                 pic_out->pts = outFrame->m_pts;
                 pic_out->dts = outFrame->m_dts;
 
+                pic_out->lookaheadExitTime = outFrame->m_lookaheadExitTime;
+                pic_out->encodeStartTime = curEncoder->m_startCompressTime;
+                pic_out->encodeEndTime = curEncoder->m_endCompressTime;
+
                 switch (slice->m_sliceType)
                 {
                 case I_SLICE:
@@ -670,6 +683,8 @@ int Encoder::encode(const x265_picture* pic_in, x265_picture* pic_out)
             frameEnc = m_lookahead->getDecidedPicture();
         if (frameEnc && !pass)
         {
+            frameEnc->m_lookaheadExitTime = x265_mdate();
+
             /* give this frame a FrameData instance before encoding */
             if (m_dpb->m_picSymFreeList)
             {
@@ -724,6 +739,18 @@ int Encoder::encode(const x265_picture* pic_in, x265_picture* pic_out)
             if (m_param->rc.rateControlMode != X265_RC_CQP)
                 m_lookahead->getEstimatedPictureCost(frameEnc);
 
+            /* rate control targets changed by x265_encoder_reconfig() apply from this frame on.
+             * They travel with the frame, rate control picks them up in encode order */
+            frameEnc->m_reconfigureRc = m_reconfigureRc;
+            if (m_reconfigureRc)
+            {
+                frameEnc->m_rcBitrate = m_latestParam->rc.bitrate;
+                frameEnc->m_rcRfConstant = m_latestParam->rc.rfConstant;
+                frameEnc->m_rcVbvMaxBitrate = m_latestParam->rc.vbvMaxBitrate;
+                frameEnc->m_rcVbvBufferSize = m_latestParam->rc.vbvBufferSize;
+                m_reconfigureRc = false;
+            }
+
             /* Allow FrameEncoder::compressFrame() to start in the frame encoder thread */
             if (!curEncoder->startCompressFrame(frameEnc))
                 m_aborted = true;
@@ -761,7 +788,35 @@ int Encoder::reconfigureParam(x265_param* encParam, x265_param* param)
     encParam->bEnableSignHiding = param->bEnableSignHiding;
     encParam->bEnableFastIntra = param->bEnableFastIntra;
     encParam->maxTUSize = param->maxTUSize;
-    return x265_check_params(encParam);
+
+    /* Rate control targets may change mid-stream, e.g. to follow the network. The rate control
+     * mode, and whether VBV is enabled at all, are fixed when the encoder is opened */
+    bool bRcChanged = param->rc.bitrate != encParam->rc.bitrate ||
+                      param->rc.rfConstant != encParam->rc.rfConstant ||
+                      param->rc.vbvMaxBitrate != encParam->rc.vbvMaxBitrate ||
+                      param->rc.vbvBufferSize != encParam->rc.vbvBufferSize;
+    if (bRcChanged)
+    {
+        bool bWasVbv = encParam->rc.vbvMaxBitrate > 0 && encParam->rc.vbvBufferSize > 0;
+        bool bIsVbv = param->rc.vbvMaxBitrate > 0 && param->rc.vbvBufferSize > 0;
+        if (param->rc.rateControlMode != encParam->rc.rateControlMode || bWasVbv != bIsVbv ||
+            encParam->rc.rateControlMode == X265_RC_CQP || encParam->rc.bStatRead || encParam->bEmitHRDSEI)
+        {
+            x265_log(encParam, X265_LOG_ERROR, "rate control can only be reconfigured within the same mode and VBV setting, without HRD or 2-pass\n");
+            return -1;
+        }
+        if (encParam->rc.rateControlMode == X265_RC_ABR)
+            encParam->rc.bitrate = param->rc.bitrate;
+        else
+            encParam->rc.rfConstant = param->rc.rfConstant;
+        encParam->rc.vbvMaxBitrate = param->rc.vbvMaxBitrate;
+        encParam->rc.vbvBufferSize = param->rc.vbvBufferSize;
+    }
+
+    int ret = x265_check_params(encParam);
+    if (!ret && bRcChanged)
+        m_reconfigureRc = true;
+    return ret;
 }
 
 void EncStats::addPsnr(double psnrY, double psnrU, double psnrV)
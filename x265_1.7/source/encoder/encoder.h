@@ -133,6 +133,7 @@ public:
     bool               m_bZeroLatency;     // x265_encoder_encode() returns NALs for the input picture, zero lag
     bool               m_aborted;          // fatal error detected
     bool               m_reconfigured;      // reconfigure of encoder detected
+    bool               m_reconfigureRc;     // rate control targets changed, handed to the next frame dispatched
 
     Encoder();
     ~Encoder() {}
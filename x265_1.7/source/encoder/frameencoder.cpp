@@ -47,6 +47,7 @@ FrameEncoder::FrameEncoder()
     m_activeWorkerCount = 0;
     m_completionCount = 0;
     m_bAllRowsStop = false;
+    m_bStaticSkip = false;
     m_vbvResetTriggerRow = -1;
     m_outStreams = NULL;
     m_substreamSizes = NULL;
@@ -362,6 +363,16 @@ void FrameEncoder::compressFrame()
         }
     }
 
+    /* CTUs the input reported unchanged since the previous picture are coded as
+     * zero motion skips when that picture is the unweighted L0 reference 0 */
+    m_bStaticSkip = m_frame->m_lowres.ctuDirtyMap && numPredDir && !m_param->analysisMode &&
+                    slice->m_refPOCList[0][0] == m_frame->m_poc - 1;
+    if (m_bStaticSkip && (bUseWeightP || bUseWeightB))
+    {
+        for (int plane = 0; plane < 3; plane++)
+            m_bStaticSkip &= !slice->m_weightPredTable[0][0][plane].bPresentFlag;
+    }
+
     /* Get the QP for this frame from rate control. This call may block until
      * frames ahead of it in encode order have called rateControlEnd() */
     int qp = m_top->m_rateControl->rateControlStart(m_frame, &m_rce, m_top);
@@ -789,6 +800,47 @@ void FrameEncoder::processRow(int row, int threadId)
     m_totalWorkerElapsedTime += x265_mdate() - startTime; // not thread safe, but good enough
 }
 
+/* An unchanged CTU coded as a zero motion skip reconstructs to the reference's recon.
+ * It is copied for each run of them in the row at once, long lines instead of a block
+ * copy per CTU. The reference rows were waited for before the row was enabled; a CTU
+ * that goes through the normal analysis after all writes its own recon over the copy */
+void FrameEncoder::copyStaticRecon(uint32_t row)
+{
+    const PicYuv& refPic = *m_frame->m_encData->m_slice->m_refPicList[0][0]->m_reconPic;
+    PicYuv& reconPic = *m_frame->m_reconPic;
+    const uint8_t* dirtyMap = m_frame->m_ctuDirtyMap + row * m_numCols;
+    const uint32_t height = X265_MIN(g_maxCUSize, reconPic.m_picHeight - row * g_maxCUSize);
+
+    uint32_t col = 0;
+    while (col < m_numCols)
+    {
+        if (dirtyMap[col])
+        {
+            col++;
+            continue;
+        }
+
+        uint32_t end = col + 1;
+        while (end < m_numCols && !dirtyMap[end])
+            end++;
+
+        const uint32_t cuAddr = row * m_numCols + col;
+        const uint32_t width = X265_MIN(end * g_maxCUSize, reconPic.m_picWidth) - col * g_maxCUSize;
+        for (uint32_t plane = 0; plane < 3; plane++)
+        {
+            const uint32_t hShift = plane ? reconPic.m_hChromaShift : 0;
+            const uint32_t vShift = plane ? reconPic.m_vChromaShift : 0;
+            const intptr_t stride = plane ? reconPic.m_strideC : reconPic.m_stride;
+            pixel* dst = reconPic.getPlaneAddr(plane, cuAddr);
+            const pixel* src = refPic.getPlaneAddr(plane, cuAddr);
+            for (uint32_t y = 0; y < (height >> vShift); y++)
+                memcpy(dst + y * stride, src + y * stride, (width >> hShift) * sizeof(pixel));
+        }
+
+        col = end;
+    }
+}
+
 // Called by worker threads
 void FrameEncoder::processRowEncoder(int intRow, ThreadLocalData& tld)
 {
@@ -833,6 +885,9 @@ void FrameEncoder::processRowEncoder(int intRow, ThreadLocalData& tld)
     for (uint32_t depth = 0; depth <= g_maxCUDepth; depth++)
         qTreeIntraCnt[depth] = qTreeInterCnt[depth] = qTreeSkipCnt[depth] = 0;
 
+    if (m_bStaticSkip && !curRow.completed)
+        copyStaticRecon(row);
+
     while (curRow.completed < numCols)
     {
         ProfileScopeEvent(encodeCTU);
@@ -886,8 +941,12 @@ void FrameEncoder::processRowEncoder(int intRow, ThreadLocalData& tld)
             rowCoder.loadContexts(m_rows[row - 1].bufferedEntropy);
         }
 
-        // Does all the CU analysis, returns best top level mode decision
-        Mode& best = tld.analysis.compressCTU(*ctu, *m_frame, m_cuGeoms[m_ctuGeomMap[cuAddr]], rowCoder);
+        // Does all the CU analysis, returns best top level mode decision. Unchanged CTUs skip it when they can
+        const CUGeom& ctuGeom = m_cuGeoms[m_ctuGeomMap[cuAddr]];
+        Mode* staticMode = NULL;
+        if (m_bStaticSkip && !m_frame->m_ctuDirtyMap[cuAddr])
+            staticMode = tld.analysis.compressStaticCTU(*ctu, *m_frame, ctuGeom, rowCoder);
+        Mode& best = staticMode ? *staticMode : tld.analysis.compressCTU(*ctu, *m_frame, ctuGeom, rowCoder);
 
         // take a sample of the current active worker count
         ATOMIC_ADD(&m_totalActiveWorkerCount, m_activeWorkerCount);
@@ -895,7 +954,7 @@ void FrameEncoder::processRowEncoder(int intRow, ThreadLocalData& tld)
 
         /* advance top-level row coder to include the context of this CTU.
          * if SAO is disabled, rowCoder writes the final CTU bitstream */
-        rowCoder.encodeCTU(*ctu, m_cuGeoms[m_ctuGeomMap[cuAddr]]);
+        rowCoder.encodeCTU(*ctu, ctuGeom);
 
         if (m_param->bEnableWavefront && col == 1)
             // Save CABAC state for next row
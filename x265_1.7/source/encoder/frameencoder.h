@@ -134,6 +134,7 @@ public:
 
     volatile bool            m_threadActive;
     volatile bool            m_bAllRowsStop;
+    bool                     m_bStaticSkip;      // code unchanged CTUs of the current frame as zero motion skips
     volatile int             m_completionCount;
     volatile int             m_vbvResetTriggerRow;
 
@@ -224,6 +225,7 @@ protected:
     int  collectCTUStatistics(const CUData& ctu, uint32_t* qtreeInterCnt, uint32_t* qtreeIntraCnt, uint32_t* qtreeSkipCnt);
     int  calcCTUQP(const CUData& ctu);
     void noiseReductionUpdate();
+    void copyStaticRecon(uint32_t row);
 
     /* Called by WaveFront::findJob() */
     virtual void processRow(int row, int threadId);
@@ -23,10 +23,108 @@
 
 #include "common.h"
 #include "bitstream.h"
+#include "threading.h"
 #include "nal.h"
 
 using namespace x265;
 
+namespace {
+
+/* hidden header in front of every access unit buffer; the size is a multiple
+ * of X265_ALIGNBYTES so the payload keeps the alignment of x265_malloc() */
+struct NALBufferHeader
+{
+    int32_t          refCount;
+    uint32_t         allocSize;
+    NALBufferHeader* next;
+};
+
+const uint32_t NAL_BUFFER_HEADER_SIZE = 64;
+const int      MAX_FREE_NAL_BUFFERS = 8;
+
+Lock             s_freeListLock;
+NALBufferHeader* s_freeList;
+int              s_numFreeBuffers;
+
+inline NALBufferHeader* bufferHeader(uint8_t* buffer)
+{
+    return (NALBufferHeader*)(buffer - NAL_BUFFER_HEADER_SIZE);
+}
+
+}
+
+uint8_t* NALList::allocBuffer(uint32_t size)
+{
+    NALBufferHeader* hdr = NULL;
+
+    {
+        ScopedLock lock(s_freeListLock);
+        for (NALBufferHeader** link = &s_freeList; *link; link = &(*link)->next)
+        {
+            if ((*link)->allocSize >= size)
+            {
+                hdr = *link;
+                *link = hdr->next;
+                s_numFreeBuffers--;
+                break;
+            }
+        }
+    }
+
+    if (!hdr)
+    {
+        hdr = (NALBufferHeader*)x265_malloc(NAL_BUFFER_HEADER_SIZE + size);
+        if (!hdr)
+            return NULL;
+        hdr->allocSize = size;
+    }
+
+    hdr->refCount = 1;
+    hdr->next = NULL;
+    return (uint8_t*)hdr + NAL_BUFFER_HEADER_SIZE;
+}
+
+void NALList::pinBuffer(uint8_t* buffer)
+{
+    if (buffer)
+        ATOMIC_INC(&bufferHeader(buffer)->refCount);
+}
+
+void NALList::releaseBuffer(uint8_t* buffer)
+{
+    if (!buffer)
+        return;
+
+    NALBufferHeader* hdr = bufferHeader(buffer);
+    if (ATOMIC_DEC(&hdr->refCount) > 0)
+        return;
+
+    {
+        ScopedLock lock(s_freeListLock);
+        if (s_numFreeBuffers < MAX_FREE_NAL_BUFFERS)
+        {
+            hdr->next = s_freeList;
+            s_freeList = hdr;
+            s_numFreeBuffers++;
+            return;
+        }
+    }
+
+    x265_free(hdr);
+}
+
+void NALList::destroyBufferPool()
+{
+    ScopedLock lock(s_freeListLock);
+    while (s_freeList)
+    {
+        NALBufferHeader* hdr = s_freeList;
+        s_freeList = hdr->next;
+        x265_free(hdr);
+    }
+    s_numFreeBuffers = 0;
+}
+
 NALList::NALList()
     : m_numNal(0)
     , m_buffer(NULL)
@@ -40,8 +138,9 @@ NALList::NALList()
 
 void NALList::takeContents(NALList& other)
 {
-    /* take other NAL buffer, discard our old one */
-    X265_FREE(m_buffer);
+    /* take other NAL buffer, discard our old one (unless the application
+     * still has it pinned) */
+    releaseBuffer(m_buffer);
     m_buffer = other.m_buffer;
     m_allocSize = other.m_allocSize;
     m_occupancy = other.m_occupancy;
@@ -53,7 +152,7 @@ void NALList::takeContents(NALList& other)
     /* reset other list, re-allocate their buffer with same size */
     other.m_numNal = 0;
     other.m_occupancy = 0;
-    other.m_buffer = X265_MALLOC(uint8_t, m_allocSize);
+    other.m_buffer = allocBuffer(m_allocSize);
 }
 
 void NALList::serialize(NalUnitType nalUnitType, const Bitstream& bs)
@@ -68,7 +167,7 @@ void NALList::serialize(NalUnitType nalUnitType, const Bitstream& bs)
     uint32_t nextSize = m_occupancy + sizeof(startCodePrefix) + 2 + payloadSize + (payloadSize >> 1) + m_extraOccupancy;
     if (nextSize > m_allocSize)
     {
-        uint8_t *temp = X265_MALLOC(uint8_t, nextSize);
+        uint8_t *temp = allocBuffer(nextSize);
         if (temp)
         {
             memcpy(temp, m_buffer, m_occupancy);
@@ -77,7 +176,7 @@ void NALList::serialize(NalUnitType nalUnitType, const Bitstream& bs)
             for (uint32_t i = 0; i < m_numNal; i++)
                 m_nal[i].payload = temp + (m_nal[i].payload - m_buffer);
 
-            X265_FREE(m_buffer);
+            releaseBuffer(m_buffer);
             m_buffer = temp;
             m_allocSize = nextSize;
         }
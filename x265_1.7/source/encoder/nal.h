@@ -51,13 +51,23 @@ public:
     bool        m_annexB;
 
     NALList();
-    ~NALList() { X265_FREE(m_buffer); X265_FREE(m_extraBuffer); }
+    ~NALList() { releaseBuffer(m_buffer); X265_FREE(m_extraBuffer); }
 
     void takeContents(NALList& other);
 
     void serialize(NalUnitType nalUnitType, const Bitstream& bs);
 
     uint32_t serializeSubstreams(uint32_t* streamSizeBytes, uint32_t streamCount, const Bitstream* streams);
+
+    /* Access unit buffers are reference counted so the application may pin
+     * the payloads of an output access unit (x265_nal_pin) beyond the next
+     * encoder call, e.g. while an async socket write still references them.
+     * Released buffers are kept in a small free list and reused by
+     * allocBuffer() instead of going back to the heap. */
+    static uint8_t* allocBuffer(uint32_t size);
+    static void pinBuffer(uint8_t* buffer);
+    static void releaseBuffer(uint8_t* buffer);
+    static void destroyBufferPool();
 };
 
 }
@@ -605,6 +605,56 @@ bool RateControl::init(const SPS& sps)
     return true;
 }
 
+void RateControl::reconfigureRC(const Frame& frame)
+{
+    int bitrate = frame.m_rcBitrate;
+    if (m_isVbv)
+    {
+        int vbvBufferSize = x265_clip3(0, 2000000, frame.m_rcVbvBufferSize);
+        int vbvMaxBitrate = x265_clip3(0, 2000000, frame.m_rcVbvMaxBitrate);
+        if (vbvMaxBitrate < bitrate && m_param->rc.rateControlMode == X265_RC_ABR)
+            bitrate = vbvMaxBitrate;
+        if (vbvBufferSize < (int)(vbvMaxBitrate / m_fps))
+            vbvBufferSize = (int)(vbvMaxBitrate / m_fps);
+
+        /* keep the buffer as full, relatively, as it was; a smaller buffer must not start out overflowed */
+        double fill = m_bufferSize > 0 ? m_bufferFillFinal / m_bufferSize : m_param->rc.vbvBufferInit;
+        m_bufferRate = vbvMaxBitrate * 1000 / m_fps;
+        m_vbvMaxRate = vbvMaxBitrate * 1000;
+        m_bufferSize = vbvBufferSize * 1000;
+        m_bufferFillFinal = x265_clip3(0.0, m_bufferSize, fill * m_bufferSize);
+        m_singleFrameVbv = m_bufferRate * 1.1 > m_bufferSize;
+    }
+
+    if (m_param->rc.rateControlMode == X265_RC_ABR)
+    {
+        /* rescale the ABR history as if it had been encoded at the new rate, otherwise the
+         * overflow feedback would spend the rest of the stream paying back the old rate */
+        double newBitrate = bitrate * 1000;
+        if (m_bitrate > 0 && newBitrate > 0)
+        {
+            double ratio = newBitrate / m_bitrate;
+            m_wantedBitsWindow *= ratio;
+            m_totalBits = (int64_t)(m_totalBits * ratio);
+            for (int i = 0; i < s_slidingWindowFrames; i++)
+                m_encodedBitsWindow[i] = (int64_t)(m_encodedBitsWindow[i] * ratio);
+        }
+        m_bitrate = newBitrate;
+    }
+    else if (m_param->rc.rateControlMode == X265_RC_CRF)
+    {
+        double rfConstant = frame.m_rcRfConstant;
+        double baseCplx = m_ncu * (m_param->bframes ? 120 : 80);
+        double mbtree_offset = m_param->rc.cuTree ? (1.0 - m_param->rc.qCompress) * 13.5 : 0;
+        m_rateFactorConstant = pow(baseCplx, 1 - m_qCompress) /
+            x265_qp2qScale(rfConstant + mbtree_offset);
+        if (m_param->rc.rfConstantMax)
+            m_rateFactorMaxIncrement = X265_MAX(0, m_param->rc.rfConstantMax - rfConstant);
+        if (m_param->rc.rfConstantMin)
+            m_rateFactorMaxDecrement = rfConstant - m_param->rc.rfConstantMin;
+    }
+}
+
 void RateControl::initHRD(SPS& sps)
 {
     int vbvBufferSize = m_param->rc.vbvBufferSize * 1000;
@@ -946,6 +996,12 @@ int RateControl::rateControlStart(Frame* curFrame, RateControlEntry* rce, Encode
         return 0;
     }
 
+    /* targets from x265_encoder_reconfig() travel with the frame; every earlier frame has
+     * passed rateControlStart() and no rateControlEnd() can run until this one increments
+     * m_startEndOrder, so the RC state may be rewritten here without racing them */
+    if (curFrame->m_reconfigureRc)
+        reconfigureRC(*curFrame);
+
     FrameData& curEncData = *curFrame->m_encData;
     m_curSlice = curEncData.m_slice;
     m_sliceType = m_curSlice->m_sliceType;
@@ -233,6 +233,7 @@ public:
     RateControl(x265_param& p);
     bool init(const SPS& sps);
     void initHRD(SPS& sps);
+    void reconfigureRC(const Frame& frame); /* new bitrate / CRF / VBV targets carried by frame */
 
     void setFinalFrameCount(int count);
     void terminate();          /* un-block all waiting functions so encoder may close */
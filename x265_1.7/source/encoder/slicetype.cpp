@@ -199,7 +199,19 @@ void LookaheadTLD::calcAdaptiveQuantFrame(Frame *curFrame, x265_param* param)
     }
 }
 
-void LookaheadTLD::lowresIntraEstimate(Lowres& fenc)
+/* the intra estimate of a lowres block reads the block and the samples above,
+ * above-right, left and below-left of it */
+static bool staticIntraBlock(const Lowres& fenc, int cuX, int cuY, int widthInCU, int heightInCU)
+{
+    for (int y = cuY - 1; y <= cuY + 1; y++)
+        for (int x = cuX - 1; x <= cuX + 2; x++)
+            if (!fenc.staticBlock(x265_clip3(0, widthInCU - 1, x), x265_clip3(0, heightInCU - 1, y)))
+                return false;
+
+    return true;
+}
+
+void LookaheadTLD::lowresIntraEstimate(Lowres& fenc, const int32_t* lastCost, const uint8_t* lastMode)
 {
     ALIGN_VAR_32(pixel, prediction[X265_LOWRES_CU_SIZE * X265_LOWRES_CU_SIZE]);
     pixel fencIntra[X265_LOWRES_CU_SIZE * X265_LOWRES_CU_SIZE];
@@ -226,62 +238,75 @@ void LookaheadTLD::lowresIntraEstimate(Lowres& fenc)
         for (int cuX = 0; cuX < widthInCU; cuX++)
         {
             const int cuXY = cuX + cuY * widthInCU;
-            const intptr_t pelOffset = cuSize * cuX + cuSize * cuY * fenc.lumaStride;
-            pixel *pixCur = fenc.lowresPlane[0] + pelOffset;
-
-            /* copy fenc pixels */
-            primitives.cu[sizeIdx].copy_pp(fencIntra, cuSize, pixCur, fenc.lumaStride);
 
-            /* collect reference sample pixels */
-            pixCur -= fenc.lumaStride + 1;
-            memcpy(samples, pixCur, (2 * cuSize + 1) * sizeof(pixel)); /* top */
-            for (int i = 1; i <= 2 * cuSize; i++)
-                samples[cuSize2 + i] = pixCur[i * fenc.lumaStride];    /* left */
+            int icost;
+            uint32_t ilowmode;
+            if (lastCost && staticIntraBlock(fenc, cuX, cuY, widthInCU, heightInCU))
+            {
+                /* same samples as the previous picture, same estimate */
+                icost = lastCost[cuXY];
+                ilowmode = lastMode[cuXY];
+            }
+            else
+            {
+                const intptr_t pelOffset = cuSize * cuX + cuSize * cuY * fenc.lumaStride;
+                pixel *pixCur = fenc.lowresPlane[0] + pelOffset;
 
-            primitives.cu[sizeIdx].intra_filter(samples, filtered);
+                /* copy fenc pixels */
+                primitives.cu[sizeIdx].copy_pp(fencIntra, cuSize, pixCur, fenc.lumaStride);
 
-            int cost, icost = me.COST_MAX;
-            uint32_t ilowmode = 0;
+                /* collect reference sample pixels */
+                pixCur -= fenc.lumaStride + 1;
+                memcpy(samples, pixCur, (2 * cuSize + 1) * sizeof(pixel)); /* top */
+                for (int i = 1; i <= 2 * cuSize; i++)
+                    samples[cuSize2 + i] = pixCur[i * fenc.lumaStride];    /* left */
 
-            /* DC and planar */
-            primitives.cu[sizeIdx].intra_pred[DC_IDX](prediction, cuSize, samples, 0, cuSize <= 16);
-            cost = satd(fencIntra, cuSize, prediction, cuSize);
-            COPY2_IF_LT(icost, cost, ilowmode, DC_IDX);
+                primitives.cu[sizeIdx].intra_filter(samples, filtered);
 
-            primitives.cu[sizeIdx].intra_pred[PLANAR_IDX](prediction, cuSize, neighbours[planar], 0, 0);
-            cost = satd(fencIntra, cuSize, prediction, cuSize);
-            COPY2_IF_LT(icost, cost, ilowmode, PLANAR_IDX);
+                int cost;
+                icost = me.COST_MAX;
+                ilowmode = 0;
 
-            /* scan angular predictions */
-            int filter, acost = me.COST_MAX;
-            uint32_t mode, alowmode = 4;
-            for (mode = 5; mode < 35; mode += 5)
-            {
-                filter = !!(g_intraFilterFlags[mode] & cuSize);
-                primitives.cu[sizeIdx].intra_pred[mode](prediction, cuSize, neighbours[filter], mode, cuSize <= 16);
+                /* DC and planar */
+                primitives.cu[sizeIdx].intra_pred[DC_IDX](prediction, cuSize, samples, 0, cuSize <= 16);
                 cost = satd(fencIntra, cuSize, prediction, cuSize);
-                COPY2_IF_LT(acost, cost, alowmode, mode);
-            }
-            for (uint32_t dist = 2; dist >= 1; dist--)
-            {
-                int minusmode = alowmode - dist;
-                int plusmode = alowmode + dist;
+                COPY2_IF_LT(icost, cost, ilowmode, DC_IDX);
 
-                mode = minusmode;
-                filter = !!(g_intraFilterFlags[mode] & cuSize);
-                primitives.cu[sizeIdx].intra_pred[mode](prediction, cuSize, neighbours[filter], mode, cuSize <= 16);
+                primitives.cu[sizeIdx].intra_pred[PLANAR_IDX](prediction, cuSize, neighbours[planar], 0, 0);
                 cost = satd(fencIntra, cuSize, prediction, cuSize);
-                COPY2_IF_LT(acost, cost, alowmode, mode);
+                COPY2_IF_LT(icost, cost, ilowmode, PLANAR_IDX);
 
-                mode = plusmode;
-                filter = !!(g_intraFilterFlags[mode] & cuSize);
-                primitives.cu[sizeIdx].intra_pred[mode](prediction, cuSize, neighbours[filter], mode, cuSize <= 16);
-                cost = satd(fencIntra, cuSize, prediction, cuSize);
-                COPY2_IF_LT(acost, cost, alowmode, mode);
-            }
-            COPY2_IF_LT(icost, acost, ilowmode, alowmode);
+                /* scan angular predictions */
+                int filter, acost = me.COST_MAX;
+                uint32_t mode, alowmode = 4;
+                for (mode = 5; mode < 35; mode += 5)
+                {
+                    filter = !!(g_intraFilterFlags[mode] & cuSize);
+                    primitives.cu[sizeIdx].intra_pred[mode](prediction, cuSize, neighbours[filter], mode, cuSize <= 16);
+                    cost = satd(fencIntra, cuSize, prediction, cuSize);
+                    COPY2_IF_LT(acost, cost, alowmode, mode);
+                }
+                for (uint32_t dist = 2; dist >= 1; dist--)
+                {
+                    int minusmode = alowmode - dist;
+                    int plusmode = alowmode + dist;
+
+                    mode = minusmode;
+                    filter = !!(g_intraFilterFlags[mode] & cuSize);
+                    primitives.cu[sizeIdx].intra_pred[mode](prediction, cuSize, neighbours[filter], mode, cuSize <= 16);
+                    cost = satd(fencIntra, cuSize, prediction, cuSize);
+                    COPY2_IF_LT(acost, cost, alowmode, mode);
+
+                    mode = plusmode;
+                    filter = !!(g_intraFilterFlags[mode] & cuSize);
+                    primitives.cu[sizeIdx].intra_pred[mode](prediction, cuSize, neighbours[filter], mode, cuSize <= 16);
+                    cost = satd(fencIntra, cuSize, prediction, cuSize);
+                    COPY2_IF_LT(acost, cost, alowmode, mode);
+                }
+                COPY2_IF_LT(icost, acost, ilowmode, alowmode);
 
-            icost += intraPenalty + lowresPenalty; /* estimate intra signal cost */
+                icost += intraPenalty + lowresPenalty; /* estimate intra signal cost */
+            }
 
             fenc.lowresCosts[0][0][cuXY] = (uint16_t)(X265_MIN(icost, LOWRES_COST_MASK) | (0 << LOWRES_COST_SHIFT));
             fenc.intraCost[cuXY] = icost;
@@ -465,6 +490,9 @@ Lookahead::Lookahead(x265_param *param, ThreadPool* pool)
 
     m_lastNonB = NULL;
     m_scratch  = NULL;
+    m_lastIntraCost = NULL;
+    m_lastIntraMode = NULL;
+    m_lastIntraPoc = -1;
     m_tld      = NULL;
     m_filled   = false;
     m_outputSignalRequired = false;
@@ -545,8 +573,10 @@ bool Lookahead::create()
     for (int i = 0; i < numTLD; i++)
         m_tld[i].init(m_8x8Width, m_8x8Height, m_8x8Blocks);
     m_scratch = X265_MALLOC(int, m_tld[0].widthInCU);
+    m_lastIntraCost = X265_MALLOC(int32_t, m_8x8Width * m_8x8Height);
+    m_lastIntraMode = X265_MALLOC(uint8_t, m_8x8Width * m_8x8Height);
 
-    return m_tld && m_scratch;
+    return m_tld && m_scratch && m_lastIntraCost && m_lastIntraMode;
 }
 
 void Lookahead::stopJobs()
@@ -581,6 +611,8 @@ void Lookahead::destroy()
     }
 
     X265_FREE(m_scratch);
+    X265_FREE(m_lastIntraCost);
+    X265_FREE(m_lastIntraMode);
 
     delete [] m_tld;
 }
@@ -794,7 +826,14 @@ void PreLookaheadGroup::processTasks(int workerThreadID)
             /* cu-tree offsets were read from stats file */;
         else if (m_lookahead.m_bAdaptiveQuant)
             tld.calcAdaptiveQuantFrame(preFrame, m_lookahead.m_param);
-        tld.lowresIntraEstimate(preFrame->m_lowres);
+
+        /* run one at a time, a picture with a change map finds the intra estimate
+         * of the picture before it in the lookahead */
+        Lowres& lowres = preFrame->m_lowres;
+        if (m_jobTotal == 1 && lowres.ctuDirtyMap && m_lookahead.m_lastIntraPoc == preFrame->m_poc - 1)
+            tld.lowresIntraEstimate(lowres, m_lookahead.m_lastIntraCost, m_lookahead.m_lastIntraMode);
+        else
+            tld.lowresIntraEstimate(lowres, NULL, NULL);
         preFrame->m_lowresInit = true;
 
         m_lock.acquire();
@@ -849,6 +888,11 @@ void Lookahead::slicetypeDecide()
             pre.tryBondPeers(*m_pool, pre.m_jobTotal);
         pre.processTasks(-1);
         pre.waitForExit();
+
+        Lowres& last = pre.m_preframes[pre.m_jobTotal - 1]->m_lowres;
+        memcpy(m_lastIntraCost, last.intraCost, m_8x8Width * m_8x8Height * sizeof(int32_t));
+        memcpy(m_lastIntraMode, last.intraMode, m_8x8Width * m_8x8Height * sizeof(uint8_t));
+        m_lastIntraPoc = last.frameNum;
     }
 
     if (m_lastNonB && !m_param->rc.bStatRead &&
@@ -1984,7 +2028,12 @@ void CostEstimateGroup::estimateCUCost(LookaheadTLD& tld, int cuX, int cuY, int
     const int cuSize = X265_LOWRES_CU_SIZE;
     const intptr_t pelOffset = cuSize * cuX + cuSize * cuY * fenc->lumaStride;
 
-    if (bBidir || bDoSearch[0] || bDoSearch[1])
+    /* a block of a CTU the capture reported unchanged is a copy of the previous
+     * picture; the L0 estimate against that picture needs no motion search and
+     * nothing can beat it, bidir included */
+    bool bStatic = fenc->ctuDirtyMap && b - p0 == 1 && fenc->staticBlock(cuX, cuY);
+
+    if ((!bStatic && (bBidir || bDoSearch[0])) || bDoSearch[1])
         tld.me.setSourcePU(fenc->lowresPlane[0], fenc->lumaStride, pelOffset, cuSize, cuSize);
 
     /* A small, arbitrary bias to avoid VBV problems caused by zero-residual lookahead blocks. */
@@ -2016,6 +2065,18 @@ void CostEstimateGroup::estimateCUCost(LookaheadTLD& tld, int cuX, int cuY, int
         MV* fencMV = &fenc->lowresMvs[i][listDist[i]][cuXY];
         ReferencePlanes* fref = i ? fref1 : wfref0;
 
+        if (!i && bStatic)
+        {
+            /* what the search finds among unchanged neighbours: the zero MV, no residual,
+             * predicted from zero MVs. Costing it 0 instead lowers the frame cost estimate
+             * and with it the QP rate control picks */
+            *fencMV = 0;
+            tld.me.setMVP(0);
+            fencCost = tld.me.mvcost(0);
+            COPY2_IF_LT(bcost, fencCost, listused, i + 1);
+            continue;
+        }
+
         /* Reverse-order MV prediction */
 #define MVC(mv) mvc[numc++] = mv;
         if (cuX < widthInCU - 1)
@@ -2055,7 +2116,9 @@ void CostEstimateGroup::estimateCUCost(LookaheadTLD& tld, int cuX, int cuY, int
         COPY2_IF_LT(bcost, fencCost, listused, i + 1);
     }
 
-    if (bBidir) /* B, also consider bidir */
+    if (bBidir && bStatic)
+        bcost += lowresPenalty;
+    else if (bBidir) /* B, also consider bidir */
     {
         /* NOTE: the wfref0 (weightp) is not used for BIDIR */
 
@@ -84,7 +84,7 @@ struct LookaheadTLD
     ~LookaheadTLD() { X265_FREE(wbuffer[0]); }
 
     void calcAdaptiveQuantFrame(Frame *curFrame, x265_param* param);
-    void lowresIntraEstimate(Lowres& fenc);
+    void lowresIntraEstimate(Lowres& fenc, const int32_t* lastCost, const uint8_t* lastMode);
 
     void weightsAnalyse(Lowres& fenc, Lowres& ref);
 
@@ -118,6 +118,12 @@ public:
     x265_param*   m_param;
     Lowres*       m_lastNonB;
     int*          m_scratch;         // temp buffer for cutree propagate
+
+    /* intra estimate of the last pre-analysed picture, the unchanged blocks of
+     * the picture after it reuse it (see x265_picture.ctuDirtyMap) */
+    int32_t*      m_lastIntraCost;
+    uint8_t*      m_lastIntraMode;
+    int           m_lastIntraPoc;
     
     int           m_histogram[X265_BFRAME_MAX + 1];
     int           m_lastKeyframe;
@@ -0,0 +1,503 @@
+#ifndef _CAPTURE_SOURCE_HPP
+#define _CAPTURE_SOURCE_HPP
+
+#include "x265.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <algorithm>
+
+/*
+ * 采集源，每个会话开始时(YUVInput构造，这时才知道分辨率、格式和帧率)由DesktopStreamingService按
+ * "capture <spec>"命令或服务端的默认值创建一个，采集线程每帧调用capture直接写进环的slot。
+ * spec:
+ *     screen                                  Windows GDI屏幕采集(input/capture.hpp)，Windows下的默认值
+ *     file:<path>                             逐帧读取YUV文件，读完结束
+ *     synthetic[:<scene>][,fps=N][,nopace]    合成的桌面(SyntheticDesktopSource)，其他平台的默认值
+ * 只支持8 bit的i420和i444。
+ */
+struct CaptureFormat {
+    CaptureFormat( int _Width = 0, int _Height = 0, int _Csp = X265_CSP_I420, double _Fps = 0, int _Depth = 8 )
+            : width(_Width), height(_Height), csp(_Csp), depth(_Depth), fps(_Fps) {}
+
+    bool supported() const
+    {
+        if( width <= 0 || height <= 0 || depth != 8 )
+            return false;
+        return csp == X265_CSP_I444 || (csp == X265_CSP_I420 && !(width & 1) && !(height & 1));
+    }
+
+    int chromaWidth() const { return csp == X265_CSP_I444 ? width : width / 2; }
+    int chromaHeight() const { return csp == X265_CSP_I444 ? height : height / 2; }
+
+    std::size_t frameSize() const
+    { return (std::size_t)width * height + 2 * (std::size_t)chromaWidth() * chromaHeight(); }
+
+    int         width, height;
+    int         csp;            // X265_CSP_I420 or X265_CSP_I444
+    int         depth;
+    double      fps;
+};
+
+class CaptureSource {
+public:
+    virtual ~CaptureSource() {}
+
+    // writes one picture of len bytes (the --input-csp layout) into dst, false ends the capture.
+    // *pConvertTime is preset to the call time, a source that converts from RGB sets it when that starts
+    virtual bool capture( char *dst, std::size_t len, int64_t *pConvertTime ) = 0;
+
+    // one line for the "capture" reply and the logs
+    virtual std::string description() const = 0;
+};
+
+typedef std::shared_ptr<CaptureSource>      CaptureSourcePtr;
+
+
+/*
+ * 逐帧读取原始YUV文件，帧大小必须和会话的格式一致。
+ */
+class FileCaptureSource : public CaptureSource {
+public:
+    explicit FileCaptureSource( const std::string &_Path )
+            : path(_Path), ifs(_Path.c_str(), std::ios::in | std::ios::binary) {}
+
+    bool good() const { return ifs.good(); }
+
+    bool capture( char *dst, std::size_t len, int64_t* )
+    {
+        if( !ifs || ifs.eof() )
+            return false;
+        ifs.read( dst, len );
+        return (std::size_t)ifs.gcount() == len;
+    }
+
+    std::string description() const
+    { return "file " + path; }
+
+private:
+    std::string             path;
+    std::ifstream           ifs;
+};
+
+
+/*
+ * 合成的桌面，在构建服务器上没有屏幕也能跑和回归测试采集->编码->发送的流水线。
+ * 每一帧只由帧号决定(render(n)总是同一幅画面)，同一个spec每次运行的码流相同。场景:
+ *     idle    静止的桌面，只有光标闪烁和任务栏时钟每秒变一次
+ *     text    编辑器窗口里的文字匀速滚动
+ *     drag    一个窗口被拖着在桌面上移动，窗口内容不变(运动补偿的典型情况)
+ *     video   桌面中间一块视频播放区域，每帧全部变化
+ *     mixed   每MIXED_SCENE_SECONDS秒依次切换上面四个场景
+ * paced时按帧率的节拍产生，编码端反压导致错过的节拍记为丢帧(真实采集也只取最新的屏幕)；
+ * 否则尽快产生，用来测吞吐。
+ */
+class SyntheticDesktopSource : public CaptureSource {
+public:
+    enum Scene { SCENE_IDLE, SCENE_TEXT, SCENE_DRAG, SCENE_VIDEO, SCENE_MIXED, SCENE_COUNT };
+
+    static const int            MIXED_SCENE_SECONDS = 5;
+    static const int            TASKBAR_H = 40;
+    static const int            TITLE_H = 24;
+    static const int            GLYPH_W = 8;
+    static const int            GLYPH_H = 16;
+    static const int            GLYPHS = 64;
+    static const int            SCROLL_PX = 2;          // text scene, per frame
+
+    SyntheticDesktopSource( const CaptureFormat &_Format, Scene _Scene = SCENE_MIXED, bool _Paced = true )
+            : format(_Format), scene(_Scene), paced(_Paced)
+            , period(std::chrono::microseconds(_Format.fps > 0 ? (int64_t)(1e6 / _Format.fps) : 16667))
+            , frameNo(0), generated(0), missed(0)
+    {
+        planes = Planes( format );
+        InitGlyphs();
+        InitBackground();
+    }
+
+    static const char* sceneName( Scene s )
+    {
+        static const char * const names[SCENE_COUNT] = { "idle", "text", "drag", "video", "mixed" };
+        return s >= 0 && s < SCENE_COUNT ? names[s] : "?";
+    }
+
+    static bool parseScene( const std::string &name, Scene &s )
+    {
+        for( int i = 0; i < SCENE_COUNT; ++i ) {
+            if( name == sceneName((Scene)i) ) {
+                s = (Scene)i;
+                return true;
+            } // if
+        } // for
+        return false;
+    }
+
+    std::size_t frameSize() const { return background.size(); }
+
+    // the frame source, runs on the capture thread
+    bool capture( char *dst, std::size_t len, int64_t* )
+    {
+        if( len != background.size() )
+            return false;
+
+        if( paced ) {
+            // hold the frame rate; a tick the pipeline made us miss is dropped, not made up
+            Clock::time_point now = Clock::now();
+            if( !generated )
+                next = now;
+            if( now > next + period ) {
+                int64_t behind = (int64_t)((now - next) / period);
+                missed += behind;
+                frameNo += behind;
+                next += period * behind;
+            } // if
+            std::this_thread::sleep_until( next );
+            next += period;
+        } // if
+
+        render( (uint8_t*)dst, frameNo++ );
+        ++generated;
+        return true;
+    }
+
+    std::string description() const
+    {
+        char buf[128];
+        sprintf( buf, "synthetic %s %dx%d %s %.2ffps%s", sceneName(scene), format.width, format.height,
+                    format.csp == X265_CSP_I444 ? "i444" : "i420", format.fps, paced ? "" : " unpaced" );
+        return buf;
+    }
+
+    // picture n of this scene into dst, frameSize() bytes
+    void render( uint8_t *dst, uint64_t n ) const
+    {
+        memcpy( dst, &background[0], background.size() );
+        Planes p = planes.at( dst );
+        Scene s = scene;
+        if( s == SCENE_MIXED ) {
+            uint64_t sceneFrames = (uint64_t)std::max( 1.0, MIXED_SCENE_SECONDS * FramesPerSecond() );
+            s = (Scene)((n / sceneFrames) % SCENE_MIXED);
+        } // if
+
+        switch( s ) {
+        case SCENE_TEXT:
+            DrawText( p, n );
+            break;
+        case SCENE_DRAG:
+            DrawDrag( p, n );
+            break;
+        case SCENE_VIDEO:
+            DrawVideo( p, n );
+            break;
+        default:
+            DrawIdle( p, n );
+            break;
+        } // switch
+    }
+
+    uint64_t generatedFrames() const { return generated; }
+    uint64_t missedFrames() const { return missed; }
+
+private:
+    typedef std::chrono::steady_clock       Clock;
+
+    // the three planes of one picture, chroma subsampled by 1 << sx, 1 << sy
+    struct Planes {
+        Planes() : y(NULL), u(NULL), v(NULL), w(0), h(0), cw(0), ch(0), sx(0), sy(0) {}
+        explicit Planes( const CaptureFormat &fmt )
+                : y(NULL), u(NULL), v(NULL), w(fmt.width), h(fmt.height)
+                , cw(fmt.chromaWidth()), ch(fmt.chromaHeight())
+                , sx(fmt.csp == X265_CSP_I444 ? 0 : 1), sy(fmt.csp == X265_CSP_I444 ? 0 : 1) {}
+
+        Planes at( uint8_t *base ) const
+        {
+            Planes ret = *this;
+            ret.y = base;
+            ret.u = base + (std::size_t)w * h;
+            ret.v = ret.u + (std::size_t)cw * ch;
+            return ret;
+        }
+
+        uint8_t     *y, *u, *v;
+        int         w, h, cw, ch, sx, sy;
+    };
+
+    struct Rect {
+        Rect( int _X = 0, int _Y = 0, int _W = 0, int _H = 0 ) : x(_X), y(_Y), w(_W), h(_H) {}
+        int         x, y, w, h;
+    };
+
+    static uint32_t Hash( uint32_t a, uint32_t b = 0 )
+    {
+        uint32_t h = a * 0x9E3779B1u ^ (b + 0x7F4A7C15u) * 0x85EBCA77u;
+        h ^= h >> 15;
+        h *= 0x2C1B3C6Du;
+        h ^= h >> 12;
+        return h;
+    }
+
+    double FramesPerSecond() const { return format.fps > 0 ? format.fps : 60; }
+
+    // clipped to the picture, chroma covers every chroma sample the luma rectangle touches
+    static void FillRect( const Planes &p, Rect r, uint8_t y, uint8_t u, uint8_t v )
+    {
+        int x0 = std::max( 0, r.x ), y0 = std::max( 0, r.y );
+        int x1 = std::min( p.w, r.x + r.w ), y1 = std::min( p.h, r.y + r.h );
+        if( x0 >= x1 || y0 >= y1 )
+            return;
+        for( int row = y0; row < y1; ++row )
+            memset( p.y + (std::size_t)row * p.w + x0, y, x1 - x0 );
+        int cx0 = x0 >> p.sx, cx1 = (x1 + (1 << p.sx) - 1) >> p.sx;
+        int cy0 = y0 >> p.sy, cy1 = (y1 + (1 << p.sy) - 1) >> p.sy;
+        for( int row = cy0; row < cy1; ++row ) {
+            memset( p.u + (std::size_t)row * p.cw + cx0, u, cx1 - cx0 );
+            memset( p.v + (std::size_t)row * p.cw + cx0, v, cx1 - cx0 );
+        } // for
+    }
+
+    // random strokes that look like text to the encoder: thin lines, mostly background
+    void InitGlyphs()
+    {
+        glyphs.assign( GLYPHS * GLYPH_H, 0 );
+        for( int g = 1; g < GLYPHS; ++g ) {         // glyph 0 is the space
+            uint8_t *rows = &glyphs[g * GLYPH_H];
+            uint32_t h = Hash( g, 0x51 );
+            int strokes = 2 + (h & 3);
+            for( int s = 0; s < strokes; ++s ) {
+                uint32_t k = Hash( g, s );
+                if( k & 1 ) {                       // vertical stroke
+                    int col = 1 + (k >> 1) % 6, top = 3 + (k >> 4) % 3, len = 6 + (k >> 8) % 5;
+                    for( int r = top; r < std::min(GLYPH_H - 2, top + len); ++r )
+                        rows[r] |= (uint8_t)(0x80 >> col);
+                } else {                            // horizontal stroke
+                    int row = 4 + (k >> 1) % 9, left = (k >> 5) % 3, len = 3 + (k >> 8) % 4;
+                    for( int c = left; c < std::min(GLYPH_W - 1, left + len); ++c )
+                        rows[row] |= (uint8_t)(0x80 >> c);
+                } // if
+            } // for
+        } // for
+    }
+
+    // glyph of column col in text line line, 0 past the end of the line
+    int GlyphAt( uint32_t line, int col, uint32_t seed ) const
+    {
+        uint32_t h = Hash( line, seed );
+        int indent = (h & 3) * 4, len = 10 + (h >> 2) % 70;
+        if( col < indent || col >= indent + len )
+            return 0;
+        uint32_t k = Hash( line * 131 + col, seed );
+        return (k % 7 == 0) ? 0 : 1 + (int)(k % (GLYPHS - 1));     // words separated by spaces
+    }
+
+    // black text on white in r, the text starts scrollPx pixels into the document
+    void DrawTextArea( const Planes &p, Rect r, uint64_t scrollPx, uint32_t seed ) const
+    {
+        FillRect( p, r, 235, 128, 128 );
+        int x0 = std::max( 0, r.x + 4 ), x1 = std::min( p.w, r.x + r.w - 4 );
+        int y0 = std::max( 0, r.y ), y1 = std::min( p.h, r.y + r.h );
+        for( int row = y0; row < y1; ++row ) {
+            uint64_t docY = scrollPx + (uint64_t)(row - r.y);
+            uint32_t line = (uint32_t)(docY / GLYPH_H);
+            const int gy = (int)(docY % GLYPH_H);
+            uint8_t *dst = p.y + (std::size_t)row * p.w;
+            for( int x = x0; x < x1; ) {
+                int col = (x - r.x - 4) / GLYPH_W, gx = (x - r.x - 4) % GLYPH_W;
+                int g = GlyphAt( line, col, seed );
+                if( !g ) {
+                    x += GLYPH_W - gx;
+                    continue;
+                } // if
+                uint8_t bits = glyphs[g * GLYPH_H + gy];
+                for( ; gx < GLYPH_W && x < x1; ++gx, ++x )
+                    if( bits & (0x80 >> gx) )
+                        dst[x] = 30;
+            } // for
+        } // for
+    }
+
+    void DrawWindow( const Planes &p, Rect r, uint64_t scrollPx, uint32_t seed ) const
+    {
+        FillRect( p, Rect(r.x - 1, r.y - 1, r.w + 2, r.h + 2), 90, 128, 128 );      // border
+        FillRect( p, Rect(r.x, r.y, r.w, TITLE_H), 70, 160, 110 );                  // title bar
+        FillRect( p, Rect(r.x + r.w - 20, r.y + 6, 12, 12), 200, 110, 190 );        // close button
+        DrawTextArea( p, Rect(r.x, r.y + TITLE_H, r.w, r.h - TITLE_H), scrollPx, seed );
+    }
+
+    void DrawCursor( const Planes &p, int x, int y ) const
+    {
+        // an arrow: a column per row that grows to the right
+        for( int r = 0; r < 19; ++r ) {
+            int w = std::min( r, 12 ) + 1;
+            FillRect( p, Rect(x, y + r, w, 1), 16, 128, 128 );
+            if( r > 0 && w > 2 && r < 18 )
+                FillRect( p, Rect(x + 1, y + r, w - 2, 1), 235, 128, 128 );
+        } // for
+    }
+
+    // the taskbar clock, four blocks of digits that change once a second
+    void DrawClock( const Planes &p, uint64_t n ) const
+    {
+        uint64_t seconds = (uint64_t)(n / FramesPerSecond());
+        int x = p.w - 80, y = p.h - TASKBAR_H + 12;
+        for( int d = 0; d < 4; ++d ) {
+            uint32_t digit = (uint32_t)(d < 2 ? seconds / 60 : seconds) % (d & 1 ? 10 : 6);
+            Rect cell( x + d * 16 + (d >= 2 ? 8 : 0), y, GLYPH_W, GLYPH_H );
+            const uint8_t *rows = &glyphs[(1 + digit) * GLYPH_H];
+            for( int r = 0; r < GLYPH_H; ++r )
+                for( int c = 0; c < GLYPH_W; ++c )
+                    if( rows[r] & (0x80 >> c) )
+                        FillRect( p, Rect(cell.x + c, cell.y + r, 1, 1), 220, 128, 128 );
+        } // for
+    }
+
+    void DrawIdle( const Planes &p, uint64_t n ) const
+    {
+        DrawClock( p, n );
+        // blinks once a second
+        if( (uint64_t)(n * 2 / FramesPerSecond()) & 1 )
+            DrawCursor( p, p.w / 2, p.h / 2 );
+    }
+
+    Rect EditorRect( const Planes &p ) const
+    {
+        int w = std::min( p.w - 40, std::max(p.w * 3 / 5, 320) );
+        int h = std::min( p.h - TASKBAR_H - 40, std::max(p.h * 3 / 5, 200) );
+        return Rect( (p.w - w) / 2, (p.h - TASKBAR_H - h) / 2, w, h );
+    }
+
+    void DrawText( const Planes &p, uint64_t n ) const
+    {
+        DrawClock( p, n );
+        Rect r = EditorRect( p );
+        DrawWindow( p, r, n * SCROLL_PX, 0x7e );
+        DrawCursor( p, r.x + r.w - 60, r.y + r.h / 2 );
+    }
+
+    void DrawDrag( const Planes &p, uint64_t n ) const
+    {
+        DrawClock( p, n );
+        int w = std::min( p.w - 2, std::max(p.w / 4, 160) ), h = std::min( p.h - TASKBAR_H - 2, std::max(p.h / 3, 120) );
+        // a triangle wave in each direction, 8 and 3 pixels per frame
+        int spanX = std::max( 1, p.w - w - 2 ), spanY = std::max( 1, p.h - TASKBAR_H - h - 2 );
+        int x = (int)(n * 8 % (2 * spanX)), y = (int)(n * 3 % (2 * spanY));
+        if( x >= spanX )
+            x = 2 * spanX - x;
+        if( y >= spanY )
+            y = 2 * spanY - y;
+        DrawWindow( p, Rect(x + 1, y + 1, w, h), 0, 0xd5 );
+        DrawCursor( p, x + w / 2, y + 1 + TITLE_H / 2 );
+    }
+
+    void DrawVideo( const Planes &p, uint64_t n ) const
+    {
+        DrawClock( p, n );
+        int w = std::max( 64, std::min(p.w - 2, p.w / 3) ) & ~1, h = (w * 9 / 16) & ~1;
+        h = std::min( h, (p.h - TASKBAR_H - 2) & ~1 );
+        Rect r( ((p.w - w) / 2) & ~1, ((p.h - TASKBAR_H - h) / 2) & ~1, w, h );
+        DrawWindow( p, Rect(r.x, r.y - TITLE_H, r.w, r.h + TITLE_H), 0, 0x3c );
+        // moving diagonal bands with a little noise, every pixel changes every frame
+        uint32_t t = (uint32_t)n;
+        for( int row = std::max(0, r.y); row < std::min(p.h, r.y + r.h); ++row ) {
+            uint8_t *dst = p.y + (std::size_t)row * p.w;
+            for( int x = std::max(0, r.x); x < std::min(p.w, r.x + r.w); ++x ) {
+                int band = ((x - r.x) * 3 + (row - r.y) * 2 + (int)t * 5) & 255;
+                int level = band < 128 ? band : 255 - band;
+                dst[x] = (uint8_t)(40 + level + (Hash(x * 7919 + row, t) & 15));
+            } // for
+        } // for
+        for( int row = std::max(0, r.y) >> p.sy; row < std::min(p.h, r.y + r.h) >> p.sy; ++row ) {
+            for( int x = std::max(0, r.x) >> p.sx; x < std::min(p.w, r.x + r.w) >> p.sx; ++x ) {
+                p.u[(std::size_t)row * p.cw + x] = (uint8_t)(128 + ((x + (int)t) & 63) - 32);
+                p.v[(std::size_t)row * p.cw + x] = (uint8_t)(128 + ((row * 2 + (int)t * 3) & 63) - 32);
+            } // for
+        } // for
+    }
+
+    // gradient wallpaper, a taskbar and a column of icons; every scene draws on top of it
+    void InitBackground()
+    {
+        background.resize( format.frameSize() );
+        Planes p = planes.at( &background[0] );
+        for( int r = 0; r < p.h; ++r )
+            for( int c = 0; c < p.w; ++c )
+                p.y[(std::size_t)r * p.w + c] = (uint8_t)(60 + r * 80 / p.h + ((c >> 6) & 1) * 4);
+        memset( p.u, 140, (std::size_t)p.cw * p.ch );
+        for( int r = 0; r < p.ch; ++r )
+            memset( p.v + (std::size_t)r * p.cw, 110 + r * 16 / p.ch, p.cw );
+        FillRect( p, Rect(0, p.h - TASKBAR_H, p.w, TASKBAR_H), 40, 130, 126 );
+        for( int i = 0; i < 6 && 24 + i * 80 + 48 < p.h - TASKBAR_H; ++i ) {
+            uint32_t h = Hash( i, 0x1c );
+            FillRect( p, Rect(24, 24 + i * 80, 48, 48), (uint8_t)(100 + h % 120),
+                        (uint8_t)(90 + (h >> 8) % 80), (uint8_t)(90 + (h >> 16) % 80) );
+        } // for
+    }
+
+private:
+    CaptureFormat           format;
+    Scene                   scene;
+    bool                    paced;
+    Clock::duration         period;
+    Clock::time_point       next;
+    Planes                  planes;
+    std::vector<uint8_t>    background;
+    std::vector<uint8_t>    glyphs;             // GLYPH_H rows of GLYPH_W bits each
+    uint64_t                frameNo;
+    std::atomic<uint64_t>   generated, missed;
+};
+
+
+/*
+ * 按spec创建file和synthetic采集源，"screen"依赖平台，由调用者处理。
+ * 失败返回空，error是给客户端的说明。
+ */
+inline
+CaptureSourcePtr CreateCaptureSource( const std::string &spec, const CaptureFormat &format, std::string &error )
+{
+    if( !format.supported() ) {
+        error = "capture needs an 8 bit i420 or i444 input with even dimensions";
+        return CaptureSourcePtr();
+    } // if
+
+    if( spec.compare(0, 5, "file:") == 0 ) {
+        std::shared_ptr<FileCaptureSource> source = std::make_shared<FileCaptureSource>( spec.substr(5) );
+        if( !source->good() ) {
+            error = "cannot open " + spec.substr(5);
+            return CaptureSourcePtr();
+        } // if
+        return source;
+    } // if
+
+    if( spec.compare(0, 9, "synthetic") == 0 && (spec.size() == 9 || spec[9] == ':') ) {
+        SyntheticDesktopSource::Scene scene = SyntheticDesktopSource::SCENE_MIXED;
+        CaptureFormat fmt = format;
+        bool paced = true;
+        std::string opts = spec.size() > 10 ? spec.substr(10) : std::string();
+        std::string::size_type pos = 0;
+        while( pos < opts.size() ) {
+            std::string::size_type end = opts.find( ',', pos );
+            std::string opt = opts.substr( pos, end == std::string::npos ? std::string::npos : end - pos );
+            pos = end == std::string::npos ? opts.size() : end + 1;
+            if( opt.compare(0, 4, "fps=") == 0 && atof(opt.c_str() + 4) > 0 ) {
+                fmt.fps = atof( opt.c_str() + 4 );
+            } else if( opt == "nopace" ) {
+                paced = false;
+            } else if( !SyntheticDesktopSource::parseScene(opt, scene) ) {
+                error = "unknown synthetic option " + opt + ", expected idle|text|drag|video|mixed, fps=N or nopace";
+                return CaptureSourcePtr();
+            } // if
+        } // while
+        return std::make_shared<SyntheticDesktopSource>( fmt, scene, paced );
+    } // if
+
+    error = "unknown capture source " + spec + ", expected screen, file:<path> or synthetic[:<scene>][,fps=N][,nopace]";
+    return CaptureSourcePtr();
+}
+
+#endif
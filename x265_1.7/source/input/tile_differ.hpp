@@ -0,0 +1,67 @@
+#ifndef _TILE_DIFFER_HPP
+#define _TILE_DIFFER_HPP
+
+#include "capture_source.hpp"
+#include "primitives.h"
+
+/*
+ * 采集帧的脏块检测。画面按CTU大小(tileSize，默认64)分块，每一帧和上一帧逐块比较Y、U、V，
+ * 得到每个CTU一个字节的map(光栅顺序，1为有变化)，和块数一起放在环的slot里YUV数据之后，
+ * 用YuvFrameInfo::dirtyMap()取得。一行块按内存顺序逐行比较，已经发现不同的块不再比较它剩下的行
+ * 和平面；静止的桌面要读完两帧。比较用x265::primitives.diff_tiles，要先setup primitives。
+ */
+class TileDiffer {
+public:
+    TileDiffer( const CaptureFormat &_Format, int _TileSize )
+            : format(_Format), tileSize(_TileSize)
+            , cols((_Format.width + _TileSize - 1) / _TileSize)
+            , rows((_Format.height + _TileSize - 1) / _TileSize) {}
+
+    int tileCols() const { return cols; }
+    int tileRows() const { return rows; }
+    std::size_t mapSize() const { return (std::size_t)cols * rows; }
+
+    // fills map (mapSize() bytes) for the frame cur against prev, both in the CaptureFormat layout,
+    // returns the number of dirty tiles. prev NULL, e.g. the first frame, marks every tile
+    uint32_t diff( const uint8_t *cur, const uint8_t *prev, uint8_t *map ) const
+    {
+        if( !prev ) {
+            memset( map, 1, mapSize() );
+            return (uint32_t)mapSize();
+        } // if
+
+        memset( map, 0, mapSize() );
+        int shift = format.csp == X265_CSP_I420 ? 1 : 0;
+        std::size_t lumaSize = (std::size_t)format.width * format.height;
+        std::size_t chromaSize = (std::size_t)format.chromaWidth() * format.chromaHeight();
+        // luma first, most changes show there and the chroma of those tiles is not read
+        DiffPlane( cur, prev, format.width, format.height, 0, map );
+        DiffPlane( cur + lumaSize, prev + lumaSize, format.chromaWidth(), format.chromaHeight(), shift, map );
+        DiffPlane( cur + lumaSize + chromaSize, prev + lumaSize + chromaSize,
+                    format.chromaWidth(), format.chromaHeight(), shift, map );
+
+        uint32_t dirty = 0;
+        for( std::size_t i = 0; i < mapSize(); ++i )
+            dirty += map[i];
+        return dirty;
+    }
+
+protected:
+    void DiffPlane( const uint8_t *cur, const uint8_t *prev, int width, int height, int shift, uint8_t *map ) const
+    {
+        int size = tileSize >> shift;
+        for( int r = 0; r < rows; ++r ) {
+            int y = r * size;
+            std::size_t offset = (std::size_t)y * width;
+            x265::primitives.diff_tiles( cur + offset, prev + offset, width, width,
+                            std::min(size, height - y), size, map + r * cols );
+        } // for
+    }
+
+protected:
+    CaptureFormat       format;
+    int                 tileSize;
+    int                 cols, rows;
+};
+
+#endif
@@ -38,7 +38,11 @@
 #endif
 
 #include "network/desktop_streaming_service.hpp"
+#include "capture_source.hpp"
+#include "tile_differ.hpp"
+#if _WIN32
 #include "capture.hpp"
+#endif
 
 using namespace x265;
 using namespace std;
@@ -46,91 +50,133 @@ using namespace std;
 // std::unique_ptr<SharedBuffer>           pYuvFrameBuf;
 // std::unique_ptr<std::thread>            pReadThread;
 
-#include <fstream>
-inline
-char* DesktopStreamingService::ReadFrameFromFile(std::size_t &len)
-{
-    using namespace std;
-
-    assert( framesize > 0 );
+#if _WIN32
+// the GDI screen in the session's format, the capture ends if the screen does not match it
+class ScreenCaptureSource : public CaptureSource {
+public:
+    explicit ScreenCaptureSource( const CaptureFormat &format )
+            : frame(format.width, format.height, format.csp) {}
 
-    static ifstream ifs( "hd.yuv", ios::in | ios::binary );
-    static vector<char> buf;
+    bool capture( char *dst, std::size_t len, int64_t *pConvertTime )
+    { return CaptureScreenToYuv(frame, dst, len, pConvertTime) != NULL; }
 
-    static uint32_t count = 0;
+    std::string description() const
+    { return "screen"; }
 
-    if (!ifs || ifs.eof())
-        return NULL;
+private:
+    YuvFrame            frame;
+};
+#endif
 
-    buf.resize( framesize );
-    ifs.read( &buf[0], framesize );
-    //!! check read correct in this way!!!
-    if( ifs.gcount() != framesize )
-        return NULL;
+bool DesktopStreamingService::OpenCaptureSource( const CaptureFormat &format )
+{
+    CaptureSourcePtr source;
+    std::string error;
+    std::unique_lock<std::mutex> lkSession(lock, std::defer_lock);
+    if( !format.supported() ) {
+        // the converters and the tile differ know only these layouts; CreateCaptureSource says the same,
+        // but a fixed source or the screen would not go through it
+        error = "capture needs an 8 bit i420 or i444 input with even dimensions";
+    } else {
+        std::unique_lock<std::mutex> lk(sourceLock());
+        source = fixedSource();
+        std::string spec = defaultCaptureSpec();
+        lk.unlock();
+
+        lkSession.lock();
+        if( !captureSpec.empty() )
+            spec = captureSpec;
+        lkSession.unlock();
+
+        if( !source ) {
+#if _WIN32
+            if( spec.empty() || spec == "screen" )
+                source = std::make_shared<ScreenCaptureSource>( format );
+#else
+            if( spec.empty() )
+                spec = "synthetic";
+#endif
+        } // if
+        if( !source )
+            source = CreateCaptureSource( spec, format, error );
+    } // if
 
-    // std::this_thread::sleep_for( std::chrono::milliseconds(100) );
+    lkSession.lock();
+    pCaptureSource = source;
+    captureDescription = source ? source->description() : std::string();
+    lkSession.unlock();
 
-    // DBG_STREAM("Reading yuv frame " << ++count << " framesize = " << framesize);
+    pTileDiffer.reset();
+    if( source && tileSize ) {
+        pTileDiffer = std::make_shared<TileDiffer>( format, tileSize );
+        yuvBuf.reserve( YUV_HEADER_LEN + framesize + pTileDiffer->mapSize() );
+    } // if
 
-    len = framesize;
-    return &buf[0];
+    if( !source ) {
+        x265_log( NULL, X265_LOG_ERROR, "capture: %s\n", error.c_str() );
+        pClient->sendMsg( "Capture failed: " + error + ".\n" );
+        return false;
+    } // if
+    DBG_STREAM( "Capture source: " << source->description() );
+    return true;
 }
 
 inline
-char* DesktopStreamingService::CaptureOneFrame(std::size_t &len)
+bool DesktopStreamingService::CaptureOneFrame(char *dst, std::size_t len, int64_t *pConvertTime)
 { 
-    return CaptureScreenToYuv(len); 
-    // return ReadFrameFromFile(len);
+    if( !pCaptureSource )
+        return false;
+    if( pConvertTime )
+        *pConvertTime = gen_timestamp_us();     // sources that convert from RGB overwrite it
+    return pCaptureSource->capture( dst, len, pConvertTime );
 }
 
-void DesktopStreamingService::DoStartCapture()
+// the previous slot is compared in place, the ring does not give it to the writer again before this one is committed
+void DesktopStreamingService::MarkDirtyTiles( BytesArray &buffer )
 {
-    std::size_t     len;
-    char*           pFrame = NULL;
-
-    while( captureRunning && (pFrame = CaptureOneFrame(len)) ) {
-        assert( len == framesize );
-        BytesArray &buffer = yuvBuf.writeBuf();
-        buffer.resize( YUV_HEADER_LEN );
-        new (buffer.ptr()) YuvFrameInfo( ++yuvSeqNO );
-        DBG_STREAM("Captured frame SeqNO = " << yuvSeqNO);
-        buffer.append( pFrame, framesize );
-        yuvBuf.push();
-    } // while
-
-	captureRunning = false;
+    if( !pTileDiffer )
+        return;
 
-    DBG_STREAM("Capture thread end!");
+    YuvFrameInfo *pInfo = (YuvFrameInfo*)(buffer.ptr());
+    const BytesArray *pPrev = yuvBuf.lastCommitted();
+    // nothing to compare with after reset() or the end-of-stream slot
+    const uint8_t *prev = pPrev && pPrev->size() == buffer.size() ? (const uint8_t*)pPrev->ptr() + YUV_HEADER_LEN : NULL;
+    pInfo->dirtyMapOffset = YUV_HEADER_LEN + framesize;
+    pInfo->dirtyTiles = pTileDiffer->diff( (const uint8_t*)buffer.ptr() + YUV_HEADER_LEN, prev,
+                                (uint8_t*)buffer.ptr() + pInfo->dirtyMapOffset );
+    pInfo->tileCols = (uint16_t)pTileDiffer->tileCols();
+    pInfo->tileRows = (uint16_t)pTileDiffer->tileRows();
 }
 
-void DesktopStreamingService::Capture_n_frames( const std::string &cmd, const ErrType &error )
+// capture straight into the preallocated ring slot, no intermediate frame copy.
+// the only writer of yuvBuf, maxFrames 0 runs until StopCapture(), otherwise captures "n" frames
+void DesktopStreamingService::DoStartCapture( uint32_t maxFrames )
 {
-    std::size_t     len;
-    char*           pFrame = NULL;
-    uint32_t        i, n;
+    uint32_t        n = 0;
     char            msgBuf[128];
 
-    if( sscanf( cmd.c_str(), "%u", &n ) != 1 ) {
-        DBG_STREAM("DesktopStreamingService::Capture_n_frames() wrong cmd format!");
-        pClient->sendMsg("DesktopStreamingService::Capture_n_frames() wrong cmd format!\n");
-        return;
-    } // if
-    
-    captureRunning = true;
-    for( i = 1; i <= n && captureRunning; ++i ) {
-        pFrame = CaptureOneFrame(len);
-        if( !pFrame ) break;
-        BytesArray &buffer = yuvBuf.writeBuf();
-        buffer.resize( YUV_HEADER_LEN );
-        new (buffer.ptr()) YuvFrameInfo( ++yuvSeqNO );
-        buffer.append( pFrame, framesize );
-        yuvBuf.push();
-    } // for
+    set_thread_name( "capture" );
+    while( captureRunning && (!maxFrames || n < maxFrames) ) {
+        BytesArray &buffer = yuvBuf.writeSlot();
+        buffer.resize( YUV_HEADER_LEN + framesize + (pTileDiffer ? pTileDiffer->mapSize() : 0) );
+        int64_t captureTime = gen_timestamp_us(), convertTime = 0;
+        if( !CaptureOneFrame(buffer.ptr() + YUV_HEADER_LEN, framesize, &convertTime) )
+            break;
+        new (buffer.ptr()) YuvFrameInfo( ++yuvSeqNO, captureTime, convertTime );
+        MarkDirtyTiles( buffer );
+        DBG_STREAM("Captured frame SeqNO = " << yuvSeqNO << " dirty tiles " << ((YuvFrameInfo*)buffer.ptr())->dirtyTiles);
+        yuvBuf.commitWrite();
+        ++n;
+    } // while
 
     captureRunning = false;
-    DBG_STREAM("DesktopStreamingService::Capture_n_frames() finish.");
-    sprintf( msgBuf, "N_Capture finish, totally captured %u frames.\n", i-1 );
-    pClient->sendMsg(msgBuf);
+
+    if( maxFrames && pClient ) {
+        sprintf( msgBuf, "N_Capture finish, totally captured %u frames.\n", n );
+        pClient->sendMsg(msgBuf);
+    } // if
+
+    DBG_STREAM("Capture thread end!");
 }
 
 YUVInput::YUVInput(InputFileInfo& info)
@@ -143,6 +189,7 @@ YUVInput::YUVInput(InputFileInfo& info)
     height = info.height;
     colorSpace = info.csp;
     threadActive = false;
+    forcedKeyframe = false;
     ifs = NULL;
 
     uint32_t pixelbytes = depth > 8 ? 2 : 1;
@@ -162,6 +209,10 @@ YUVInput::YUVInput(InputFileInfo& info)
         return;
     }
 
+    CaptureFormat captureFormat(width, height, colorSpace, (double)info.fpsNum / info.fpsDenom, depth);
+    if (!DesktopStreamingService::instance()->OpenCaptureSource(captureFormat))
+        return;
+
     if (!strcmp(info.filename, "-"))
     {
         ifs = &cin;
@@ -237,6 +288,8 @@ YUVInput::YUVInput(InputFileInfo& info)
 
 YUVInput::~YUVInput()
 {
+    /* the encoder is closed before the input is released */
+    DesktopStreamingService::instance()->FreeFrameTraces();
     if (ifs && ifs != &cin)
         delete ifs;
     for (int i = 0; i < QUEUE_SIZE; i++)
@@ -325,17 +378,35 @@ void YUVInput::threadMain()
 // }
 
 // called by main thread
+// pic points into the ring slot; x265_encoder_encode() copies it before the next readPicture,
+// so the slot is handed back to the capture thread here
 bool YUVInput::readPicture(x265_picture& pic)
 {
-    static BytesArray buffer( framesize + YUV_HEADER_LEN );
+    SpscFrameRing &ring = DesktopStreamingService::instance()->YuvBuffer();
 
-    DesktopStreamingService::instance()->YuvBuffer().pop( buffer );
+    ring.releaseRead();
+    BytesArray &buffer = *ring.readSlot();
 
-    if( buffer.empty() )
+    if( buffer.empty() ) {
+        ring.releaseRead();
         return false;
+    } // if
+
+    // keyframe asked for by the send queue after dropping frames
+    if( DesktopStreamingService::instance()->TakeKeyframeRequest() ) {
+        pic.sliceType = X265_TYPE_IDR;
+        forcedKeyframe = true;
+    } else if( forcedKeyframe ) {
+        pic.sliceType = X265_TYPE_AUTO;
+        forcedKeyframe = false;
+    } // if
 
     YuvFrameInfo *pInfo = (YuvFrameInfo*)(buffer.ptr());
-    DBG_STREAM( "Reading YUV frame seq = " << pInfo->seqNO << " created at " << pInfo->timestamp );
+    DBG_STREAM( "Reading YUV frame seq = " << pInfo->seqNO << " created at " << pInfo->timestamp
+                << " handoff " << ring.lastHandoffMicros() << "us dirty tiles " << pInfo->dirtyTiles );
+
+    // comes back in pic_out.userData, released by RAWOutput::writeFrame or at teardown
+    pic.userData = DesktopStreamingService::instance()->NewFrameTrace( *pInfo );
 
     uint32_t pixelbytes = depth > 8 ? 2 : 1;
     pic.colorSpace = colorSpace;
@@ -346,6 +417,8 @@ bool YUVInput::readPicture(x265_picture& pic)
     pic.planes[0] = buffer.ptr() + YUV_HEADER_LEN;
     pic.planes[1] = (char*)pic.planes[0] + pic.stride[0] * height;
     pic.planes[2] = (char*)pic.planes[1] + pic.stride[1] * (height >> x265_cli_csps[colorSpace].height[1]);
+    // 块大小就是CTU(SetTileSize)，没有变化的CTU编码器不做分析，直接编成零运动矢量的skip
+    pic.ctuDirtyMap = const_cast<uint8_t*>( pInfo->dirtyMap() );
 
     return true;
 }
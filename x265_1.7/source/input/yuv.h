@@ -49,6 +49,8 @@ protected:
 
     bool threadActive;
 
+    bool forcedKeyframe;
+
     ThreadSafeInteger readCount;
 
     ThreadSafeInteger writeCount;
@@ -0,0 +1,124 @@
+// compile: c++ -o io_pool_bench io_pool_bench.cpp -Icommon -lboost_system -std=c++11 -pthread -O2
+
+/*
+ * 测试IoServicePool线程数对发送吞吐的影响。
+ * 每个线程数下建立nConns个loopback连接，服务端是DataConnection，同一份payload以GatherBuffer
+ * 的形式发给所有连接(和broadcast一样)，客户端每个连接一个阻塞读线程，统计所有数据收完的时间。
+ * usage: io_pool_bench [-c connections] [-s frame_bytes] [-n frames] [-t 1,2,4,8]
+ */
+
+#include "network/connection.hpp"
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+
+using boost::asio::ip::tcp;
+
+struct BenchResult {
+    std::size_t     threads;
+    double          seconds;
+    double          mbytesPerSec;
+};
+
+static
+BenchResult RunOnce( std::size_t nThreads, std::size_t nConns, std::size_t frameBytes, std::size_t nFrames )
+{
+    boost::asio::io_service io_service;
+    std::unique_ptr<boost::asio::io_service::work> work( new boost::asio::io_service::work(io_service) );
+
+    tcp::acceptor acceptor( io_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0) );
+    tcp::endpoint server = acceptor.local_endpoint();
+
+    std::vector<TcpConnectionPtr>                   senders;
+    std::vector<std::shared_ptr<tcp::socket>>       receivers;
+    for( std::size_t i = 0; i < nConns; ++i ) {
+        TcpConnectionPtr conn( new DataConnection(io_service) );
+        std::shared_ptr<tcp::socket> sock = std::make_shared<tcp::socket>( io_service );
+        sock->connect( server );
+        acceptor.accept( conn->socket() );
+        senders.push_back( conn );
+        receivers.push_back( sock );
+    } // for
+
+    std::vector<char> payload( frameBytes, 'x' );
+    const std::size_t totalPerConn = frameBytes * nFrames;
+
+    IoServicePool pool( io_service );
+    pool.start( nThreads );
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> readers;
+    for( std::size_t i = 0; i < nConns; ++i ) {
+        std::shared_ptr<tcp::socket> sock = receivers[i];
+        readers.emplace_back( [sock, totalPerConn]() {
+            std::vector<char> buf( 1024 * 1024 );
+            std::size_t total = 0;
+            boost::system::error_code ec;
+            while( total < totalPerConn ) {
+                std::size_t n = sock->read_some( boost::asio::buffer(buf), ec );
+                if( ec ) break;
+                total += n;
+            } // while
+        } );
+    } // for
+
+    for( std::size_t f = 0; f < nFrames; ++f ) {
+        GatherBufferPtr frame = std::make_shared<GatherBuffer>();
+        frame->append( &payload[0], payload.size() );
+        for( auto &conn : senders )
+            conn->sendData( frame );
+    } // for
+
+    for( auto &t : readers )
+        t.join();
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    work.reset();
+    pool.stop();
+    pool.join();
+
+    BenchResult ret;
+    ret.threads = nThreads;
+    ret.seconds = std::chrono::duration<double>(end - start).count();
+    ret.mbytesPerSec = (double)totalPerConn * nConns / ret.seconds / (1024.0 * 1024.0);
+    return ret;
+}
+
+int main( int argc, char **argv )
+{
+    std::size_t nConns = 4, frameBytes = 256 * 1024, nFrames = 2000;
+    std::vector<std::size_t> threadCounts = { 1, 2, 4, 8 };
+
+    for( int i = 1; i + 1 < argc; i += 2 ) {
+        std::string opt( argv[i] );
+        if( opt == "-c" ) {
+            nConns = strtoul( argv[i+1], NULL, 10 );
+        } else if( opt == "-s" ) {
+            frameBytes = strtoul( argv[i+1], NULL, 10 );
+        } else if( opt == "-n" ) {
+            nFrames = strtoul( argv[i+1], NULL, 10 );
+        } else if( opt == "-t" ) {
+            threadCounts.clear();
+            std::stringstream sstr( argv[i+1] );
+            std::string item;
+            while( std::getline(sstr, item, ',') )
+                threadCounts.push_back( strtoul(item.c_str(), NULL, 10) );
+        } else {
+            fprintf( stderr, "usage: %s [-c connections] [-s frame_bytes] [-n frames] [-t 1,2,4,8]\n", argv[0] );
+            return -1;
+        } // if
+    } // for
+
+    printf( "connections: %lu frame bytes: %lu frames: %lu\n",
+            (unsigned long)nConns, (unsigned long)frameBytes, (unsigned long)nFrames );
+    printf( "%8s %10s %12s\n", "threads", "seconds", "MB/s" );
+    for( std::size_t n : threadCounts ) {
+        if( !n ) continue;
+        BenchResult r = RunOnce( n, nConns, frameBytes, nFrames );
+        printf( "%8lu %10.3f %12.1f\n", (unsigned long)r.threads, r.seconds, r.mbytesPerSec );
+    } // for
+
+    return 0;
+}
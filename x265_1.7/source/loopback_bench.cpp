@@ -0,0 +1,450 @@
+// compile: c++ -o loopback_bench loopback_bench.cpp common/network/desktop_streaming_request.cpp common/network/service.cpp x265.cpp input/*.cpp output/*.cpp <x265 encoder and common objects> -Icommon -Iencoder -I. -lavcodec -lavutil -lswscale `sdl-config --cflags --libs` -lboost_system -std=c++11 -pthread -O2
+
+/*
+ * 端到端loopback benchmark: 同一个进程里跑TcpServer + DesktopStreamingService + x265编码，
+ * 客户端是headless的DesktopStreamingRequest(解码、颜色转换，不开窗口)，通过127.0.0.1连接。
+ * 画面来自合成的桌面(input/capture_source.hpp的SyntheticDesktopSource，-s选场景)，按帧率定时产生，
+ * 不依赖屏幕采集。
+ * 预热之后清零各阶段的延迟直方图，测量期间统计:
+ *     fps、Mbit/s、server/client各阶段延迟的p50/p90/p99/max、每个线程组(按线程名)的CPU占用、
+ *     各处丢掉的帧(采集追不上、发送队列、播放追帧、显示流水线覆盖)。
+ * 客户端和服务端在同一进程，时钟是同一个，network和endtoend两个阶段是准确的。
+ * -l 在数据连接中间加一个限速的代理，模拟瓶颈带宽；-a 打开服务端的码率控制(需要x265参数里有VBV，
+ * 例如 -x "--bitrate 8000 --vbv-maxrate 8000 --vbv-bufsize 400")，每秒的目标码率、估计的排队延迟、
+ * 实际收到的Mbit/s记录在series里，可以看到码率收敛的过程。
+ * 结果以JSON输出到stdout，其余日志在stderr。
+ * usage: loopback_bench [-r 1920x1080] [-c i444|i420] [-f fps] [-w warmup_s] [-d duration_s]
+ *                       [-p port] [-t io_threads] [-x "extra x265 args"]
+ *                       [-l link_kbps] [-a "min_kbps max_kbps [delay_ms]"] [-s idle|text|drag|video|mixed]
+ */
+
+#include "network/tcp_server.hpp"
+#include "network/desktop_streaming_request.hpp"
+#include "input/capture_source.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#if defined(__linux__)
+#include <dirent.h>
+#endif
+
+using boost::asio::ip::tcp;
+
+// the globals server.cpp defines for the server side
+BufferPool<BytesArray>          gServerBufMgr(INIT_FRAME_SIZE, 16);
+FrameBroadcaster                gBroadcaster;
+
+static const char * const       SERVER_LATENCY_STAGES[SLS_COUNT] = {
+    "capture", "convert", "queue", "lookahead", "dispatch", "encode", "output", "send", "total"
+};
+LatencyTracer                   gServerLatency(SERVER_LATENCY_STAGES, SLS_COUNT);
+bool                            g_broadcast_mode = false;
+
+DesktopStreamingService* DesktopStreamingService::pInstance = NULL;
+
+std::unique_ptr<boost::asio::deadline_timer>    fps_timer_counter;
+bool g_fps_count_flag = false;
+uint32_t g_fps_count = 0;
+
+// frames sent in each second of the measurement
+static std::mutex               gFpsLock;
+static std::vector<uint32_t>    gFpsSamples;
+static std::atomic<bool>        gMeasuring(false);
+
+void FPS_CountHandler(const boost::system::error_code &ec)
+{
+    if( gMeasuring ) {
+        std::lock_guard<std::mutex> lk( gFpsLock );
+        gFpsSamples.push_back( g_fps_count );
+    } // if
+    g_fps_count = 0;
+    if( g_fps_count_flag ) {
+        fps_timer_counter->expires_from_now(boost::posix_time::seconds(1));
+        fps_timer_counter->async_wait( FPS_CountHandler );
+    } // if
+}
+
+
+/*
+ * 限速的TCP代理，放在客户端和服务端的数据端口之间: 服务端到客户端的方向按令牌桶限制在linkKbps，
+ * 两端socket的缓冲都设得很小，瓶颈的积压才会留在服务端的socket和发送队列里，
+ * 就像慢速链路上那样，而不是被loopback巨大的缓冲吸收掉。
+ */
+class ThrottleProxy {
+    static const std::size_t    CHUNK = 4096;
+    static const int            SOCKET_BUFSIZE = 32 * 1024;
+public:
+    ThrottleProxy( uint16_t _ListenPort, uint16_t _UpstreamPort, uint32_t _LinkKbps )
+            : acceptor(io), listenPort(_ListenPort), upstreamPort(_UpstreamPort), linkKbps(_LinkKbps) {}
+
+    uint16_t port() const { return listenPort; }
+
+    bool start()
+    {
+        boost::system::error_code ec;
+        tcp::endpoint ep( boost::asio::ip::address_v4::loopback(), listenPort );
+        acceptor.open( ep.protocol(), ec );
+        if( !ec ) acceptor.set_option( tcp::acceptor::reuse_address(true), ec );
+        if( !ec ) acceptor.bind( ep, ec );
+        if( !ec ) acceptor.listen( 1, ec );
+        if( ec ) {
+            std::cerr << "throttle proxy on port " << listenPort << ": " << ec.message() << std::endl;
+            return false;
+        } // if
+        std::thread( std::bind(&ThrottleProxy::Run, this) ).detach();
+        return true;
+    }
+
+private:
+    typedef std::chrono::steady_clock       Clock;
+
+    void Run()
+    {
+        set_thread_name( "throttle" );
+
+        tcp::socket down( io ), up( io );
+        boost::system::error_code ec;
+        acceptor.accept( down, ec );
+        if( !ec ) up.open( tcp::v4(), ec );
+        if( !ec ) {
+            up.set_option( tcp::socket::receive_buffer_size(SOCKET_BUFSIZE) );
+            down.set_option( tcp::socket::send_buffer_size(SOCKET_BUFSIZE) );
+            up.connect( tcp::endpoint(boost::asio::ip::address_v4::loopback(), upstreamPort), ec );
+        } // if
+        if( ec ) {
+            std::cerr << "throttle proxy: " << ec.message() << std::endl;
+            return;
+        } // if
+
+        // the client does not write on the data connection, one direction is enough
+        double bytesPerSecond = linkKbps * 1000.0 / 8;
+        char buf[CHUNK];
+        Clock::time_point next = Clock::now();
+        for( ;; ) {
+            std::size_t n = up.read_some( boost::asio::buffer(buf), ec );
+            if( ec )
+                break;
+            // an idle link does not save up credit beyond one chunk
+            Clock::time_point now = Clock::now();
+            if( next < now )
+                next = now;
+            next += std::chrono::duration_cast<Clock::duration>( std::chrono::duration<double>(n / bytesPerSecond) );
+            std::this_thread::sleep_until( next );
+            boost::asio::write( down, boost::asio::buffer(buf, n), ec );
+            if( ec )
+                break;
+        } // for
+        std::cerr << "throttle proxy: " << ec.message() << std::endl;
+    }
+
+private:
+    boost::asio::io_service     io;
+    tcp::acceptor               acceptor;
+    uint16_t                    listenPort, upstreamPort;
+    uint32_t                    linkKbps;
+};
+
+
+/*
+ * 每个线程组(线程名)累计的CPU时间，来自/proc/self/task/<tid>/stat的utime + stime。
+ * 测量前后各取一次，差值除以墙钟时间就是占用的核数。
+ */
+typedef std::map<std::string, double>       CpuSeconds;
+
+static
+CpuSeconds SampleThreadCpu()
+{
+    CpuSeconds ret;
+#if defined(__linux__)
+    double tick = (double)sysconf( _SC_CLK_TCK );
+    DIR *dir = opendir( "/proc/self/task" );
+    if( !dir )
+        return ret;
+    while( struct dirent *ent = readdir(dir) ) {
+        if( ent->d_name[0] == '.' )
+            continue;
+        std::ifstream ifs( std::string("/proc/self/task/") + ent->d_name + "/stat" );
+        std::string line;
+        if( !std::getline(ifs, line) )
+            continue;
+        std::string::size_type l = line.find( '(' ), r = line.rfind( ')' );
+        if( l == std::string::npos || r == std::string::npos )
+            continue;
+        std::string name = line.substr( l + 1, r - l - 1 );
+        // fields after the name start at 3 (state), utime and stime are 14 and 15
+        std::stringstream sstr( line.substr(r + 2) );
+        std::string field;
+        unsigned long long utime = 0, stime = 0;
+        for( int i = 3; i <= 15 && sstr >> field; ++i ) {
+            if( i == 14 ) utime = strtoull( field.c_str(), NULL, 10 );
+            if( i == 15 ) stime = strtoull( field.c_str(), NULL, 10 );
+        } // for
+        ret[name] += (double)(utime + stime) / tick;
+    } // while
+    closedir( dir );
+#endif
+    return ret;
+}
+
+
+// a quoted JSON string, the x265 args and thread names are free text
+static
+std::string JsonString( const std::string &str )
+{
+    std::string ret( "\"" );
+    for( char c : str ) {
+        switch( c ) {
+        case '"':  ret += "\\\""; break;
+        case '\\': ret += "\\\\"; break;
+        case '\n': ret += "\\n"; break;
+        case '\r': ret += "\\r"; break;
+        case '\t': ret += "\\t"; break;
+        default:
+            if( (unsigned char)c < 0x20 ) {
+                char hex[8];
+                sprintf( hex, "\\u%04x", (unsigned)(unsigned char)c );
+                ret += hex;
+            } else {
+                ret += c;
+            } // if
+        } // switch
+    } // for
+    ret += "\"";
+    return ret;
+}
+
+
+struct BenchOptions {
+    BenchOptions() : width(1920), height(1080), i444(true), fps(60), warmup(3), duration(10)
+                   , port(18888), ioThreads(2), linkKbps(0), scene(SyntheticDesktopSource::SCENE_DRAG) {}
+
+    int             width, height;
+    bool            i444;
+    int             fps;
+    double          warmup, duration;
+    uint16_t        port;
+    std::size_t     ioThreads;
+    std::string     extraArgs;
+    uint32_t        linkKbps;           // 0 connects the data connection directly
+    std::string     rateControl;        // "min max [delay]", empty leaves the server's rate control off
+    SyntheticDesktopSource::Scene   scene;
+};
+
+static
+bool ParseOptions( int argc, char **argv, BenchOptions &opt )
+{
+    for( int i = 1; i + 1 < argc; i += 2 ) {
+        std::string key( argv[i] ), val( argv[i+1] );
+        if( key == "-r" ) {
+            if( sscanf(val.c_str(), "%dx%d", &opt.width, &opt.height) != 2 )
+                return false;
+        } else if( key == "-c" ) {
+            if( val != "i444" && val != "i420" )
+                return false;
+            opt.i444 = val == "i444";
+        } else if( key == "-f" ) {
+            opt.fps = atoi( val.c_str() );
+        } else if( key == "-w" ) {
+            opt.warmup = atof( val.c_str() );
+        } else if( key == "-d" ) {
+            opt.duration = atof( val.c_str() );
+        } else if( key == "-p" ) {
+            opt.port = (uint16_t)atoi( val.c_str() );
+        } else if( key == "-t" ) {
+            opt.ioThreads = std::max( 1, atoi(val.c_str()) );
+        } else if( key == "-x" ) {
+            opt.extraArgs = val;
+        } else if( key == "-l" ) {
+            opt.linkKbps = (uint32_t)atoi( val.c_str() );
+        } else if( key == "-a" ) {
+            opt.rateControl = val;
+        } else if( key == "-s" ) {
+            if( !SyntheticDesktopSource::parseScene(val, opt.scene) )
+                return false;
+        } else {
+            return false;
+        } // if
+    } // for
+    return argc % 2 == 1 && opt.fps > 0 && opt.width > 0 && opt.height > 0 && opt.duration > 0;
+}
+
+static
+bool ConnectTo( const TcpConnectionPtr &conn, const tcp::endpoint &ep )
+{
+    boost::system::error_code ec;
+    for( int i = 0; i < 100; ++i ) {
+        conn->socket().connect( ep, ec );
+        if( !ec )
+            return true;
+        conn->socket().close();
+        std::this_thread::sleep_for( std::chrono::milliseconds(20) );
+    } // for
+    std::cerr << "connect to " << ep << " failed: " << ec.message() << std::endl;
+    return false;
+}
+
+int main( int argc, char **argv )
+{
+    BenchOptions opt;
+    if( !ParseOptions(argc, argv, opt) )
+        err_ret( -1, "usage: %s [-r 1920x1080] [-c i444|i420] [-f fps] [-w warmup_s] [-d duration_s] "
+                     "[-p port] [-t io_threads] [-x \"extra x265 args\"] [-l link_kbps] "
+                     "[-a \"min_kbps max_kbps [delay_ms]\"] [-s idle|text|drag|video|mixed]", argv[0] );
+
+    // stdout carries only the JSON result
+    std::cout.rdbuf( std::cerr.rdbuf() );
+    set_thread_name( "bench" );
+
+    std::shared_ptr<SyntheticDesktopSource> desktop = std::make_shared<SyntheticDesktopSource>(
+                CaptureFormat(opt.width, opt.height, opt.i444 ? X265_CSP_I444 : X265_CSP_I420, opt.fps), opt.scene );
+    DesktopStreamingService::SetCaptureSource( desktop );
+
+    // server
+    boost::asio::io_service serverIo;
+    fps_timer_counter.reset( new boost::asio::deadline_timer(serverIo, boost::posix_time::seconds(1)) );
+    TcpServer server( serverIo, opt.port );
+    IoServicePool serverPool( serverIo, "server-io" );
+    serverPool.start( opt.ioThreads );
+
+    // headless client
+    g_headless_display = true;
+    boost::asio::io_service clientIo;
+    std::unique_ptr<boost::asio::io_service::work> clientWork( new boost::asio::io_service::work(clientIo) );
+    TcpConnectionPtr msgConn( new MsgConnection(clientIo) );
+    TcpConnectionPtr dataConn( new DataConnection(clientIo) );
+    tcp::endpoint msgEp( boost::asio::ip::address_v4::loopback(), opt.port );
+    tcp::endpoint dataEp( boost::asio::ip::address_v4::loopback(), opt.port + 1 );
+    std::unique_ptr<ThrottleProxy> proxy;
+    if( opt.linkKbps ) {
+        proxy.reset( new ThrottleProxy(opt.port + 2, opt.port + 1, opt.linkKbps) );
+        if( !proxy->start() )
+            _exit( 1 );
+        dataEp.port( proxy->port() );
+    } // if
+    if( !ConnectTo(msgConn, msgEp) || !ConnectTo(dataConn, dataEp) )
+        _exit( 1 );
+    msgConn->addMsgHandler( 10, []( const std::string &msg, TcpConnectionPtr ) {
+        std::cerr << "Server message: " << msg << std::endl;
+        return true;
+    } );
+    msgConn->recvMsg();
+    IoServicePool clientPool( clientIo, "client-io" );
+    clientPool.start( 1 );
+
+    char res[32];
+    sprintf( res, "%dx%d", opt.width, opt.height );
+    std::string args = std::string("- --preset ultrafast --bframes 0 --rc-lookahead 0 --ref 1 --no-b-pyramid")
+                        + " --input-res " + res + " --input-csp " + (opt.i444 ? "i444" : "i420")
+                        + " --fps " + std::to_string(opt.fps) + " -o - " + opt.extraArgs;
+    msgConn->sendMsg( "service DesktopStreaming\n" );
+    msgConn->sendMsg( "latency on\n" );
+    std::shared_ptr<DesktopStreamingRequest> request( new DesktopStreamingRequest(msgConn, dataConn) );
+    request->SetEncoderArgs( args );
+    request->Start();
+    if( !opt.rateControl.empty() )
+        msgConn->sendMsg( "ratecontrol " + opt.rateControl + "\n" );
+
+    // warm up until pictures come out of the display pipeline, then start from clean counters
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point warmupEnd = Clock::now() + std::chrono::microseconds((int64_t)(opt.warmup * 1e6));
+    while( Clock::now() < warmupEnd || !request->Summarize().displayed ) {
+        std::this_thread::sleep_for( std::chrono::milliseconds(50) );
+        if( Clock::now() > warmupEnd + std::chrono::seconds(30) ) {
+            std::cerr << "no frame was displayed within 30s after the warm-up" << std::endl;
+            _exit( 1 );
+        } // if
+    } // while
+
+    gServerLatency.reset();
+    gClientLatency.reset();
+    DesktopStreamingService *service = DesktopStreamingService::instance();
+    SendQueueStats sendBefore = service ? service->SendQueueStatistics() : SendQueueStats();
+    DesktopStreamingRequest::Summary before = request->Summarize();
+    uint64_t generatedBefore = desktop->generatedFrames(), missedBefore = desktop->missedFrames();
+    CpuSeconds cpuBefore = SampleThreadCpu();
+    Clock::time_point start = Clock::now();
+    gMeasuring = true;
+
+    // one sample a second: the rate controller's target and delay estimate, and what arrived
+    struct Sample {
+        double                  t;
+        RateController::Stats   rc;
+        double                  mbps;
+    };
+    std::vector<Sample> series;
+    Clock::time_point end = start + std::chrono::microseconds((int64_t)(opt.duration * 1e6));
+    Clock::time_point last = start;
+    uint64_t lastBytes = before.bytes;
+    while( Clock::now() < end ) {
+        std::this_thread::sleep_until( std::min(end, last + std::chrono::seconds(1)) );
+        Clock::time_point now = Clock::now();
+        uint64_t bytes = request->Summarize().bytes;
+        Sample s;
+        s.t = std::chrono::duration<double>( now - start ).count();
+        s.rc = service ? service->RateControlStatistics() : RateController::Stats();
+        s.mbps = (bytes - lastBytes) * 8.0 / std::chrono::duration<double>(now - last).count() / 1e6;
+        series.push_back( s );
+        last = now;
+        lastBytes = bytes;
+    } // while
+
+    gMeasuring = false;
+    double seconds = std::chrono::duration<double>( Clock::now() - start ).count();
+    CpuSeconds cpuAfter = SampleThreadCpu();
+    DesktopStreamingRequest::Summary after = request->Summarize();
+    SendQueueStats sendAfter = service ? service->SendQueueStatistics() : SendQueueStats();
+    uint64_t generated = desktop->generatedFrames() - generatedBefore;
+    uint64_t received = after.frames - before.frames;
+
+    std::ostringstream json;
+    json << std::fixed << std::setprecision( 3 );
+    json << "{\"config\":{\"resolution\":" << JsonString(res) << ",\"csp\":\"" << (opt.i444 ? "i444" : "i420")
+         << "\",\"fps\":" << opt.fps << ",\"duration_s\":" << seconds << ",\"io_threads\":" << opt.ioThreads
+         << ",\"x265\":" << JsonString(opt.extraArgs) << ",\"link_kbps\":" << opt.linkKbps
+         << ",\"ratecontrol\":" << JsonString(opt.rateControl)
+         << ",\"scene\":" << JsonString(SyntheticDesktopSource::sceneName(opt.scene)) << "},";
+    json << "\"fps\":" << received / seconds << ",\"mbit_per_s\":" << (after.bytes - before.bytes) * 8.0 / seconds / 1e6
+         << ",\"frames\":{\"generated\":" << generated << ",\"received\":" << received
+         << ",\"displayed\":" << after.displayed - before.displayed << "},";
+    json << "\"dropped\":{\"capture\":" << desktop->missedFrames() - missedBefore
+         << ",\"send_queue\":" << sendAfter.droppedFrames - sendBefore.droppedFrames
+         << ",\"playout\":" << after.playout.skipped - before.playout.skipped
+         << ",\"display\":" << after.displaySkipped - before.displaySkipped << "},";
+
+    json << "\"fps_per_second\":[";
+    {
+        std::lock_guard<std::mutex> lk( gFpsLock );
+        for( std::size_t i = 0; i < gFpsSamples.size(); ++i )
+            json << (i ? "," : "") << gFpsSamples[i];
+    }
+    json << "],";
+
+    json << "\"series\":[";
+    for( std::size_t i = 0; i < series.size(); ++i ) {
+        const Sample &s = series[i];
+        json << (i ? "," : "") << "{\"t\":" << s.t << ",\"target_kbps\":" << s.rc.targetKbps
+             << ",\"delivery_kbps\":" << s.rc.deliveryKbps << ",\"delay_ms\":" << s.rc.delayMs
+             << ",\"mbit_per_s\":" << s.mbps << "}";
+    } // for
+    json << "],";
+
+    json << "\"latency_us\":{\"server\":" << gServerLatency.json() << ",\"client\":" << gClientLatency.json() << "},";
+
+    // cores used by each thread group
+    json << "\"cpu\":{";
+    bool first = true;
+    for( auto &v : cpuAfter ) {
+        double used = v.second - (cpuBefore.count(v.first) ? cpuBefore[v.first] : 0.0);
+        json << (first ? "" : ",") << JsonString(v.first) << ":" << used / seconds;
+        first = false;
+    } // for
+    json << "}}\n";
+
+    fputs( json.str().c_str(), stdout );
+    fflush( stdout );
+
+    // the encoder, player and display threads have no orderly shutdown across both ends in one process
+    _exit( 0 );
+}
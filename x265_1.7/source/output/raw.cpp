@@ -69,44 +69,99 @@ void RAWOutput::setParam(x265_param* param)
     param->bAnnexB = true;
 }
 
-int RAWOutput::writeHeaders(const x265_nal* nal, uint32_t nalcount)
+// the NAL payloads are sent in place, the encoder buffer is pinned until the socket write completes
+static EncodedFramePtr makeEncodedFrame(const x265_nal* nal, uint32_t nalcount, uint32_t &bytes,
+                                        const FrameHeaderFormat& format)
 {
-    seqno = 0;
-    uint32_t bytes = 0;
-    BytesArrayPtr pBuf = gServerBufMgr.get();
+    EncodedFramePtr pFrame = std::make_shared<EncodedFrame>(format);
 
-    pBuf->resize( ENCODED_FRAME_HEADER_LEN );
+    bytes = 0;
     for (uint32_t i = 0; i < nalcount; i++)
     {
-        pBuf->append((const char*)nal->payload, nal->sizeBytes);
-        bytes += nal->sizeBytes;
-        nal++;
+        pFrame->append(nal[i].payload, nal[i].sizeBytes);
+        bytes += nal[i].sizeBytes;
+    }
+
+    if (nalcount)
+    {
+        void *pin = x265_nal_pin(nal);
+        pFrame->releaser = [pin]() { x265_nal_unpin(pin); };
     }
 
+    return pFrame;
+}
+
+/* record the encoder-side stages of this picture; the send stage ends when the last
+ * frame is released, i.e. it has been written to every connection */
+static void traceFrame(const FrameTrace& trace, const x265_picture& pic, EncodedFrame& frame)
+{
+    int64_t writeTime = gen_timestamp_us();
+    gServerLatency.record(SLS_CAPTURE, trace.convertTime - trace.captureTime);
+    gServerLatency.record(SLS_CONVERT, trace.readyTime - trace.convertTime);
+    gServerLatency.record(SLS_QUEUE, trace.readTime - trace.readyTime);
+    gServerLatency.record(SLS_LOOKAHEAD, pic.lookaheadExitTime - trace.readTime);
+    gServerLatency.record(SLS_DISPATCH, pic.encodeStartTime - pic.lookaheadExitTime);
+    gServerLatency.record(SLS_ENCODE, pic.encodeEndTime - pic.encodeStartTime);
+    gServerLatency.record(SLS_OUTPUT, writeTime - pic.encodeEndTime);
+
+    int64_t captureTime = trace.captureTime;
+    GatherBuffer::ReleaserType unpin = frame.releaser;
+    frame.releaser = [unpin, writeTime, captureTime]()
+    {
+        int64_t now = gen_timestamp_us();
+        gServerLatency.record(SLS_SEND, now - writeTime);
+        gServerLatency.record(SLS_TOTAL, now - captureTime);
+        if (unpin)
+            unpin();
+    };
+}
+
+int RAWOutput::writeHeaders(const x265_nal* nal, uint32_t nalcount)
+{
+    seqno = 0;
+    uint32_t bytes = 0;
+    DesktopStreamingService *pService = DesktopStreamingService::instance();
+    FrameHeaderFormat format = pService->HeaderFormat();
+    format.traced = false;
+    EncodedFramePtr pFrame = makeEncodedFrame(nal, nalcount, bytes, format);
+
     DBG_STREAM("Generated encode header size = " << bytes << " at " << gen_timestamp());
 
-    DesktopStreamingService::instance()->SendEncodedFrame( 0, pBuf );
+    pService->SendEncodedFrame( 0, pFrame );
 
     return bytes;
 }
 
-int RAWOutput::writeFrame(const x265_nal* nal, uint32_t nalcount, x265_picture&)
+int RAWOutput::writeFrame(const x265_nal* nal, uint32_t nalcount, x265_picture& pic)
 {
     uint32_t bytes = 0;
-    BytesArrayPtr pBuf = gServerBufMgr.get();
-
-    pBuf->resize( ENCODED_FRAME_HEADER_LEN );
+    DesktopStreamingService *pService = DesktopStreamingService::instance();
+    FrameTrace *trace = (FrameTrace*)pic.userData;
+    FrameHeaderFormat format = pService->HeaderFormat();
+    format.traced = format.traced && trace;
+    EncodedFramePtr pFrame = makeEncodedFrame(nal, nalcount, bytes, format);
+
+    /* the send queue may drop pictures under congestion, an IRAP access unit
+     * is the point from which the client can decode again */
+    pFrame->flags = GatherBuffer::FLAG_DROPPABLE;
     for (uint32_t i = 0; i < nalcount; i++)
     {
-        pBuf->append((const char*)nal->payload, nal->sizeBytes);
-        bytes += nal->sizeBytes;
-        nal++;
+        if (nal[i].type >= NAL_UNIT_CODED_SLICE_BLA_W_LP && nal[i].type <= NAL_UNIT_CODED_SLICE_CRA)
+            pFrame->flags |= GatherBuffer::FLAG_KEYFRAME;
     }
 
     ++seqno;
     DBG_STREAM("Encoding " << seqno << " frame size = " << bytes );
 
-    DesktopStreamingService::instance()->SendEncodedFrame( seqno, pBuf );
+    if (trace)
+    {
+        pFrame->captureTime = trace->captureTime;
+        traceFrame(*trace, pic, *pFrame);
+        pService->DeleteFrameTrace(trace);
+        pic.userData = NULL;
+    }
+
+    pService->SendEncodedFrame( seqno, pFrame );
 
     return bytes;
 }
@@ -0,0 +1,269 @@
+// compile: c++ -o static_skip_bench static_skip_bench.cpp <x265 encoder and common objects> -Icommon -Iencoder -I. -std=c++11 -pthread -O2
+
+/*
+ * 静止CTU快速路径的benchmark: 合成桌面(input/capture_source.hpp的SyntheticDesktopSource)的n帧先全部
+ * 生成好，用TileDiffer按CTU大小算出每帧的脏块map，然后同样的帧、同样的参数编码两次:
+ *     full    x265_picture.ctuDirtyMap为NULL，每个CTU都做模式选择和运动搜索
+ *     static  带上map，没有变化的CTU直接编成零运动矢量的skip，lookahead也不搜索这些块
+ * 只计编码器的时间: 第一帧(IDR，两次的编码一样)输出之后开始，进程的CPU时间(包括编码器所有的线程)
+ * 和墙钟时间，按输出的帧平均；还有码率和PSNR，两次的画质应该差不多，bitrate_change是static比full多出的
+ * 码率比例(lookahead给没有变化的块的代价和运动搜索的结果不一样时，帧的QP会变，这里会看出来)。
+ * 速度比取决于full那次有多慢: 只用C的primitive(--no-asm)时full慢得多，比值也大得多。
+ * 计时的两次和服务一样不开PSNR(PSNR的SSD每帧都要把整个画面过一遍，是两次都有的固定开销，会压低速度比)，
+ * PSNR来自另外不计时的两次编码，编码的结果和计时的两次一样。
+ * 结果以JSON输出到stdout，x265的日志在stderr。
+ * usage: static_skip_bench [-r 1920x1080] [-c i444|i420] [-n frames] [-f fps] [-p preset]
+ *                          [-x "extra x265 args"] [-s idle,text,drag,video,mixed]
+ */
+
+#include "x265.h"
+#include "input/capture_source.hpp"
+#include "input/tile_differ.hpp"
+#include <ctime>
+#include <iostream>
+#include <sstream>
+
+struct BenchOptions {
+    BenchOptions() : width(1920), height(1080), i444(true), frames(60), fps(60), preset("ultrafast")
+                   , scenes("idle,text,drag,video") {}
+
+    int             width, height;
+    bool            i444;
+    int             frames;
+    int             fps;
+    std::string     preset;
+    std::string     extraArgs;
+    std::string     scenes;
+};
+
+static
+bool ParseOptions( int argc, char **argv, BenchOptions &opt )
+{
+    for( int i = 1; i + 1 < argc; i += 2 ) {
+        std::string key( argv[i] ), val( argv[i+1] );
+        if( key == "-r" ) {
+            if( sscanf(val.c_str(), "%dx%d", &opt.width, &opt.height) != 2 )
+                return false;
+        } else if( key == "-c" ) {
+            if( val != "i444" && val != "i420" )
+                return false;
+            opt.i444 = val == "i444";
+        } else if( key == "-n" ) {
+            opt.frames = atoi( val.c_str() );
+        } else if( key == "-f" ) {
+            opt.fps = atoi( val.c_str() );
+        } else if( key == "-p" ) {
+            opt.preset = val;
+        } else if( key == "-x" ) {
+            opt.extraArgs = val;
+        } else if( key == "-s" ) {
+            opt.scenes = val;
+        } else {
+            return false;
+        } // if
+    } // for
+    return argc % 2 == 1 && opt.frames > 1 && opt.fps > 0 && opt.width > 0 && opt.height > 0;
+}
+
+// the same parameters for all runs: the preset, the streaming defaults of the server and -x; PSNR only when asked for
+static
+x265_param* CreateParam( const BenchOptions &opt, bool psnr )
+{
+    x265_param *param = x265_param_alloc();
+    if( x265_param_default_preset(param, opt.preset.c_str(), "zerolatency") < 0 ) {
+        x265_param_free( param );
+        return NULL;
+    } // if
+    param->sourceWidth = opt.width;
+    param->sourceHeight = opt.height;
+    param->internalCsp = opt.i444 ? X265_CSP_I444 : X265_CSP_I420;
+    param->fpsNum = opt.fps;
+    param->fpsDenom = 1;
+    param->maxNumReferences = 1;
+    param->bEnablePsnr = psnr;
+    param->logLevel = X265_LOG_INFO;        // PSNR is not measured below INFO
+
+    // "--name value" or a bare "--flag"
+    std::istringstream iss( opt.extraArgs );
+    std::vector<std::string> args;
+    for( std::string s; iss >> s; )
+        args.push_back( s );
+    for( std::size_t i = 0; i < args.size(); ++i ) {
+        if( args[i].compare(0, 2, "--") ) {
+            std::cerr << "unexpected x265 argument " << args[i] << std::endl;
+            x265_param_free( param );
+            return NULL;
+        } // if
+        const std::string &name = args[i];
+        const char *value = NULL;
+        if( i + 1 < args.size() && args[i+1].compare(0, 2, "--") )
+            value = args[++i].c_str();
+        if( x265_param_parse(param, name.c_str() + 2, value) ) {
+            std::cerr << "bad x265 argument " << name << std::endl;
+            x265_param_free( param );
+            return NULL;
+        } // if
+    } // for
+    return param;
+}
+
+struct RunResult {
+    RunResult() : cpuSeconds(0), wallSeconds(0), pictures(0), bytes(0), psnr(0) {}
+
+    double          cpuSeconds, wallSeconds;
+    int             pictures;           // pictures output during the measurement
+    uint64_t        bytes;
+    double          psnr;
+};
+
+static
+bool Encode( const BenchOptions &opt, const CaptureFormat &format, const std::vector<std::vector<uint8_t>> &frames,
+                const std::vector<std::vector<uint8_t>> *maps, bool psnr, RunResult &result )
+{
+    x265_param *param = CreateParam( opt, psnr );
+    if( !param )
+        return false;
+    x265_encoder *encoder = x265_encoder_open( param );
+    if( !encoder ) {
+        x265_param_free( param );
+        return false;
+    } // if
+
+    x265_picture pic;
+    x265_picture_init( param, &pic );
+    pic.stride[0] = format.width;
+    pic.stride[1] = pic.stride[2] = format.chromaWidth();
+    std::size_t lumaSize = (std::size_t)format.width * format.height;
+    std::size_t chromaSize = (std::size_t)format.chromaWidth() * format.chromaHeight();
+
+    // the measurement starts when the first picture, the IDR both runs code the same way, is out
+    typedef std::chrono::steady_clock Clock;
+    x265_nal *nal = NULL;
+    uint32_t nnal = 0;
+    std::clock_t cpuStart = 0;
+    Clock::time_point start;
+    bool measuring = false;
+    for( std::size_t i = 0; i <= frames.size(); ++i ) {
+        int ret;
+        if( i < frames.size() ) {
+            uint8_t *frame = const_cast<uint8_t*>( frames[i].data() );
+            pic.planes[0] = frame;
+            pic.planes[1] = frame + lumaSize;
+            pic.planes[2] = frame + lumaSize + chromaSize;
+            pic.pts = (int64_t)i;
+            pic.ctuDirtyMap = maps ? const_cast<uint8_t*>( (*maps)[i].data() ) : NULL;
+            ret = x265_encoder_encode( encoder, &nal, &nnal, &pic, NULL );
+        } else {
+            // flush, until the encoder has nothing left
+            ret = x265_encoder_encode( encoder, &nal, &nnal, NULL, NULL );
+            if( ret > 0 )
+                --i;
+        } // if
+        if( ret < 0 )
+            break;
+        for( uint32_t k = 0; k < nnal; ++k )
+            result.bytes += nal[k].sizeBytes;
+        if( measuring ) {
+            result.pictures += ret;
+        } else if( ret > 0 ) {
+            measuring = true;
+            cpuStart = std::clock();
+            start = Clock::now();
+        } // if
+    } // for
+    result.cpuSeconds = (double)(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+    result.wallSeconds = std::chrono::duration<double>( Clock::now() - start ).count();
+
+    x265_stats stats;
+    x265_encoder_get_stats( encoder, &stats, sizeof(stats) );
+    result.psnr = stats.globalPsnr;
+
+    x265_encoder_close( encoder );
+    x265_param_free( param );
+    return true;
+}
+
+int main( int argc, char **argv )
+{
+    BenchOptions opt;
+    if( !ParseOptions(argc, argv, opt) ) {
+        std::cerr << "usage: " << argv[0] << " [-r 1920x1080] [-c i444|i420] [-n frames] [-f fps] [-p preset] "
+                     "[-x \"extra x265 args\"] [-s idle,text,drag,video,mixed]" << std::endl;
+        return -1;
+    } // if
+
+    x265_param *param = CreateParam( opt, false );
+    if( !param )
+        return -1;
+    // TileDiffer compares with x265::primitives, the tiles are the CTUs of the encoder
+    x265_setup_primitives( param, param->cpuid );
+    int ctuSize = (int)param->maxCUSize;
+    x265_param_free( param );
+
+    CaptureFormat format( opt.width, opt.height, opt.i444 ? X265_CSP_I444 : X265_CSP_I420, opt.fps );
+    TileDiffer differ( format, ctuSize );
+
+    char buf[512];
+    sprintf( buf, "{\"config\":{\"resolution\":\"%dx%d\",\"csp\":\"%s\",\"frames\":%d,\"preset\":\"%s\","
+                  "\"x265\":\"%s\",\"ctu\":%d},\"scenes\":[",
+                  opt.width, opt.height, opt.i444 ? "i444" : "i420", opt.frames, opt.preset.c_str(),
+                  opt.extraArgs.c_str(), ctuSize );
+    std::string json( buf );
+
+    std::istringstream scenes( opt.scenes );
+    bool first = true;
+    for( std::string name; std::getline(scenes, name, ','); ) {
+        SyntheticDesktopSource::Scene scene;
+        if( !SyntheticDesktopSource::parseScene(name, scene) ) {
+            std::cerr << "unknown scene " << name << std::endl;
+            return -1;
+        } // if
+
+        // frames and maps up front, neither is part of the measurement
+        SyntheticDesktopSource desktop( format, scene, false );
+        std::vector<std::vector<uint8_t>> frames( opt.frames ), maps( opt.frames );
+        uint64_t dirty = 0;
+        for( int i = 0; i < opt.frames; ++i ) {
+            frames[i].resize( desktop.frameSize() );
+            desktop.capture( (char*)frames[i].data(), frames[i].size(), NULL );
+            maps[i].resize( differ.mapSize() );
+            dirty += differ.diff( frames[i].data(), i ? frames[i-1].data() : NULL, maps[i].data() );
+        } // for
+
+        RunResult full, skip, fullQuality, skipQuality;
+        std::cerr << "scene " << name << ": full analysis" << std::endl;
+        if( !Encode(opt, format, frames, NULL, false, full) )
+            return -1;
+        std::cerr << "scene " << name << ": static CTUs skipped" << std::endl;
+        if( !Encode(opt, format, frames, &maps, false, skip) )
+            return -1;
+        std::cerr << "scene " << name << ": PSNR of both" << std::endl;
+        if( !Encode(opt, format, frames, NULL, true, fullQuality) || !Encode(opt, format, frames, &maps, true, skipQuality) )
+            return -1;
+        full.psnr = fullQuality.psnr;
+        skip.psnr = skipQuality.psnr;
+
+        double static_ratio = 1.0 - (double)dirty / ((double)differ.mapSize() * opt.frames);
+        json += first ? "" : ",";
+        sprintf( buf, "{\"scene\":\"%s\",\"static_ctus\":%.4f,", name.c_str(), static_ratio );
+        json += buf;
+        const RunResult *runs[2] = { &full, &skip };
+        const char * const names[2] = { "full", "static" };
+        for( int r = 0; r < 2; ++r ) {
+            int pictures = std::max( 1, runs[r]->pictures );
+            sprintf( buf, "\"%s\":{\"cpu_ms_per_frame\":%.3f,\"wall_ms_per_frame\":%.3f,\"kbytes\":%.1f,\"psnr\":%.3f},",
+                          names[r], runs[r]->cpuSeconds * 1e3 / pictures, runs[r]->wallSeconds * 1e3 / pictures,
+                          runs[r]->bytes / 1024.0, runs[r]->psnr );
+            json += buf;
+        } // for
+        sprintf( buf, "\"cpu_speedup\":%.2f,\"bitrate_change\":%.4f}", skip.cpuSeconds > 0 ? full.cpuSeconds / skip.cpuSeconds : 0.0,
+                      full.bytes ? (double)skip.bytes / full.bytes - 1.0 : 0.0 );
+        json += buf;
+        first = false;
+    } // for
+    json += "]}";
+
+    x265_cleanup();
+    std::cout << json << std::endl;
+    return 0;
+}
@@ -1104,6 +1104,115 @@ bool PixelHarness::check_planecopy_cp(planecopy_cp_t ref, planecopy_cp_t opt)
     return true;
 }
 
+bool PixelHarness::check_bgra_to_yuv(bgra_to_yuv_t ref, bgra_to_yuv_t opt, bool i420)
+{
+    /* rows of up to 256 BGRA pixels, up to 8 of them fit in uchar_test_buff at every offset */
+    enum { MAX_WIDTH = 256, MAX_ROWS = 8 };
+    ALIGN_VAR_16(uint8_t, ref_dest[MAX_WIDTH * MAX_ROWS * 3]);
+    ALIGN_VAR_16(uint8_t, opt_dest[MAX_WIDTH * MAX_ROWS * 3]);
+
+    memset(ref_dest, 0xCD, sizeof(ref_dest));
+    memset(opt_dest, 0xCD, sizeof(opt_dest));
+
+    intptr_t srcStride = MAX_WIDTH * 4;
+    int j = 0;
+
+    for (int i = 0; i < ITERS; i++)
+    {
+        /* the AVX2 loops take 32 (I444) and 64 (I420) pixels at a time: odd multiples of 32 leave
+         * the I420 chroma loop a 32 pixel tail, the random widths leave shorter ones */
+        int width;
+        switch (i % 4)
+        {
+        case 0: width = 160; break;
+        case 1: width = 224; break;
+        case 2: width = MAX_WIDTH; break;
+        default: width = 128 + rand() % (MAX_WIDTH - 127); break;
+        }
+        int height = 2 + rand() % (MAX_ROWS - 1);
+        if (i420)
+        {
+            width &= ~1;
+            height &= ~1;
+        }
+        int cwidth = i420 ? width >> 1 : width;
+        int cheight = i420 ? height >> 1 : height;
+
+        int index = i % TEST_CASES;
+        const uint8_t* src = uchar_test_buff[index] + j;
+        intptr_t stride = srcStride;
+        if (i & 1)
+        {
+            // bottom-up
+            src += srcStride * (height - 1);
+            stride = -srcStride;
+        }
+        uint8_t* ref_u = ref_dest + width * height;
+        uint8_t* opt_u = opt_dest + width * height;
+
+        checked(opt, src, stride, opt_dest, opt_u, opt_u + cwidth * cheight, (intptr_t)width, (intptr_t)cwidth, width, height);
+        ref(src, stride, ref_dest, ref_u, ref_u + cwidth * cheight, (intptr_t)width, (intptr_t)cwidth, width, height);
+
+        if (memcmp(ref_dest, opt_dest, width * height + 2 * cwidth * cheight))
+            return false;
+
+        reportfail();
+        j += INCR;
+    }
+
+    return true;
+}
+
+bool PixelHarness::check_diff_tiles(tile_diff_t ref, tile_diff_t opt)
+{
+    /* rows of up to 256 bytes, up to 32 of them fit in uchar_test_buff at every offset */
+    enum { MAX_WIDTH = 256, MAX_ROWS = 32 };
+    ALIGN_VAR_16(uint8_t, copy[MAX_WIDTH * MAX_ROWS]);
+    uint8_t ref_dirty[MAX_WIDTH], opt_dirty[MAX_WIDTH];
+
+    intptr_t stride = MAX_WIDTH;
+    int j = 0;
+
+    for (int i = 0; i < ITERS; i++)
+    {
+        int index = i % TEST_CASES;
+        int width = 1 + rand() % MAX_WIDTH;
+        int height = 1 + rand() % MAX_ROWS;
+        /* the CTU sizes take the 64 and 32 byte vector loops, odd sizes the tails */
+        static const int tileWidths[] = { 16, 32, 64 };
+        int tileWidth = (i & 3) ? tileWidths[i % 3] : 1 + rand() % 64;
+        int tiles = (width + tileWidth - 1) / tileWidth;
+        const uint8_t* src = uchar_test_buff[index] + j;
+
+        /* most tiles of a desktop are unchanged, the rest usually differ in a few bytes. A
+         * difference in the last bytes of a tile is only seen by the end of its vector loop */
+        for (int y = 0; y < height; y++)
+            memcpy(copy + y * stride, src + y * stride, width);
+        for (int t = 0; t < tiles; t++)
+        {
+            if (rand() & 1)
+            {
+                int end = X265_MIN((t + 1) * tileWidth, width);
+                copy[(rand() % height) * stride + end - 1 - rand() % X265_MIN(4, end - t * tileWidth)] ^= 1 + rand() % 255;
+            }
+        }
+        for (int k = rand() % 4; k > 0; k--)
+            copy[(rand() % height) * stride + rand() % width] ^= 1 + rand() % 255;
+        for (int t = 0; t < tiles; t++)
+            ref_dirty[t] = opt_dirty[t] = (rand() % 8) == 0;
+
+        checked(opt, src, copy, stride, width, height, tileWidth, opt_dirty);
+        ref(src, copy, stride, width, height, tileWidth, ref_dirty);
+        if (memcmp(ref_dirty, opt_dirty, tiles))
+            return false;
+
+        reportfail();
+        j += INCR;
+    }
+
+    return true;
+}
+
 bool PixelHarness::check_cutree_propagate_cost(cutree_propagate_cost ref, cutree_propagate_cost opt)
 {
     ALIGN_VAR_16(int, ref_dest[64 * 64]);
@@ -1861,6 +1970,33 @@ bool PixelHarness::testCorrectness(const EncoderPrimitives& ref, const EncoderPr
         }
     }
 
+    if (opt.bgra_to_i444)
+    {
+        if (!check_bgra_to_yuv(ref.bgra_to_i444, opt.bgra_to_i444, false))
+        {
+            printf("bgra_to_i444 failed\n");
+            return false;
+        }
+    }
+
+    if (opt.bgra_to_i420)
+    {
+        if (!check_bgra_to_yuv(ref.bgra_to_i420, opt.bgra_to_i420, true))
+        {
+            printf("bgra_to_i420 failed\n");
+            return false;
+        }
+    }
+
+    if (opt.diff_tiles)
+    {
+        if (!check_diff_tiles(ref.diff_tiles, opt.diff_tiles))
+        {
+            printf("diff_tiles failed\n");
+            return false;
+        }
+    }
+
     if (opt.propagateCost)
     {
         if (!check_cutree_propagate_cost(ref.propagateCost, opt.propagateCost))
@@ -2256,6 +2392,25 @@ void PixelHarness::measureSpeed(const EncoderPrimitives& ref, const EncoderPrimi
         REPORT_SPEEDUP(opt.planecopy_cp, ref.planecopy_cp, uchar_test_buff[0], 64, pbuf1, 64, 64, 64, 2);
     }
 
+    if (opt.bgra_to_i444)
+    {
+        HEADER0("bgra_to_i444");
+        REPORT_SPEEDUP(opt.bgra_to_i444, ref.bgra_to_i444, uchar_test_buff[0], 64 * 4, (uint8_t*)pbuf1, (uint8_t*)pbuf2, (uint8_t*)pbuf3, 64, 64, 64, 32);
+    }
+
+    if (opt.bgra_to_i420)
+    {
+        HEADER0("bgra_to_i420");
+        REPORT_SPEEDUP(opt.bgra_to_i420, ref.bgra_to_i420, uchar_test_buff[0], 64 * 4, (uint8_t*)pbuf1, (uint8_t*)pbuf2, (uint8_t*)pbuf3, 64, 32, 64, 32);
+    }
+
+    if (opt.diff_tiles)
+    {
+        uint8_t dirty[2] = { 0, 0 };
+        HEADER0("diff_tiles");
+        REPORT_SPEEDUP(opt.diff_tiles, ref.diff_tiles, uchar_test_buff[0], uchar_test_buff[0], 64, 64, 64, 32, dirty);
+    }
+
     if (opt.propagateCost)
     {
         HEADER0("propagateCost");
@@ -345,6 +345,8 @@ bool CLIOptions::parse(int argc, char **argv)
     info.frameCount = 0;
     getParamAspectRatio(param, info.sarWidth, info.sarHeight);
 
+    /* captured frames carry a dirty map with one entry per CTU */
+    DesktopStreamingService::instance()->SetTileSize(param->maxCUSize);
     this->input = InputFile::open(info, this->bForceY4m);
     if (!this->input || this->input->isFail())
     {
@@ -401,6 +403,8 @@ bool CLIOptions::parse(int argc, char **argv)
         general_log(param, input->getName(), X265_LOG_INFO, "%s\n", buf);
     }
 
+    /* the reader converts captured BGRA with the primitives, it starts before encoder_open sets them up */
+    x265_setup_primitives(param, param->cpuid);
     this->input->startReader();
 
     if (reconfn)
@@ -531,6 +535,13 @@ int x265_main(int argc, char **argv)
     DBG_STREAM("After eccoder_parameters() param is: " << paramStr);
     x265_free( paramStr );
 
+    /* the network rate controller moves the VBV max rate, and the ABR target with it,
+     * the buffer keeps its size in seconds */
+    DesktopStreamingService *pService = DesktopStreamingService::instance();
+    bool bVbv = param->rc.vbvMaxBitrate > 0 && param->rc.vbvBufferSize > 0;
+    double vbvSeconds = bVbv ? (double)param->rc.vbvBufferSize / param->rc.vbvMaxBitrate : 0;
+    pService->SetEncoderBitrate(bVbv ? param->rc.vbvMaxBitrate : 0);
+
     /* Control-C handler */
     if (signal(SIGINT, sigint_handler) == SIG_ERR)
         x265_log(param, X265_LOG_ERROR, "Unable to register CTRL+C handler: %s\n", strerror(errno));
@@ -539,7 +550,8 @@ int x265_main(int argc, char **argv)
     x265_picture *pic_in = &pic_orig;
     /* Allocate recon picture if analysisMode is enabled */
     std::priority_queue<int64_t>* pts_queue = cliopt.output->needPTS() ? new std::priority_queue<int64_t>() : NULL;
-    x265_picture *pic_recon = (cliopt.recon || !!param->analysisMode || pts_queue || reconPlay) ? &pic_out : NULL;
+    /* always ask for pic_out, the streaming output reads the latency trace from pic_out.userData */
+    x265_picture *pic_recon = &pic_out;
     uint32_t inFrameCount = 0;
     uint32_t outFrameCount = 0;
     x265_nal *p_nal;
@@ -607,6 +619,19 @@ int x265_main(int argc, char **argv)
             pic_in->pts = pic_in->poc;
         }
 
+        uint32_t kbps;
+        if (pService->TakeBitrateChange(kbps))
+        {
+            x265_param rcParam;
+            memcpy(&rcParam, param, sizeof(x265_param));
+            rcParam.rc.vbvMaxBitrate = (int)kbps;
+            rcParam.rc.vbvBufferSize = X265_MAX((int)(kbps * vbvSeconds), 1);
+            if (rcParam.rc.rateControlMode == X265_RC_ABR)
+                rcParam.rc.bitrate = (int)kbps;
+            if (!api->encoder_reconfig(encoder, &rcParam))
+                memcpy(param, &rcParam, sizeof(x265_param));
+        }
+
         int numEncoded = api->encoder_encode(encoder, &p_nal, &nal, pic_in, pic_recon);
         if (numEncoded < 0)
         {
@@ -744,6 +769,9 @@ void DesktopStreamingService::DoStartEncoder( const std::string &cmd )
 {
     using namespace std;
 
+    // x265's worker pool and the capture thread are created from here and inherit the name
+    set_thread_name( "encode" );
+
     vector<char*>   cmdArgs;
     const char*     SPACES = " \t\f\r\v\n";
 
@@ -161,6 +161,22 @@ typedef struct x265_picture
      * this data structure */
     x265_analysis_data analysisData;
 
+    /* Ignored on input. On output, x265_mdate() timestamps in microseconds of
+     * when this picture left the lookahead and when its frame encoder started
+     * and finished compressing it, for latency tracing */
+    int64_t lookaheadExitTime;
+    int64_t encodeStartTime;
+    int64_t encodeEndTime;
+
+    /* Optional change map of the input picture, one byte per CTU of
+     * param.maxCUSize in raster order, 0 if the CTU is identical to the same
+     * CTU of the previous picture passed to x265_encoder_encode(). Unchanged
+     * CTUs of frames which use that picture as their first L0 reference are
+     * coded as skips with a zero motion vector, without mode decision, and
+     * the lookahead does not search them. The map is copied on input. NULL
+     * (the default) encodes every CTU normally */
+    uint8_t* ctuDirtyMap;
+
 } x265_picture;
 
 typedef enum
@@ -1272,6 +1288,20 @@ void x265_encoder_log(x265_encoder *encoder, int argc, char **argv);
  *      close an encoder handler */
 void x265_encoder_close(x265_encoder *);
 
+/* x265_nal_pin:
+ *       keep the payloads of the NAL array returned by x265_encoder_encode() or
+ *       x265_encoder_headers() valid beyond the next call into the encoder.
+ *       nal must be the first NAL of the returned array. The returned handle
+ *       must be passed to x265_nal_unpin() once the application no longer
+ *       references the payloads; the memory is then recycled by the encoder.
+ *       returns NULL if nal is NULL. May be called from any thread. */
+void* x265_nal_pin(const x265_nal *nal);
+
+/* x265_nal_unpin:
+ *       release a handle returned by x265_nal_pin(). May be called from any
+ *       thread, and after x265_encoder_close() */
+void x265_nal_unpin(void *handle);
+
 /* x265_cleanup:
  *       release library static allocations, reset configured CTU size */
 void x265_cleanup(void);